@@ -40,12 +40,26 @@
 
 #define LED_TIMER_vect TIMER0_COMPA_vect
 
+// Drive the LEDs with binary code modulation rather than soft-PWM (see led.c).
+// This chip only has the LEDs to take care of, so no other interrupt holds up
+// the short bit planes for long.
+#define LED_BCM
+
+// The BCM bit plane timer (see led.c): the compare and counter registers, and
+// the clock select bits for the short and the long planes.  The LSB is 16 us,
+// for a PWM period of 1008 us (992 Hz).  The long planes run at prescale 64
+// rather than 8, so that they fit into the 8 bit timer.
+#define LED_BCM_OCR             OCR0A
+#define LED_BCM_TCNT            TCNT0
+#define LED_BCM_TCCRB           TCCR0B
+#define LED_BCM_LSB_TICKS       32                      // 16 us at prescale 8
+#define LED_BCM_CLOCK_SHORT     _BV(CS01)               // prescale 8
+#define LED_BCM_CLOCK_LONG      (_BV(CS01) | _BV(CS00)) // prescale 64
+#define LED_BCM_LONG_PLANE      3                       // first long plane; 64 / 8 == 1 << 3
+
 static void inline led_timer_init(void)
 {
-	const int T0_CYCLE_US = 200;
-	OCR0A = (((T0_CYCLE_US * (F_CPU / 1000L)) / (64 * 1000L)) - 1);
 	TCCR0A = _BV(WGM01); // clear timer/counter on compare0 match
-	TCCR0B = _BV(CS01) |_BV(CS00); // prescale 64
 	TIMSK0 = _BV(OCIE0A); // enable Output Compare 0 overflow interrupt
 	TCNT0 = 0x00;
 }
@@ -198,6 +198,38 @@ void profile_start(void)
 #endif
 
 
+// is this 8-byte message a ping command?
+bool ping_check(uint8_t const *pdata)
+{
+	return pdata[0] == LWCCONFIG_CMD_PING &&
+	       pdata[5] == 0xFF &&
+	       pdata[6] == 0xFF &&
+	       pdata[7] == (uint8_t)~pdata[1];
+}
+
+// build the reply to a ping command, returns the reply length
+uint8_t ping_reply(uint8_t *preply, uint8_t const *prequest)
+{
+	uint32_t const t = clock();
+	uint16_t const k = F_CPU / 1000;
+
+	preply[0] = LWCCONFIG_CMD_PING;
+	preply[1] = prequest[1];
+	preply[2] = prequest[2];
+	preply[3] = prequest[3];
+	preply[4] = prequest[4];
+	preply[5] = (uint8_t)(t);
+	preply[6] = (uint8_t)(t >> 8);
+	preply[7] = (uint8_t)(t >> 16);
+	preply[8] = (uint8_t)(t >> 24);
+	preply[9] = (uint8_t)(k);
+	preply[10] = (uint8_t)(k >> 8);
+	preply[11] = LWCCONFIG_CAP_LEVELS;
+
+	return PING_REPLY_LEN;
+}
+
+
 void sleep_ms(uint16_t ms)
 {
 	if (ms > 0) {
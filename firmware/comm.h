@@ -17,6 +17,7 @@
 #ifndef UART_H__INCLUDED
 #define UART_H__INCLUDED
 
+#include <stdbool.h>
 #include <avr/pgmspace.h>
 #include <hwconfig.h>
 #include "queue.h"
@@ -71,6 +72,35 @@ typedef enum {
 #endif
 
 
+// Round trip "ping" command, for measuring the latency from the host to
+// the LED controller and back.  The host sends
+//
+//   69 s0 s1 s2 s3 FF FF ~s0
+//
+// and the LED controller answers with an input report on the LED
+// interface:
+//
+//   69 s0 s1 s2 s3 t0 t1 t2 t3 k0 k1 cc
+//
+// s0..s3 is the host's sequence number, echoed back unchanged.  t0..t3
+// is clock() when the command was processed, and k0..k1 is the clock()
+// rate in ticks per millisecond, both little endian.  cc has a bit for
+// each optional LED command the controller takes, so the host can find
+// out before sending one that older firmware would misread.  On a two-chip
+// board, the command travels over the UART to the LED chip and the
+// reply comes back the same way, so the round trip includes the bridge.
+// Commands are processed in order, so the reply also shows that the
+// commands sent before it have been applied.
+
+#define LWCCONFIG_CMD_PING  69
+#define PING_REPLY_LEN      12
+
+#define LWCCONFIG_CAP_LEVELS  0x01   // 8 bit brightness levels (command 70, see led.c)
+
+bool ping_check(uint8_t const *pdata);
+uint8_t ping_reply(uint8_t *preply, uint8_t const *prequest);
+
+
 #if defined(ENABLE_PROFILING)
 void profile_start(void);
 void profile_stop(void);
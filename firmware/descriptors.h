@@ -71,7 +71,7 @@
 #define USB_PRODUCT_ID     0x0147
 #endif
 
-#define LWCLONEU2_VERSION   1
+#define LWCLONEU2_VERSION   2   // 2: answers the ping command (comm.h)
 
 
 /* Type Defines: */
@@ -17,6 +17,7 @@
 #include <stdint.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 
 #include <hwconfig.h>
 #include "led.h"
@@ -35,23 +36,218 @@ enum { LED_MAPPING_TABLE(MAP) NUMBER_OF_LEDS };
 #define NUMBER_OF_BANKS   ((NUMBER_OF_LEDS + 7) / 8)
 #define MAX_PWM 49
 
+// Besides the LedWiz SBA and PBA messages, we take an extended message with
+// 8 bit brightness levels:
+//
+//   70 pp l0 l1 l2 l3 l4 l5   levels for up to six ports from port p on
+//
+// The low 5 bits of pp are p (0 = port 1), and the high 3 bits the number of
+// levels, 1-6, or 0 for all six; the bytes past the last level are ignored.
+// A level replaces the port's PBA mode until the next PBA, and the SBA on/off
+// state applies to it as usual.  PBA brightness values 0-49 map onto the same
+// 0-255 scale, as do the flash modes.  The host learns that we take this
+// message from the capability bits in the ping reply (see comm.h), since
+// older firmware takes it for PBA data.
+#define LED_CMD_LEVELS 70
+
+#define MODE_LEVEL 0xFF  // g_LED[].mode: the brightness is g_LED[].level
+
+// LedWiz brightness 0-49 to level 0-255
+#define LEVEL_FROM_PWM(x) (((uint16_t)(x) * 1337) >> 8)
+
 
 #if (NUMBER_OF_LEDS > 32)
 	#error "number of led pins is bigger than 32!"
 #endif
 
 
+// the i/o ports of the chip, any of which may have LEDs on it
+
+#if defined(PORTA)
+	#define LED_PORT_A(_map_) _map_(A)
+#else
+	#define LED_PORT_A(_map_)
+#endif
+#if defined(PORTB)
+	#define LED_PORT_B(_map_) _map_(B)
+#else
+	#define LED_PORT_B(_map_)
+#endif
+#if defined(PORTC)
+	#define LED_PORT_C(_map_) _map_(C)
+#else
+	#define LED_PORT_C(_map_)
+#endif
+#if defined(PORTD)
+	#define LED_PORT_D(_map_) _map_(D)
+#else
+	#define LED_PORT_D(_map_)
+#endif
+#if defined(PORTE)
+	#define LED_PORT_E(_map_) _map_(E)
+#else
+	#define LED_PORT_E(_map_)
+#endif
+#if defined(PORTF)
+	#define LED_PORT_F(_map_) _map_(F)
+#else
+	#define LED_PORT_F(_map_)
+#endif
+#if defined(PORTG)
+	#define LED_PORT_G(_map_) _map_(G)
+#else
+	#define LED_PORT_G(_map_)
+#endif
+#if defined(PORTH)
+	#define LED_PORT_H(_map_) _map_(H)
+#else
+	#define LED_PORT_H(_map_)
+#endif
+#if defined(PORTJ)
+	#define LED_PORT_J(_map_) _map_(J)
+#else
+	#define LED_PORT_J(_map_)
+#endif
+#if defined(PORTK)
+	#define LED_PORT_K(_map_) _map_(K)
+#else
+	#define LED_PORT_K(_map_)
+#endif
+#if defined(PORTL)
+	#define LED_PORT_L(_map_) _map_(L)
+#else
+	#define LED_PORT_L(_map_)
+#endif
+
+#define LED_PORT_TABLE(_map_) \
+	LED_PORT_A(_map_) LED_PORT_B(_map_) LED_PORT_C(_map_) LED_PORT_D(_map_) \
+	LED_PORT_E(_map_) LED_PORT_F(_map_) LED_PORT_G(_map_) LED_PORT_H(_map_) \
+	LED_PORT_J(_map_) LED_PORT_K(_map_) LED_PORT_L(_map_)
+
+#define MAP(X) X##_port,
+enum { LED_PORT_TABLE(MAP) NUMBER_OF_PORTS };
+#undef MAP
+
+// The pins of a port that belong to the LED driver, and those of them that
+// are inverted.  These are only used in a block that defines 'port_id'.
+#define LED_PIN_MASK(X, pin, inv) | ((X##_port == port_id) ? (1 << pin) : 0)
+#define LED_PIN_INV(X, pin, inv)  | ((X##_port == port_id) && inv ? (1 << pin) : 0)
+
+
 struct {
 	volatile uint8_t enable;
 	volatile uint8_t mode;
+	volatile uint8_t level;
 } g_LED[NUMBER_OF_BANKS * 8];
 
 volatile uint16_t g_dt = 256;  // access is not atomic, but the read in the pwm loop is not critical
 
+// Both drivers map brightness levels 0-255 to duties 0-252 (63 * 4) through
+// this table, which is gamma 2.2 with a linear toe: no duty is below the
+// level's legacy PBA value 0-49, so the low PBA steps stay apart rather than
+// all landing on the smallest duty.  Levels above 0 get at least the
+// smallest duty.
+//
+// That makes the output 8 bits deep at best, and the gamma curve spends
+// most of it on the bright end: levels 1-7 all get duty 1, and levels
+// 1-64 share 12 duties.  BCM shows the duty as it is (see below); the
+// soft-PWM only has MAX_PWM steps, and rounds the duty up to the next one.
+static PROGMEM const uint8_t g_gamma[256] =
+{
+	  0,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   3,   3,
+	  3,   3,   3,   4,   4,   4,   4,   4,   5,   5,   5,   5,   5,   6,   6,   6,
+	  6,   6,   7,   7,   7,   7,   7,   7,   8,   8,   8,   8,   8,   9,   9,   9,
+	  9,   9,  10,  10,  10,  10,  10,  11,  11,  11,  11,  11,  12,  12,  12,  12,
+	 12,  12,  13,  13,  14,  14,  15,  15,  16,  16,  17,  17,  18,  18,  19,  19,
+	 20,  20,  21,  21,  22,  22,  23,  24,  24,  25,  25,  26,  27,  27,  28,  29,
+	 29,  30,  31,  31,  32,  33,  34,  34,  35,  36,  37,  37,  38,  39,  40,  40,
+	 41,  42,  43,  44,  45,  45,  46,  47,  48,  49,  50,  51,  52,  53,  53,  54,
+	 55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,  68,  70,  71,
+	 72,  73,  74,  75,  76,  77,  78,  80,  81,  82,  83,  84,  85,  87,  88,  89,
+	 90,  92,  93,  94,  95,  97,  98,  99, 101, 102, 103, 105, 106, 107, 109, 110,
+	111, 113, 114, 116, 117, 119, 120, 121, 123, 124, 126, 127, 129, 130, 132, 133,
+	135, 137, 138, 140, 141, 143, 144, 146, 148, 149, 151, 153, 154, 156, 158, 159,
+	161, 163, 164, 166, 168, 170, 171, 173, 175, 177, 178, 180, 182, 184, 186, 188,
+	189, 191, 193, 195, 197, 199, 201, 203, 205, 207, 209, 211, 213, 215, 217, 219,
+	221, 223, 225, 227, 229, 231, 233, 235, 237, 239, 241, 243, 246, 248, 250, 252
+};
+
+#define DUTY_FROM_LEVEL(x) pgm_read_byte(&g_gamma[(uint8_t)(x)])
+
+// duty 0-252 to soft-PWM step 0-49: duty * 49 / 252, rounded up, without
+// a division in the ISR
+#define PWM_FROM_DUTY(x) ((((uint16_t)(x) * 199) + 1023) >> 10)
+
+#if defined(LED_BCM)
+
+// Binary code modulation.  Each LED's brightness level goes through the gamma
+// table to a duty of 0-252, and the PWM period is made of one bit plane per
+// bit of a 6 bit code, where plane k lasts (1 << k) LSB times (see
+// led_timer_set(), and the board's timer constants in hwconfig.h).  An LED is
+// on during the planes of the bits that are set in its code.
+//
+// The ISR starts each plane, except that planes 0 and 1 share an interrupt:
+// it starts plane 0, waits out its single LSB on the timer, and then starts
+// plane 1.  That makes 5 interrupts per period, and with a 16 us LSB, a period
+// of 1008 us, so about 4.96k interrupts/s against the 5k/s of the soft-PWM, for
+// a PWM rate (992 Hz) 10 times higher.  Waiting out plane 0 costs about as
+// much as the interrupt it saves.
+//
+// The code is the duty / 4, and the remaining 2 bits are dithered over 4
+// periods, so the duty has 8 bits of resolution, and the dither pattern
+// repeats at 256 Hz.  More dither bits would add resolution, but the pattern
+// of a low duty would then repeat slowly enough to show as flicker; more real
+// planes would need a shorter LSB than the ISR can keep up with.
+//
+// The levels are updated every BCM_UPDATE_PERIODS periods, which keeps the
+// flash modes at the speed of the soft-PWM.
+
+#define BCM_PLANES 6
+#define BCM_UPDATE_PERIODS 10
+
+// For each bit plane and port, the bits of the LEDs that are on during that
+// plane.  Only the ISR accesses these.
+static uint8_t g_bcm_plane[BCM_PLANES][NUMBER_OF_PORTS];
+
+// Set the timer to 'n' LSB times, the length of the next plane or planes.
+// The long planes run on the slower clock, which is (1 << LED_BCM_LONG_PLANE)
+// times slower, so 'n' has to be a multiple of that for them.
+static void inline led_timer_set(uint8_t n)
+{
+	if (n < (1 << LED_BCM_LONG_PLANE)) {
+		LED_BCM_OCR = LED_BCM_LSB_TICKS * n - 1;
+		LED_BCM_TCCRB = LED_BCM_CLOCK_SHORT;
+	} else {
+		LED_BCM_OCR = LED_BCM_LSB_TICKS * (n >> LED_BCM_LONG_PLANE) - 1;
+		LED_BCM_TCCRB = LED_BCM_CLOCK_LONG;
+	}
+}
+
+// the dither offsets of the 4 periods, in bit-reversed order so that the
+// extra code steps of a duty spread evenly over the periods
+static const uint8_t g_dither[4] = { 0, 2, 1, 3 };
+
+#else
+
+// The soft-PWM steps, in bit-sliced form.  For each step and port, the bits
+// of the LEDs that switch on at that step.  An LED stays on until the end of
+// the PWM period, so g_port_state[] collects these bits into the current
+// output state of each port.  Only the ISR accesses these.
+static uint8_t g_pwm_on[MAX_PWM][NUMBER_OF_PORTS];
+static uint8_t g_port_state[NUMBER_OF_PORTS];
+
+#endif
+
 
 static void update_state(uint8_t * p5bytes);
 static void update_profile(int8_t k, uint8_t * p8bytes);
-static void update_pwm(uint8_t *pwm, int8_t n, uint16_t t);
+static void update_levels(uint8_t first, uint8_t * p6bytes);
+static void update_pwm(uint8_t *level, int8_t n, uint16_t t);
+#if defined(LED_BCM)
+static void update_planes(uint8_t const *duty, uint8_t dither);
+#else
+static void update_steps(uint8_t const *level);
+#endif
 static void led_ports_init(void);
 
 
@@ -61,8 +257,12 @@ void led_init(void)
 	/* LED driver */
 	led_ports_init();
 
-	// Timer for soft-PWM
+	// Timer for soft-PWM, or for BCM planes 0 and 1, which the ISR takes as
+	// the last ones started
 	led_timer_init();
+	#if defined(LED_BCM)
+	led_timer_set(3);
+	#endif
 }
 
 
@@ -75,6 +275,10 @@ void led_update(uint8_t *p8bytes)
 		update_state(p8bytes + 1);
 		nbank = 0;
 	}
+	else if (p8bytes[0] == LED_CMD_LEVELS)
+	{
+		update_levels(p8bytes[1], p8bytes + 2);
+	}
 	else
 	{
 		update_profile(nbank, p8bytes);
@@ -120,13 +324,34 @@ static void update_profile(int8_t k, uint8_t * p8bytes)
 }
 
 
-static void update_pwm(uint8_t *pwm, int8_t n, uint16_t t)
+static void update_levels(uint8_t first, uint8_t * p6bytes)
+{
+	uint8_t const count = (first >> 5) ? (first >> 5) : 6;
+
+	first &= 0x1F;
+
+	for (int8_t i = 0; i < count && i < 6; i++)
+	{
+		uint16_t const k = first + i;
+
+		if (k >= NUMBER_OF_BANKS * 8)
+			return;
+
+		// set the level before the mode, which is what the ISR looks at
+		g_LED[k].level = p6bytes[i];
+		g_LED[k].mode = MODE_LEVEL;
+	}
+}
+
+
+// compute the brightness levels (0-255) of the LEDs at time 't'
+static void update_pwm(uint8_t *level, int8_t n, uint16_t t)
 {
 	for (int8_t i = 0; i < n; i++) 
 	{
 		if (g_LED[i].enable == 0)
 		{
-			pwm[i] = 0;
+			level[i] = 0;
 		}
 		else
 		{
@@ -136,7 +361,13 @@ static void update_pwm(uint8_t *pwm, int8_t n, uint16_t t)
 			{
 				// constant brightness
 
-				pwm[i] = b;
+				level[i] = LEVEL_FROM_PWM(b);
+			}
+			else if (b == MODE_LEVEL)
+			{
+				// extended brightness level
+
+				level[i] = g_LED[i].level;
 			}
 			else if (b == 129)
 			{
@@ -146,14 +377,14 @@ static void update_pwm(uint8_t *pwm, int8_t n, uint16_t t)
 				if (x & 0x80) // 128..255
 					x = 255 - x;
 
-				pwm[i] = (MAX_PWM * x) >> 7;
+				level[i] = LEVEL_FROM_PWM((MAX_PWM * x) >> 7);
 
 			}
 			else if (b == 130)
 			{
 				// rect
 				
-				pwm[i] = (t & 0x8000) ? MAX_PWM : 0;
+				level[i] = (t & 0x8000) ? LEVEL_FROM_PWM(MAX_PWM) : 0;
 			}
 			else if (b == 131)
 			{
@@ -161,7 +392,7 @@ static void update_pwm(uint8_t *pwm, int8_t n, uint16_t t)
 
 				uint16_t x = 255 - (t >> 8);
 
-				pwm[i] = (MAX_PWM * x) >> 8;
+				level[i] = LEVEL_FROM_PWM((MAX_PWM * x) >> 8);
 			}
 			else if (b == 132)
 			{
@@ -169,19 +400,167 @@ static void update_pwm(uint8_t *pwm, int8_t n, uint16_t t)
 
 				uint16_t x = t >> 8;
 
-				pwm[i] = (MAX_PWM * x) >> 8;
+				level[i] = LEVEL_FROM_PWM((MAX_PWM * x) >> 8);
 			}
 			else
 			{
 				// unexpected!
 
-				pwm[i] = 0;
+				level[i] = 0;
 			}
 		}
 	}
 }
 
 
+#if defined(LED_BCM)
+
+static void set_planes(uint8_t port, uint8_t bit, uint8_t code)
+{
+	for (int8_t k = 0; k < BCM_PLANES; k++)
+	{
+		if (code & 0x01)
+			g_bcm_plane[k][port] |= bit;
+
+		code >>= 1;
+	}
+}
+
+
+// Rebuild the bit planes from the duties, with the dither offset of the
+// next period.  The ISR calls this during the last (and longest) plane of a
+// period, when it's done with the others.
+static void update_planes(uint8_t const *duty, uint8_t dither)
+{
+	for (int8_t k = 0; k < BCM_PLANES; k++)
+	{
+		for (int8_t i = 0; i < NUMBER_OF_PORTS; i++)
+		{
+			g_bcm_plane[k][i] = 0;
+		}
+	}
+
+	#define MAP(X, pin, inv) set_planes(X##_port, (1 << pin), (duty[X##pin##_index] + dither) >> 2);
+	LED_MAPPING_TABLE(MAP)
+	#undef MAP
+}
+
+
+// Switch the LEDs to a bit plane, with one masked write per port
+static void inline output_plane(uint8_t const *pplane)
+{
+	#define MAP(X) \
+	{ \
+		enum { \
+			port_id = X##_port, \
+			port_mask = 0 LED_MAPPING_TABLE(LED_PIN_MASK), \
+			port_inv = 0 LED_MAPPING_TABLE(LED_PIN_INV) \
+		}; \
+		if (port_mask != 0) { \
+			PORT##X = (PORT##X & (uint8_t)~port_mask) | (pplane[port_id] ^ port_inv); \
+		} \
+	}
+	LED_PORT_TABLE(MAP)
+	#undef MAP
+}
+
+
+ISR(LED_TIMER_vect)
+{
+	#if defined(ENABLE_PROFILING)
+	profile_start();
+	#endif
+
+	static int8_t plane = 1;
+	static int8_t period = 0;
+	static uint8_t frame = 0;
+	static uint16_t t = 0;
+	static uint8_t level[NUMBER_OF_LEDS];
+	static uint8_t duty[NUMBER_OF_LEDS];
+	static volatile uint8_t rebuilding = 0;
+
+	// the previous plane is over, so start the next one right away
+
+	if (++plane >= BCM_PLANES)
+		plane = 0;
+
+	if (plane == 0)
+	{
+		// Planes 0 and 1 share this interrupt: start plane 0, and plane 1 when
+		// the timer has counted off one LSB since then.
+
+		led_timer_set(3);
+		output_plane(g_bcm_plane[0]);
+
+		uint8_t const t0 = LED_BCM_TCNT;
+		while ((uint8_t)(LED_BCM_TCNT - t0) < LED_BCM_LSB_TICKS)
+			;
+
+		plane = 1;
+	}
+	else
+	{
+		led_timer_set(1 << plane);
+	}
+
+	output_plane(g_bcm_plane[plane]);
+
+	// Prepare the next period during the last plane, which is long enough for
+	// it.  This interrupt doesn't come back before the plane is over, so let
+	// the others in while we're at it.  Should the rebuild run over anyway,
+	// the next planes interrupt it, and the flag keeps a last plane coming
+	// around again from starting a second rebuild on top of this one.
+
+	if (plane == BCM_PLANES - 1 && !rebuilding)
+	{
+		rebuilding = 1;
+		sei();
+
+		if (++period >= BCM_UPDATE_PERIODS)
+		{
+			period = 0;
+
+			// increment time counter
+			t += g_dt;
+
+			// update pwm values
+			update_pwm(level, NUMBER_OF_LEDS, t);
+
+			for (int8_t i = 0; i < NUMBER_OF_LEDS; i++)
+			{
+				duty[i] = DUTY_FROM_LEVEL(level[i]);
+			}
+		}
+
+		frame = (frame + 1) & 0x03;
+
+		update_planes(duty, g_dither[frame]);
+
+		cli();
+		rebuilding = 0;
+	}
+}
+
+#else
+
+// Rebuild the step tables from new brightness levels, at the start of a PWM
+// period.  The ISR has cleared the entries of g_pwm_on[] as it used them.
+static void update_steps(uint8_t const *level)
+{
+	for (int8_t i = 0; i < NUMBER_OF_PORTS; i++)
+	{
+		g_port_state[i] = 0;
+	}
+
+	// The ISR counts down from MAX_PWM - 1, and an LED with the pwm value 'x' is on from step x - 1 on.
+	// The levels go through the same gamma curve as with BCM, to the coarser steps of the soft-PWM.
+
+	#define MAP(X, pin, inv) { uint8_t const x = PWM_FROM_DUTY(DUTY_FROM_LEVEL(level[X##pin##_index])); if (x > 0) { g_pwm_on[x - 1][X##_port] |= (1 << pin); } }
+	LED_MAPPING_TABLE(MAP)
+	#undef MAP
+}
+
+
 ISR(LED_TIMER_vect)
 {
 	#if defined(ENABLE_PROFILING)
@@ -190,7 +569,7 @@ ISR(LED_TIMER_vect)
 
 	static int8_t counter = 0;
 	static uint16_t t = 0;
-	static uint8_t pwm[NUMBER_OF_LEDS];
+	static uint8_t level[NUMBER_OF_LEDS];
 
 	counter--;
 
@@ -203,16 +582,33 @@ ISR(LED_TIMER_vect)
 		t += g_dt;
 
 		// update pwm values
-		update_pwm(pwm, sizeof(pwm) / sizeof(pwm[0]), t);
+		update_pwm(level, NUMBER_OF_LEDS, t);
+		update_steps(level);
 	}
 
-	// set or clear all defined pins
-
-	#define MAP(X, pin, inv) if ((pwm[X##pin##_index] > counter) == (!inv)) { PORT##X |= (1 << pin); } else { PORT##X &= ~(1 << pin); }
-	LED_MAPPING_TABLE(MAP)
+	// set or clear all defined pins, with one masked write per port
+
+	uint8_t * const pon = g_pwm_on[counter];
+
+	#define MAP(X) \
+	{ \
+		enum { \
+			port_id = X##_port, \
+			port_mask = 0 LED_MAPPING_TABLE(LED_PIN_MASK), \
+			port_inv = 0 LED_MAPPING_TABLE(LED_PIN_INV) \
+		}; \
+		if (port_mask != 0) { \
+			g_port_state[port_id] |= pon[port_id]; \
+			pon[port_id] = 0; \
+			PORT##X = (PORT##X & (uint8_t)~port_mask) | (g_port_state[port_id] ^ port_inv); \
+		} \
+	}
+	LED_PORT_TABLE(MAP)
 	#undef MAP
 }
 
+#endif
+
 
 static void led_ports_init(void)
 {
@@ -59,6 +59,21 @@ int main(void)
 			{
 				DbgOut(DBGERROR, "main_led, invalid framesize");
 			}
+			else if (ping_check(&prxmsg->data[0]))
+			{
+				// answer a ping via the USB chip
+				msg_t * const ptxmsg = msg_prepare();
+
+				if (ptxmsg != NULL)
+				{
+					ptxmsg->nlen = ping_reply(&ptxmsg->data[0], &prxmsg->data[0]);
+					msg_send();
+				}
+				else
+				{
+					DbgOut(DBGERROR, "main_led, tx buffer overflow");
+				}
+			}
 			else
 			{
 				// process the data
@@ -59,7 +59,7 @@ static struct {
 static void hardware_init(void);
 static void main_task(void);
 static uint8_t* buffer_lock(void);
-static void buffer_unlock(void);
+static void buffer_unlock(bool commit);
 static void hardware_restart(bool enter_bootloader);
 static void configure_device(void);
 
@@ -146,18 +146,51 @@ static void configure_device(void)
 }
 
 
+#if defined(ENABLE_LED_DEVICE)
+
+// ping reply waiting to be sent, if the LEDs are driven by this chip
+static struct {
+	uint8_t reply[PING_REPLY_LEN];
+	volatile bool pending;
+} g_ping;
+
+// send a ping reply as an input report on the LED interface,
+// returns false if the host isn't ready for it yet
+
+static bool ping_send_reply(uint8_t const *preply)
+{
+	Endpoint_SelectEndpoint(LED_EPADDR);
+
+	if (!Endpoint_IsINReady())
+		return false;
+
+	Endpoint_Write_Stream_LE(preply, PING_REPLY_LEN, NULL);
+
+	// pad to the full report size
+	for (uint8_t i = PING_REPLY_LEN; i < LED_EPSIZE; i++) {
+		Endpoint_Write_8(0);
+	}
+
+	Endpoint_ClearIN();
+
+	return true;
+}
+
+#endif
+
+
 static void main_task(void)
 {
-#if defined(ENABLE_PANEL_DEVICE)
+#if defined(ENABLE_LED_DEVICE)
 
-	/* Select the Joystick Report Endpoint */
-	Endpoint_SelectEndpoint(PANEL_EPADDR);
+	if (g_ping.pending && ping_send_reply(&g_ping.reply[0]))
+	{
+		g_ping.pending = false;
+	}
 
-	/* Check to see if the host is ready for another packet */
-	if (!Endpoint_IsINReady())
-		return;
+#endif
 
-	#if defined(DATA_RX_UART_vect)
+#if defined(DATA_RX_UART_vect)
 
 	msg_t * const pmsg = msg_recv();
 
@@ -165,6 +198,30 @@ static void main_task(void)
 	{
 		DbgOut(DBGINFO, "main_usb, message received");
 
+		#if defined(ENABLE_LED_DEVICE)
+
+		// a ping reply from the LED chip goes out on the LED interface
+
+		if (pmsg->nlen == PING_REPLY_LEN && pmsg->data[0] == LWCCONFIG_CMD_PING)
+		{
+			if (ping_send_reply(&pmsg->data[0])) {
+				msg_release();
+			}
+
+			return;
+		}
+
+		#endif
+
+		#if defined(ENABLE_PANEL_DEVICE)
+
+		/* Select the Joystick Report Endpoint */
+		Endpoint_SelectEndpoint(PANEL_EPADDR);
+
+		/* Check to see if the host is ready for another packet */
+		if (!Endpoint_IsINReady())
+			return;
+
 		// is the message valid?
 
 		if (pmsg->nlen < 2 || pmsg->nlen > 8)
@@ -180,10 +237,21 @@ static void main_task(void)
 			Endpoint_ClearIN();
 		}
 
+		#endif
+
 		msg_release();
 	}
 
-	#elif defined(PANEL_TASK)
+#elif defined(ENABLE_PANEL_DEVICE)
+
+	/* Select the Joystick Report Endpoint */
+	Endpoint_SelectEndpoint(PANEL_EPADDR);
+
+	/* Check to see if the host is ready for another packet */
+	if (!Endpoint_IsINReady())
+		return;
+
+	#if defined(PANEL_TASK)
 
 	uint8_t * pdata;
 	uint8_t const ndata = panel_get_report(&pdata);
@@ -271,6 +339,8 @@ void EVENT_USB_Device_ControlRequest(void)
 
 			if (pdata != NULL)
 			{
+				bool commit = true;
+
 				// Read the report data from the control endpoint
 				Endpoint_Read_Control_Stream_LE(pdata, 8);
 
@@ -298,7 +368,18 @@ void EVENT_USB_Device_ControlRequest(void)
 					}
 				}
 
-				buffer_unlock();
+				// A ping is answered by whichever chip drives the LEDs.  If
+				// that's this one, answer it here, otherwise pass it along.
+				#if defined(LED_TIMER_vect)
+				if (ping_check(pdata))
+				{
+					ping_reply(&g_ping.reply[0], pdata);
+					g_ping.pending = true;
+					commit = false;
+				}
+				#endif
+
+				buffer_unlock(commit);
 			}
 			else
 			{
@@ -347,9 +428,11 @@ static uint8_t * buffer_lock(void)
 	return &g_databuffer[0];
 }
 
-void buffer_unlock(void)
+static void buffer_unlock(bool commit)
 {
-	led_update(&g_databuffer[0]);
+	if (commit) {
+		led_update(&g_databuffer[0]);
+	}
 }
 
 #endif
@@ -370,9 +453,12 @@ static uint8_t * buffer_lock(void)
 	return &pmsg->data[0];
 }
 
-static void buffer_unlock(void)
+static void buffer_unlock(bool commit)
 {
-	msg_send();
+	// an uncommitted message is simply never pushed into the fifo
+	if (commit) {
+		msg_send();
+	}
 }
 
 #endif
@@ -184,6 +184,61 @@ void LWZCALL LWZ_SET_NOTIFY(LWZNOTIFYPROC notify_callback, LWZDEVICELIST *plist)
 void LWZCALL LWZ_SET_NOTIFY_EX(LWZNOTIFYPROC_EX notify_ex_callback, void *puser, LWZDEVICELIST *plist);
 
 
+/************************************************************************************************************************
+LWZ_SET_DISCOVERY_MODE - select blocking or background device discovery [EXTENDED API]
+*************************************************************************************************************************
+LWZ_DISCOVERY_BLOCKING (the default) is the original behavior: LWZ_SET_NOTIFY searches for devices before it
+returns, adds all of them to the device list, and only then invokes the callback for each one.  Some clients
+(e.g., LedBlinky) depend on seeing the complete list on the first callback, so this must remain the default.
+
+With LWZ_DISCOVERY_ASYNC, LWZ_SET_NOTIFY and device arrival events return immediately, and the search runs on a
+background thread.  Each device is added to the list and reported through the callback as soon as it's confirmed,
+so the callback is invoked from the background thread.  Call this before LWZ_SET_NOTIFY.
+************************************************************************************************************************/
+
+#define LWZ_DISCOVERY_BLOCKING   0
+#define LWZ_DISCOVERY_ASYNC      1
+
+void LWZ_SET_DISCOVERY_MODE(uint32_t mode);
+
+
+/************************************************************************************************************************
+LWZ_GET_DISCOVERY_STATS - get statistics for the most recent device search [EXTENDED API]
+*************************************************************************************************************************
+The DLL remembers the outcome of probing each HID interface (accepted or rejected, and the device details), so on
+later searches, such as on each device arrival event, only interfaces it hasn't seen before have to be opened and
+queried.  This reports how the last search went.  As with LWZ_GET_DEVICE_INFO, the caller must fill in cbSize.
+Returns TRUE on success, FALSE if the structure is invalid.
+
+The probe results are also saved to a cache file in the user's temporary folder, so a newly started process can
+skip the full probe for interfaces that an earlier process has already seen.  The dwFile... fields and
+dwColdStartUs report how that went for the current process: dwColdStartUs is the time from loading the cache file
+through the end of the first search, which is the device discovery cost a newly started process pays.
+
+If writes to a device keep failing, as they do after a USB bus reset, the DLL reopens the device at the same path in
+the background and sends it the current output state again.  dwReconnects counts those recoveries, and the
+...ReconnectMs fields give the time from the first failed write to the state being sent again.
+************************************************************************************************************************/
+
+typedef struct {
+	DWORD cbSize;			// structure size
+	DWORD dwPasses;			// number of searches so far
+	DWORD dwInterfaces;		// HID interfaces present on the last search
+	DWORD dwProbed;			// interfaces that needed a full probe
+	DWORD dwCached;			// interfaces resolved from the probe cache
+	DWORD dwAdded;			// devices added, including Pinscape virtual units
+	DWORD dwLastPassUs;		// duration of the last search, in microseconds
+	DWORD dwFileEntries;	// probe results loaded from the cache file on the first search
+	DWORD dwFileLoadUs;		// time to load the cache file, in microseconds
+	DWORD dwColdStartUs;	// cache file load plus the first search, in microseconds
+	DWORD dwReconnects;		// devices reopened after write failures
+	DWORD dwLastReconnectMs;	// recovery time of the last reconnect, in milliseconds
+	DWORD dwMaxReconnectMs;	// longest recovery time, in milliseconds
+} LWZDISCOVERYSTATS;
+
+BOOL LWZ_GET_DISCOVERY_STATS(LWZDISCOVERYSTATS *stats);
+
+
 /************************************************************************************************************************
 LWZ_GET_DEVICE_INFO - retrieve information on a device [EXTENDED API]
 *************************************************************************************************************************
@@ -215,6 +270,371 @@ return number of bytes read.
 uint32_t LWZ_RAWREAD(LWZHANDLE hlwz, uint8_t *pdata, uint32_t ndata);
 
 
+/************************************************************************************************************************
+LWZ_READ_LATEST - get the most recent input report without waiting [EXTENDED API]
+LWZ_SET_INPUT_CALLBACK - subscribe to input reports [EXTENDED API]
+*************************************************************************************************************************
+Each device with input reports has a background thread that keeps a read pending at all times, so reports are
+consumed as the device sends them instead of piling up in the Windows HID buffer.
+
+LWZ_READ_LATEST copies the newest report received so far and returns its length, or 0 if nothing has arrived yet.
+If pseqno is not NULL, it receives the report's sequence number, which increases by one for each report received,
+so a polling caller can tell whether it has seen the report before.  It doesn't take the API lock, so it never waits
+behind another thread's device search or Pinscape configuration query.
+
+LWZ_SET_INPUT_CALLBACK registers a callback that's invoked for each report as it arrives.  Pass NULL to unsubscribe.
+The callback is called on the device's reader thread, so it should return quickly.  A callback already in progress
+might still complete after unsubscribing.  Reports for a Pinscape virtual unit come from the physical unit.
+Returns TRUE if the device was valid, FALSE if not.
+************************************************************************************************************************/
+
+typedef void (LWZCALLBACK * LWZINPUTPROC)(void *puser, LWZHANDLE hlwz, uint8_t const *pdata, uint32_t ndata);
+
+uint32_t LWZ_READ_LATEST(LWZHANDLE hlwz, uint8_t *pdata, uint32_t ndata, uint32_t *pseqno);
+BOOL LWZ_SET_INPUT_CALLBACK(LWZHANDLE hlwz, LWZINPUTPROC input_callback, void *puser);
+
+
+/************************************************************************************************************************
+LWZ_RUN_BROKER - run the device broker [EXTENDED API]
+LWZ_CONNECT_BROKER - send output through the device broker [EXTENDED API]
+*************************************************************************************************************************
+In broker mode, one long-lived process owns all of the devices, and other programs send their output to it instead
+of opening the devices themselves.  That saves each program the device search, and lets several programs light the
+cabinet at the same time without their writes colliding.
+
+LWZ_RUN_BROKER makes the calling process the broker.  Call LWZ_SET_NOTIFY first to set up the device list (and
+LWZ_REGISTER, to follow devices being plugged in and removed).  The function runs the broker on the calling thread
+until hquit is signaled, then returns TRUE.  Returns FALSE immediately if another broker is already running.
+
+LWZ_CONNECT_BROKER connects this process to the running broker, returning FALSE if there isn't one.  Call it before
+LWZ_SET_NOTIFY.  Once connected, the device list is the broker's, and LWZ_SBA, LWZ_PBA and LWZ_RAWWRITE go to the
+broker.  If the broker falls behind, those calls wait for it, as they would for a busy device.  Changes to the
+broker's device list, and the switch back to opening the devices directly if the broker exits, are reported to the
+notify callback from a background thread.
+
+Limits of broker mode: the broker only serves the 16 legacy units, so a client doesn't see extended units (see
+LWZ_SET_EXTENDED_UNITS).  Input isn't forwarded, so in a client, LWZ_RAWREAD, LWZ_READ_LATEST and the input callback
+return nothing.
+
+The broker keeps each program's output state separately and merges them: each port is lit by the highest-priority
+program that has it switched on, at that program's brightness setting.  A program's state is dropped when it exits.
+************************************************************************************************************************/
+
+BOOL LWZ_RUN_BROKER(HANDLE hquit);
+BOOL LWZ_CONNECT_BROKER(uint32_t priority);
+
+
+/************************************************************************************************************************
+LWZ_START_EFFECT - start a brightness effect on a port [EXTENDED API]
+LWZ_STOP_EFFECTS - stop effects [EXTENDED API]
+*************************************************************************************************************************
+Effects are run by the DLL on a background thread, so a program can start a fade or a blink with one call instead of
+sending a stream of LWZ_PBA updates itself.  The DLL updates each unit at a fixed rate suited to the device: every
+20ms for a real LedWiz, which takes that long to accept a full set of brightness levels, and every 10ms for the
+others.  Updates that wouldn't change anything aren't sent.
+
+An effect controls the port's brightness level only; the port still has to be switched on with LWZ_SBA to light.
+Levels are the LWZ_PBA values, 0-48 (or 49), and port numbers start at 1.  Starting an effect replaces any effect
+already running on the same port.  While an effect runs, it overrides the level set for the port with LWZ_PBA.
+
+LWZ_EFFECT_RAMP fades the port from dwFrom to dwTo over dwPeriodMs, then leaves the port at dwTo, as though it had
+been set with LWZ_PBA.  LWZ_EFFECT_BLINK alternates between dwTo ("on") and dwFrom ("off") with a period of
+dwPeriodMs, staying on for dwDutyPct percent of each period.  It stops after dwCycles periods, or runs until stopped
+if dwCycles is 0, and the port then goes back to its LWZ_PBA level.
+
+Set the 'cbSize' field to sizeof(LWZEFFECT).  LWZ_START_EFFECT returns TRUE if the effect was started, FALSE if the
+device or the effect description isn't valid, or too many effects are already running.
+
+LWZ_STOP_EFFECTS stops the effects on one port, or on all of the unit's ports if port is 0, putting the ports back to
+their LWZ_PBA levels.
+************************************************************************************************************************/
+
+#define LWZ_EFFECT_RAMP   1
+#define LWZ_EFFECT_BLINK  2
+
+typedef struct {
+	DWORD cbSize;          // structure size
+	DWORD dwType;          // LWZ_EFFECT_xxx
+	DWORD dwPort;          // port number, 1-32
+	DWORD dwFrom;          // ramp: start level; blink: "off" level
+	DWORD dwTo;            // ramp: end level; blink: "on" level
+	DWORD dwPeriodMs;      // ramp: duration; blink: period
+	DWORD dwDutyPct;       // blink: "on" time as a percentage of the period
+	DWORD dwCycles;        // blink: number of periods, 0 to run until stopped
+} LWZEFFECT;
+
+BOOL LWZ_START_EFFECT(LWZHANDLE hlwz, LWZEFFECT const *effect);
+void LWZ_STOP_EFFECTS(LWZHANDLE hlwz, uint32_t port);
+
+
+/************************************************************************************************************************
+LWZ_SET_OUTPUTS_8BIT - set brightness levels from 8-bit intensities [EXTENDED API]
+LWZ_SET_GAMMA - set the 8-bit intensity translation table [EXTENDED API]
+*************************************************************************************************************************
+LWZ_SET_OUTPUTS_8BIT sets the brightness of 'count' consecutive ports, starting at port number first_port (1 for the
+first port), from 8-bit intensities 0-255.  Each intensity is translated to a PBA level through the unit's
+translation table.  On a Pinscape unit, ports past 32 continue on the unit's virtual LedWiz interfaces, so all of
+the unit's ports can be set in one call through the base unit's handle.  Only groups of ports whose translated
+levels changed are sent, except on devices that only take the original PBA, where any change sends all 32 ports.
+As with LWZ_PBA, the levels take effect on ports switched on with LWZ_SBA.  Returns the number of ports set.
+
+LWCloneU2 units with firmware that reports 8-bit level support (version 2 and later, asked at discovery) get the
+intensities as they are, and the firmware applies its own gamma curve.  The result is at most 8 bits deep (a duty of
+0-252) on firmware built for binary code modulation, and 49 steps with the soft-PWM; the curve shares the lowest duties
+among several intensities, so intensities 1-7 all come out at the dimmest one.
+The translated levels still make up the unit's state for LWZ_GET_STATE.  The intensities go out as PBA levels
+instead if a translation table was set with LWZ_SET_GAMMA, in the staged flush modes, in broker client mode, and
+while effects are running on the unit.
+
+LWZ_SET_GAMMA sets the translation table for a unit: 256 PBA values (0-49, or 129-132 for the flash modes), indexed
+by intensity.  A table set through a Pinscape virtual unit applies to the whole physical unit.  Pass NULL to go back
+to the default, which maps 0-255 linearly onto 0-48.  The table belongs to the unit number, so it stays in place if
+the device is unplugged and plugged back in.  Returns FALSE if the table contains an invalid value.
+************************************************************************************************************************/
+
+uint32_t LWZ_SET_OUTPUTS_8BIT(LWZHANDLE hlwz, uint32_t first_port, uint8_t const *values, uint32_t count);
+BOOL LWZ_SET_GAMMA(LWZHANDLE hlwz, uint8_t const *table);
+
+
+/************************************************************************************************************************
+LWZ_UPDATE_PORTS - change individual ports [EXTENDED API]
+*************************************************************************************************************************
+Sets the on/off state and/or brightness level of a list of ports, leaving the other ports as they are.  Port numbers
+run over all of the physical unit's ports, starting at 1, so on a Pinscape unit, ports past 32 can be changed
+through the base unit's handle without going through its virtual LedWiz units.  Set 'on' or 'level' to
+LWZ_PORT_UNCHANGED to leave that part of the port alone.  The level is a PBA value (0-49, or 129-132 for the flash
+modes).  On a unit that hasn't had its state set yet, ports start out off, at full brightness.
+
+Only the messages covering the changed ports are sent: one SBA or SBX for each group of 32 ports with on/off
+changes, and on devices that take PBX, one PBX for each group of 8 ports with level changes (a device that only takes
+the original PBA gets all 32 levels).  Returns the number of updates applied; updates for ports the unit doesn't
+have are skipped.
+************************************************************************************************************************/
+
+#define LWZ_PORT_UNCHANGED  0xFF
+
+typedef struct {
+	uint16_t port;         // port number on the physical unit, 1-based
+	uint8_t on;            // 0 = off, 1 = on, or LWZ_PORT_UNCHANGED
+	uint8_t level;         // PBA brightness level, or LWZ_PORT_UNCHANGED
+} LWZPORTUPDATE;
+
+uint32_t LWZ_UPDATE_PORTS(LWZHANDLE hlwz, LWZPORTUPDATE const *updates, uint32_t count);
+
+
+/************************************************************************************************************************
+LWZ_LOAD_OUTPUT_MAP - load a logical output map [EXTENDED API]
+LWZ_UPDATE_OUTPUTS - change outputs by logical output number [EXTENDED API]
+*************************************************************************************************************************
+The output map numbers the cabinet's outputs independently of the units they're attached to, so a program can
+address all of them without knowing the topology.  LWZ_LOAD_OUTPUT_MAP reads the map from a text file, replacing any
+map loaded before; pass NULL to unload it.  Returns FALSE if the file can't be read or has an error, in which case
+the previous map stays in place.  Each line of the file maps a run of logical outputs onto consecutive ports of a
+unit:
+
+    <output> <unit> <port> [<count>]
+
+where <output> is the first logical output number (from 1), <unit> the unit's handle (1-16 for the LedWiz unit
+numbers, up to 1024 for extended units; see LWZ_SET_EXTENDED_UNITS), <port> the first port number, and <count> the
+number of outputs in the run (1 if omitted).  Port numbers run over all of the physical unit's ports, so port 33 of a
+Pinscape unit is the first port of its first virtual LedWiz unit.  Text after '#' or ';' is a comment.
+
+LWZ_UPDATE_OUTPUTS works like LWZ_UPDATE_PORTS, with the 'port' field of each update holding a logical output number.
+The updates can span any number of units, and each unit gets only the messages covering its changed ports.  Returns
+the number of updates applied; updates for outputs that aren't in the map, or whose unit isn't present, are skipped.
+************************************************************************************************************************/
+
+BOOL LWZ_LOAD_OUTPUT_MAP(char const *path);
+uint32_t LWZ_UPDATE_OUTPUTS(LWZPORTUPDATE const *updates, uint32_t count);
+
+
+/************************************************************************************************************************
+LWZ_SET_STATE_BUFFER - register a client-owned output state buffer [EXTENDED API]
+*************************************************************************************************************************
+For clients that change outputs at a high rate, the DLL can read the output state straight from a buffer in the
+client's memory instead of taking it through function calls.  The client registers the buffer once, then just writes
+the state into it; the DLL polls the buffer on its update thread, at the rate each device can take updates (see
+LWZ_START_EFFECT), and sends only the groups of ports that changed.  There's no queue in between, so the device
+always gets the latest state.
+
+The buffer has the state for each unit, indexed by handle - 1: the on/off bits and pulse speed, as for LWZ_SBA, and
+the brightness levels, as for LWZ_PBA.  Only the units with their bit set in dwUnitMask (bit 0 for handle 1, and
+so on) are driven from the buffer.  Running effects still apply on top of the buffer's levels.
+
+The client must bracket each change with the sequence number, so that the DLL never reads a half-written update:
+increment lSequence with InterlockedIncrement() before changing the state (making it odd), and again afterwards
+(making it even).  A change made outside the brackets might not be noticed.
+
+Set 'cbSize' to sizeof(LWZSTATEBUFFER) before registering.  The buffer must stay valid until it's unregistered by
+passing NULL.  Returns FALSE if the buffer is invalid.
+************************************************************************************************************************/
+
+typedef struct {
+	DWORD cbSize;                           // structure size
+	volatile LONG lSequence;                // change sequence number, odd while the client is writing
+	DWORD dwUnitMask;                       // units driven from the buffer, bit 0 = handle 1
+	uint8_t on[LWZ_MAX_DEVICES][4];         // on/off bits per unit, as for LWZ_SBA
+	uint8_t speed[LWZ_MAX_DEVICES];         // pulse speed per unit
+	uint8_t level[LWZ_MAX_DEVICES][32];     // brightness levels per unit, as for LWZ_PBA
+} LWZSTATEBUFFER;
+
+BOOL LWZ_SET_STATE_BUFFER(LWZSTATEBUFFER const *buffer);
+
+
+/************************************************************************************************************************
+LWZ_SET_FLUSH_MODE - choose when output changes are sent [EXTENDED API]
+LWZ_FLUSH - send staged output changes [EXTENDED API]
+*************************************************************************************************************************
+By default, each LWZ_SBA, LWZ_PBA or other output call is sent to the device right away.  A client that makes
+several calls per game frame can instead have the calls only stage the new state, and send everything at once:
+
+LWZ_FLUSH_IMMEDIATE     send each change right away (the default)
+LWZ_FLUSH_EXPLICIT      stage changes until the client calls LWZ_FLUSH
+LWZ_FLUSH_TIMED         stage changes, and flush them automatically rate_hz times per second
+
+A flush sends each unit with staged changes its brightness levels and then its on/off state, so the device never
+sees a partly updated frame, and ports being switched on light at their new levels.  Levels that didn't change
+since the last flush aren't sent again where the device takes PBX.  Effects and the state buffer are staged the
+same way.  Switching modes flushes anything already staged.  LWZ_SET_FLUSH_MODE returns FALSE if the mode or rate
+isn't valid.  Timed flushes are scheduled with the system timer, so rates are approximate above about 60 Hz.
+************************************************************************************************************************/
+
+#define LWZ_FLUSH_IMMEDIATE   0
+#define LWZ_FLUSH_EXPLICIT    1
+#define LWZ_FLUSH_TIMED       2
+
+BOOL LWZ_SET_FLUSH_MODE(uint32_t mode, uint32_t rate_hz);
+void LWZ_FLUSH(void);
+
+
+/************************************************************************************************************************
+LWZ_SET_DEBUG_LOG - turn the DLL's debug log on or off [EXTENDED API]
+*************************************************************************************************************************
+Starts writing the DLL's debug log to the given file, appending to it, or stops the log if path is NULL.  The log can
+also be turned on without changing the client, by setting the LWZ_DEBUG_LOG environment variable to the log file
+name before the DLL loads, or to 1 for LedWizDllDebug.log in the current directory.  Log entries are buffered and
+written out in the background, so logging adds little time to the API calls.  Returns FALSE if the file can't be
+opened.
+************************************************************************************************************************/
+
+BOOL LWZ_SET_DEBUG_LOG(char const *path);
+
+
+/************************************************************************************************************************
+LWZ_GET_STATE - read back a unit's output state [EXTENDED API]
+*************************************************************************************************************************
+Gets the output state the DLL holds for a unit, without any USB traffic.  There are two copies of the state:
+
+  - the state set by the clients in this process (on, speed, level), as of the last LWZ_SBA, LWZ_PBA or other output
+    call, including staged changes not yet flushed (see LWZ_SET_FLUSH_MODE)
+
+  - the state last sent to the device (on_sent, speed_sent, level_sent), with any running effects applied; this is
+    the state as passed to the DLL's I/O queue, so it may take a few milliseconds more to reach the device
+
+dwFlags tells which parts are valid: a unit that hasn't had its state set or sent since the DLL loaded (or since it
+was plugged in) reads back as zeroes, with the corresponding flags clear.  The function never blocks on the DLL's
+internal lock, so it's safe to call at any rate from any thread.  Set 'cbSize' to sizeof(LWZUNITSTATE) before
+calling.  Returns FALSE if the handle or structure isn't valid.
+************************************************************************************************************************/
+
+#define LWZ_STATE_ON_SET       0x0001    // on[] and speed are valid
+#define LWZ_STATE_LEVEL_SET    0x0002    // level[] is valid
+#define LWZ_STATE_ON_SENT      0x0004    // on_sent[] and speed_sent are valid
+#define LWZ_STATE_LEVEL_SENT   0x0008    // level_sent[] is valid
+
+typedef struct {
+	DWORD cbSize;               // structure size
+	DWORD dwFlags;              // LWZ_STATE_xxx
+	uint8_t on[4];              // on/off bits, as for LWZ_SBA
+	uint8_t speed;              // pulse speed
+	uint8_t level[32];          // brightness levels, as for LWZ_PBA
+	uint8_t on_sent[4];         // on/off bits last sent
+	uint8_t speed_sent;         // pulse speed last sent
+	uint8_t level_sent[32];     // brightness levels last sent
+} LWZUNITSTATE;
+
+BOOL LWZ_GET_STATE(LWZHANDLE hlwz, LWZUNITSTATE *state);
+
+
+/************************************************************************************************************************
+LWZ_SET_EXTENDED_UNITS - enable extended unit handles [EXTENDED API]
+*************************************************************************************************************************
+The legacy API has room for LWZ_MAX_DEVICES units, at the handles given by the LedWiz product IDs.  Devices that
+don't fit there still get handles, above LWZ_MAX_DEVICES, that aren't tied to a product ID:
+
+  - a second device with the same product ID as one that's already present
+
+  - a Pinscape virtual LedWiz unit (for ports 33 and up) whose consecutive unit number is taken by a real device, or
+    past unit 16
+
+Extended handles work with all of the calls that take a handle.  They never appear in the LWZDEVICELIST, and by
+default they aren't reported to the notify callback either, since older clients can't handle them.  Call this with
+TRUE to get notify callbacks for extended units as well; any already present are reported right away.  An extended
+handle stays valid until its device goes away, and the handle can be reused for a different device after that.
+************************************************************************************************************************/
+
+void LWZ_SET_EXTENDED_UNITS(BOOL enable);
+
+
+/************************************************************************************************************************
+LWZ_GET_DEVICE_HANDLES - list the handles of all present units [EXTENDED API]
+*************************************************************************************************************************
+Fills in 'handles' with up to 'max_handles' handles of the units currently present, legacy and extended alike (see
+LWZ_SET_EXTENDED_UNITS), and returns the total number of units present, which may be more than 'max_handles'.  Pass
+NULL to just get the count.  This doesn't search for devices; call LWZ_SET_NOTIFY or LWZ_SET_NOTIFY_EX first.
+************************************************************************************************************************/
+
+uint32_t LWZ_GET_DEVICE_HANDLES(LWZHANDLE *handles, uint32_t max_handles);
+
+
+/************************************************************************************************************************
+LWZ_GET_IO_STATS - get output statistics for a device [EXTENDED API]
+LWZ_RESET_IO_STATS - reset the output statistics for a device [EXTENDED API]
+*************************************************************************************************************************
+Reports the counters the DLL keeps for writes to the given device.  The counters are kept in memory shared by every
+process using the DLL, so they cover the writes of all of those processes, from when the first of them opened the
+device; a monitoring program such as "lwcconfig stats" sees the output of DOF and the rest.  A Pinscape virtual unit
+reports the counters of its physical unit, since its output goes through the same device handle.  As with
+LWZ_GET_DEVICE_INFO, the caller must fill in cbSize.  Returns TRUE on success, FALSE if the device or structure is
+invalid.
+
+Messages are added to the write queue and sent by the DLL's writer thread.  A PBA or SBA that arrives while an
+earlier one for the same device is still waiting in the queue replaces it rather than being queued separately, which
+dwCoalesced counts.  dwSuppressed counts messages that weren't sent because the device already had that state, as
+recorded by the state shared between processes.  dwPacingMs is the time spent waiting out the minimum interval
+between writes (5 ms for a real LedWiz).  The dwLatency... figures are the time taken by each 8-byte packet write, and
+the dwQueue... figures are the time from a message being added to the write queue until it has been written, which
+includes waiting behind other messages.  Times are measured to 100 us up to 10 ms, and more coarsely beyond that.
+
+LWZ_RESET_IO_STATS zeroes the counters, other than the current queue depth, for every process using the device.  It's
+meant for benchmarks that measure one load at a time.  Returns TRUE on success, FALSE if the device is invalid.
+************************************************************************************************************************/
+
+typedef struct {
+	DWORD cbSize;			// structure size
+	DWORD dwMessages;		// messages written to the device
+	DWORD dwPackets;		// 8-byte packets written
+	DWORD dwFailed;			// messages that failed, or were dropped while the device was being reopened
+	DWORD dwSuppressed;		// messages skipped because the device already had the state
+	DWORD dwQueued;			// messages added to the write queue
+	DWORD dwCoalesced;		// messages merged into one already in the write queue
+	DWORD dwQueueDepth;		// messages currently waiting in the write queues
+	DWORD dwMaxQueueDepth;	// highest queue depth so far
+	DWORD dwPacingMs;		// total time spent waiting between writes, in milliseconds
+	DWORD dwLatencyP50Us;	// median packet write time, in microseconds
+	DWORD dwLatencyP90Us;	// 90th percentile packet write time, in microseconds
+	DWORD dwLatencyP99Us;	// 99th percentile packet write time, in microseconds
+	DWORD dwLatencyMaxUs;	// longest packet write time, in microseconds
+	DWORD dwQueueP50Us;		// median time from queueing a message to writing it, in microseconds
+	DWORD dwQueueP90Us;		// 90th percentile queue-to-write time, in microseconds
+	DWORD dwQueueP99Us;		// 99th percentile queue-to-write time, in microseconds
+	DWORD dwQueueMaxUs;		// longest queue-to-write time, in microseconds
+} LWZIOSTATS;
+
+BOOL LWZ_GET_IO_STATS(LWZHANDLE hlwz, LWZIOSTATS *stats);
+BOOL LWZ_RESET_IO_STATS(LWZHANDLE hlwz);
+
+
 #ifdef __cplusplus
 }
 #endif
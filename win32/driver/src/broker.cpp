@@ -0,0 +1,461 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Device broker transport.
+//
+// In broker mode, one long-lived process (the broker) owns all of the
+// devices, and other processes using the DLL (the clients) send their
+// output traffic to the broker instead of opening the devices
+// themselves.  This file implements the shared memory that connects
+// them; the broker's scheduling and merging logic is in ledwiz.cpp.
+//
+// The shared block has:
+//
+// - The broker's process ID, so clients can tell whether a broker is
+//   running.
+//
+// - The unit table, which the broker publishes so that clients can
+//   report the same set of devices to their callers.  The broker is the
+//   only writer; 'units_seq' works as a sequence lock, and doubles as
+//   the table generation number.
+//
+// - One slot per client, each with a single-producer, single-consumer
+//   message ring.  The client is the only writer of 'head' and the
+//   broker is the only writer of 'tail', so the ring needs no locks.  A
+//   client claims a free slot by swapping its process ID into 'pid'.
+//
+// Clients signal a named auto-reset event after adding messages, to
+// wake the broker.  The broker watches for clients that exit without
+// releasing their slots, and frees the slots itself.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "broker.h"
+
+
+// Object names.  Bump the version whenever the block layout changes.
+#define BROKER_BLOCK_NAME           "Local\\lwz_broker_v1"
+#define BROKER_EVENT_NAME           "Local\\lwz_broker_v1_kick"
+#define BROKER_MAGIC                0x4b52424c      // 'LBRK'
+
+// messages per client ring; must be a power of two
+#define BROKER_RING_LENGTH          64
+
+
+typedef struct {
+	volatile LONG pid;          // client process ID, 0 if the slot is free
+	volatile LONG session;      // odd while the client is setting up, even when ready
+	volatile LONG priority;     // merge priority; higher wins
+	volatile LONG head;         // next message to write; written only by the client
+	volatile LONG tail;         // next message to read; written only by the broker
+	broker_msg_t msgs[BROKER_RING_LENGTH];
+} broker_slot_t;
+
+typedef struct {
+	DWORD magic;
+	volatile LONG broker_pid;   // broker process ID, 0 if there's no broker
+	volatile LONG units_seq;    // sequence lock/generation for units[]
+	broker_unit_t units[BROKER_MAX_UNITS];
+	broker_slot_t slots[BROKER_MAX_CLIENTS];
+} broker_block_t;
+
+typedef struct {
+	HANDLE hmap;
+	broker_block_t *p;
+	HANDLE hkick;
+
+	// broker side: the client we last saw in each slot
+	struct {
+		LONG pid;
+		LONG session;
+		HANDLE hproc;
+	} known[BROKER_MAX_CLIENTS];
+
+	// client side
+	int slot;
+	LONG broker_pid;
+	HANDLE hbroker_proc;
+} broker_context_t;
+
+
+static void broker_close_internal(broker_context_t *h)
+{
+	if (h == NULL)
+		return;
+
+	for (int i = 0 ; i < BROKER_MAX_CLIENTS ; ++i)
+	{
+		if (h->known[i].hproc != NULL)
+			CloseHandle(h->known[i].hproc);
+	}
+
+	if (h->hbroker_proc != NULL)
+		CloseHandle(h->hbroker_proc);
+
+	if (h->hkick != NULL)
+		CloseHandle(h->hkick);
+
+	if (h->p != NULL)
+		UnmapViewOfFile(h->p);
+
+	if (h->hmap != NULL)
+		CloseHandle(h->hmap);
+
+	free(h);
+}
+
+// is the process still running?
+static bool broker_process_alive(HANDLE hproc)
+{
+	return hproc != NULL && WaitForSingleObject(hproc, 0) == WAIT_TIMEOUT;
+}
+
+static bool broker_pid_alive(LONG pid)
+{
+	if (pid == 0)
+		return false;
+
+	HANDLE const hproc = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+	bool const alive = broker_process_alive(hproc);
+	if (hproc != NULL)
+		CloseHandle(hproc);
+
+	return alive;
+}
+
+
+//**********************************************************************************************************************
+// Broker side
+//**********************************************************************************************************************
+
+// Create the shared block and become the broker.  Fails if another
+// broker is already running.
+HBROKER broker_server_open(void)
+{
+	broker_context_t * const h = (broker_context_t*)malloc(sizeof(broker_context_t));
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+
+	LONG const me = (LONG)GetCurrentProcessId();
+	LONG prev;
+
+	h->hmap = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(broker_block_t), BROKER_BLOCK_NAME);
+	if (h->hmap == NULL)
+		goto Failed;
+
+	h->p = (broker_block_t *)MapViewOfFile(h->hmap, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(broker_block_t));
+	if (h->p == NULL)
+		goto Failed;
+
+	h->hkick = CreateEventA(NULL, FALSE, FALSE, BROKER_EVENT_NAME);
+	if (h->hkick == NULL)
+		goto Failed;
+
+	// Claim the broker role.  The block outlives a broker that exited
+	// while clients still had it mapped, so a stale process ID can be
+	// taken over.
+	prev = h->p->broker_pid;
+	if (prev != 0 && broker_pid_alive(prev))
+		goto Failed;
+
+	if (InterlockedCompareExchange(&h->p->broker_pid, me, prev) != prev)
+		goto Failed;
+
+	h->p->magic = BROKER_MAGIC;
+	return h;
+
+	Failed:
+	broker_close_internal(h);
+	return NULL;
+}
+
+void broker_server_close(HBROKER hbroker)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	if (h == NULL)
+		return;
+
+	if (h->p != NULL)
+		InterlockedCompareExchange(&h->p->broker_pid, 0, (LONG)GetCurrentProcessId());
+
+	broker_close_internal(h);
+}
+
+// event signaled when a client adds messages or disconnects
+HANDLE broker_server_event(HBROKER hbroker)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	return h->hkick;
+}
+
+// publish the unit table
+void broker_server_publish(HBROKER hbroker, broker_unit_t const *units)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+
+	InterlockedIncrement(&h->p->units_seq);
+	memcpy(h->p->units, units, sizeof(h->p->units));
+	InterlockedIncrement(&h->p->units_seq);
+}
+
+// Check for clients connecting and disconnecting, and free the slots of
+// clients that exited without releasing them.  Returns a bit mask of
+// the slots whose client state must be reset: the client went away, or
+// a new client took the slot.
+DWORD broker_server_check_clients(HBROKER hbroker)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	DWORD reset = 0;
+
+	for (int i = 0 ; i < BROKER_MAX_CLIENTS ; ++i)
+	{
+		broker_slot_t * const s = &h->p->slots[i];
+		LONG const pid = s->pid;
+		LONG const session = s->session;
+
+		// if it's the same client as before, just make sure it's still running
+		if (pid != 0 && pid == h->known[i].pid && session == h->known[i].session)
+		{
+			if (!broker_process_alive(h->known[i].hproc))
+				InterlockedCompareExchange(&s->pid, 0, pid);
+			else
+				continue;
+		}
+
+		// the client we knew is gone
+		if (h->known[i].pid != 0)
+		{
+			if (h->known[i].hproc != NULL)
+				CloseHandle(h->known[i].hproc);
+
+			h->known[i].pid = 0;
+			h->known[i].hproc = NULL;
+			reset |= (1 << i);
+		}
+
+		// pick up a new client once it has finished setting up its slot
+		if (s->pid != 0 && s->pid == pid && (session & 1) == 0 && s->session == session)
+		{
+			h->known[i].pid = pid;
+			h->known[i].session = session;
+			h->known[i].hproc = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+			reset |= (1 << i);
+		}
+	}
+
+	return reset;
+}
+
+bool broker_server_connected(HBROKER hbroker, int slot)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	return h->known[slot].pid != 0;
+}
+
+LONG broker_server_priority(HBROKER hbroker, int slot)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	return h->p->slots[slot].priority;
+}
+
+// Take the next message from a client's ring.  Returns false if the
+// ring is empty.
+bool broker_server_receive(HBROKER hbroker, int slot, broker_msg_t *msg)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	broker_slot_t * const s = &h->p->slots[slot];
+
+	// ignore anything from a client we haven't picked up yet
+	if (h->known[slot].pid == 0 || s->session != h->known[slot].session)
+		return false;
+
+	for (;;)
+	{
+		LONG const tail = s->tail;
+		if ((LONG)(s->head - tail) <= 0)
+			return false;
+
+		MemoryBarrier();
+		*msg = s->msgs[tail & (BROKER_RING_LENGTH - 1)];
+		MemoryBarrier();
+		InterlockedExchange(&s->tail, tail + 1);
+
+		// skip anything malformed
+		if (msg->len >= 0 && msg->len <= (LONG)sizeof(msg->data)
+			&& msg->unit >= 0 && msg->unit < BROKER_MAX_UNITS)
+			return true;
+	}
+}
+
+
+//**********************************************************************************************************************
+// Client side
+//**********************************************************************************************************************
+
+// Connect to the running broker.  Returns NULL if there's no broker, or
+// all of the client slots are taken.
+HBROKER broker_client_open(LONG priority)
+{
+	broker_context_t * const h = (broker_context_t*)malloc(sizeof(broker_context_t));
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+	h->slot = -1;
+
+	LONG const me = (LONG)GetCurrentProcessId();
+	broker_slot_t *s;
+	LONG session;
+
+	h->hmap = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, BROKER_BLOCK_NAME);
+	if (h->hmap == NULL)
+		goto Failed;
+
+	h->p = (broker_block_t *)MapViewOfFile(h->hmap, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(broker_block_t));
+	if (h->p == NULL || h->p->magic != BROKER_MAGIC)
+		goto Failed;
+
+	// make sure the broker is actually running
+	h->broker_pid = h->p->broker_pid;
+	if (h->broker_pid == 0 || h->broker_pid == me)
+		goto Failed;
+
+	h->hbroker_proc = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)h->broker_pid);
+	if (!broker_process_alive(h->hbroker_proc))
+		goto Failed;
+
+	h->hkick = OpenEventA(EVENT_MODIFY_STATE, FALSE, BROKER_EVENT_NAME);
+	if (h->hkick == NULL)
+		goto Failed;
+
+	// claim a free slot
+	for (int i = 0 ; i < BROKER_MAX_CLIENTS && h->slot < 0 ; ++i)
+	{
+		if (InterlockedCompareExchange(&h->p->slots[i].pid, me, 0) == 0)
+			h->slot = i;
+	}
+
+	if (h->slot < 0)
+		goto Failed;
+
+	// Set up the slot.  The session number is odd while we're doing
+	// this, so the broker doesn't pick us up half way through.
+	s = &h->p->slots[h->slot];
+	session = (s->session | 1) + 2;
+	InterlockedExchange(&s->session, session);
+	InterlockedExchange(&s->priority, priority);
+	InterlockedExchange(&s->head, s->tail);
+	InterlockedExchange(&s->session, session + 1);
+	SetEvent(h->hkick);
+
+	return h;
+
+	Failed:
+	broker_close_internal(h);
+	return NULL;
+}
+
+void broker_client_close(HBROKER hbroker)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	if (h == NULL)
+		return;
+
+	// release the slot, and let the broker know right away
+	if (h->slot >= 0)
+	{
+		InterlockedExchange(&h->p->slots[h->slot].pid, 0);
+		SetEvent(h->hkick);
+	}
+
+	broker_close_internal(h);
+}
+
+// is the broker we connected to still running?
+bool broker_client_alive(HBROKER hbroker)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	return broker_process_alive(h->hbroker_proc) && h->p->broker_pid == h->broker_pid;
+}
+
+// Send a message to the broker.  If the ring is full, we wait for the
+// broker to catch up, the way a caller waits for a full write queue when
+// it has the devices itself.  Returns false only if the broker is gone.
+bool broker_client_submit(HBROKER hbroker, LONG unit, LONG kind, BYTE const *pdata, DWORD ndata)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	broker_slot_t * const s = &h->p->slots[h->slot];
+
+	if (ndata > sizeof(s->msgs[0].data))
+		ndata = sizeof(s->msgs[0].data);
+
+	LONG const head = s->head;
+	while ((LONG)(head - s->tail) >= BROKER_RING_LENGTH)
+	{
+		if (!broker_client_alive(hbroker))
+			return false;
+
+		SetEvent(h->hkick);
+		Sleep(1);
+	}
+
+	broker_msg_t * const msg = &s->msgs[head & (BROKER_RING_LENGTH - 1)];
+	msg->unit = unit;
+	msg->kind = kind;
+	msg->len = (LONG)ndata;
+	memcpy(msg->data, pdata, ndata);
+
+	MemoryBarrier();
+	InterlockedExchange(&s->head, head + 1);
+	SetEvent(h->hkick);
+
+	return true;
+}
+
+// get the unit table generation, which changes each time the broker publishes a new table
+LONG broker_client_generation(HBROKER hbroker)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+	return h->p->units_seq;
+}
+
+// copy the unit table; returns its generation
+LONG broker_client_units(HBROKER hbroker, broker_unit_t *units)
+{
+	broker_context_t * const h = (broker_context_t*)hbroker;
+
+	for (;;)
+	{
+		LONG const seq = h->p->units_seq;
+		if ((seq & 1) == 0)
+		{
+			MemoryBarrier();
+			memcpy(units, h->p->units, sizeof(h->p->units));
+			MemoryBarrier();
+
+			if (h->p->units_seq == seq)
+				return seq;
+		}
+
+		Sleep(0);
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef BROKER_H__INCLUDED
+#define BROKER_H__INCLUDED
+
+
+// Device broker shared memory transport (see broker.cpp)
+typedef void * HBROKER;
+
+#define BROKER_MAX_CLIENTS   8      // number of client slots
+#define BROKER_MAX_UNITS     16     // units in the published unit table (LWZ_MAX_DEVICES)
+
+// message kinds
+#define BROKER_MSG_SBA       1      // data = bank0..bank3, pulse speed
+#define BROKER_MSG_PBA       2      // data = 32 brightness values
+#define BROKER_MSG_RAW       3      // data = raw bytes, as for LWZ_RAWWRITE
+
+typedef struct {
+	LONG unit;              // unit index (LedWiz handle - 1)
+	LONG kind;              // BROKER_MSG_xxx
+	LONG len;               // number of bytes in data[]
+	BYTE data[32];
+} broker_msg_t;
+
+typedef struct {
+	UINT device_type;       // LWZ_DEVICE_TYPE_xxx; LWZ_DEVICE_TYPE_NONE for an empty slot
+	char name[256];         // device name
+} broker_unit_t;
+
+// broker side
+HBROKER broker_server_open(void);
+void broker_server_close(HBROKER hbroker);
+HANDLE broker_server_event(HBROKER hbroker);
+void broker_server_publish(HBROKER hbroker, broker_unit_t const *units);
+DWORD broker_server_check_clients(HBROKER hbroker);
+bool broker_server_connected(HBROKER hbroker, int slot);
+LONG broker_server_priority(HBROKER hbroker, int slot);
+bool broker_server_receive(HBROKER hbroker, int slot, broker_msg_t *msg);
+
+// client side
+HBROKER broker_client_open(LONG priority);
+void broker_client_close(HBROKER hbroker);
+bool broker_client_alive(HBROKER hbroker);
+bool broker_client_submit(HBROKER hbroker, LONG unit, LONG kind, BYTE const *pdata, DWORD ndata);
+LONG broker_client_generation(HBROKER hbroker);
+LONG broker_client_units(HBROKER hbroker, broker_unit_t *units);
+
+
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Asynchronous debug log.
+//
+// Logging has to be cheap enough to leave on in the field, where the
+// calls that matter (LWZ_SBA and LWZ_PBA) come at game frame rates.  So
+// the calling thread doesn't format anything or touch the file.  It just
+// stores the format string pointer and the raw argument values in a
+// fixed-size record, in a ring buffer of its own, and a background thread
+// formats the records and writes them out.  Each ring has one writer (its
+// thread) and one reader (the log thread), so no locking is needed.
+// String arguments are copied into the record, since the caller's buffer
+// might be gone by the time the record is formatted.  If a ring fills up,
+// new records are dropped and counted, rather than making the caller wait.
+//
+// Logging is off unless it's enabled at run time, with LWZ_SET_DEBUG_LOG
+// or the LWZ_DEBUG_LOG environment variable, and when it's off, LOG()
+// costs one test of a global flag.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "dbglog.h"
+
+
+#define DBGLOG_MAX_THREADS   32      // number of per-thread rings
+#define DBGLOG_RING_SIZE     256     // records per ring; must be a power of 2
+#define DBGLOG_MAX_ARGS      8       // arguments per record
+#define DBGLOG_STR_SIZE      96      // space for copies of string arguments
+#define DBGLOG_FLUSH_MS      50      // how often the log thread writes out records
+
+// default log file, for LWZ_DEBUG_LOG=1
+#define DBGLOG_DEFAULT_FILE  "LedWizDllDebug.log"
+
+typedef struct {
+	LONGLONG t;							// QueryPerformanceCounter() time
+	char const *fmt;					// format string
+	int nargs;							// number of arguments
+	LONGLONG args[DBGLOG_MAX_ARGS];		// argument values; for %s, the offset in str[], or -1 for NULL
+	char str[DBGLOG_STR_SIZE];			// copies of string arguments
+} dbglog_rec_t;
+
+typedef struct {
+	volatile LONG owner;				// ID of the thread writing to the ring, 0 if free
+	volatile LONG released;				// the owner has exited; free the ring once it's drained
+	volatile LONG head;					// next record to write (written by the owner)
+	volatile LONG tail;					// next record to read (written by the log thread)
+	volatile LONG dropped;				// records dropped because the ring was full
+	DWORD tid;							// owner thread ID, for the log thread
+	dbglog_rec_t rec[DBGLOG_RING_SIZE];
+} dbglog_ring_t;
+
+static struct {
+	dbglog_ring_t * volatile rings[DBGLOG_MAX_THREADS];		// allocated on first use
+	DWORD tls;							// TLS slot with each thread's ring
+	volatile LONG dropped;				// records dropped for lack of a free ring
+	FILE *fp;							// log file
+	bool line_start;					// the last text written ended a line
+	LONGLONG t0;						// time logging started
+	LONGLONG freq;						// performance counter frequency
+	HANDLE hthread;						// log thread
+	HANDLE hquit;						// signaled to tell the log thread to exit
+	HANDLE hdone;						// signaled by the log thread as its last act
+} g_dbglog = { { NULL }, TLS_OUT_OF_INDEXES };
+
+LONG volatile g_dbglog_enabled = 0;
+
+
+// Find the next conversion in a format string.  Returns a pointer just
+// past it, or NULL if there are no more.  Sets '*pconv' to the conversion
+// character, and '*pwide' if the argument is 64 bits.
+static char const *dbglog_next_spec(char const *p, char *pconv, bool *pwide)
+{
+	for (;;)
+	{
+		p = strchr(p, '%');
+		if (p == NULL)
+			return NULL;
+
+		++p;
+		if (*p == '%')
+		{
+			++p;
+			continue;
+		}
+
+		// skip flags, width and precision
+		while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL)
+			++p;
+
+		// check for a 64-bit size prefix, and skip the others
+		*pwide = false;
+		if (strncmp(p, "I64", 3) == 0)
+		{
+			*pwide = true;
+			p += 3;
+		}
+		else if (strncmp(p, "ll", 2) == 0)
+		{
+			*pwide = true;
+			p += 2;
+		}
+		else
+		{
+			while (*p == 'h' || *p == 'l' || *p == 'I')
+				++p;
+		}
+
+		if (*p == '\0')
+			return NULL;
+
+		*pconv = *p;
+		return p + 1;
+	}
+}
+
+// Get the calling thread's ring, claiming one if it doesn't have one yet
+static dbglog_ring_t *dbglog_thread_ring(void)
+{
+	dbglog_ring_t *r = (dbglog_ring_t *)TlsGetValue(g_dbglog.tls);
+	if (r != NULL)
+		return r;
+
+	LONG const tid = (LONG)GetCurrentThreadId();
+	for (int i = 0 ; i < DBGLOG_MAX_THREADS ; ++i)
+	{
+		dbglog_ring_t * const slot = g_dbglog.rings[i];
+		if (slot == NULL)
+		{
+			// allocate the ring on first use of the slot
+			dbglog_ring_t *pnew = (dbglog_ring_t *)malloc(sizeof(dbglog_ring_t));
+			if (pnew == NULL)
+				return NULL;
+
+			memset(pnew, 0x00, sizeof(*pnew));
+			pnew->owner = tid;
+			pnew->tid = tid;
+			if (InterlockedCompareExchangePointer((PVOID volatile *)&g_dbglog.rings[i], pnew, NULL) != NULL)
+			{
+				// another thread got the slot first
+				free(pnew);
+				continue;
+			}
+
+			r = pnew;
+		}
+		else if (InterlockedCompareExchange(&slot->owner, tid, 0) == 0)
+		{
+			// reuse a ring freed by a thread that has exited
+			r = slot;
+			r->tid = tid;
+		}
+		else
+			continue;
+
+		TlsSetValue(g_dbglog.tls, r);
+		return r;
+	}
+
+	return NULL;
+}
+
+void dbglog_write(char const *fmt, ...)
+{
+	dbglog_ring_t * const r = dbglog_thread_ring();
+	if (r == NULL)
+	{
+		InterlockedIncrement(&g_dbglog.dropped);
+		return;
+	}
+
+	// make sure there's room
+	LONG const head = r->head;
+	if (head - r->tail >= DBGLOG_RING_SIZE)
+	{
+		InterlockedIncrement(&r->dropped);
+		return;
+	}
+
+	dbglog_rec_t * const rec = &r->rec[head & (DBGLOG_RING_SIZE - 1)];
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	rec->t = t.QuadPart;
+	rec->fmt = fmt;
+
+	// capture the arguments
+	va_list va;
+	va_start(va, fmt);
+
+	int n = 0;
+	size_t spos = 0;
+	char conv;
+	bool wide;
+	for (char const *p = fmt ; n < DBGLOG_MAX_ARGS && (p = dbglog_next_spec(p, &conv, &wide)) != NULL ; ++n)
+	{
+		if (conv == 's')
+		{
+			char const * const s = va_arg(va, char const *);
+			if (s == NULL || spos >= sizeof(rec->str))
+			{
+				rec->args[n] = -1;
+				continue;
+			}
+
+			strncpy_s(&rec->str[spos], sizeof(rec->str) - spos, s, _TRUNCATE);
+			rec->args[n] = spos;
+			spos += strlen(&rec->str[spos]) + 1;
+		}
+		else if (wide)
+			rec->args[n] = va_arg(va, LONGLONG);
+		else
+			rec->args[n] = va_arg(va, INT_PTR);
+	}
+
+	va_end(va);
+	rec->nargs = n;
+
+	// publish the record
+	MemoryBarrier();
+	r->head = head + 1;
+}
+
+// Write text to the log file, starting each new line with the time and
+// thread ID
+static void dbglog_put(char const *text, LONGLONG t, DWORD tid)
+{
+	if (*text == '\0')
+		return;
+
+	if (g_dbglog.line_start)
+	{
+		fprintf(g_dbglog.fp, "[%10.3f %5lu] ",
+			(double)(t - g_dbglog.t0) * 1000.0 / (double)g_dbglog.freq, (unsigned long)tid);
+	}
+
+	fputs(text, g_dbglog.fp);
+	g_dbglog.line_start = (text[strlen(text) - 1] == '\n');
+}
+
+// Format a record and write it out.  Each conversion is formatted
+// separately, with its own piece of the format string.
+static void dbglog_format(dbglog_rec_t const *rec, DWORD tid)
+{
+	char line[512];
+	size_t pos = 0;
+	char const *p = rec->fmt;
+	char conv;
+	bool wide;
+	line[0] = '\0';
+
+	for (int n = 0 ; n < rec->nargs ; ++n)
+	{
+		char const * const end = dbglog_next_spec(p, &conv, &wide);
+
+		char piece[128];
+		size_t const len = end - p;
+		if (len >= sizeof(piece))
+			break;
+
+		memcpy(piece, p, len);
+		piece[len] = '\0';
+		p = end;
+
+		char * const dst = &line[pos];
+		size_t const room = sizeof(line) - pos;
+		if (conv == 's')
+			_snprintf_s(dst, room, _TRUNCATE, piece, rec->args[n] < 0 ? "(null)" : &rec->str[rec->args[n]]);
+		else if (wide)
+			_snprintf_s(dst, room, _TRUNCATE, piece, rec->args[n]);
+		else
+			_snprintf_s(dst, room, _TRUNCATE, piece, (INT_PTR)rec->args[n]);
+
+		pos += strlen(dst);
+	}
+
+	// Add the rest of the format string.  If it still has conversions,
+	// there were more arguments than a record holds, so just show it as is.
+	if (dbglog_next_spec(p, &conv, &wide) == NULL)
+		_snprintf_s(&line[pos], sizeof(line) - pos, _TRUNCATE, p);
+	else
+		_snprintf_s(&line[pos], sizeof(line) - pos, _TRUNCATE, "%s", p);
+
+	dbglog_put(line, rec->t, tid);
+}
+
+// Write out everything in the rings, in time order across threads
+static void dbglog_drain(void)
+{
+	for (;;)
+	{
+		// find the oldest record at the head of a ring
+		dbglog_ring_t *oldest = NULL;
+		for (int i = 0 ; i < DBGLOG_MAX_THREADS ; ++i)
+		{
+			dbglog_ring_t * const r = g_dbglog.rings[i];
+			if (r == NULL || r->tail == r->head)
+				continue;
+
+			MemoryBarrier();
+			if (oldest == NULL || r->rec[r->tail & (DBGLOG_RING_SIZE - 1)].t < oldest->rec[oldest->tail & (DBGLOG_RING_SIZE - 1)].t)
+				oldest = r;
+		}
+
+		if (oldest == NULL)
+			break;
+
+		dbglog_format(&oldest->rec[oldest->tail & (DBGLOG_RING_SIZE - 1)], oldest->tid);
+		MemoryBarrier();
+		oldest->tail = oldest->tail + 1;
+	}
+
+	// report drops, and free the rings of threads that have exited
+	for (int i = 0 ; i < DBGLOG_MAX_THREADS ; ++i)
+	{
+		dbglog_ring_t * const r = g_dbglog.rings[i];
+		if (r == NULL)
+			continue;
+
+		LONG const dropped = InterlockedExchange(&r->dropped, 0);
+		if (dropped != 0)
+		{
+			char buf[64];
+			_snprintf_s(buf, sizeof(buf), _TRUNCATE, "%s(%ld records dropped)\n", g_dbglog.line_start ? "" : "\n", dropped);
+			g_dbglog.line_start = true;
+			dbglog_put(buf, r->rec[(r->tail - 1) & (DBGLOG_RING_SIZE - 1)].t, r->tid);
+		}
+
+		if (r->released && r->tail == r->head)
+		{
+			r->released = 0;
+			InterlockedExchange(&r->owner, 0);
+		}
+	}
+
+	LONG const dropped = InterlockedExchange(&g_dbglog.dropped, 0);
+	if (dropped != 0)
+		fprintf(g_dbglog.fp, "(%ld records dropped, too many threads)\n", dropped);
+
+	fflush(g_dbglog.fp);
+}
+
+static DWORD WINAPI DbgLogThreadProc(LPVOID lpParameter)
+{
+	while (WaitForSingleObject(g_dbglog.hquit, DBGLOG_FLUSH_MS) == WAIT_TIMEOUT)
+		dbglog_drain();
+
+	// write out anything left
+	dbglog_drain();
+
+	SetEvent(g_dbglog.hdone);
+
+	return 0;
+}
+
+// Start logging to the given file, stopping any log already running
+bool dbglog_start(char const *path)
+{
+	dbglog_stop();
+
+	if (g_dbglog.tls == TLS_OUT_OF_INDEXES)
+	{
+		g_dbglog.tls = TlsAlloc();
+		if (g_dbglog.tls == TLS_OUT_OF_INDEXES)
+			return false;
+	}
+
+	if (fopen_s(&g_dbglog.fp, path, "a") != 0 || g_dbglog.fp == NULL)
+	{
+		g_dbglog.fp = NULL;
+		return false;
+	}
+
+	LARGE_INTEGER t, freq;
+	QueryPerformanceCounter(&t);
+	QueryPerformanceFrequency(&freq);
+	g_dbglog.t0 = t.QuadPart;
+	g_dbglog.freq = freq.QuadPart;
+	g_dbglog.line_start = true;
+
+	g_dbglog.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+	g_dbglog.hdone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (g_dbglog.hquit == NULL || g_dbglog.hdone == NULL)
+		goto Failed;
+
+	g_dbglog.hthread = CreateThread(NULL, 0, DbgLogThreadProc, NULL, 0, NULL);
+	if (g_dbglog.hthread == NULL)
+		goto Failed;
+
+	InterlockedExchange(&g_dbglog_enabled, 1);
+	return true;
+
+	Failed:
+	dbglog_stop();
+	return false;
+}
+
+// Stop logging, writing out everything logged so far.  Like the DLL's
+// other threads, the log thread is stopped by waiting for its "done"
+// event rather than the thread handle, so this is safe from DllMain.
+void dbglog_stop(void)
+{
+	InterlockedExchange(&g_dbglog_enabled, 0);
+
+	if (g_dbglog.hthread != NULL)
+	{
+		SetEvent(g_dbglog.hquit);
+		WaitForSingleObject(g_dbglog.hdone, INFINITE);
+		CloseHandle(g_dbglog.hthread);
+		g_dbglog.hthread = NULL;
+	}
+
+	if (g_dbglog.hquit != NULL)
+	{
+		CloseHandle(g_dbglog.hquit);
+		g_dbglog.hquit = NULL;
+	}
+
+	if (g_dbglog.hdone != NULL)
+	{
+		CloseHandle(g_dbglog.hdone);
+		g_dbglog.hdone = NULL;
+	}
+
+	if (g_dbglog.fp != NULL)
+	{
+		fclose(g_dbglog.fp);
+		g_dbglog.fp = NULL;
+	}
+}
+
+// Start logging if the LWZ_DEBUG_LOG environment variable is set: to a
+// file name, or to 1 for the default file in the current directory
+void dbglog_start_from_environment(void)
+{
+	char path[MAX_PATH];
+	DWORD const len = GetEnvironmentVariableA("LWZ_DEBUG_LOG", path, sizeof(path));
+	if (len == 0 || len >= sizeof(path))
+		return;
+
+	dbglog_start(strcmp(path, "1") == 0 ? DBGLOG_DEFAULT_FILE : path);
+}
+
+// Release the calling thread's ring when the thread exits.  The log
+// thread frees it for reuse once it has written out the ring's records.
+void dbglog_thread_detach(void)
+{
+	if (g_dbglog.tls == TLS_OUT_OF_INDEXES)
+		return;
+
+	dbglog_ring_t * const r = (dbglog_ring_t *)TlsGetValue(g_dbglog.tls);
+	if (r != NULL)
+	{
+		TlsSetValue(g_dbglog.tls, NULL);
+		InterlockedExchange(&r->released, 1);
+	}
+}
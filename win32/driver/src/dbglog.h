@@ -0,0 +1,35 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DBGLOG_H__INCLUDED
+#define DBGLOG_H__INCLUDED
+
+
+// Asynchronous debug log (see dbglog.cpp).  The format string must be a
+// string literal, since it's only read later, on the log thread.
+extern LONG volatile g_dbglog_enabled;
+
+#define LOG(...)   do { if (g_dbglog_enabled) dbglog_write(__VA_ARGS__); } while (0)
+
+void dbglog_write(char const *fmt, ...);
+bool dbglog_start(char const *path);
+void dbglog_stop(void);
+void dbglog_start_from_environment(void);
+void dbglog_thread_detach(void);
+
+
+
+#endif
@@ -0,0 +1,428 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Device state shared across processes.
+//
+// More than one program can drive the same unit at the same time - DOF
+// in the game and LedBlinky in the front end, for example.  Each process
+// has its own copy of the DLL, with its own I/O queue and its own write
+// pacing, so without some coordination, the processes' writes interleave
+// freely.  That defeats the write pacing that the real LedWiz needs (see
+// usbdev.cpp), and can split up the four-packet PBA sequence.
+//
+// For each device, we keep a named mutex, which a writer holds for a
+// whole message, so that the packets of one message go out together and
+// other processes' messages follow.  There's also a small named shared
+// memory block that every process maps.  It holds:
+//
+// - The pacing schedule: the earliest time the next write may start.
+//   A writer reserves each packet's slot just before writing it, so the
+//   spacing holds even when a wait overshoots its slot.
+//
+// - The last state sent to the device, per port (brightness) and per
+//   bank of 8 ports (on/off bits plus the pulse speed), so that a
+//   process can skip a message that wouldn't change anything on the
+//   device because some process (possibly this one) already sent it.
+//
+// - The device's I/O counters (see usbdev_stats), so that a monitoring
+//   tool can see the writes of all of the processes using the device.
+//
+// Access to the block is lock-free.  Each value is a single LONG that includes a
+// "valid" bit, so readers never see a torn value.  A writer marks the
+// state it's about to change as unknown before the write, and stores the
+// new values only after the write succeeds, so a concurrent writer never
+// skips a message based on state that isn't on the device yet.  Zero
+// means unknown, so a newly created (zero-filled) block needs no setup.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devshare.h"
+#include "usbdev.h"
+#include "lwzcodec.h"
+
+
+// Segment name.  Bump the version whenever the block layout changes, so
+// that different DLL versions running side by side don't share a block.
+#define DEVSHARE_NAME_FORMAT        "Local\\lwz_device_v3_%08lx"
+#define DEVSHARE_MUTEX_FORMAT       "Local\\lwz_device_v3_%08lx_write"
+
+// Longest wait for another process to finish its message.  If it takes
+// longer than this, it's probably hung, so we write anyway.
+#define DEVSHARE_LOCK_TIMEOUT_MS    1000
+
+// number of ports tracked; this covers the largest Pinscape configuration
+#define DEVSHARE_MAX_PORTS          128
+
+// "valid" flag in state values
+#define DEVSHARE_VALID              0x01000000
+
+// A redundant message is still sent if the state it matches is older
+// than this.  The real LedWiz firmware occasionally garbles an update,
+// and some programs periodically resend the full state to repair that,
+// so we mustn't suppress repeats indefinitely.
+#define DEVSHARE_REFRESH_MS         2000
+
+// If the schedule is further ahead than this, assume it's garbage (or
+// left over from a long-gone process with a wrapped tick count) and
+// start over from the current time.
+#define DEVSHARE_MAX_AHEAD_MS       1000
+
+
+typedef struct {
+	volatile LONG next_write;								// GetTickCount() time the next write may start
+	volatile LONG port_stamp[DEVSHARE_MAX_PORTS / 8];		// time each group of 8 ports was last sent
+	volatile LONG bank_stamp[DEVSHARE_MAX_PORTS / 32];		// time each group of 4 banks was last sent
+	volatile LONG port[DEVSHARE_MAX_PORTS];					// brightness | DEVSHARE_VALID
+	volatile LONG bank[DEVSHARE_MAX_PORTS / 8];				// on/off bits | (speed << 8) | DEVSHARE_VALID
+	usbdev_stats_t stats;									// I/O counters
+} devshare_block_t;
+
+typedef struct {
+	HANDLE hmap;
+	HANDLE hmutex;
+	devshare_block_t *p;
+} devshare_context_t;
+
+// One state value set by a message, with the timestamp covering it
+typedef struct {
+	volatile LONG *slot;
+	volatile LONG *stamp;
+	LONG value;
+} devshare_update_t;
+
+// largest number of updates in one message: a PBA or four PBX packets
+#define DEVSHARE_MAX_UPDATES        32
+
+// commands that don't change the outputs
+#define DEVSHARE_CMD_CONFIG         65      // LWCloneU2 set ID, Pinscape configuration query
+#define DEVSHARE_CMD_PING           69      // LWCloneU2 ping
+
+// packet kinds, by the first byte
+enum {
+	DEVSHARE_PKT_UNKNOWN,
+	DEVSHARE_PKT_PBA,
+	DEVSHARE_PKT_BANKS,
+	DEVSHARE_PKT_PORTS,
+	DEVSHARE_PKT_LEVELS,
+	DEVSHARE_PKT_CONTROL
+};
+
+
+HDEVSHARE devshare_open(DWORD path_hash)
+{
+	devshare_context_t * const h = (devshare_context_t*)malloc(sizeof(devshare_context_t));
+	if (h == NULL)
+		return NULL;
+
+	memset(h, 0x00, sizeof(*h));
+
+	char name[64];
+	_snprintf_s(name, sizeof(name), _TRUNCATE, DEVSHARE_NAME_FORMAT, (unsigned long)path_hash);
+
+	// create the block, or open it if another process already did
+	h->hmap = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(devshare_block_t), name);
+	if (h->hmap == NULL)
+		goto Failed;
+
+	h->p = (devshare_block_t *)MapViewOfFile(h->hmap, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(devshare_block_t));
+	if (h->p == NULL)
+		goto Failed;
+
+	_snprintf_s(name, sizeof(name), _TRUNCATE, DEVSHARE_MUTEX_FORMAT, (unsigned long)path_hash);
+	h->hmutex = CreateMutexA(NULL, FALSE, name);
+	if (h->hmutex == NULL)
+		goto Failed;
+
+	return h;
+
+	Failed:
+	devshare_close(h);
+	return NULL;
+}
+
+void devshare_close(HDEVSHARE hshare)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+	if (h == NULL)
+		return;
+
+	if (h->p != NULL)
+		UnmapViewOfFile(h->p);
+
+	if (h->hmap != NULL)
+		CloseHandle(h->hmap);
+
+	if (h->hmutex != NULL)
+		CloseHandle(h->hmutex);
+
+	free(h);
+}
+
+// Take the device's write lock, for the length of one message.  Returns
+// false if another process held on to it for too long, in which case the
+// caller writes without it and mustn't call devshare_unlock().
+bool devshare_lock(HDEVSHARE hshare)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	// an abandoned lock is ours now; its owner exited mid-message, which
+	// doesn't leave anything for us to clean up
+	DWORD const res = WaitForSingleObject(h->hmutex, DEVSHARE_LOCK_TIMEOUT_MS);
+	return (res == WAIT_OBJECT_0 || res == WAIT_ABANDONED);
+}
+
+void devshare_unlock(HDEVSHARE hshare)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	ReleaseMutex(h->hmutex);
+}
+
+// Reserve 'nslots' consecutive write slots 'interval_ms' apart on the
+// shared schedule.  Returns the GetTickCount() time of the first slot;
+// the caller waits until then before writing the first packet.
+DWORD devshare_reserve(HDEVSHARE hshare, unsigned int nslots, unsigned int interval_ms)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	for (;;)
+	{
+		LONG const cur = h->p->next_write;
+		DWORD const now = GetTickCount();
+
+		// start at the next free slot, or now if that's already past
+		DWORD start = (DWORD)cur;
+		LONG const ahead = (LONG)(start - now);
+		if (ahead < 0 || ahead > DEVSHARE_MAX_AHEAD_MS)
+			start = now;
+
+		LONG const next = (LONG)(start + nslots * interval_ms);
+		if (InterlockedCompareExchange(&h->p->next_write, next, cur) == cur)
+			return start;
+	}
+}
+
+// Note that a write just finished.  The interval counts from the end of
+// a write, and a write can take longer than its slot, so push the next
+// free slot out to a full interval from now if it's any sooner.
+void devshare_write_done(HDEVSHARE hshare, unsigned int interval_ms)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	for (;;)
+	{
+		LONG const cur = h->p->next_write;
+		LONG const next = (LONG)(GetTickCount() + interval_ms);
+		if ((LONG)(cur - next) >= 0
+			|| InterlockedCompareExchange(&h->p->next_write, next, cur) == cur)
+			return;
+	}
+}
+
+// Classify an 8-byte packet by its first byte, the way the firmware
+// dispatches it
+static int devshare_packet_kind(BYTE cmd)
+{
+	if (cmd == LWZCODEC_CMD_SBA || cmd == LWZCODEC_CMD_SBX)
+		return DEVSHARE_PKT_BANKS;
+	if (cmd == LWZCODEC_CMD_PBX)
+		return DEVSHARE_PKT_PORTS;
+	if (cmd == LWZCODEC_CMD_LEVELS)
+		return DEVSHARE_PKT_LEVELS;
+	if (cmd == DEVSHARE_CMD_CONFIG || cmd == DEVSHARE_CMD_PING)
+		return DEVSHARE_PKT_CONTROL;
+	if (cmd <= 49 || (cmd >= 129 && cmd <= 132))
+		return DEVSHARE_PKT_PBA;
+	return DEVSHARE_PKT_UNKNOWN;
+}
+
+// Decode a message into the state values it sets.  Each 8-byte packet
+// is classified by its first byte: 64 is SBA, 67 is Pinscape SBX, 68 is
+// Pinscape PBX, 70 is LWCloneU2 levels, 65 and 69 are configuration and
+// ping commands that don't touch the outputs, and the PBA brightness
+// codes (0-49, 129-132) are PBA data.  A PBA is only recognized as a
+// complete 32-byte message of PBA packets, since the ports addressed by
+// a lone PBA packet depend on the device's protocol state.  Levels
+// aren't tracked, so the ports they set become unknown (an update
+// without DEVSHARE_VALID).  Returns the number of updates, or -1 if the
+// message has effects we can't pin down (unknown commands, partial PBA
+// messages, and so on).
+static int devshare_decode(devshare_block_t *p, BYTE const *pdata, size_t ndata, devshare_update_t *u)
+{
+	int n = 0;
+
+	if (ndata == 0 || (ndata % 8) != 0 || ndata > 32)
+		return -1;
+
+	// check for a full PBA message
+	bool pba = (ndata == 32);
+	for (size_t i = 0 ; i < ndata && pba ; i += 8)
+		pba = (devshare_packet_kind(pdata[i]) == DEVSHARE_PKT_PBA);
+
+	if (pba)
+	{
+		for (int port = 0 ; port < 32 ; ++port, ++n)
+		{
+			u[n].slot = &p->port[port];
+			u[n].stamp = &p->port_stamp[port / 8];
+			u[n].value = pdata[port] | DEVSHARE_VALID;
+		}
+
+		return n;
+	}
+
+	for (size_t i = 0 ; i < ndata ; i += 8)
+	{
+		BYTE const *pkt = pdata + i;
+		BYTE banks[4], speed, levels[8];
+		int group;
+
+		switch (devshare_packet_kind(pkt[0]))
+		{
+		case DEVSHARE_PKT_BANKS:
+			group = lwzcodec_decode_sbx(pkt, banks, &speed);
+			if (group >= DEVSHARE_MAX_PORTS / 32)
+				return -1;
+
+			for (int b = 0 ; b < 4 ; ++b, ++n)
+			{
+				u[n].slot = &p->bank[group*4 + b];
+				u[n].stamp = &p->bank_stamp[group];
+				u[n].value = banks[b] | (speed << 8) | DEVSHARE_VALID;
+			}
+			break;
+
+		case DEVSHARE_PKT_PORTS:
+			group = lwzcodec_decode_pbx(pkt, levels);
+			if (group >= DEVSHARE_MAX_PORTS / 8)
+				return -1;
+
+			for (int k = 0 ; k < 8 ; ++k, ++n)
+			{
+				u[n].slot = &p->port[group*8 + k];
+				u[n].stamp = &p->port_stamp[group];
+				u[n].value = levels[k] | DEVSHARE_VALID;
+			}
+			break;
+
+		case DEVSHARE_PKT_LEVELS:
+			{
+				int const first = pkt[1] & 0x1F;
+				int const count = (pkt[1] >> 5) & 0x07;
+				for (int k = first ; k < first + count && k < 32 ; ++k, ++n)
+				{
+					u[n].slot = &p->port[k];
+					u[n].stamp = &p->port_stamp[k / 8];
+					u[n].value = 0;
+				}
+			}
+			break;
+
+		case DEVSHARE_PKT_CONTROL:
+			break;
+
+		default:
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+// Is the message redundant?  It is if every value it sets is already
+// known to be on the device, and was sent recently.
+bool devshare_is_redundant(HDEVSHARE hshare, BYTE const *pdata, size_t ndata)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	devshare_update_t u[DEVSHARE_MAX_UPDATES];
+	int const n = devshare_decode(h->p, pdata, ndata, u);
+	if (n <= 0)
+		return false;
+
+	DWORD const now = GetTickCount();
+	for (int i = 0 ; i < n ; ++i)
+	{
+		if ((u[i].value & DEVSHARE_VALID) == 0
+			|| *u[i].slot != u[i].value
+			|| (DWORD)(now - (DWORD)*u[i].stamp) >= DEVSHARE_REFRESH_MS)
+			return false;
+	}
+
+	return true;
+}
+
+// Mark the state a message is about to change as unknown, before
+// writing it.  A message we can't decode could change anything, so it
+// invalidates everything.
+void devshare_begin_write(HDEVSHARE hshare, BYTE const *pdata, size_t ndata)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	devshare_update_t u[DEVSHARE_MAX_UPDATES];
+	int const n = devshare_decode(h->p, pdata, ndata, u);
+	if (n < 0)
+	{
+		devshare_forget(hshare);
+		return;
+	}
+
+	for (int i = 0 ; i < n ; ++i)
+		InterlockedExchange(u[i].slot, 0);
+}
+
+// Mark the whole device state as unknown, such as after the device was
+// reset or reconnected
+void devshare_forget(HDEVSHARE hshare)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	for (int i = 0 ; i < DEVSHARE_MAX_PORTS ; ++i)
+		InterlockedExchange(&h->p->port[i], 0);
+	for (int i = 0 ; i < DEVSHARE_MAX_PORTS / 8 ; ++i)
+		InterlockedExchange(&h->p->bank[i], 0);
+}
+
+// Get the device's shared I/O counters
+usbdev_stats_t *devshare_stats(HDEVSHARE hshare)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	return &h->p->stats;
+}
+
+// Record the state set by a message that was written successfully
+void devshare_commit(HDEVSHARE hshare, BYTE const *pdata, size_t ndata)
+{
+	devshare_context_t * const h = (devshare_context_t*)hshare;
+
+	devshare_update_t u[DEVSHARE_MAX_UPDATES];
+	int const n = devshare_decode(h->p, pdata, ndata, u);
+	LONG const now = (LONG)GetTickCount();
+
+	// stamp first, so a reader that sees a new value also sees a fresh time
+	for (int i = 0 ; i < n ; ++i)
+	{
+		if (u[i].value & DEVSHARE_VALID)
+			InterlockedExchange(u[i].stamp, now);
+	}
+	for (int i = 0 ; i < n ; ++i)
+		InterlockedExchange(u[i].slot, u[i].value);
+}
@@ -0,0 +1,38 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DEVSHARE_H__INCLUDED
+#define DEVSHARE_H__INCLUDED
+
+
+// Per-device state shared by all processes using the DLL (see devshare.cpp)
+typedef void * HDEVSHARE;
+
+HDEVSHARE devshare_open(DWORD path_hash);
+void devshare_close(HDEVSHARE hshare);
+bool devshare_lock(HDEVSHARE hshare);
+void devshare_unlock(HDEVSHARE hshare);
+DWORD devshare_reserve(HDEVSHARE hshare, unsigned int nslots, unsigned int interval_ms);
+void devshare_write_done(HDEVSHARE hshare, unsigned int interval_ms);
+bool devshare_is_redundant(HDEVSHARE hshare, BYTE const *pdata, size_t ndata);
+void devshare_begin_write(HDEVSHARE hshare, BYTE const *pdata, size_t ndata);
+void devshare_commit(HDEVSHARE hshare, BYTE const *pdata, size_t ndata);
+void devshare_forget(HDEVSHARE hshare);
+struct usbdev_stats_s *devshare_stats(HDEVSHARE hshare);	// usbdev_stats_t, see usbdev.h
+
+
+
+#endif
@@ -17,6 +17,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <windows.h>
 #include <crtdbg.h>
@@ -31,30 +32,39 @@ extern "C" {
 #define LWZ_DLL_EXPORT
 #include "../include/ledwiz.h"
 #include "usbdev.h"
+#include "devshare.h"
+#include "broker.h"
+#include "outmap.h"
+#include "dbglog.h"
+#include "lwzcodec.h"
 
 #define USE_SEPARATE_IO_THREAD
-#define DEBUG_LOGGING 0
 
 
-#if DEBUG_LOGGING
-#include <stdarg.h>
-#include <stdio.h>
-static void LOG(char *f, ...)
-{
-	va_list args;
-	va_start(args, f);
-	FILE *fp = fopen("LedWizDllDebug.log", "a");
-	if (fp != 0)
-	{
-		vfprintf(fp, f, args);
-		fclose(fp);
-	}
-	va_end(args);
-}
-#else
-#define LOG(x, ...)
-#endif
+// overall deadline for Pinscape configuration and LWCloneU2 capability
+// query replies, in milliseconds
+#define PINSCAPE_CONFIG_QUERY_TIMEOUT_MS   2000
+
+// LWCloneU2 ping command and its reply (see firmware/comm.h).  Firmware
+// version 2 and later answers it, with a byte of capability bits at the
+// end of the reply; older firmware would take it for PBA data, so we
+// only send it to units that report a new enough version.
+#define LWCLONEU2_CMD_PING                 69
+#define LWCLONEU2_PING_REPLY_LEN           12
+#define LWCLONEU2_PING_MIN_VERSION         2
+#define LWCLONEU2_CAP_LEVELS               0x01	// takes 8-bit levels (LWZCODEC_CMD_LEVELS)
+
+// how often the broker and its clients check for changes when idle, in milliseconds
+#define LWZ_BROKER_POLL_MS                 250
+
+// how soon to try again if a reconnect pass couldn't run, in milliseconds
+// (the retries for each device back off; see usbdev_reopen_wait)
+#define LWZ_RECONNECT_RETRY_MS             100
 
+// effect update intervals, in milliseconds: the regular tick, and the
+// rate a real LedWiz can take full PBA updates (four paced packets)
+#define LWZ_EFFECT_TICK_MS                 10
+#define LWZ_EFFECT_TICK_MS_LEDWIZ          20
 
 const GUID HIDguid = { 0x4d1e55b2, 0xf16f, 0x11Cf, { 0x88, 0xcb, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } };
 
@@ -63,9 +73,6 @@ USHORT const VendorID_Zebs         = 0x20A0;
 USHORT const ProductID_LEDWiz_min  = 0x00F0;
 USHORT const ProductID_LEDWiz_max  = ProductID_LEDWiz_min + LWZ_MAX_DEVICES - 1;
 
-static const char * lwz_process_sync_mutex_name = "lwz_process_sync_mutex";
-
-
 // Pinscape Virtual LedWiz.  For each Pinscape unit with more than
 // 32 outputs, we'll set up one virtual LedWiz interface per block
 // of additional 32 outputs.  The virtual units are given LedWiz
@@ -75,8 +82,15 @@ static const char * lwz_process_sync_mutex_name = "lwz_process_sync_mutex";
 // outputs 33-64, and a virtual unit 5 for outputs 65-96.  The
 // virtual units are created only if they don't conflict with real
 // physical units connected to the system.
+//
+// A real device always takes precedence over a virtual unit.  A block
+// whose unit number isn't free goes to an extended unit instead (see
+// lwz_alloc_unit), so it can still be reached through extended handles.
+#define LWZ_PS_MAX_BLOCKS     15   // blocks of 32 ports beyond the first
+
 typedef struct {
-	int base_unit;   // index of the base Pinscape unit in the devices[] array
+	int base_unit;   // index of the base Pinscape unit in the unit table
+	int block;       // block of 32 ports addressed: 1 for ports 33-64, and so on
 } ps_virtual_lwz_t;
 
 typedef struct {
@@ -97,12 +111,21 @@ typedef struct {
 	// Does this device support the Pinscape SBX/PBX extensions?
 	BOOL supports_sbx_pbx;
 
+	// LWCloneU2 capability bits from the ping reply (LWCLONEU2_CAP_xxx);
+	// 0 for older firmware, or a unit that didn't answer
+	BYTE lwcloneu2_caps;
+
 	// If this is a Pinscape Virtual LedWiz interface, this contains 
 	// information on the underlying physical Pinscape unit and which
 	// subset of the physical ports we address.  This isn't used for
 	// entires corresponding to physical units (including Pincsape units).
 	ps_virtual_lwz_t ps_virtual_lwz;
 
+	// For a physical Pinscape unit, the unit index of the virtual
+	// interface for each block of 32 ports after the first, or -1 if
+	// there's none.
+	int ps_virtual_units[LWZ_PS_MAX_BLOCKS];
+
 	// Device name, from the USB HID descriptor
 	char device_name[256];
 
@@ -110,13 +133,179 @@ typedef struct {
 	// system path for the device, which we might need to re-open the
 	// file handle after a device change event
 	DWORD dat[256];
+
+	// hash of the device path, for quick comparisons (see lwz_path_hash)
+	DWORD path_hash;
+
+	// HID attributes (VID, PID, version) from the probe, which we keep in
+	// the probe cache to validate cached results cheaply
+	HIDD_ATTRIBUTES attrib;
+
+	// Output state for this unit, as set by the client through LWZ_SBA
+	// and LWZ_PBA, plus the brightness levels last sent after applying
+	// any running effects (see lwz_send_pba).
+	struct {
+		BYTE banks[4];			// on/off bits
+		BYTE speed;				// pulse speed
+		BYTE pba[32];			// brightness levels
+		bool sba_known;			// banks/speed have been set
+		bool pba_known;			// pba has been set
+		BYTE pba_sent[32];		// levels last sent, with effects applied
+		bool pba_sent_valid;
+		bool levels_sent;		// ports were last set with 8-bit levels, so the next PBA goes out in full
+		BYTE banks_sent[4];		// on/off bits last sent
+		BYTE speed_sent;		// pulse speed last sent
+		bool sba_sent_valid;
+	} shadow;
 } lwz_device_t;
 
+// Probe cache entry.  Probing an interface means opening it and running
+// through a chain of HID queries, plus a configuration query for Pinscape
+// units or a capability query for LWCloneU2 units, so we remember the outcome for each interface path, including
+// rejections (keyboards, mice, etc).  On a later search, only paths that
+// we haven't seen before need the full probe.  Entries are dropped when
+// the interface disappears, since a device can come back with the same
+// path but a different configuration.
+//
+// The cache is also saved to a file (see lwz_cache_load/lwz_cache_save),
+// so that a new process doesn't have to start from scratch.  Accepted
+// entries loaded from the file are checked against the device's HID
+// attributes the first time they're used, which is a single query in
+// place of the whole probe.  A Pinscape unit's configuration can change
+// without a firmware update, so cached Pinscape units still get the
+// configuration query; the cache only saves the HID probe.  An LWCloneU2
+// unit's capabilities come with its firmware version, which the
+// validation checks, so those are cached.
+typedef struct {
+	DWORD path_hash;
+	char path[MAX_PATH];
+	int indx;					// unit index, or -1 if the interface was rejected
+	UINT device_type;
+	UINT input_rpt_len;
+	int num_outputs;
+	BOOL supports_sbx_pbx;
+	BYTE lwcloneu2_caps;
+	char device_name[256];
+	USHORT vid, pid, version;	// HID attributes, for validation
+	bool validate;				// loaded from the file, not yet validated
+	bool seen;					// present on the current search pass
+} lwz_probe_cache_entry_t;
+
+// Probe cache file layout.  This is a header followed by 'count' records.
+// The layout is fixed independently of the in-memory entry structure;
+// bump the version whenever it changes.  A file that fails any of the
+// header checks is simply ignored, and replaced after the next search.
+#define LWZ_PROBE_FILE_NAME			"lwcloneu2_probe_cache.bin"
+#define LWZ_PROBE_FILE_MAGIC		0x435a574c		// 'LWZC'
+#define LWZ_PROBE_FILE_VERSION		2
+#define LWZ_PROBE_FILE_MAX_RECORDS	1024
+
+typedef struct {
+	DWORD magic;				// LWZ_PROBE_FILE_MAGIC
+	DWORD version;				// LWZ_PROBE_FILE_VERSION
+	DWORD record_size;			// sizeof(lwz_probe_file_record_t)
+	DWORD count;				// number of records
+	DWORD checksum;				// FNV-1a hash of the records
+} lwz_probe_file_header_t;
+
+typedef struct {
+	char path[MAX_PATH];
+	char device_name[256];
+	int32_t indx;
+	uint32_t device_type;
+	uint32_t input_rpt_len;
+	uint32_t num_outputs;
+	uint32_t supports_sbx_pbx;
+	uint16_t vid, pid, version, lwcloneu2_caps;
+} lwz_probe_file_record_t;
+
+// Host-side effect (see LWZ_START_EFFECT).  Effects override the
+// brightness level of one port while they run.
+typedef struct {
+	int indx;					// unit index
+	int port;					// port on the unit, 0-31
+	UINT type;					// LWZ_EFFECT_xxx
+	BYTE from;					// ramp start level, or blink "off" level
+	BYTE to;					// ramp end level, or blink "on" level
+	DWORD t0;					// start time, GetTickCount()
+	DWORD period_ms;			// ramp duration, or blink period
+	DWORD on_ms;				// blink: "on" time in each period
+	DWORD cycles;				// blink: number of periods, 0 to run until stopped
+} lwz_effect_t;
+
+// maximum number of effects running at once, across all units
+#define LWZ_MAX_EFFECTS   128
+
+// discovery pass statistics
+typedef struct {
+	LONGLONG t0;				// pass start time, in QueryPerformanceCounter ticks
+	DWORD interfaces;			// HID interfaces present
+	DWORD probed;				// interfaces that needed a full probe
+	DWORD cached;				// interfaces resolved from the probe cache
+	DWORD added;				// devices added
+} lwz_pass_stats_t;
+
 typedef void * HQUEUE;
 
+// Unit table entry: the device, plus the per-unit state that belongs to
+// the unit number rather than to the device, and so survives the device
+// being unplugged and plugged back in
+typedef struct {
+	lwz_device_t dev;
+
+	// 8-bit level translation table (see LWZ_SET_GAMMA); only the
+	// physical unit's table is used.  'gamma_set' is true if the client
+	// set its own table, which then applies even on a unit that takes
+	// 8-bit levels directly.
+	BYTE gamma[256];
+	bool gamma_set;
+
+	// Output state, published for LWZ_GET_STATE.  Readers don't take
+	// 'g_cs', so this is guarded by a sequence number that's odd while
+	// the entry is being updated.
+	struct {
+		volatile LONG seq;
+		LWZUNITSTATE state;
+	} published;
+
+	// The device's input handle, published for LWZ_READ_LATEST, which
+	// doesn't take 'g_cs' either.  A reader counts itself in 'readers'
+	// while it takes its reference, and lwz_unpublish_input() waits for
+	// the count to drain before the owner releases the handle.
+	struct {
+		HUDEV volatile hudev;
+		volatile LONG readers;
+	} input;
+
+	// next time the unit is due for an effect or state buffer update
+	DWORD next_tick;
+
+	// changes staged for the next flush (LWZ_STAGED_xxx; see LWZ_SET_FLUSH_MODE)
+	BYTE staged;
+
+	// changes made by lwz_update_port() and not yet sent (LWZ_STAGED_xxx),
+	// and the next unit on the list of units with changes
+	BYTE dirty;
+	int dirty_next;
+} lwz_unit_t;
+
+// change flags for lwz_unit_t::staged and ::dirty
+#define LWZ_STAGED_SBA        0x01	// on/off state
+#define LWZ_STAGED_PBA        0x02	// brightness levels that changed
+#define LWZ_STAGED_PBA_FULL   0x04	// all brightness levels (LWZ_PBA)
+
+// The unit table is allocated in chunks, so that it can grow without
+// moving existing entries.  The first chunk holds the legacy units, at
+// the LedWiz unit numbers; extended units come after those (see
+// lwz_alloc_unit).
+#define LWZ_UNIT_CHUNK        16
+#define LWZ_MAX_UNITS         1024
+
 typedef struct
 {
-	lwz_device_t devices[LWZ_MAX_DEVICES];
+	lwz_unit_t *units[LWZ_MAX_UNITS / LWZ_UNIT_CHUNK];
+	volatile LONG num_units;	// units allocated, a multiple of LWZ_UNIT_CHUNK
+	bool extended_units;		// report extended units to the client (LWZ_SET_EXTENDED_UNITS)
 	LWZDEVICELIST *plist;
 	HWND hwnd;
 	HANDLE hDevNotify;
@@ -132,6 +321,81 @@ typedef struct
 		LWZNOTIFYPROC_EX notify_ex;
 	} cb;
 
+	// probe results by interface path
+	struct {
+		lwz_probe_cache_entry_t *entries;
+		int count;
+		int alloc;
+		bool dirty;			// changed since it was last loaded or saved
+		bool loaded;		// the cache file has been read
+	} probe_cache;
+
+	// statistics for the most recent discovery pass
+	LWZDISCOVERYSTATS discovery_stats;
+
+	// time we started loading the probe cache file, for the cold start time
+	LONGLONG cold_start_t0;
+
+	// background device discovery (LWZ_DISCOVERY_ASYNC mode)
+	struct {
+		uint32_t mode;		// LWZ_DISCOVERY_xxx
+		HANDLE hthread;		// discovery thread
+		HANDLE hkick;		// auto-reset, signaled to request a discovery pass
+		HANDLE hquit;		// signaled to tell the thread to exit
+		HANDLE hdone;		// signaled by the thread as its last act
+	} discovery;
+
+	// device broker connection, in broker client mode (see LWZ_CONNECT_BROKER)
+	struct {
+		HBROKER hclient;	// connection to the broker
+		LONG generation;	// broker unit table generation we last synced to
+		HANDLE hthread;		// watches for unit table changes
+		HANDLE hquit;		// signaled to tell the thread to exit
+		HANDLE hdone;		// signaled by the thread as its last act
+	} broker;
+
+	// reopening devices whose handles failed (see lwz_reconnect_pass)
+	struct {
+		HANDLE hthread;		// reconnect thread
+		HANDLE hkick;		// auto-reset, signaled by the USB layer when a device's writes fail
+		HANDLE hquit;		// signaled to tell the thread to exit
+		HANDLE hdone;		// signaled by the thread as its last act
+	} reconnect;
+
+	// logical output map, or NULL if none is loaded (see LWZ_LOAD_OUTPUT_MAP)
+	outmap_t *outmap;
+
+	// first unit on the list of units changed by lwz_update_port(), -1
+	// if none (see lwz_send_dirty)
+	int dirty_first;
+
+	// flush mode (see LWZ_SET_FLUSH_MODE)
+	struct {
+		UINT mode;			// LWZ_FLUSH_xxx
+		DWORD period_ms;	// timed mode: flush interval
+		DWORD next;			// timed mode: time of the next flush
+		int nstaged;		// number of units with staged changes (see lwz_unit_t::staged)
+		bool flushing;		// lwz_flush() is sending
+	} flush;
+
+	// client state buffer, polled on the effect thread (see LWZ_SET_STATE_BUFFER)
+	struct {
+		LWZSTATEBUFFER const *buffer;	// client's buffer, NULL if none
+		LONG seq;						// sequence number of the last snapshot
+		LWZSTATEBUFFER snap;			// last consistent snapshot
+		DWORD pending;					// units with snapshot state not yet applied
+	} statebuf;
+
+	// host-side effects, and the thread that runs them
+	struct {
+		lwz_effect_t list[LWZ_MAX_EFFECTS];
+		int count;
+		HANDLE hthread;		// effect thread
+		HANDLE hkick;		// auto-reset, signaled when effects are added or removed
+		HANDLE hquit;		// signaled to tell the thread to exit
+		HANDLE hdone;		// signaled by the thread as its last act
+	} effects;
+
 } lwz_context_t;
 
 // 'g_cs' protects our state if there is more than on thread in the process using the API.
@@ -142,20 +406,69 @@ CRITICAL_SECTION g_cs;
 // global context
 lwz_context_t * g_plwz = NULL;
 
+// Unit table access.  A unit index is the handle minus one; indices below
+// LWZ_MAX_DEVICES are the legacy LedWiz units.  Lookup is a direct index
+// into the chunk table, whatever the table size.
+static inline lwz_unit_t * lwz_unit(lwz_context_t *h, int indx)
+{
+	return &h->units[indx / LWZ_UNIT_CHUNK][indx % LWZ_UNIT_CHUNK];
+}
+
+static inline lwz_device_t * lwz_dev(lwz_context_t *h, int indx)
+{
+	return &lwz_unit(h, indx)->dev;
+}
+
+static inline bool lwz_valid_unit(lwz_context_t *h, int indx)
+{
+	return indx >= 0 && indx < h->num_units;
+}
+
 
 static LRESULT CALLBACK lwz_wndproc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 
 static lwz_context_t * lwz_open(HINSTANCE hinstDLL);
+static bool lwz_grow_units(lwz_context_t *h);
 static void lwz_close(lwz_context_t *h);
 
 static void lwz_register(lwz_context_t *h, int indx_user, HWND hwnd);
 static HUDEV lwz_get_hdev(lwz_context_t *h, int indx_user);
 static void lwz_notify_callback(lwz_context_t *h, int reason, LWZHANDLE hlwz);
 
+static void lwz_refreshlist(lwz_context_t *h);
 static void lwz_refreshlist_attached(lwz_context_t *h);
+static void lwz_discovery_stop(lwz_context_t *h);
+static bool lwz_reconnect_start(lwz_context_t *h);
+static void lwz_reconnect_stop(lwz_context_t *h);
+static bool lwz_broker_submit(lwz_context_t *h, int indx, LONG kind, BYTE const *pdata, DWORD ndata);
+static void lwz_broker_sync_units(lwz_context_t *h);
+static void lwz_broker_disconnect(lwz_context_t *h);
+static void lwz_broker_stop(lwz_context_t *h);
+static bool lwz_broker_connect(lwz_context_t *h, LONG priority);
+static void lwz_broker_serve(HBROKER hb, HANDLE hquit);
+static void lwz_send_sba(lwz_context_t *h, int indx);
+static bool lwz_flush_stage(lwz_context_t *h, int indx, BYTE change);
+static void lwz_state_publish(lwz_context_t *h, int indx);
+static void lwz_flush(lwz_context_t *h);
+static void lwz_send_pba(lwz_context_t *h, int indx, bool changed_only);
+static void lwz_gamma_default(BYTE *table);
+static void lwz_effects_apply(lwz_context_t *h, int indx, BYTE *pba);
+static void lwz_effects_remove(lwz_context_t *h, int indx, int port);
+static bool lwz_effects_kick(lwz_context_t *h);
+static void lwz_statebuf_poll(lwz_context_t *h);
+static void lwz_statebuf_apply(lwz_context_t *h, int indx);
+static void lwz_effects_stop(lwz_context_t *h);
 static void lwz_refreshlist_detached(lwz_context_t *h);
+static bool lwz_refreshlist_detached_path(lwz_context_t *h, DEV_BROADCAST_HDR const *phdr);
+static DWORD lwz_path_hash(const char *path);
+static int lwz_cache_load(lwz_context_t *h);
+static void lwz_cache_save(lwz_context_t *h);
+static LONGLONG lwz_qpc_now();
+static DWORD lwz_qpc_elapsed_us(LONGLONG t0);
 static void lwz_freelist(lwz_context_t *h);
-static void lwz_add(lwz_context_t *h, int indx);
+static const char *lwz_device_path(lwz_device_t *pdev);
+static void lwz_cache_forget(lwz_context_t *h, const char *path);
+static void lwz_add(lwz_context_t *h, int ndevices, const int *device_indices);
 static void lwz_remove(lwz_context_t *h, int indx);
 
 enum packet_type_t
@@ -170,7 +483,7 @@ enum packet_type_t
 static void queue_close(HQUEUE hqueue, bool unload);
 static HQUEUE queue_open(void);
 static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t const *pdata, size_t ndata);
-static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t nsize);
+static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, LONGLONG *pt_queued, uint8_t *pbuffer, size_t nsize);
 static void queue_wait_empty(HQUEUE hqueue);
 
 
@@ -203,22 +516,131 @@ void LWZ_SBA(
 
 	// validate the device index
 	int indx = hlwz - 1;
-	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+	if (!lwz_valid_unit(g_plwz, indx))
+		return;
+
+	// remember the caller's settings
+	lwz_device_t *pdev = lwz_dev(g_plwz, indx);
+	pdev->shadow.banks[0] = bank0;
+	pdev->shadow.banks[1] = bank1;
+	pdev->shadow.banks[2] = bank2;
+	pdev->shadow.banks[3] = bank3;
+	pdev->shadow.speed = globalPulseSpeed;
+	pdev->shadow.sba_known = true;
+
+	lwz_send_sba(g_plwz, indx);
+}
+
+// Publish a unit's output state for LWZ_GET_STATE.  Must be called with
+// 'g_cs' held, which keeps writers from overlapping.
+static void lwz_state_publish(lwz_context_t *h, int indx)
+{
+	lwz_device_t const * const pdev = lwz_dev(h, indx);
+	LWZUNITSTATE * const st = &lwz_unit(h, indx)->published.state;
+
+	InterlockedIncrement(&lwz_unit(h, indx)->published.seq);
+
+	st->dwFlags = (pdev->shadow.sba_known ? LWZ_STATE_ON_SET : 0)
+		| (pdev->shadow.pba_known ? LWZ_STATE_LEVEL_SET : 0)
+		| (pdev->shadow.sba_sent_valid ? LWZ_STATE_ON_SENT : 0)
+		| (pdev->shadow.pba_sent_valid ? LWZ_STATE_LEVEL_SENT : 0);
+	memcpy(st->on, pdev->shadow.banks, 4);
+	st->speed = pdev->shadow.speed;
+	memcpy(st->level, pdev->shadow.pba, 32);
+	memcpy(st->on_sent, pdev->shadow.banks_sent, 4);
+	st->speed_sent = pdev->shadow.speed_sent;
+	memcpy(st->level_sent, pdev->shadow.pba_sent, 32);
+
+	InterlockedIncrement(&lwz_unit(h, indx)->published.seq);
+}
+
+// In the staged flush modes, note a unit with a change to send on the
+// next flush (LWZ_STAGED_xxx).  Returns true if the change was staged,
+// false if the caller should send it now.
+static bool lwz_flush_stage(lwz_context_t *h, int indx, BYTE change)
+{
+	if (h->flush.mode == LWZ_FLUSH_IMMEDIATE || h->flush.flushing)
+		return false;
+
+	lwz_unit_t * const u = lwz_unit(h, indx);
+	if (u->staged == 0)
+	{
+		// In timed mode, wake up the update thread when the first change
+		// comes in, so that it schedules the next flush.  It sleeps while
+		// there's nothing to send.
+		if (h->flush.nstaged++ == 0 && h->flush.mode == LWZ_FLUSH_TIMED)
+			lwz_effects_kick(h);
+	}
+
+	u->staged |= change;
+	return true;
+}
+
+// Send all changes staged since the last flush, in one pass over the
+// units.  Each unit gets its brightness levels before its on/off state,
+// so that ports being switched on light at their new levels.  Must be
+// called with 'g_cs' held.
+static void lwz_flush(lwz_context_t *h)
+{
+	h->flush.flushing = true;
+	for (int unit = 0 ; unit < h->num_units && h->flush.nstaged > 0 ; ++unit)
+	{
+		lwz_unit_t * const u = lwz_unit(h, unit);
+		BYTE const staged = u->staged;
+		if (staged == 0)
+			continue;
+
+		u->staged = 0;
+		h->flush.nstaged--;
+		if (staged & (LWZ_STAGED_PBA | LWZ_STAGED_PBA_FULL))
+			lwz_send_pba(h, unit, (staged & LWZ_STAGED_PBA_FULL) == 0);
+		if (staged & LWZ_STAGED_SBA)
+			lwz_send_sba(h, unit);
+	}
+	h->flush.flushing = false;
+}
+
+// Send the on/off state for a unit, as last set by the client.  In the
+// staged flush modes, this just notes the unit for the next flush.  Must
+// be called with 'g_cs' held.
+static void lwz_send_sba(lwz_context_t *h, int indx)
+{
+	if (lwz_flush_stage(h, indx, LWZ_STAGED_SBA))
+	{
+		lwz_state_publish(h, indx);
+		return;
+	}
+
+	lwz_device_t *pdev = lwz_dev(h, indx);
+	BYTE const bank0 = pdev->shadow.banks[0];
+	BYTE const bank1 = pdev->shadow.banks[1];
+	BYTE const bank2 = pdev->shadow.banks[2];
+	BYTE const bank3 = pdev->shadow.banks[3];
+	BYTE const globalPulseSpeed = pdev->shadow.speed;
+
+	memcpy(pdev->shadow.banks_sent, pdev->shadow.banks, 4);
+	pdev->shadow.speed_sent = globalPulseSpeed;
+	pdev->shadow.sba_sent_valid = true;
+	lwz_state_publish(h, indx);
+
+	// in broker client mode, the broker does the rest
+	if (h->broker.hclient != NULL)
+	{
+		BYTE const msg[5] = { bank0, bank1, bank2, bank3, globalPulseSpeed };
+		lwz_broker_submit(h, indx, BROKER_MSG_SBA, msg, sizeof(msg));
 		return;
+	}
 
-	// Start with the standard SBA message: command code 64.  The
-	// "port group" byte is used only in SBX messages; this is unused
-	// in regular SBA messages and must be zero.
-	BYTE cmd = 64;
+	// Start with the standard SBA message.  The "port group" is used
+	// only in SBX messages.
 	int port_group = 0;
 	packet_type_t packet_type = PACKET_TYPE_SBA;
 
 	// check to see if this is addressed to a Pinscape virtual LedWiz
-	lwz_device_t *pdev = &g_plwz->devices[indx];
 	if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
 	{
 		// get the real Pinscape reference information
-		ps_virtual_lwz_t *ps = &g_plwz->devices[indx].ps_virtual_lwz;
+		ps_virtual_lwz_t *ps = &lwz_dev(h, indx)->ps_virtual_lwz;
 
 		// Figure the port group.
 		// The port group tells the Pinscape unit which group of 32
@@ -226,42 +648,35 @@ void LWZ_SBA(
 		// the unit addresses the first 32 ports (0-31).  The first
 		// *virtual* interface addresses the next 32 ports (32-64).
 		// The second virtual interface addresses the next 32, and
-		// so on.  The virtual interfaces are always numbered
-		// consecutively after the base Pinscape interface, so we
-		// can determine the group simply by looking at the indices.
-		// If the Pinscape unit is at index N, and we're at index
-		// N+1, we're the first virtual interface, so we address the
-		// first block of extended ports; if we're at N+2, we address
-		// the second block.
-		port_group = indx - ps->base_unit;
+		// so on.  The virtual interfaces are usually numbered
+		// consecutively after the base Pinscape interface, but one
+		// can land on an extended unit if its unit number is taken
+		// by a real device, so the block is recorded with the unit.
+		port_group = ps->block;
 
 		// redirect the message to the physical Pinscape device
 		indx = ps->base_unit;
 
 		// switch to Pinscape SBX message
-		cmd = 67;
 		packet_type = PACKET_TYPE_SBX;
 	}
 
 	// make sure we have a valid file handle
-	HUDEV hudev = lwz_get_hdev(g_plwz, indx);
+	HUDEV hudev = lwz_get_hdev(h, indx);
 	if (hudev == NULL)
 		return;
 
 	// set up the SBA or SBX message
+	BYTE const banks[4] = { bank0, bank1, bank2, bank3 };
 	BYTE data[8];
-	data[0] = cmd;
-	data[1] = bank0;
-	data[2] = bank1;
-	data[3] = bank2;
-	data[4] = bank3;
-	data[5] = globalPulseSpeed;
-	data[6] = port_group;
-	data[7] = 0;
+	if (packet_type == PACKET_TYPE_SBX)
+		lwzcodec_encode_sbx(data, banks, globalPulseSpeed, port_group);
+	else
+		lwzcodec_encode_sba(data, banks, globalPulseSpeed);
 
 	#if defined(USE_SEPARATE_IO_THREAD)
 
-	queue_push(g_plwz->hqueue, hudev, packet_type, &data[0], 8);
+	queue_push(h->hqueue, hudev, packet_type, &data[0], 8);
 
 	#else
 
@@ -273,26 +688,80 @@ void LWZ_SBA(
 
 void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 {
-#if DEBUG_LOGGING
-	LOG("PBA(unit=%d, {", hlwz);
-	for (int i = 0 ; i < 32 ; ++i)
-		LOG("%s%d:%d", i == 0 ? "" : ", ", i, pbrightness_32bytes[i]);
-	LOG("})\n");
-#endif
+	if (g_dbglog_enabled && pbrightness_32bytes != NULL)
+	{
+		LOG("PBA(unit=%d, {", hlwz);
+		for (int i = 0 ; i < 32 ; ++i)
+			LOG("%s%d:%d", i == 0 ? "" : ", ", i, pbrightness_32bytes[i]);
+		LOG("})\n");
+	}
 
 	AUTOLOCK(g_cs);
 
 	// get and validate the device index
 	int indx = hlwz - 1;
-	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+	if (!lwz_valid_unit(g_plwz, indx))
 		return;
 
 	// make sure we have a non-null brightness buffer
 	if (pbrightness_32bytes == NULL)
 		return;
 
-	// for regular PBA messages, we'll send the caller's brightness
-	// byte array directly
+	// remember the caller's levels, and send them, along with any
+	// effects running on the unit
+	lwz_device_t *pdev = lwz_dev(g_plwz, indx);
+	memcpy(pdev->shadow.pba, pbrightness_32bytes, 32);
+	pdev->shadow.pba_known = true;
+
+	lwz_send_pba(g_plwz, indx, false);
+}
+
+// Send the brightness levels for a unit: the levels the client set,
+// with any running effects applied.  If 'changed_only' is set, only
+// levels that differ from the last ones sent go out; that's at the
+// granularity of 8-port PBX groups where the device takes PBX, and all
+// or nothing otherwise, since a PBA always sets all 32 ports.  In the
+// staged flush modes, this just notes the unit for the next flush.  Must
+// be called with 'g_cs' held.
+static void lwz_send_pba(lwz_context_t *h, int indx, bool changed_only)
+{
+	if (lwz_flush_stage(h, indx, changed_only ? LWZ_STAGED_PBA : LWZ_STAGED_PBA_FULL))
+	{
+		lwz_state_publish(h, indx);
+		return;
+	}
+
+	// figure the levels to send, with any running effects applied
+	BYTE pbrightness_32bytes[32];
+	lwz_effects_apply(h, indx, pbrightness_32bytes);
+
+	// figure which groups of 8 ports changed since the last send
+	unsigned int group_mask = 0x0F;
+	lwz_device_t * const psent = lwz_dev(h, indx);
+	if (changed_only && psent->shadow.pba_sent_valid && !psent->shadow.levels_sent)
+	{
+		group_mask = lwzcodec_changed_groups(pbrightness_32bytes, psent->shadow.pba_sent, 4);
+		if (group_mask == 0)
+		{
+			lwz_state_publish(h, indx);
+			return;
+		}
+	}
+
+	memcpy(psent->shadow.pba_sent, pbrightness_32bytes, 32);
+	psent->shadow.pba_sent_valid = true;
+	psent->shadow.levels_sent = false;
+	lwz_state_publish(h, indx);
+
+	// in broker client mode, the broker does the rest
+	if (g_plwz->broker.hclient != NULL)
+	{
+		lwz_broker_submit(g_plwz, indx, BROKER_MSG_PBA, pbrightness_32bytes, 32);
+		return;
+	}
+
+	// for regular PBA messages, we'll send the brightness levels
+	// directly
 	const BYTE *pdata = pbrightness_32bytes;
 
 	// presume we'll use a send this as a standard PBA message
@@ -302,7 +771,7 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 	// virtual LedWiz interface.  If so, switch the message to the
 	// extended PBX format instead.
 	BOOL pbx = false;
-	lwz_device_t *pdev = &g_plwz->devices[indx];
+	lwz_device_t *pdev = lwz_dev(g_plwz, indx);
 	int port_group = 0;
 	if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE && pdev->supports_sbx_pbx)
 	{
@@ -320,7 +789,7 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 	{
 		// It's a Pinscape virtual LedWiz unit.  Get the underlying
 		// physical Pinscape unit reference.
-		ps_virtual_lwz_t *ps = &g_plwz->devices[indx].ps_virtual_lwz;
+		ps_virtual_lwz_t *ps = &lwz_dev(g_plwz, indx)->ps_virtual_lwz;
 
 		// Figure the port group.
 		// The port group tells the Pinscape unit which group of 8
@@ -328,19 +797,13 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 		// the unit addresses the first 32 ports (0-31).  The first
 		// *virtual* interface addresses the next 32 ports (32-64).
 		// The second virtual interface addresses the next 32, and
-		// so on.  The virtual interfaces are always numbered
-		// consecutively after the base Pinscape interface, so we
-		// can figure which block of 32 ports this unit addresses
-		// from the unit index.  If the Pinscape unit is at index N,
-		// and we're at index N+1, we're the first virtual interface,
-		// so we address ports 32-64.  If we're at N+2, we address
-		// ports 65-96, and so on.
+		// so on.  The unit records which block of 32 ports it
+		// addresses (see ps_virtual_lwz_t).
 		//
 		// For PBX purposes, we want the group of 8 ports we're
-		// addressing.  Each unit is 32 ports, so the unit number
-		// offset (from the base unit) gives us the group of 32
-		// ports.  So the group of 8 is offset*32/8 = offset*4.
-		port_group = 4*(indx - ps->base_unit);
+		// addressing.  Each block is 32 ports, so the group of 8 is
+		// block*32/8 = block*4.
+		port_group = 4*ps->block;
 
 		// redirect the mesage to the Pinscape device as a PBX
 		pbx = true;
@@ -350,42 +813,11 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 	// If we're using the Pinscape extended PBX message, rewrite the
 	// message data using the PBX format.
 	BYTE bbuf[32];
+	size_t ndata = 32;
 	if (pbx)
 	{
-		// Encode each set of 8 bytes as a PBX message
-		const BYTE *psrc = pdata;
-		BYTE *pdst = bbuf;
-		for (int block = 0 ; block < 4 ;
-			 ++block, ++port_group, psrc += 8, pdst += 8)
-		{
-			// encode this PBX message:
-			//
-			// 68 pp ee ee ee ee ee ee
-			//
-			// 68 = command code
-			// pp = port group: 0 for ports 1-8, 1 for 9-16, etc
-			// ee = packed brightness values, 6 bits per port
-
-			// LedWiz flash codes have to be translated for PBX to fit into 6 bits.
-			// 129->60, 130->61, 131->62, 132->63.
-			BYTE tmp[8];
-			for (int i = 0 ; i < 8 ; ++i)
-				tmp[i] = (psrc[i] >= 129 ? psrc[i] - 129 + 60 : psrc[i]) & 0x3F;
-
-			// pack the first four brightness values into tmp1, the next four into tmp2
-			unsigned int tmp1 = tmp[0] | (tmp[1]<<6) | (tmp[2]<<12) | (tmp[3]<<18);
-			unsigned int tmp2 = tmp[4] | (tmp[5]<<6) | (tmp[6]<<12) | (tmp[7]<<18);
-
-			// now construct the 8-byte PBX message
-			pdst[0] = 68;
-			pdst[1] = port_group;
-			pdst[2] = tmp1 & 0xFF;
-			pdst[3] = (tmp1 >> 8) & 0xFF;
-			pdst[4] = (tmp1 >> 16) & 0xFF;
-			pdst[5] = tmp2 & 0xFF;
-			pdst[6] = (tmp2 >> 8) & 0xFF;
-			pdst[7] = (tmp2 >> 16) & 0xFF;
-		}
+		// Encode each changed set of 8 bytes as a PBX message
+		ndata = lwzcodec_encode_pbx_groups(bbuf, pdata, port_group, 4, group_mask);
 
 		// use the encoded private copy instead of the original
 		pdata = bbuf;
@@ -399,11 +831,11 @@ void LWZ_PBA(LWZHANDLE hlwz, BYTE const *pbrightness_32bytes)
 
 	#if defined(USE_SEPARATE_IO_THREAD)
 
-	queue_push(g_plwz->hqueue, hudev, packet_type, pdata, 32);
+	queue_push(g_plwz->hqueue, hudev, packet_type, pdata, ndata);
 
 	#else
 
-	usbdev_write(hudev, pdata, 32);
+	usbdev_write(hudev, pdata, ndata);
 
 	#endif
 }
@@ -420,6 +852,10 @@ DWORD LWZ_RAWWRITE(LWZHANDLE hlwz, BYTE const *pdata, DWORD ndata)
 	if (ndata > 32)
 	    ndata = 32;
 
+	if (g_plwz->broker.hclient != NULL) {
+		return lwz_broker_submit(g_plwz, indx, BROKER_MSG_RAW, pdata, ndata) ? ndata : 0;
+	}
+
 	HUDEV hudev = lwz_get_hdev(g_plwz, indx);
 
 	if (hudev == NULL) {
@@ -467,6 +903,106 @@ DWORD LWZ_RAWREAD(LWZHANDLE hlwz, BYTE *pdata, DWORD ndata)
 	return usbdev_read(hudev, pdata, ndata);
 }
 
+// Get the USB handle for input purposes.  Input reports from a Pinscape
+// unit all arrive on the physical unit's interface, so a virtual LedWiz
+// unit reads from its base unit.
+// Publish a unit's input handle for lock-free readers, or withdraw it.
+// Withdrawing waits out any reader still taking its reference, so the
+// caller can release its own reference afterwards.
+static void lwz_publish_input(lwz_context_t *h, int indx, HUDEV hudev)
+{
+	lwz_unit_t * const u = lwz_unit(h, indx);
+	InterlockedExchangePointer((PVOID volatile *)&u->input.hudev, hudev);
+}
+
+static void lwz_unpublish_input(lwz_context_t *h, int indx)
+{
+	lwz_unit_t * const u = lwz_unit(h, indx);
+	InterlockedExchangePointer((PVOID volatile *)&u->input.hudev, NULL);
+	while (u->input.readers != 0)
+		Sleep(0);
+}
+
+// Get a reference to a unit's input handle without taking 'g_cs'.  A
+// virtual unit reads its Pinscape unit's input.  The caller releases the
+// handle with usbdev_release().
+static HUDEV lwz_acquire_input_hdev(lwz_context_t *h, int indx)
+{
+	if (!lwz_valid_unit(h, indx))
+		return NULL;
+
+	lwz_device_t const * const dev = lwz_dev(h, indx);
+	if (dev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+	{
+		indx = dev->ps_virtual_lwz.base_unit;
+		if (!lwz_valid_unit(h, indx))
+			return NULL;
+	}
+
+	lwz_unit_t * const u = lwz_unit(h, indx);
+	InterlockedIncrement(&u->input.readers);
+	HUDEV const hudev = u->input.hudev;
+	usbdev_addref(hudev);
+	InterlockedDecrement(&u->input.readers);
+
+	return hudev;
+}
+
+static HUDEV lwz_get_input_hdev(lwz_context_t *h, int indx)
+{
+	if (!lwz_valid_unit(h, indx))
+		return NULL;
+
+	if (lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+		indx = lwz_dev(h, indx)->ps_virtual_lwz.base_unit;
+
+	return lwz_get_hdev(h, indx);
+}
+
+uint32_t LWZ_READ_LATEST(LWZHANDLE hlwz, uint8_t *pdata, uint32_t ndata, uint32_t *pseqno)
+{
+	// no lock here, so that the poll never waits behind a device search
+	// or a Pinscape configuration query
+	if (pdata == NULL)
+		return 0;
+
+	if (ndata > 64)
+		ndata = 64;
+
+	HUDEV hudev = lwz_acquire_input_hdev(g_plwz, hlwz - 1);
+
+	if (hudev == NULL) {
+		return 0;
+	}
+
+	DWORD num = 0;
+	size_t const nread = usbdev_read_latest(hudev, pdata, ndata, &num);
+	usbdev_release(hudev);
+
+	if (pseqno != NULL)
+		*pseqno = num;
+
+	return nread;
+}
+
+BOOL LWZ_SET_INPUT_CALLBACK(LWZHANDLE hlwz, LWZINPUTPROC input_cb, void *puser)
+{
+	AUTOLOCK(g_cs);
+
+	HUDEV hudev = lwz_get_input_hdev(g_plwz, hlwz - 1);
+
+	if (hudev == NULL) {
+		return FALSE;
+	}
+
+	// The client callback has the same signature as the USB layer's input
+	// callback, with the LedWiz handle passed as the tag, so we can hand
+	// it straight to the reader thread.
+	usbdev_set_input_callback(hudev, (USBDEV_INPUT_PROC)input_cb, puser, hlwz);
+
+	return TRUE;
+}
+
 void LWZ_REGISTER(LWZHANDLE hlwz, HWND hwnd)
 {
 	LOG(hwnd == 0 ? "LWZ_REGISTER(%d, null)\n" : "LWZ_REGISTER(%d, %lx)\n",
@@ -494,7 +1030,7 @@ void LWZ_SET_NOTIFY_EX(LWZNOTIFYPROC_EX notify_ex_cb, void * puser, LWZDEVICELIS
 		memset(h->plist, 0x00, sizeof(*plist));
 	}
 
-	lwz_refreshlist_attached(h);
+	lwz_refreshlist(h);
 }
 
 void LWZ_SET_NOTIFY(LWZNOTIFYPROC notify_cb, LWZDEVICELIST *plist)
@@ -523,863 +1059,3794 @@ void LWZ_SET_NOTIFY(LWZNOTIFYPROC notify_cb, LWZDEVICELIST *plist)
 
 	// create a new internal list of available devices
 
-	lwz_refreshlist_attached(h);
+	lwz_refreshlist(h);
 }
 
-static void safe_strcpy(char *dst, size_t dst_size, const char *src)
+void LWZ_SET_EXTENDED_UNITS(BOOL enable)
 {
-	// only proceed if we have a destination buffer of non-zero size
-	if (dst_size != 0 && dst != 0)
-	{
-		// substitute an empty string if the source is null
-		if (src == 0)
-			src = "";
+	LOG("LWZ_SET_EXTENDED_UNITS(%d)\n", enable);
 
-		// figure the copy length as the source length, or the destination
-		// buffer size minus one for the trailing null, whichever is shorter
-		size_t copy_len = strlen(src);
-		if (copy_len > dst_size - 1)
-			copy_len = dst_size - 1;
+	AUTOLOCK(g_cs);
 
-		// copy the copy length, then add the null terminator
-		memcpy(dst, src, copy_len);
-		dst[copy_len] = '\0';
+	lwz_context_t * const h = g_plwz;
+
+	bool const was_enabled = h->extended_units;
+	h->extended_units = (enable != FALSE);
+	if (was_enabled || !h->extended_units)
+		return;
+
+	// announce the extended units that are already present
+	int new_devices[LWZ_MAX_UNITS];
+	int num_new_devices = 0;
+	for (int i = LWZ_MAX_DEVICES ; i < h->num_units ; ++i)
+	{
+		if (lwz_dev(h, i)->device_type != LWZ_DEVICE_TYPE_NONE)
+			new_devices[num_new_devices++] = i;
 	}
+
+	if (num_new_devices != 0)
+		lwz_add(h, num_new_devices, new_devices);
 }
 
-static void safe_strcat(char *dst, size_t dst_size, const char *src)
+uint32_t LWZ_GET_DEVICE_HANDLES(LWZHANDLE *handles, uint32_t max_handles)
 {
-	// make sure we have a destination buffer of non-zero size
-	if (dst != 0 && dst_size != 0)
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	uint32_t n = 0;
+	for (int i = 0 ; i < h->num_units ; ++i)
 	{
-		// get the current length, and make sure there's room for more
-		size_t old_len = strlen(dst);
-		if (old_len < dst_size)
-		{
-			// figure the maximum copy length
-			size_t copy_len = strlen(src);
-			if (copy_len > dst_size - old_len - 1)
-				copy_len = dst_size - old_len - 1;
+		if (lwz_dev(h, i)->device_type == LWZ_DEVICE_TYPE_NONE)
+			continue;
 
-			// copy the copy length, and add a null terminator
-			memcpy(dst + old_len, src, copy_len);
-			dst[old_len + copy_len] = '\0';
-		}
+		if (handles != NULL && n < max_handles)
+			handles[n] = i + 1;
+		++n;
 	}
+
+	return n;
 }
 
-BOOL LWZ_GET_DEVICE_INFO(LWZHANDLE hlwz, LWZDEVICEINFO *info)
+BOOL LWZ_GET_IO_STATS(LWZHANDLE hlwz, LWZIOSTATS *stats)
 {
-	// enter our critical section
 	AUTOLOCK(g_cs);
 
-	// get our global context
-	lwz_context_t * const h = g_plwz;
-
-	// set defaults in the return struct
-	info->dwDevType = LWZ_DEVICE_TYPE_NONE;
-	info->szName[0] = '\0';
-
-	// validate the index
-	int indx = (int)hlwz - 1;
-	if (indx < 0 || indx >= LWZ_MAX_DEVICES)
+	if (stats == NULL || stats->cbSize < sizeof(DWORD))
 		return FALSE;
 
-	// get the device and make sure it's an existing device
-	lwz_device_t *dev = &h->devices[indx];
-	if (dev->device_type == LWZ_DEVICE_TYPE_NONE)
+	// virtual units report the physical unit's counters
+	HUDEV const hudev = lwz_get_input_hdev(g_plwz, hlwz - 1);
+	if (hudev == NULL)
 		return FALSE;
 
-	// fill in the fields
-	info->dwDevType = dev->device_type;
-	safe_strcpy(info->szName, sizeof(info->szName), dev->device_name);
+	usbdev_stats_t const * const u = usbdev_stats(hudev);
+	LWZIOSTATS s;
+	s.cbSize = sizeof(s);
+	s.dwMessages = u->messages;
+	s.dwPackets = u->packets;
+	s.dwFailed = u->failed;
+	s.dwSuppressed = u->suppressed;
+	s.dwQueued = u->queued;
+	s.dwCoalesced = u->coalesced;
+	s.dwQueueDepth = u->queue_depth;
+	s.dwMaxQueueDepth = u->max_queue_depth;
+	s.dwPacingMs = u->pacing_ms;
+	s.dwLatencyP50Us = usbdev_latency_percentile(&u->write_latency, 50);
+	s.dwLatencyP90Us = usbdev_latency_percentile(&u->write_latency, 90);
+	s.dwLatencyP99Us = usbdev_latency_percentile(&u->write_latency, 99);
+	s.dwLatencyMaxUs = u->write_latency.max_us;
+	s.dwQueueP50Us = usbdev_latency_percentile(&u->queue_latency, 50);
+	s.dwQueueP90Us = usbdev_latency_percentile(&u->queue_latency, 90);
+	s.dwQueueP99Us = usbdev_latency_percentile(&u->queue_latency, 99);
+	s.dwQueueMaxUs = u->queue_latency.max_us;
+
+	// copy as much of the structure as the caller has room for
+	DWORD cbSize = stats->cbSize;
+	if (cbSize > sizeof(LWZIOSTATS))
+		cbSize = sizeof(LWZIOSTATS);
+
+	memcpy((BYTE*)stats + sizeof(DWORD), (BYTE*)&s + sizeof(DWORD), cbSize - sizeof(DWORD));
 
-	// success
 	return TRUE;
 }
 
+BOOL LWZ_RESET_IO_STATS(LWZHANDLE hlwz)
+{
+	AUTOLOCK(g_cs);
 
-//**********************************************************************************************************************
-// Low level implementation 
-//**********************************************************************************************************************
+	HUDEV const hudev = lwz_get_input_hdev(g_plwz, hlwz - 1);
+	if (hudev == NULL)
+		return FALSE;
 
-BOOL WINAPI DllMain(
-	HINSTANCE hinstDLL,
-	DWORD fdwReason,
-	LPVOID lpvReserved)
+	usbdev_reset_stats(hudev);
+	return TRUE;
+}
+
+BOOL LWZ_GET_DISCOVERY_STATS(LWZDISCOVERYSTATS *stats)
 {
-	if (fdwReason == DLL_PROCESS_ATTACH)
-	{
-		LOG("*****\n"
-			"LEDWIZ.DLL loading\n\n");
-		InitializeCriticalSection(&g_cs);
+	AUTOLOCK(g_cs);
 
-		g_plwz = lwz_open(hinstDLL);
-
-		if (g_plwz == NULL)
-		{
-			DeleteCriticalSection(&g_cs);
-			return FALSE;
-		}
-	}
-	else if (fdwReason == DLL_PROCESS_DETACH)
-	{
-		{
-			AUTOLOCK(g_cs);
+	if (stats == NULL || stats->cbSize < sizeof(DWORD))
+		return FALSE;
 
-			lwz_close(g_plwz);
-		}
+	// copy as much of the structure as the caller has room for
+	DWORD cbSize = stats->cbSize;
+	if (cbSize > sizeof(LWZDISCOVERYSTATS))
+		cbSize = sizeof(LWZDISCOVERYSTATS);
 
-		DeleteCriticalSection(&g_cs);
-	}
+	memcpy((BYTE*)stats + sizeof(DWORD), (BYTE*)&g_plwz->discovery_stats + sizeof(DWORD), cbSize - sizeof(DWORD));
 
 	return TRUE;
 }
 
-static LRESULT CALLBACK lwz_wndproc(
-	HWND hwnd,
-    UINT uMsg,
-    WPARAM wParam,
-    LPARAM lParam)
+void LWZ_SET_DISCOVERY_MODE(uint32_t mode)
 {
 	AUTOLOCK(g_cs);
 
-	lwz_context_t * const h = g_plwz;
+	if (mode == LWZ_DISCOVERY_BLOCKING || mode == LWZ_DISCOVERY_ASYNC)
+		g_plwz->discovery.mode = mode;
+}
 
-	// get the original WndProc
-	WNDPROC OriginalWndProc = h->WndProc;
+BOOL LWZ_CONNECT_BROKER(uint32_t priority)
+{
+	LOG("LWZ_CONNECT_BROKER(priority=%d)\n", priority);
+
+	AUTOLOCK(g_cs);
+
+	return lwz_broker_connect(g_plwz, (LONG)priority);
+}
+
+BOOL LWZ_RUN_BROKER(HANDLE hquit)
+{
+	LOG("LWZ_RUN_BROKER\n");
 
-	// check the message type
-	switch (uMsg)
 	{
-	case WM_DEVICECHANGE:
-		// device change - check which type (attach or detach)
-		switch (wParam)
-		{
-		case DBT_DEVICEARRIVAL:
-			lwz_refreshlist_attached(h);
-			break;
-			
-		case DBT_DEVICEREMOVECOMPLETE:
-			lwz_refreshlist_detached(h);
-			break;
-		}
-		break;
+		AUTOLOCK(g_cs);
 
-	case WM_DESTROY:
-		// destroying the window - cancel the registration
-		lwz_register(h, 0, NULL);
-		break;
+		// a broker client can't be the broker as well
+		if (g_plwz->broker.hclient != NULL)
+			return FALSE;
 	}
-	
-	// forward the message to original windows procedure
-	if (OriginalWndProc != NULL)
+
+	// Run the broker.  Note that we don't hold the lock here: the broker
+	// loop takes it as needed, so that device change notifications can
+	// get in while we're waiting for client messages.
+	HBROKER const hb = broker_server_open();
+	if (hb == NULL)
+		return FALSE;
+
+	lwz_broker_serve(hb, hquit);
+	broker_server_close(hb);
+
+	return TRUE;
+}
+
+// Fill in the default 8-bit level translation table: a straight linear
+// mapping of 0-255 onto the PBA levels 0-48
+static void lwz_gamma_default(BYTE *table)
+{
+	for (int i = 0 ; i < 256 ; ++i)
+		table[i] = (BYTE)((i * 48 + 127) / 255);
+}
+
+// Get the physical unit behind a unit: the unit itself, or the Pinscape
+// unit that a virtual LedWiz interface refers to
+static int lwz_physical_unit(lwz_context_t *h, int indx)
+{
+	if (lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+		return lwz_dev(h, indx)->ps_virtual_lwz.base_unit;
+
+	return indx;
+}
+
+// Get the unit that addresses a block of 32 ports, counting from the
+// given unit's first port.  Ports past the unit's 32 continue on the
+// virtual interfaces of the same Pinscape unit.  Returns -1 if no unit
+// covers the block.
+static int lwz_block_unit(lwz_context_t *h, int indx, uint32_t block)
+{
+	lwz_device_t const * const pdev = lwz_dev(h, indx);
+	int base = indx;
+	if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
 	{
-		return CallWindowProc(
-			OriginalWndProc,
-			hwnd,
-			uMsg,
-			wParam,
-			lParam);
+		base = pdev->ps_virtual_lwz.base_unit;
+		block += pdev->ps_virtual_lwz.block;
 	}
 
-	return 0;
+	if (block == 0)
+		return base;
+
+	lwz_device_t const * const pbase = lwz_dev(h, base);
+	if (pbase->device_type != LWZ_DEVICE_TYPE_PINSCAPE || block > LWZ_PS_MAX_BLOCKS)
+		return -1;
+
+	return pbase->ps_virtual_units[block - 1];
 }
 
-static lwz_context_t * lwz_open(HINSTANCE hinstDLL)
+BOOL LWZ_SET_GAMMA(LWZHANDLE hlwz, uint8_t const *table)
 {
-	// allocate the context
-	lwz_context_t * const h = (lwz_context_t *)malloc(sizeof(lwz_context_t));
-	if (h == NULL)
-		return NULL;
+	AUTOLOCK(g_cs);
 
-	// clear the context structure to all zeroes
-	memset(h, 0x00, sizeof(*h));
+	int indx = hlwz - 1;
+	if (!lwz_valid_unit(g_plwz, indx))
+		return FALSE;
 
-	// initialize all unit types to None
-	for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
-		h->devices[i].device_type = LWZ_DEVICE_TYPE_NONE;
+	// the table applies to the physical unit, including its virtual units
+	lwz_unit_t * const u = lwz_unit(g_plwz, lwz_physical_unit(g_plwz, indx));
+	BYTE * const gamma = u->gamma;
+	if (table == NULL)
+	{
+		lwz_gamma_default(gamma);
+		u->gamma_set = false;
+		return TRUE;
+	}
 
-	// set up the I/O queue and worker thread
-	#if defined(USE_SEPARATE_IO_THREAD)
-	if ((h->hqueue = queue_open()) == NULL)
+	// every entry has to be a valid PBA value
+	for (int i = 0 ; i < 256 ; ++i)
 	{
-		free(h);
-		return NULL;
+		if (table[i] > 49 && (table[i] < 129 || table[i] > 132))
+			return FALSE;
 	}
-	#endif
 
-	return h;
+	memcpy(gamma, table, 256);
+	u->gamma_set = true;
+	return TRUE;
 }
 
-static void lwz_close(lwz_context_t *h)
+// Send 8-bit levels for 'n' ports from 'port' on (0-31) straight to an
+// LWCloneU2 unit whose firmware takes them (LWCLONEU2_CAP_LEVELS), rather
+// than as PBA levels.  The firmware applies its own gamma curve, to an
+// 8-bit duty with BCM, or to its 49 steps with the soft-PWM.  The shadow
+// state must already hold the levels translated through the unit's table,
+// which is what we publish as sent.
+//
+// Returns false if the levels have to go out as a PBA instead: the unit
+// doesn't take them, the client set its own translation table, the
+// changes are being staged or handed to the broker, effects are running
+// on the unit, or the other ports' levels haven't been sent yet.  Must be
+// called with 'g_cs' held.
+static bool lwz_send_levels(lwz_context_t *h, int indx, uint32_t port, uint8_t const *values, uint32_t n)
 {
-	if (h == NULL)
-		return;
+	lwz_device_t * const pdev = lwz_dev(h, indx);
+	if (pdev->device_type != LWZ_DEVICE_TYPE_LWCLONEU2
+		|| (pdev->lwcloneu2_caps & LWCLONEU2_CAP_LEVELS) == 0
+		|| lwz_unit(h, indx)->gamma_set
+		|| h->flush.mode != LWZ_FLUSH_IMMEDIATE
+		|| h->broker.hclient != NULL
+		|| !pdev->shadow.pba_sent_valid)
+		return false;
+
+	// the PBA path merges in any running effects
+	BYTE pba[32];
+	lwz_effects_apply(h, indx, pba);
+	if (memcmp(pba, pdev->shadow.pba, 32) != 0)
+		return false;
+
+	// the ports we're not setting have to be on the device already
+	for (uint32_t i = 0 ; i < 32 ; ++i)
+	{
+		if ((i < port || i >= port + n) && pdev->shadow.pba_sent[i] != pdev->shadow.pba[i])
+			return false;
+	}
 
-	// close all open device handles and
-	// unhook our window proc (and unregister the device change notifications)
+	memcpy(pdev->shadow.pba_sent, pdev->shadow.pba, 32);
+	pdev->shadow.levels_sent = true;
+	lwz_state_publish(h, indx);
 
-	lwz_freelist(h);
-	lwz_register(h, 0, NULL);
+	HUDEV hudev = lwz_get_hdev(h, indx);
+	if (hudev == NULL)
+		return true;
 
-	#if defined(USE_SEPARATE_IO_THREAD)
-	if (h->hqueue != NULL)
+	// up to four packets of 6 ports per write
+	for (uint32_t i = 0 ; i < n ; i += 24)
 	{
-		queue_close(h->hqueue, true);
-		h->hqueue = NULL;
-	}
-	#endif
+		BYTE buf[32];
+		uint32_t const m = (n - i < 24) ? n - i : 24;
+		size_t const ndata = lwzcodec_encode_levels(buf, &values[i], port + i, m);
 
-	// free resources
+		#if defined(USE_SEPARATE_IO_THREAD)
 
-	free(h);
+		queue_push(h->hqueue, hudev, PACKET_TYPE_RAW, buf, ndata);
+
+		#else
+
+		usbdev_write(hudev, buf, ndata);
+
+		#endif
+	}
+
+	return true;
 }
-	
-static void lwz_register(lwz_context_t *h, int indx, HWND hwnd)
+
+uint32_t LWZ_SET_OUTPUTS_8BIT(LWZHANDLE hlwz, uint32_t first_port, uint8_t const *values, uint32_t count)
 {
-	// if there's a non-null window handle, register, otherwise unregister
-	if (hwnd != NULL)
+	LOG("SET_OUTPUTS_8BIT(unit=%d, port=%u, count=%u)\n", hlwz, first_port, count);
+
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	int indx = hlwz - 1;
+	if (!lwz_valid_unit(h, indx) || values == NULL || first_port < 1)
+		return 0;
+
+	if (lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_NONE)
+		return 0;
+
+	// Ports past the unit's 32 continue on the virtual interfaces of the
+	// same Pinscape unit, for as long as there are any.
+	BYTE const * const gamma = lwz_unit(h, lwz_physical_unit(h, indx))->gamma;
+	uint32_t const port0 = first_port - 1;
+	uint32_t nset = 0;
+	for (uint32_t block = port0 / 32, port = port0 % 32 ;
+		 nset < count ;
+		 ++block, port = 0)
 	{
-		// Window handle provided - register.
-		
-		// If there's a previous window handle registered, fail.  Only
-		// one window may be registered at a time.  The caller can register
-		// a new window, but only if they explicitly un-register the prior
-		// one first.
-		if (h->hwnd != NULL && h->hwnd != hwnd)
-			return;
+		int const unit = lwz_block_unit(h, indx, block);
+		if (unit < 0)
+			break;
 
-		// verify that this index is valid
-		if (indx < 0 ||	indx >= LWZ_MAX_DEVICES)
-			return;
+		lwz_device_t * const pdev = lwz_dev(h, unit);
 
-		// verify that there's a device at this index
-		if (h->devices[indx].hudev == NULL)
-			return;
+		if (!pdev->shadow.pba_known)
+		{
+			memset(pdev->shadow.pba, 48, 32);
+			pdev->shadow.pba_known = true;
+		}
 
-		// "subclass" the window to intercept messages
-		WNDPROC PrevWndProc = (WNDPROC)SetWindowLongPtrA(
-			hwnd,
-			GWLP_WNDPROC,
-			(LONG_PTR)lwz_wndproc);
+		// translate through the table
+		uint32_t n = 32 - port;
+		if (n > count - nset)
+			n = count - nset;
 
-		// make sure that succeeded, and that we didn't already do this
-		if (PrevWndProc == NULL || PrevWndProc == lwz_wndproc)
-			return;
+		BYTE * const dst = &pdev->shadow.pba[port];
+		uint8_t const * const src = &values[nset];
+		for (uint32_t i = 0 ; i < n ; ++i)
+			dst[i] = gamma[src[i]];
 
-		// remember the original window proc so that we can forward messages to it
-		h->WndProc = PrevWndProc;
-		h->hwnd = hwnd;
+		nset += n;
 
-		// register for device notifications
-		if (h->hDevNotify == NULL)
+		// send the levels as they are where the unit takes them, and
+		// whatever changed as a PBA otherwise
+		if (!lwz_send_levels(h, unit, port, src, n))
+			lwz_send_pba(h, unit, true);
+	}
+
+	return nset;
+}
+
+// Note a change made by lwz_update_port() (LWZ_STAGED_xxx), adding the
+// unit to the change list if it isn't there already
+static void lwz_mark_dirty(lwz_context_t *h, int unit, BYTE change)
+{
+	lwz_unit_t * const u = lwz_unit(h, unit);
+	if (u->dirty == 0)
+	{
+		u->dirty_next = h->dirty_first;
+		h->dirty_first = unit;
+	}
+
+	u->dirty |= change;
+}
+
+// Apply one port update to a unit's output state.  Units whose on/off
+// or brightness states changed go on the change list, for
+// lwz_send_dirty().
+static void lwz_update_port(lwz_context_t *h, int unit, int port, BYTE on, BYTE level)
+{
+	lwz_device_t * const pdev = lwz_dev(h, unit);
+
+	if (on != LWZ_PORT_UNCHANGED)
+	{
+		if (!pdev->shadow.sba_known)
 		{
-			DEV_BROADCAST_DEVICEINTERFACE_A dbch = {};
-			dbch.dbcc_size = sizeof(dbch); 
-			dbch.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE; 
-			dbch.dbcc_classguid = HIDguid; 
-			dbch.dbcc_name[0] = '\0'; 
+			memset(pdev->shadow.banks, 0x00, 4);
+			pdev->shadow.speed = 2;
+			pdev->shadow.sba_known = true;
+			lwz_mark_dirty(h, unit, LWZ_STAGED_SBA);
+		}
 
-			h->hDevNotify = RegisterDeviceNotificationA(hwnd, &dbch, DEVICE_NOTIFY_WINDOW_HANDLE);
+		BYTE * const bank = &pdev->shadow.banks[port / 8];
+		BYTE const bit = (BYTE)(1 << (port % 8));
+		BYTE const newbank = on ? (*bank | bit) : (*bank & ~bit);
+		if (newbank != *bank)
+		{
+			*bank = newbank;
+			lwz_mark_dirty(h, unit, LWZ_STAGED_SBA);
 		}
 	}
-	else
+
+	if (level != LWZ_PORT_UNCHANGED && (level <= 49 || (level >= 129 && level <= 132)))
 	{
-		// Null window handle - unregister
-		
-		// unregister the device notification
-		if (h->hDevNotify)
+		if (!pdev->shadow.pba_known)
 		{
-			UnregisterDeviceNotification(h->hDevNotify);
-			h->hDevNotify = NULL;
+			memset(pdev->shadow.pba, 48, 32);
+			pdev->shadow.pba_known = true;
 		}
 
-		// un-subclass the window
-		if (h->hwnd != NULL && h->WndProc != NULL)
+		if (pdev->shadow.pba[port] != level)
 		{
-			SetWindowLongPtrA(
-				h->hwnd,
-				GWLP_WNDPROC,
-				(LONG_PTR)h->WndProc);
-
-			h->hwnd = NULL;
-			h->WndProc = NULL;
+			pdev->shadow.pba[port] = level;
+			lwz_mark_dirty(h, unit, LWZ_STAGED_PBA);
 		}
 	}
 }
 
-static HUDEV lwz_get_hdev(lwz_context_t *h, int indx)
+// Send the changes noted by lwz_update_port().  The brightness levels go
+// first, so that ports being switched on light at their new levels.
+// Levels go out only for the changed groups of 8 ports (see
+// lwz_send_pba); on/off bits go out as one SBA or SBX per changed unit.
+// Empties the change list.
+static void lwz_send_dirty(lwz_context_t *h)
 {
-	if (indx < 0 ||
-	    indx >= LWZ_MAX_DEVICES)
+	for (int unit = h->dirty_first ; unit >= 0 ; unit = lwz_unit(h, unit)->dirty_next)
 	{
-		return NULL;
+		if (lwz_unit(h, unit)->dirty & LWZ_STAGED_PBA)
+			lwz_send_pba(h, unit, true);
+	}
+
+	for (int unit = h->dirty_first ; unit >= 0 ; unit = lwz_unit(h, unit)->dirty_next)
+	{
+		lwz_unit_t * const u = lwz_unit(h, unit);
+		if (u->dirty & LWZ_STAGED_SBA)
+			lwz_send_sba(h, unit);
+		u->dirty = 0;
 	}
 
-	return h->devices[indx].hudev;
+	h->dirty_first = -1;
 }
 
-static void lwz_notify_callback(lwz_context_t *h, int reason, LWZHANDLE hlwz)
+uint32_t LWZ_UPDATE_PORTS(LWZHANDLE hlwz, LWZPORTUPDATE const *updates, uint32_t count)
 {
-	if (h->cb.notify != 0)
+	LOG("UPDATE_PORTS(unit=%d, count=%u)\n", hlwz, count);
+
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	int indx = hlwz - 1;
+	if (!lwz_valid_unit(h, indx) || updates == NULL)
+		return 0;
+
+	if (lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_NONE)
+		return 0;
+
+	// Apply the updates to the output state.  Port numbers are on the
+	// physical unit, so ports past 32 go to the Pinscape virtual units
+	// that cover them.
+	int const base = lwz_physical_unit(h, indx);
+	uint32_t nset = 0;
+	for (uint32_t i = 0 ; i < count ; ++i)
 	{
-		LOG("NOTIFY(reason=%d (%s), unit=%d)\n",
-			reason,
-			reason == LWZ_REASON_ADD ? "Add" : reason == LWZ_REASON_DELETE ? "Delete" : "Unknown",
-			hlwz);
-		h->cb.notify(reason, hlwz);
+		LWZPORTUPDATE const *u = &updates[i];
+		if (u->port < 1)
+			continue;
+
+		int const unit = lwz_block_unit(h, base, (u->port - 1) / 32);
+		if (unit < 0)
+			continue;
+
+		lwz_update_port(h, unit, (u->port - 1) % 32, u->on, u->level);
+		++nset;
+	}
+
+	lwz_send_dirty(h);
+
+	return nset;
+}
+
+BOOL LWZ_LOAD_OUTPUT_MAP(char const *path)
+{
+	LOG("LOAD_OUTPUT_MAP(%s)\n", path != NULL ? path : "NULL");
+
+	// compile the new map before taking the lock
+	outmap_t *map = NULL;
+	if (path != NULL)
+	{
+		UINT error_line;
+		map = outmap_load(path, &error_line);
+		if (map == NULL)
+		{
+			LOG("  failed, error at line %u\n", error_line);
+			return FALSE;
+		}
+	}
+
+	AUTOLOCK(g_cs);
+
+	outmap_free(g_plwz->outmap);
+	g_plwz->outmap = map;
+
+	return TRUE;
+}
+
+uint32_t LWZ_UPDATE_OUTPUTS(LWZPORTUPDATE const *updates, uint32_t count)
+{
+	LOG("UPDATE_OUTPUTS(count=%u)\n", count);
+
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+	outmap_t const * const map = h->outmap;
+	if (map == NULL || updates == NULL)
+		return 0;
+
+	// apply the updates through the map, then send what changed on each
+	// unit involved
+	uint32_t nset = 0;
+	for (uint32_t i = 0 ; i < count ; ++i)
+	{
+		LWZPORTUPDATE const *u = &updates[i];
+		UINT const output = (UINT)u->port - 1;
+		if (output >= map->count || map->unit[output] == OUTMAP_UNMAPPED)
+			continue;
+
+		// the map can name extended units that don't exist (yet)
+		if (!lwz_valid_unit(h, map->unit[output]))
+			continue;
+
+		int const unit = lwz_block_unit(h, map->unit[output], map->port[output] / 32);
+		if (unit < 0 || lwz_dev(h, unit)->device_type == LWZ_DEVICE_TYPE_NONE)
+			continue;
+
+		lwz_update_port(h, unit, map->port[output] % 32, u->on, u->level);
+		++nset;
+	}
+
+	lwz_send_dirty(h);
+
+	return nset;
+}
+
+BOOL LWZ_GET_STATE(LWZHANDLE hlwz, LWZUNITSTATE *state)
+{
+	// no lock here: read the published copy, retrying if an update
+	// was in progress
+	int indx = hlwz - 1;
+	if (!lwz_valid_unit(g_plwz, indx) || state == NULL || state->cbSize < sizeof(LWZUNITSTATE))
+		return FALSE;
+
+	volatile LONG * const pseq = &lwz_unit(g_plwz, indx)->published.seq;
+	for (int tries = 0 ; ; ++tries)
+	{
+		LONG const seq = *pseq;
+		if ((seq & 1) == 0)
+		{
+			MemoryBarrier();
+			memcpy(state, &lwz_unit(g_plwz, indx)->published.state, sizeof(LWZUNITSTATE));
+			MemoryBarrier();
+			if (*pseq == seq)
+				break;
+		}
+
+		// the writer holds 'g_cs', which might be held for a while by a
+		// blocked thread, so give it the CPU after a few tries
+		if (tries >= 16)
+			Sleep(0);
+	}
+
+	state->cbSize = sizeof(LWZUNITSTATE);
+	return TRUE;
+}
+
+BOOL LWZ_SET_DEBUG_LOG(char const *path)
+{
+	AUTOLOCK(g_cs);
+
+	if (path == NULL)
+	{
+		dbglog_stop();
+		return TRUE;
+	}
+
+	return dbglog_start(path) ? TRUE : FALSE;
+}
+
+BOOL LWZ_SET_FLUSH_MODE(uint32_t mode, uint32_t rate_hz)
+{
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	if (mode != LWZ_FLUSH_IMMEDIATE && mode != LWZ_FLUSH_EXPLICIT && mode != LWZ_FLUSH_TIMED)
+		return FALSE;
+
+	if (mode == LWZ_FLUSH_TIMED && (rate_hz < 1 || rate_hz > 1000))
+		return FALSE;
+
+	// send anything staged under the old mode
+	lwz_flush(h);
+
+	h->flush.mode = mode;
+	if (mode == LWZ_FLUSH_TIMED)
+	{
+		h->flush.period_ms = 1000 / rate_hz;
+		h->flush.next = GetTickCount() + h->flush.period_ms;
+		if (!lwz_effects_kick(h))
+		{
+			h->flush.mode = LWZ_FLUSH_IMMEDIATE;
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+void LWZ_FLUSH(void)
+{
+	AUTOLOCK(g_cs);
+
+	lwz_flush(g_plwz);
+}
+
+BOOL LWZ_SET_STATE_BUFFER(LWZSTATEBUFFER const *buffer)
+{
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	if (buffer != NULL && buffer->cbSize < sizeof(LWZSTATEBUFFER))
+		return FALSE;
+
+	// Set the new buffer.  Start with a sequence number that can't match,
+	// so the first tick takes a snapshot.
+	h->statebuf.buffer = buffer;
+	h->statebuf.seq = -1;
+	h->statebuf.pending = 0;
+	memset(&h->statebuf.snap, 0x00, sizeof(h->statebuf.snap));
+
+	if (buffer == NULL)
+		return TRUE;
+
+	// start polling right away on all units
+	DWORD const now = GetTickCount();
+	for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
+		lwz_unit(h, i)->next_tick = now;
+
+	if (!lwz_effects_kick(h))
+	{
+		h->statebuf.buffer = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL LWZ_START_EFFECT(LWZHANDLE hlwz, LWZEFFECT const *effect)
+{
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	// validate the unit and the effect description
+	int indx = hlwz - 1;
+	if (!lwz_valid_unit(h, indx) || lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_NONE)
+		return FALSE;
+
+	if (effect == NULL || effect->cbSize < sizeof(LWZEFFECT)
+		|| effect->dwPort < 1 || effect->dwPort > 32
+		|| effect->dwFrom > 49 || effect->dwTo > 49)
+		return FALSE;
+
+	if ((effect->dwType != LWZ_EFFECT_RAMP && effect->dwType != LWZ_EFFECT_BLINK)
+		|| (effect->dwType == LWZ_EFFECT_BLINK && (effect->dwPeriodMs == 0 || effect->dwDutyPct > 100)))
+		return FALSE;
+
+	// a new effect replaces anything already running on the port
+	int const port = effect->dwPort - 1;
+	lwz_effects_remove(h, indx, port);
+
+	if (h->effects.count >= LWZ_MAX_EFFECTS)
+		return FALSE;
+
+	lwz_effect_t * const e = &h->effects.list[h->effects.count];
+	e->indx = indx;
+	e->port = port;
+	e->type = effect->dwType;
+	e->from = (BYTE)effect->dwFrom;
+	e->to = (BYTE)effect->dwTo;
+	e->t0 = GetTickCount();
+	e->period_ms = effect->dwPeriodMs;
+	e->on_ms = (DWORD)((ULONGLONG)effect->dwPeriodMs * effect->dwDutyPct / 100);
+	e->cycles = effect->dwCycles;
+
+	if (!lwz_effects_kick(h))
+		return FALSE;
+
+	// update the unit on the next tick
+	h->effects.count += 1;
+	lwz_unit(h, indx)->next_tick = e->t0;
+
+	return TRUE;
+}
+
+void LWZ_STOP_EFFECTS(LWZHANDLE hlwz, uint32_t port)
+{
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	int indx = hlwz - 1;
+	if (!lwz_valid_unit(h, indx) || port > 32)
+		return;
+
+	// remove the effects, and put the ports back to the client's levels
+	lwz_effects_remove(h, indx, (int)port - 1);
+
+	if (lwz_dev(h, indx)->device_type != LWZ_DEVICE_TYPE_NONE && lwz_dev(h, indx)->shadow.pba_sent_valid)
+		lwz_send_pba(h, indx, true);
+}
+
+static void safe_strcpy(char *dst, size_t dst_size, const char *src)
+{
+	// only proceed if we have a destination buffer of non-zero size
+	if (dst_size != 0 && dst != 0)
+	{
+		// substitute an empty string if the source is null
+		if (src == 0)
+			src = "";
+
+		// figure the copy length as the source length, or the destination
+		// buffer size minus one for the trailing null, whichever is shorter
+		size_t copy_len = strlen(src);
+		if (copy_len > dst_size - 1)
+			copy_len = dst_size - 1;
+
+		// copy the copy length, then add the null terminator
+		memcpy(dst, src, copy_len);
+		dst[copy_len] = '\0';
+	}
+}
+
+static void safe_strcat(char *dst, size_t dst_size, const char *src)
+{
+	// make sure we have a destination buffer of non-zero size
+	if (dst != 0 && dst_size != 0)
+	{
+		// get the current length, and make sure there's room for more
+		size_t old_len = strlen(dst);
+		if (old_len < dst_size)
+		{
+			// figure the maximum copy length
+			size_t copy_len = strlen(src);
+			if (copy_len > dst_size - old_len - 1)
+				copy_len = dst_size - old_len - 1;
+
+			// copy the copy length, and add a null terminator
+			memcpy(dst + old_len, src, copy_len);
+			dst[old_len + copy_len] = '\0';
+		}
+	}
+}
+
+BOOL LWZ_GET_DEVICE_INFO(LWZHANDLE hlwz, LWZDEVICEINFO *info)
+{
+	// enter our critical section
+	AUTOLOCK(g_cs);
+
+	// get our global context
+	lwz_context_t * const h = g_plwz;
+
+	// set defaults in the return struct
+	info->dwDevType = LWZ_DEVICE_TYPE_NONE;
+	info->szName[0] = '\0';
+
+	// validate the index
+	int indx = (int)hlwz - 1;
+	if (!lwz_valid_unit(g_plwz, indx))
+		return FALSE;
+
+	// get the device and make sure it's an existing device
+	lwz_device_t *dev = lwz_dev(h, indx);
+	if (dev->device_type == LWZ_DEVICE_TYPE_NONE)
+		return FALSE;
+
+	// fill in the fields
+	info->dwDevType = dev->device_type;
+	safe_strcpy(info->szName, sizeof(info->szName), dev->device_name);
+
+	// success
+	return TRUE;
+}
+
+
+//**********************************************************************************************************************
+// Low level implementation 
+//**********************************************************************************************************************
+
+BOOL WINAPI DllMain(
+	HINSTANCE hinstDLL,
+	DWORD fdwReason,
+	LPVOID lpvReserved)
+{
+	if (fdwReason == DLL_PROCESS_ATTACH)
+	{
+		dbglog_start_from_environment();
+
+		LOG("*****\n"
+			"LEDWIZ.DLL loading\n\n");
+		InitializeCriticalSection(&g_cs);
+
+		g_plwz = lwz_open(hinstDLL);
+
+		if (g_plwz == NULL)
+		{
+			DeleteCriticalSection(&g_cs);
+			dbglog_stop();
+			return FALSE;
+		}
+	}
+	else if (fdwReason == DLL_THREAD_DETACH)
+	{
+		// let the debug log reuse the thread's log buffer
+		dbglog_thread_detach();
+	}
+	else if (fdwReason == DLL_PROCESS_DETACH)
+	{
+		// stop background discovery, the broker client thread, the
+		// effect thread and the reconnect thread before taking the lock,
+		// since the threads might be waiting for the lock themselves
+		lwz_discovery_stop(g_plwz);
+		lwz_broker_stop(g_plwz);
+		lwz_effects_stop(g_plwz);
+		lwz_reconnect_stop(g_plwz);
+
+		{
+			AUTOLOCK(g_cs);
+
+			lwz_close(g_plwz);
+		}
+
+		DeleteCriticalSection(&g_cs);
+
+		// write out the rest of the debug log
+		dbglog_stop();
+	}
+
+	return TRUE;
+}
+
+static LRESULT CALLBACK lwz_wndproc(
+	HWND hwnd,
+    UINT uMsg,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+	AUTOLOCK(g_cs);
+
+	lwz_context_t * const h = g_plwz;
+
+	// get the original WndProc
+	WNDPROC OriginalWndProc = h->WndProc;
+
+	// check the message type
+	switch (uMsg)
+	{
+	case WM_DEVICECHANGE:
+		// device change - check which type (attach or detach)
+		switch (wParam)
+		{
+		case DBT_DEVICEARRIVAL:
+			lwz_refreshlist(h);
+			break;
+			
+		case DBT_DEVICEREMOVECOMPLETE:
+			// Find the removed device from the interface path in the
+			// notification.  If the notification doesn't identify the
+			// interface, check all of our devices instead.
+			if (!lwz_refreshlist_detached_path(h, (DEV_BROADCAST_HDR const *)lParam))
+				lwz_refreshlist_detached(h);
+			break;
+		}
+		break;
+
+	case WM_DESTROY:
+		// destroying the window - cancel the registration
+		lwz_register(h, 0, NULL);
+		break;
+	}
+	
+	// forward the message to original windows procedure
+	if (OriginalWndProc != NULL)
+	{
+		return CallWindowProc(
+			OriginalWndProc,
+			hwnd,
+			uMsg,
+			wParam,
+			lParam);
+	}
+
+	return 0;
+}
+
+// Add a chunk of units to the unit table.  The new units are empty, with
+// linear 8-bit level translation.  Returns false if the table is full or
+// we're out of memory.
+static bool lwz_grow_units(lwz_context_t *h)
+{
+	int const nchunks = h->num_units / LWZ_UNIT_CHUNK;
+	if (nchunks >= LWZ_MAX_UNITS / LWZ_UNIT_CHUNK)
+		return false;
+
+	lwz_unit_t * const chunk = (lwz_unit_t *)malloc(LWZ_UNIT_CHUNK * sizeof(lwz_unit_t));
+	if (chunk == NULL)
+		return false;
+
+	memset(chunk, 0x00, LWZ_UNIT_CHUNK * sizeof(lwz_unit_t));
+	for (int i = 0 ; i < LWZ_UNIT_CHUNK ; ++i)
+	{
+		chunk[i].dev.device_type = LWZ_DEVICE_TYPE_NONE;
+		chunk[i].dirty_next = -1;
+		lwz_gamma_default(chunk[i].gamma);
+	}
+
+	// LWZ_GET_STATE reads the table without the lock, so the chunk has
+	// to be in place before the count covers it
+	h->units[nchunks] = chunk;
+	MemoryBarrier();
+	InterlockedExchange(&h->num_units, h->num_units + LWZ_UNIT_CHUNK);
+	return true;
+}
+
+// Find a free extended unit, past the legacy units, growing the table if
+// they're all taken.  Returns the unit index, or -1 if there's no room.
+// A unit is free if no device is installed there and it's not a virtual
+// unit; a previous occupant's state was cleared by lwz_remove().
+static int lwz_alloc_unit(lwz_context_t *h)
+{
+	for (;;)
+	{
+		for (int i = LWZ_MAX_DEVICES ; i < h->num_units ; ++i)
+		{
+			if (lwz_dev(h, i)->device_type == LWZ_DEVICE_TYPE_NONE)
+				return i;
+		}
+
+		if (!lwz_grow_units(h))
+			return -1;
+	}
+}
+
+static lwz_context_t * lwz_open(HINSTANCE hinstDLL)
+{
+	// allocate the context
+	lwz_context_t * const h = (lwz_context_t *)malloc(sizeof(lwz_context_t));
+	if (h == NULL)
+		return NULL;
+
+	// clear the context structure to all zeroes
+	memset(h, 0x00, sizeof(*h));
+	h->dirty_first = -1;
+
+	// the USB layer signals this when a device's writes start failing
+	h->reconnect.hkick = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	// set up the legacy units
+	if (!lwz_grow_units(h))
+	{
+		free(h);
+		return NULL;
+	}
+
+	// set up the I/O queue and worker thread
+	#if defined(USE_SEPARATE_IO_THREAD)
+	if ((h->hqueue = queue_open()) == NULL)
+	{
+		if (h->reconnect.hkick != NULL)
+			CloseHandle(h->reconnect.hkick);
+		free(h->units[0]);
+		free(h);
+		return NULL;
+	}
+	#endif
+
+	// the probe results saved by earlier processes are loaded on the
+	// first search (see lwz_cache_load_once)
+	h->discovery_stats.cbSize = sizeof(h->discovery_stats);
+
+	return h;
+}
+
+static void lwz_close(lwz_context_t *h)
+{
+	if (h == NULL)
+		return;
+
+	// close all open device handles and
+	// unhook our window proc (and unregister the device change notifications)
+
+	lwz_freelist(h);
+	lwz_register(h, 0, NULL);
+
+	if (h->broker.hclient != NULL)
+	{
+		broker_client_close(h->broker.hclient);
+		h->broker.hclient = NULL;
+	}
+
+	// Changes to the probe cache since the last search, such as removals,
+	// aren't saved here, since this runs under the loader lock.  The next
+	// process's first search prunes entries for interfaces that are gone,
+	// and validates the ones it uses.
+	free(h->probe_cache.entries);
+	h->probe_cache.entries = NULL;
+
+	#if defined(USE_SEPARATE_IO_THREAD)
+	if (h->hqueue != NULL)
+	{
+		queue_close(h->hqueue, true);
+		h->hqueue = NULL;
+	}
+	#endif
+
+	// free resources
+
+	// the devices are closed now, so nothing can signal the reconnect event
+	if (h->reconnect.hkick != NULL)
+		CloseHandle(h->reconnect.hkick);
+
+	outmap_free(h->outmap);
+	for (int i = 0 ; i < h->num_units / LWZ_UNIT_CHUNK ; ++i)
+		free(h->units[i]);
+	free(h);
+}
+	
+static void lwz_register(lwz_context_t *h, int indx, HWND hwnd)
+{
+	// if there's a non-null window handle, register, otherwise unregister
+	if (hwnd != NULL)
+	{
+		// Window handle provided - register.
+		
+		// If there's a previous window handle registered, fail.  Only
+		// one window may be registered at a time.  The caller can register
+		// a new window, but only if they explicitly un-register the prior
+		// one first.
+		if (h->hwnd != NULL && h->hwnd != hwnd)
+			return;
+
+		// verify that this index is valid
+		if (!lwz_valid_unit(h, indx))
+			return;
+
+		// verify that there's a device at this index
+		if (lwz_dev(h, indx)->hudev == NULL)
+			return;
+
+		// "subclass" the window to intercept messages
+		WNDPROC PrevWndProc = (WNDPROC)SetWindowLongPtrA(
+			hwnd,
+			GWLP_WNDPROC,
+			(LONG_PTR)lwz_wndproc);
+
+		// make sure that succeeded, and that we didn't already do this
+		if (PrevWndProc == NULL || PrevWndProc == lwz_wndproc)
+			return;
+
+		// remember the original window proc so that we can forward messages to it
+		h->WndProc = PrevWndProc;
+		h->hwnd = hwnd;
+
+		// register for device notifications
+		if (h->hDevNotify == NULL)
+		{
+			DEV_BROADCAST_DEVICEINTERFACE_A dbch = {};
+			dbch.dbcc_size = sizeof(dbch); 
+			dbch.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE; 
+			dbch.dbcc_classguid = HIDguid; 
+			dbch.dbcc_name[0] = '\0'; 
+
+			h->hDevNotify = RegisterDeviceNotificationA(hwnd, &dbch, DEVICE_NOTIFY_WINDOW_HANDLE);
+		}
+	}
+	else
+	{
+		// Null window handle - unregister
+		
+		// unregister the device notification
+		if (h->hDevNotify)
+		{
+			UnregisterDeviceNotification(h->hDevNotify);
+			h->hDevNotify = NULL;
+		}
+
+		// un-subclass the window
+		if (h->hwnd != NULL && h->WndProc != NULL)
+		{
+			SetWindowLongPtrA(
+				h->hwnd,
+				GWLP_WNDPROC,
+				(LONG_PTR)h->WndProc);
+
+			h->hwnd = NULL;
+			h->WndProc = NULL;
+		}
+	}
+}
+
+static HUDEV lwz_get_hdev(lwz_context_t *h, int indx)
+{
+	if (!lwz_valid_unit(h, indx))
+	{
+		return NULL;
+	}
+
+	return lwz_dev(h, indx)->hudev;
+}
+
+static void lwz_notify_callback(lwz_context_t *h, int reason, LWZHANDLE hlwz)
+{
+	// extended units are only reported to clients that asked for them
+	if (hlwz > LWZ_MAX_DEVICES && !h->extended_units)
+		return;
+
+	if (h->cb.notify != 0)
+	{
+		LOG("NOTIFY(reason=%d (%s), unit=%d)\n",
+			reason,
+			reason == LWZ_REASON_ADD ? "Add" : reason == LWZ_REASON_DELETE ? "Delete" : "Unknown",
+			hlwz);
+		h->cb.notify(reason, hlwz);
+	}
+
+	if (h->cb.notify_ex != 0)
+	{
+		LOG("NOTIFY_EX(reason=%d (%s), unit=%d)\n",
+			reason,
+			reason == LWZ_REASON_ADD ? "Add" : reason == LWZ_REASON_DELETE ? "Delete" : "Unknown",
+			hlwz);
+		h->cb.notify_ex(h->cb.puser, reason, hlwz);
+	}
+}
+
+// Add one or more new devices to the client's device list, and invoke
+// the client callback.
+//
+// For compatibility with some existing clients, it's necessary to add
+// ALL devices to the client's list before the FIRST notify callback.
+// The original LEDWIZ.DLL does this, and some clients depend on it.
+// E.g., LedBlinky apparently only pays attention to the first notify
+// callback, and ignores all subsequent invocations, so it only detects
+// devices that are in the list on the first call.  Ergo the list must
+// be populated with all devices before the first call.  This isn't
+// specified one way or the other in the API, but it would seem more
+// reasonable to me to populate the list incrementally, adding each
+// device just before calling the callback for that device.  This is
+// in fact what the original LWCloneU2 did, but that broke LedBlinky.
+// For full compatibility, we have to do things the same peculiar way
+// as the original DLL.
+static void lwz_add(lwz_context_t *h, int ndevices, const int *device_indices)
+{
+
+	// First, update the user list if one was provided.  We have to
+	// add all devices to the list before invoking the callback for
+	// any device.
+	if (h->plist)
+	{
+		for (int i = 0 ; i < ndevices ; ++i)
+		{
+			// get the current unit number (== device index + 1); the
+			// list only has room for the legacy units
+			LWZHANDLE hlwz = device_indices[i] + 1;
+			if (hlwz > LWZ_MAX_DEVICES)
+				continue;
+
+			// check to see if it's already in the list
+			bool found = false;
+			for (int j = 0 ; j < h->plist->numdevices ; ++j)
+			{
+				if (h->plist->handles[j] == hlwz)
+				{
+					found = true;
+					break;
+				}
+			}
+
+			// if there's room, and it's not already in the list, add it
+			if (!found && h->plist->numdevices < LWZ_MAX_DEVICES)
+			{
+				h->plist->handles[h->plist->numdevices] = hlwz;
+				h->plist->numdevices += 1;
+				LOG("lwz_add(unit=%d, #devices=%d)\n", hlwz, h->plist->numdevices);
+			}
+		}
+	}
+
+	// Now invoke the user callback once for each added device
+	for (int i = 0 ; i < ndevices ; ++i)
+	{
+		LWZHANDLE hlwz = device_indices[i] + 1;
+		lwz_notify_callback(h, LWZ_REASON_ADD, hlwz);
+	}
+}
+
+static void lwz_remove(lwz_context_t *h, int indx)
+{
+	LWZHANDLE hlwz = indx + 1;
+
+	// update user list (if one waw provided)
+
+	if (h->plist)
+	{
+		for (int i = 0; i < h->plist->numdevices; i++)
+		{
+			LWZHANDLE hlwz = indx + 1;
+
+			if (h->plist->handles[i] != hlwz)
+				continue;
+
+			h->plist->handles[i] = h->plist->handles[h->plist->numdevices - 1];
+			h->plist->handles[h->plist->numdevices - 1] = 0;
+
+			h->plist->numdevices -= 1;
+		}
+	}
+
+	// drop the unit's effects and output state, so that a new device
+	// arriving at the same unit number starts out clean (but picks up
+	// the state buffer's state, if the buffer drives the unit)
+	lwz_effects_remove(h, indx, -1);
+	memset(&lwz_dev(h, indx)->shadow, 0x00, sizeof(lwz_dev(h, indx)->shadow));
+	lwz_state_publish(h, indx);
+	if (indx < LWZ_MAX_DEVICES)
+		h->statebuf.pending |= h->statebuf.snap.dwUnitMask & (1 << indx);
+
+	// notify callback
+
+	lwz_notify_callback(h, LWZ_REASON_DELETE, hlwz);
+}
+
+// Remove a physical device from the list.  This drops any virtual
+// LedWiz units that refer back to it, closes our USB handle, and
+// notifies the user callback.
+static void lwz_remove_device(lwz_context_t *h, int i)
+{
+	// get the device descriptor entry
+	lwz_device_t *dev = lwz_dev(h, i);
+
+	// If this is a Pinscape device, remove any virtual LedWiz units
+	// that refer back to it.
+	if (dev->device_type == LWZ_DEVICE_TYPE_PINSCAPE)
+	{
+		// Pinscape units set up one virtual LedWiz interface per
+		// block of 32 output ports after the first 32, and the
+		// Pinscape unit's entry records where each one went.
+		for (int block = 0 ; block < LWZ_PS_MAX_BLOCKS ; ++block)
+		{
+			int const vidx = dev->ps_virtual_units[block];
+			if (vidx < 0)
+				continue;
+
+			// make sure it's still a virtual LedWiz interface that's
+			// tied to the Pinscape interface we're deleting
+			dev->ps_virtual_units[block] = -1;
+			lwz_device_t * const vdev = lwz_dev(h, vidx);
+			if (vdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT
+				&& vdev->ps_virtual_lwz.base_unit == i)
+			{
+				// it's one of ours - remove this interface too
+				vdev->device_type = LWZ_DEVICE_TYPE_NONE;
+				lwz_remove(h, vidx);
+			}
+		}
+	}
+
+	// forget the cached probe result, since the device could come
+	// back at the same path with a different configuration
+	lwz_cache_forget(h, lwz_device_path(dev));
+
+	// close our existing USB file handle, dropping any input
+	// subscription first, since the I/O queue might still hold
+	// a reference that keeps the reader thread running for now
+	usbdev_set_input_callback(dev->hudev, NULL, NULL, 0);
+	lwz_unpublish_input(h, i);
+	usbdev_release(dev->hudev);
+	dev->hudev = NULL;
+	dev->device_type = LWZ_DEVICE_TYPE_NONE;
+
+	// remove the device from the user list and notify the user callback
+	lwz_remove(h, i);
+}
+
+static void lwz_refreshlist_detached(lwz_context_t *h)
+{
+	// check for removed devices
+	// i.e. try to re-open all registered devices in our internal list
+
+	for (int i = 0; i < h->num_units; i++)
+	{
+		if (lwz_dev(h, i)->hudev != NULL)
+		{
+			// try opening the device handle again
+			SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&lwz_dev(h, i)->dat[0];
+			HANDLE hdev = CreateFileA(
+				pdiddat->DevicePath,
+				GENERIC_READ | GENERIC_WRITE,
+				FILE_SHARE_READ | FILE_SHARE_WRITE,
+				NULL,
+				OPEN_EXISTING,
+				0,
+				NULL);
+
+			// if we couldn't open the handle, the device must have been unplugged
+			if (hdev == INVALID_HANDLE_VALUE)
+			{
+				lwz_remove_device(h, i);
+			}
+			else
+			{
+				// Success - we have a valid new handle to the file.  We only
+				// needed the new handle to see if we could create it, though,
+				// so we have no more use for it; close it.
+				CloseHandle(hdev);
+			}
+		}
+	}
+}
+
+// Handle a removal notification that names the device interface that
+// went away.  We registered for HID interface notifications, so the
+// removal message normally carries the interface path, which lets us go
+// straight to the affected device rather than re-opening every device
+// we have open.  Returns false if the notification doesn't carry a
+// usable path, in which case the caller should fall back on the full
+// sweep in lwz_refreshlist_detached().
+static bool lwz_refreshlist_detached_path(lwz_context_t *h, DEV_BROADCAST_HDR const *phdr)
+{
+	if (phdr == NULL || phdr->dbch_devicetype != DBT_DEVTYP_DEVICEINTERFACE)
+		return false;
+
+	// Get the path.  We register with the ANSI API, but Windows marshals
+	// the broadcast according to the character set of the window we're
+	// subclassing, so a Unicode window gets the wide-character version
+	// of the structure.  Device paths always start with "\\?\", so the
+	// second byte tells us which we have: a backslash for ANSI, or the
+	// high byte of the first character for Unicode.  Device paths are
+	// plain ASCII, so narrowing the wide version is just a matter of
+	// dropping the high bytes.
+	DEV_BROADCAST_DEVICEINTERFACE_A const *pdi = (DEV_BROADCAST_DEVICEINTERFACE_A const *)phdr;
+	size_t const name_ofs = offsetof(DEV_BROADCAST_DEVICEINTERFACE_A, dbcc_name);
+	if (pdi->dbcc_size <= name_ofs + 1)
+		return false;
+
+	char const *name = pdi->dbcc_name;
+	size_t const maxlen = pdi->dbcc_size - name_ofs;
+	char path[MAX_PATH];
+	size_t len = 0;
+	if (name[0] != '\0' && name[1] == '\0')
+	{
+		WCHAR const *wname = (WCHAR const *)name;
+		for ( ; len + 1 < MAX_PATH && (len + 1) * sizeof(WCHAR) <= maxlen && wname[len] != 0 ; ++len)
+			path[len] = (char)wname[len];
+	}
+	else
+	{
+		for ( ; len + 1 < MAX_PATH && len < maxlen && name[len] != '\0' ; ++len)
+			path[len] = name[len];
+	}
+	path[len] = '\0';
+
+	if (len == 0)
+		return false;
+
+	// look for an open device with a matching path
+	DWORD const hash = lwz_path_hash(path);
+	for (int i = 0; i < h->num_units; i++)
+	{
+		lwz_device_t *dev = lwz_dev(h, i);
+		if (dev->hudev != NULL
+			&& dev->device_type != LWZ_DEVICE_TYPE_PINSCAPE_VIRT
+			&& dev->path_hash == hash
+			&& _stricmp(lwz_device_path(dev), path) == 0)
+		{
+			LOG("detach: unit %d removed (%s)\n", i + 1, path);
+			lwz_remove_device(h, i);
+			return true;
+		}
+	}
+
+	// It's not one of ours.  It might still have a probe cache entry,
+	// though (a rejected interface, say), which we should drop so that
+	// a different device arriving at the same path gets a fresh probe.
+	lwz_cache_forget(h, path);
+	return true;
+}
+
+// Apply a Pinscape CONFIGURATION REPORT (00 88 ...) to a device.  We're
+// interested in the number of outputs at bytes 2:3, the unit number at
+// byte 4, and the bit flags at byte 11.
+static void lwz_apply_pinscape_config(lwz_device_t *pdev, BYTE const *rbuf)
+{
+	// Start from the defaults.  A unit restored from the probe cache has
+	// the settings from its last query, and a firmware update might have
+	// taken the extensions away since then.
+	pdev->supports_sbx_pbx = false;
+	pdev->num_outputs = 32;
+
+	// If byte 11 has bit 0x02 set, the installed firmware
+	// supports the SBX/PBX protocol extensions that we need
+	// to access ports beyond the first 32.
+	if ((rbuf[11] & 0x02) != 0)
+	{
+		// SBX/PBX are supported, so we can access all
+		// output ports.  Note that actual number of ports.
+		pdev->supports_sbx_pbx = true;
+		pdev->num_outputs = rbuf[2] | (rbuf[3] << 8);
+	}
+
+	// add the pinscape unit number to the product name, replacing the
+	// one that a name restored from the probe cache already has
+	char * const oldno = strstr(pdev->device_name, " (Unit ");
+	if (oldno != NULL)
+		*oldno = '\0';
+
+	char unitno[20];
+	_snprintf_s(
+		unitno, sizeof(unitno), _TRUNCATE,
+		" (Unit %d)", int(rbuf[4] + 1));
+	safe_strcat(
+		pdev->device_name,
+		sizeof(pdev->device_name),
+		unitno);
+}
+
+// Does an LWCloneU2 unit's firmware answer the ping?  The firmware sets the
+// HID release number to the BCD form of (version << 8) | feature flags.
+// The reply has to fit in an input report, too.
+static bool lwz_lwcloneu2_pingable(lwz_device_t const *pdev)
+{
+	if (pdev->device_type != LWZ_DEVICE_TYPE_LWCLONEU2 || pdev->input_rpt_len < LWCLONEU2_PING_REPLY_LEN)
+		return false;
+
+	USHORT const bcd = pdev->attrib.VersionNumber;
+	int const rel = ((bcd >> 12) & 0x0F) * 1000 + ((bcd >> 8) & 0x0F) * 100 + ((bcd >> 4) & 0x0F) * 10 + (bcd & 0x0F);
+	return (rel >> 8) >= LWCLONEU2_PING_MIN_VERSION;
+}
+
+// Probe one HID interface to see if it's a device we handle.  'pdev'
+// must have the device interface detail data filled in.  On success,
+// fills in the rest of the device struct, including an open USB handle
+// that the caller takes over, and returns the unit index implied by the
+// product ID.  Returns -1 if it's not one of our devices, or if it
+// couldn't be opened or queried.  '*prejected' tells the two apart: it's
+// set only if the device answered and isn't one of ours (the wrong VID/PID
+// or the wrong interface), which is the only result worth remembering.
+//
+// This opens the device and queries its HID descriptors, and for a
+// Pinscape unit, sends a configuration query and waits for the reply,
+// so it can take a while.  It doesn't touch the global context, so it
+// can be called without holding 'g_cs'.
+static int lwz_probe_device(lwz_device_t *pdev, bool *prejected)
+{
+	SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&pdev->dat[0];
+	int result = -1;
+	*prejected = false;
+
+	// open the file handle to the USB device
+	pdev->hudev = usbdev_create(pdiddat->DevicePath);
+	if (pdev->hudev == NULL)
+		return -1;
+
+	// retrieve the HID attributes
+	HIDD_ATTRIBUTES attrib = {};
+	attrib.Size = sizeof(HIDD_ATTRIBUTES);
+	BOOLEAN bSuccess = HidD_GetAttributes(
+		usbdev_handle(pdev->hudev),
+		&attrib);
+	pdev->attrib = attrib;
+
+	LOG(". Found USB HID device, VID %04X, PID %04X\n", attrib.VendorID, attrib.ProductID);
+	
+	// Check to see if this looks like an LedWiz VID/PID combo.  LedWiz devices
+	// identify as Vendor ID FAFA, Product ID 00F0..00FF.  The low 4 bits of the
+	// product ID is by convention the LedWiz "unit number".  The API uses this
+	// to distinguish multiple units in one system and direct commands to the
+	// desired unit.  The nominal unit number is in the range 1..16, so it's
+	// equivalent to (ProductID & 0x000F) + 1.
+	int indx = (int)attrib.ProductID - (int)ProductID_LEDWiz_min;
+	if (bSuccess && 
+	    (attrib.VendorID == VendorID_LEDWiz || attrib.VendorID == VendorID_Zebs) &&
+	    indx >= 0 && indx < LWZ_MAX_DEVICES)
+	{
+		// It's an LedWiz, according to the VID/PID
+		LOG(".. vendor/product code matches LedWiz, checking HID descriptors\n", indx+1);
+
+		// Before we conclude for sure that it's an LedWiz, though, do some more
+		// checks.  Retrieve the preparsed data for the device.
+		PHIDP_PREPARSED_DATA p_prepdata = NULL;
+		if (HidD_GetPreparsedData(usbdev_handle(pdev->hudev), &p_prepdata) == TRUE)
+		{
+			LOG(".. retrieved preparsed data OK\n");
+
+			// get the HID capabilities struct
+			HIDP_CAPS caps = {};
+			if (HIDP_STATUS_SUCCESS == HidP_GetCaps(p_prepdata, &caps))
+			{
+				LOG(".. retrieved HID capabilities: "
+					" link collection nodes %d, output report length %d\n",
+					caps.NumberLinkCollectionNodes, caps.OutputReportByteLength);
+				
+				// Apply heuristic filters:
+				//
+				// 1. Output report byte length
+				// The LedWiz command interface has an eight byte output report.
+				// Note that the Windows HID drivers always include a one-byte
+				// "report ID" prefix in reports read or written through the
+				// driver.  The LedWiz itself doesn't transmit the prefix byte
+				// because (per USB HID conventions) it's never included by
+				// devices that have only one report type, as is the case for
+				// an LedWiz.  However, the Windows HID drivers normalize this
+				// by including the prefix byte to user programs whether it's
+				// in the physical reports or not.  For consistency, Windows
+				// HID also normalizes the report length seen in the HID caps,
+				// so the byte length we're looking for is 9.
+				//
+				// 2. USB Usage
+				// Test that this is NOT a keyboard interface (USB usage page 
+				// 1, usage 6).  The Pinscape controller presents a keyboard
+				// interface in addition its joystick interface, which looks
+				// to the HID scan like a completely separate device.  We want
+				// to skip that virtual device since it doesn't accept LedWiz 
+				// output reports.  (Note that it would filter out more false
+				// positivies if we "ruled in" specific HID usages rather than
+				// only "ruling out" the keyboard, but that would also be less
+				// flexible at recognizing future product updates from GGG and
+				// future clones and emulators.  In practice, false positives
+				// from random third-party devices don't actually seem to
+				// happen, so on balance it seems much better to err on the
+				// side of filtering in unknown devices that pass our other
+				// tests.)
+				//
+				// 3. Link collection count (REMOVED)
+				// In the past, we also checked the link collection count to
+				// make sure caps.NumberLinkCollectionNodes == 1.  This was a
+				// further ad hoc check that the original LedWiz device and
+				// LWCloneU2 devices both passed, and which the Pinscape device
+				// deliberately passed because it was known that LWCloneU2 did
+				// this test.  However, this test is now too restrictive in 
+				// that a newer real LedWiz product, the LedWiz+GP, fails the
+				// test.  So I'm removing the link collection node test.  That
+				// test was purely speculative anyway: as far as I know, there
+				// are no actual false positives that it filtered out, so it
+				// was just there *in case* something came along that spoofed
+				// an LedWiz as far as all of the other tests go.
+				if (caps.OutputReportByteLength == 9
+					&& !(caps.UsagePage == 1 && caps.Usage == 6)) // USB keyboard = page 1/usage 6
+				{
+					LOG(".. link collection node count, report length, and USB usage match LedWiz\n");
+
+					// presume it's a real LedWiz or some clone/emulation we don't
+					// handle specially
+					pdev->device_type = LWZ_DEVICE_TYPE_LEDWIZ;
+
+					// Remember the input report (device to host) length.  Note that
+					// the length in the caps is normalized to include the synthesized
+					// report ID, so subtract one to get the actual device report size.
+					pdev->input_rpt_len = caps.InputReportByteLength - 1;
+
+					// presume it has the standard LedWiz complement of 32 ports
+					pdev->num_outputs = 32;
+					pdev->supports_sbx_pbx = false;
+
+					// If it's using the zebsboard VID, make sure the manufacturer ID looks right
+					if (attrib.VendorID == VendorID_Zebs)
+					{
+						// get the manufacturer ID string, in lower-case, for further testing
+						wchar_t manustr[256] = { 0 };
+						BOOLEAN const have_manustr = HidD_GetManufacturerString(usbdev_handle(pdev->hudev), manustr, 256);
+						_wcslwr_s(manustr);
+
+						if (!have_manustr)
+						{
+							// we can't tell either way, so skip it for now
+							LOG(".. Device uses VID 0x20A0, but the manufacturer string query failed\n");
+							pdev->device_type = LWZ_DEVICE_TYPE_NONE;
+						}
+						else if (wcsstr(manustr, L"zebsboards") != NULL)
+						{
+							// mark it as a zeb's output control device
+							LOG(".. ZB Output Control detected\n");
+							pdev->device_type = LWZ_DEVICE_TYPE_ZB;
+
+							// this device doesn't need USB delays
+							usbdev_set_min_write_interval(pdev->hudev, 0);
+						}
+						else
+						{
+							// it's not a Zebsboards unit, so it must not be an LedWiz
+							// emulator after all
+							LOG(".. Device uses VID 0x20A0, but manufacturer string doesn't contain 'zebsboards' - rejecting\n");
+							pdev->device_type = LWZ_DEVICE_TYPE_NONE;
+							*prejected = true;
+						}
+					}
+
+					// get the product ID string, so that we can further identify
+					// whether the device is a real LedWiz or one of the specific
+					// types of clones we know about
+					wchar_t prodstr[256];
+					pdev->device_name[0] = '\0';
+					if (HidD_GetProductString(usbdev_handle(pdev->hudev), prodstr, 256))
+					{
+						// save the product string
+						size_t retlen;
+						wcstombs_s(
+							&retlen,
+							pdev->device_name,
+							sizeof(pdev->device_name),
+							prodstr,
+							_TRUNCATE);
+						
+						// check for the special device types
+						if (wcsstr(prodstr, L"Pinscape Controller") != 0)
+						{
+							// It's a Pinscape unit
+							LOG(".. Pinscape Controller identified\n");
+							pdev->device_type = LWZ_DEVICE_TYPE_PINSCAPE;
+
+							// Pinscape doesn't need USB delays
+							usbdev_set_min_write_interval(pdev->hudev, 0);
+
+							// The number of outputs isn't known until we query the
+							// unit's configuration.  That's done for all Pinscape units
+							// at once, after the probe; see lwz_query_units().
+						}
+						else if (wcslen(prodstr) >= 9
+								 && memcmp(prodstr, L"LWCloneU2", 9*sizeof(wchar_t)) == 0)
+						{
+							// It's an LWCloneU2 unit
+							LOG(".. LWCloneU2 identified\n");
+							pdev->device_type = LWZ_DEVICE_TYPE_LWCLONEU2;
+
+							// LWCloneU2 doesn't need USB delays
+							usbdev_set_min_write_interval(pdev->hudev, 0);
+
+							// Newer firmware reports its capabilities in the
+							// ping reply; see lwz_query_units().
+						}
+					}
+
+					// if we decided to keep this device, return its unit index
+					if (pdev->device_type != LWZ_DEVICE_TYPE_NONE)
+						result = indx;
+				}
+				else
+				{
+					// it's another interface of the same device
+					*prejected = true;
+				}
+			}
+
+			HidD_FreePreparsedData(p_prepdata);
+		}
+	}
+	else if (bSuccess)
+	{
+		// it's not an LedWiz VID/PID
+		*prejected = true;
+	}
+
+	// If we're not keeping the device, close the file handle
+	if (result < 0)
+	{
+		usbdev_release(pdev->hudev);
+		pdev->hudev = NULL;
+	}
+
+	return result;
+}
+
+// Move a Pinscape virtual LedWiz interface out of a legacy unit slot,
+// to make room for a real device.  The interface moves to an extended
+// unit, along with its output state, so the ports stay reachable through
+// extended handles.  If there's no room, the interface is dropped.  Must
+// be called with 'g_cs' held.
+static void lwz_relocate_virtual_unit(lwz_context_t *h, int indx, int *new_devices, int *pnum_new_devices)
+{
+	lwz_device_t * const vdev = lwz_dev(h, indx);
+	ps_virtual_lwz_t const ps = vdev->ps_virtual_lwz;
+
+	int const newidx = lwz_alloc_unit(h);
+	if (newidx >= 0)
+	{
+		memcpy(lwz_dev(h, newidx), vdev, sizeof(*vdev));
+		lwz_state_publish(h, newidx);
+		if (*pnum_new_devices < LWZ_MAX_UNITS)
+			new_devices[(*pnum_new_devices)++] = newidx;
+		LOG(".. moved to extended unit %d\n", newidx + 1);
+	}
+
+	lwz_dev(h, ps.base_unit)->ps_virtual_units[ps.block - 1] = newidx;
+
+	// remove the interface from the old slot and notify the user callback
+	vdev->device_type = LWZ_DEVICE_TYPE_NONE;
+	lwz_remove(h, indx);
+}
+
+// Install a newly probed device in the device table, at the unit index
+// implied by its product ID if that's free, otherwise at an extended
+// unit.  On success, the device table takes over the USB handle, and the
+// index is added to the new device list.  Returns the unit index, or -1
+// if the device couldn't be added.  Must be called with 'g_cs' held.
+static int lwz_install_device(lwz_context_t *h, lwz_device_t *pdev, int indx, int *new_devices, int *pnum_new_devices)
+{
+	LOG(".. attempting to add device\n");
+
+	// If this slot contains a Pinscape virtual LedWiz interface,
+	// move the virtual device out so that we can use the slot for
+	// the real device.  Real devices always override virtual ones.
+	if (lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+	{
+		LOG(".. this slot has a Pinscape virtual LedWiz; this real device overrides that\n");
+		lwz_relocate_virtual_unit(h, indx, new_devices, pnum_new_devices);
+	}
+
+	// if this slot is already populated, use an extended unit instead
+	if (lwz_dev(h, indx)->hudev != NULL)
+	{
+		indx = lwz_alloc_unit(h);
+		if (indx < 0)
+		{
+			LOG(".. unit slot already in use, and no extended units left; device not added\n");
+			return -1;
+		}
+
+		LOG(".. unit slot already in use; using extended unit %d\n", indx + 1);
+	}
+
+	// start the background input reader, so that input reports
+	// are consumed as they arrive rather than piling up in the
+	// HID driver's buffer
+	usbdev_start_reader(pdev->hudev, pdev->input_rpt_len);
+
+	// hook up the write pacing and output state shared with other
+	// processes using the same device
+	usbdev_set_share(pdev->hudev, devshare_open(pdev->path_hash));
+
+	// have the USB layer tell us if the handle fails, so that we can
+	// reopen it
+	if (lwz_reconnect_start(h))
+		usbdev_set_failure_event(pdev->hudev, h->reconnect.hkick);
+
+	// copy the temp device struct to the active device list entry
+	memcpy(lwz_dev(h, indx), pdev, sizeof(*pdev));
+	for (int i = 0 ; i < LWZ_PS_MAX_BLOCKS ; ++i)
+		lwz_dev(h, indx)->ps_virtual_units[i] = -1;
+	lwz_publish_input(h, indx, pdev->hudev);
+
+	// the device list entry now owns the file handle, so forget it
+	// in the temp struct
+	pdev->hudev = NULL;
+
+	// add it to our list of new devices found on this search
+	if (*pnum_new_devices < LWZ_MAX_UNITS)
+		new_devices[(*pnum_new_devices)++] = indx;
+
+	LOG(".. device added successfully, %d devices total\n", *pnum_new_devices);
+
+	return indx;
+}
+
+// Set up any needed Pinsape virtual LedWiz interfaces for a newly added
+// device.  For a Pinscape unit with more than 32 outputs, we'll set up
+// one virtual LedWiz object for each block of 32 outputs beyond the
+// first 32.  Each goes at the next unit number after the previous block
+// if that's a free legacy unit, otherwise at an extended unit.  Must be
+// called with 'g_cs' held.
+static void lwz_add_virtual_units(lwz_context_t *h, int newidx, int *new_devices, int *pnum_new_devices)
+{
+	// get the added device
+	lwz_device_t *newdev = lwz_dev(h, newidx);
+
+	// check if it's an LedWiz with more than 32 ports
+	if (newdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE && newdev->num_outputs > 32)
+	{
+		// add a virtual device for each additional block of ports
+		for (int block = 1, portno = 32 ;
+			 block <= LWZ_PS_MAX_BLOCKS && portno < newdev->num_outputs ;
+			 ++block, portno += 32)
+		{
+			// use the consecutive unit number if it's not already
+			// populated with a real device
+			int vidx = newidx + block;
+			if (newidx >= LWZ_MAX_DEVICES || vidx >= LWZ_MAX_DEVICES
+				|| lwz_dev(h, vidx)->device_type != LWZ_DEVICE_TYPE_NONE)
+				vidx = lwz_alloc_unit(h);
+
+			if (vidx < 0)
+				break;
+
+			// set it up as a virtual LedWiz for this block of
+			// ports, referring back to the real Pinscape device
+			lwz_device_t *vdev = lwz_dev(h, vidx);
+			vdev->device_type = LWZ_DEVICE_TYPE_PINSCAPE_VIRT;
+			vdev->ps_virtual_lwz.base_unit = newidx;
+			vdev->ps_virtual_lwz.block = block;
+			newdev->ps_virtual_units[block - 1] = vidx;
+
+			// synthesize a name based on the base unit name
+			_snprintf_s(vdev->device_name, sizeof(vdev->device_name), _TRUNCATE,
+						"%s Ports %d-%d", newdev->device_name, portno+1, portno+32);
+
+			// count this as a new device in the notification list
+			if (*pnum_new_devices < LWZ_MAX_UNITS)
+				new_devices[(*pnum_new_devices)++] = vidx;
+		}
+	}
+}
+
+// Get the list of HID device interfaces currently present.  Allocates an
+// array of device structs with the interface detail data filled in; the
+// caller must free() the array.  Returns the number of entries.
+static int lwz_enum_interfaces(lwz_device_t **ppdevs)
+{
+	*ppdevs = NULL;
+
+	// set up a search on all HID devices
+	HDEVINFO hDevInfo = SetupDiGetClassDevsA(
+		&HIDguid, 
+		NULL, 
+		NULL, 
+		DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+
+	// we can't proceed unless we got the HID list
+	if (hDevInfo == INVALID_HANDLE_VALUE)
+		return 0;
+
+	int ndevs = 0;
+	int nalloc = 0;
+
+	// go through all available devices
+	for (DWORD dwindex = 0 ; ; dwindex++)
+	{
+		// get the next interface in the HID list
+		SP_DEVICE_INTERFACE_DATA didat = {};
+		didat.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
+		BOOL bres = SetupDiEnumDeviceInterfaces(
+			hDevInfo,
+			NULL,
+			&HIDguid,
+			dwindex,
+			&didat);
+
+		// if that failed, we've reached the end of the list
+		if (bres == FALSE)
+			break;
+
+		// make room for the new entry
+		if (ndevs >= nalloc)
+		{
+			int const nalloc_new = (nalloc == 0) ? 32 : nalloc * 2;
+			lwz_device_t * const pnew = (lwz_device_t *)realloc(*ppdevs, nalloc_new * sizeof(lwz_device_t));
+			if (pnew == NULL)
+				break;
+
+			*ppdevs = pnew;
+			nalloc = nalloc_new;
+		}
+
+		// retrieve the device detail
+		lwz_device_t * const pdev = &(*ppdevs)[ndevs];
+		memset(pdev, 0x00, sizeof(*pdev));
+		SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&pdev->dat[0];
+		pdiddat->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
+		bres = SetupDiGetDeviceInterfaceDetailA(
+			hDevInfo,
+			&didat,
+			pdiddat,
+			sizeof(pdev->dat),
+			NULL,
+			NULL);
+
+		// if we couldn't get the device detail, proceed to the next device
+		if (bres == FALSE)
+			continue;
+
+		ndevs += 1;
+	}
+
+	// done with the HID device list
+	SetupDiDestroyDeviceInfoList(hDevInfo);
+
+	return ndevs;
+}
+
+// Hash a device path.  Windows device paths are case-insensitive, and
+// different APIs report them with different capitalization, so the hash
+// ignores case.  This is the 32-bit FNV-1a hash.
+static DWORD lwz_path_hash(const char *path)
+{
+	DWORD hash = 2166136261u;
+	for ( ; *path != '\0' ; ++path)
+	{
+		char c = *path;
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+		hash = (hash ^ (BYTE)c) * 16777619u;
+	}
+
+	return hash;
+}
+
+// get the file system path for a device
+static const char *lwz_device_path(lwz_device_t *pdev)
+{
+	return ((SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&pdev->dat[0])->DevicePath;
+}
+
+// Find a probe cache entry by path.  Must be called with 'g_cs' held.
+static lwz_probe_cache_entry_t *lwz_cache_find(lwz_context_t *h, const char *path, DWORD hash)
+{
+	for (int i = 0 ; i < h->probe_cache.count ; ++i)
+	{
+		lwz_probe_cache_entry_t * const e = &h->probe_cache.entries[i];
+		if (e->path_hash == hash && _stricmp(e->path, path) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+// Record a probe result in the cache.  'indx' is the unit index from the
+// probe, or -1 if the interface was rejected.
+static void lwz_cache_store(lwz_context_t *h, lwz_device_t *pdev, int indx)
+{
+	AUTOLOCK(g_cs);
+
+	const char * const path = lwz_device_path(pdev);
+
+	// paths too long to store just don't get cached
+	if (strlen(path) >= MAX_PATH)
+		return;
+
+	lwz_probe_cache_entry_t *e = lwz_cache_find(h, path, pdev->path_hash);
+	if (e == NULL)
+	{
+		if (h->probe_cache.count >= h->probe_cache.alloc)
+		{
+			int const nalloc = (h->probe_cache.alloc == 0) ? 32 : h->probe_cache.alloc * 2;
+			lwz_probe_cache_entry_t * const pnew = (lwz_probe_cache_entry_t *)realloc(
+				h->probe_cache.entries, nalloc * sizeof(lwz_probe_cache_entry_t));
+			if (pnew == NULL)
+				return;
+
+			h->probe_cache.entries = pnew;
+			h->probe_cache.alloc = nalloc;
+		}
+
+		e = &h->probe_cache.entries[h->probe_cache.count++];
+	}
+
+	memset(e, 0x00, sizeof(*e));
+	e->path_hash = pdev->path_hash;
+	safe_strcpy(e->path, sizeof(e->path), path);
+	e->indx = indx;
+	e->seen = true;
+	h->probe_cache.dirty = true;
+
+	if (indx >= 0)
+	{
+		e->vid = pdev->attrib.VendorID;
+		e->pid = pdev->attrib.ProductID;
+		e->version = pdev->attrib.VersionNumber;
+		e->device_type = pdev->device_type;
+		e->input_rpt_len = pdev->input_rpt_len;
+		e->num_outputs = pdev->num_outputs;
+		e->supports_sbx_pbx = pdev->supports_sbx_pbx;
+		e->lwcloneu2_caps = pdev->lwcloneu2_caps;
+		safe_strcpy(e->device_name, sizeof(e->device_name), pdev->device_name);
+	}
+}
+
+// Drop the probe cache entry for a path, if any.  Must be called with
+// 'g_cs' held.
+static void lwz_cache_forget(lwz_context_t *h, const char *path)
+{
+	lwz_probe_cache_entry_t * const e = lwz_cache_find(h, path, lwz_path_hash(path));
+	if (e != NULL)
+	{
+		*e = h->probe_cache.entries[--h->probe_cache.count];
+		h->probe_cache.dirty = true;
+	}
+}
+
+// Drop cache entries for interfaces that weren't present on the pass
+// that just finished, and reset the 'seen' flags for the next pass.
+static void lwz_cache_prune(lwz_context_t *h)
+{
+	AUTOLOCK(g_cs);
+
+	for (int i = 0 ; i < h->probe_cache.count ; )
+	{
+		lwz_probe_cache_entry_t * const e = &h->probe_cache.entries[i];
+		if (!e->seen)
+		{
+			*e = h->probe_cache.entries[--h->probe_cache.count];
+			h->probe_cache.dirty = true;
+			continue;
+		}
+
+		e->seen = false;
+		++i;
+	}
+}
+
+// get the probe cache file name; returns false if there's no usable location
+static bool lwz_cache_file_path(char *buf, DWORD buflen)
+{
+	DWORD const len = GetTempPathA(buflen, buf);
+	if (len == 0 || len + sizeof(LWZ_PROBE_FILE_NAME) > buflen)
+		return false;
+
+	safe_strcat(buf, buflen, LWZ_PROBE_FILE_NAME);
+	return true;
+}
+
+// hash a block of bytes, for the cache file checksum (32-bit FNV-1a)
+static DWORD lwz_cache_checksum(BYTE const *p, size_t len)
+{
+	DWORD hash = 2166136261u;
+	for (size_t i = 0 ; i < len ; ++i)
+		hash = (hash ^ p[i]) * 16777619u;
+
+	return hash;
+}
+
+// Load the probe cache from the cache file.  The file is mapped rather
+// than read, since we only need one pass over it to copy out the records.
+// The records are only installed if the cache is still empty; otherwise
+// a search has already started filling it in, and the file adds nothing.
+// Returns the number of entries loaded.
+static int lwz_cache_load(lwz_context_t *h)
+{
+	char fname[MAX_PATH];
+	if (!lwz_cache_file_path(fname, sizeof(fname)))
+		return 0;
+
+	HANDLE hfile = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hfile == INVALID_HANDLE_VALUE)
+		return 0;
+
+	int nloaded = 0;
+	lwz_probe_cache_entry_t *entries = NULL;
+	HANDLE hmap = NULL;
+	BYTE const *pview = NULL;
+	lwz_probe_file_header_t const *hdr;
+	lwz_probe_file_record_t const *rec;
+
+	DWORD const fsize = GetFileSize(hfile, NULL);
+	if (fsize == INVALID_FILE_SIZE || fsize < sizeof(lwz_probe_file_header_t))
+		goto Done;
+
+	hmap = CreateFileMappingA(hfile, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (hmap == NULL)
+		goto Done;
+
+	pview = (BYTE const *)MapViewOfFile(hmap, FILE_MAP_READ, 0, 0, 0);
+	if (pview == NULL)
+		goto Done;
+
+	// check the header and the record checksum
+	hdr = (lwz_probe_file_header_t const *)pview;
+	rec = (lwz_probe_file_record_t const *)(hdr + 1);
+	if (hdr->magic != LWZ_PROBE_FILE_MAGIC
+		|| hdr->version != LWZ_PROBE_FILE_VERSION
+		|| hdr->record_size != sizeof(lwz_probe_file_record_t)
+		|| hdr->count > LWZ_PROBE_FILE_MAX_RECORDS
+		|| fsize != sizeof(*hdr) + hdr->count * sizeof(lwz_probe_file_record_t)
+		|| hdr->checksum != lwz_cache_checksum((BYTE const *)rec, hdr->count * sizeof(lwz_probe_file_record_t)))
+	{
+		LOG("Probe cache file %s is invalid - ignoring it\n", fname);
+		goto Done;
+	}
+
+	if (hdr->count == 0)
+		goto Done;
+
+	entries = (lwz_probe_cache_entry_t *)malloc(hdr->count * sizeof(lwz_probe_cache_entry_t));
+	if (entries == NULL)
+		goto Done;
+
+	for (DWORD i = 0 ; i < hdr->count ; ++i, ++rec)
+	{
+		// skip anything malformed
+		if (memchr(rec->path, '\0', sizeof(rec->path)) == NULL
+			|| memchr(rec->device_name, '\0', sizeof(rec->device_name)) == NULL
+			|| rec->indx >= LWZ_MAX_DEVICES)
+			continue;
+
+		lwz_probe_cache_entry_t * const e = &entries[nloaded++];
+		memset(e, 0x00, sizeof(*e));
+		safe_strcpy(e->path, sizeof(e->path), rec->path);
+		e->path_hash = lwz_path_hash(e->path);
+		e->indx = rec->indx < 0 ? -1 : rec->indx;
+		e->device_type = rec->device_type;
+		e->input_rpt_len = rec->input_rpt_len;
+		e->num_outputs = rec->num_outputs;
+		e->supports_sbx_pbx = rec->supports_sbx_pbx;
+		e->lwcloneu2_caps = (BYTE)rec->lwcloneu2_caps;
+		safe_strcpy(e->device_name, sizeof(e->device_name), rec->device_name);
+		e->vid = rec->vid;
+		e->pid = rec->pid;
+		e->version = rec->version;
+		e->validate = true;
+	}
+
+	{
+		AUTOLOCK(g_cs);
+
+		if (h->probe_cache.count == 0)
+		{
+			free(h->probe_cache.entries);
+			h->probe_cache.entries = entries;
+			h->probe_cache.count = nloaded;
+			h->probe_cache.alloc = hdr->count;
+			entries = NULL;
+		}
+		else
+		{
+			nloaded = 0;
+		}
+	}
+
+	LOG("Loaded %d probe results from %s\n", nloaded, fname);
+
+Done:
+	free(entries);
+	if (pview != NULL)
+		UnmapViewOfFile(pview);
+	if (hmap != NULL)
+		CloseHandle(hmap);
+	CloseHandle(hfile);
+
+	return nloaded;
+}
+
+// Load the cache file before the first search.  This isn't done when the
+// DLL is loaded, since DllMain runs under the loader lock, where file I/O
+// can deadlock.  The cold start time runs from here.
+static void lwz_cache_load_once(lwz_context_t *h)
+{
+	{
+		AUTOLOCK(g_cs);
+
+		if (h->probe_cache.loaded)
+			return;
+
+		h->probe_cache.loaded = true;
+	}
+
+	LONGLONG const t0 = lwz_qpc_now();
+	int const nloaded = lwz_cache_load(h);
+
+	AUTOLOCK(g_cs);
+
+	h->cold_start_t0 = t0;
+	h->discovery_stats.dwFileEntries = nloaded;
+	h->discovery_stats.dwFileLoadUs = lwz_qpc_elapsed_us(t0);
+}
+
+// Save the probe cache to the cache file, if it has changed.  Other
+// processes using the DLL might be reading or writing the file at the
+// same time, so we write a private temporary file and move it into
+// place, which replaces the old file in one step.  The last process to
+// save wins, which is fine, since they all see the same devices.
+static void lwz_cache_save(lwz_context_t *h)
+{
+	char fname[MAX_PATH], tmpname[MAX_PATH + 16];
+	if (!lwz_cache_file_path(fname, sizeof(fname)))
+		return;
+
+	// build the file image under the lock
+	BYTE *buf;
+	DWORD buflen;
+	{
+		AUTOLOCK(g_cs);
+
+		if (!h->probe_cache.dirty)
+			return;
+
+		DWORD const count = (h->probe_cache.count > LWZ_PROBE_FILE_MAX_RECORDS) ?
+			LWZ_PROBE_FILE_MAX_RECORDS : h->probe_cache.count;
+		buflen = sizeof(lwz_probe_file_header_t) + count * sizeof(lwz_probe_file_record_t);
+		if ((buf = (BYTE *)malloc(buflen)) == NULL)
+			return;
+
+		memset(buf, 0x00, buflen);
+		lwz_probe_file_header_t * const hdr = (lwz_probe_file_header_t *)buf;
+		lwz_probe_file_record_t * const recs = (lwz_probe_file_record_t *)(hdr + 1);
+		for (DWORD i = 0 ; i < count ; ++i)
+		{
+			lwz_probe_cache_entry_t const * const e = &h->probe_cache.entries[i];
+			lwz_probe_file_record_t * const rec = &recs[i];
+			safe_strcpy(rec->path, sizeof(rec->path), e->path);
+			safe_strcpy(rec->device_name, sizeof(rec->device_name), e->device_name);
+			rec->indx = e->indx;
+			rec->device_type = e->device_type;
+			rec->input_rpt_len = e->input_rpt_len;
+			rec->num_outputs = e->num_outputs;
+			rec->supports_sbx_pbx = e->supports_sbx_pbx;
+			rec->lwcloneu2_caps = e->lwcloneu2_caps;
+			rec->vid = e->vid;
+			rec->pid = e->pid;
+			rec->version = e->version;
+		}
+
+		hdr->magic = LWZ_PROBE_FILE_MAGIC;
+		hdr->version = LWZ_PROBE_FILE_VERSION;
+		hdr->record_size = sizeof(lwz_probe_file_record_t);
+		hdr->count = count;
+		hdr->checksum = lwz_cache_checksum((BYTE const *)recs, count * sizeof(lwz_probe_file_record_t));
+
+		h->probe_cache.dirty = false;
+	}
+
+	// write it out
+	_snprintf_s(tmpname, sizeof(tmpname), _TRUNCATE, "%s.%lu", fname, GetCurrentProcessId());
+	HANDLE hfile = CreateFileA(tmpname, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hfile != INVALID_HANDLE_VALUE)
+	{
+		DWORD actual = 0;
+		BOOL const ok = WriteFile(hfile, buf, buflen, &actual, NULL) && actual == buflen;
+		CloseHandle(hfile);
+
+		if (!ok || !MoveFileExA(tmpname, fname, MOVEFILE_REPLACE_EXISTING))
+		{
+			LOG("Unable to save the probe cache to %s\n", fname);
+			DeleteFileA(tmpname);
+		}
+	}
+
+	free(buf);
+}
+
+// Probe an interface, using the probe cache when possible.  Returns the
+// unit index, or -1 if the interface should be skipped: rejected before,
+// already open as one of our devices, or rejected by a new probe.
+//
+// A newly probed Pinscape unit still needs its configuration query, and
+// a newly probed LWCloneU2 unit its capability query, so it's not cached
+// yet; '*pquery' is set to tell the caller to run the query (see
+// lwz_query_units).
+static int lwz_probe_cached(lwz_context_t *h, lwz_device_t *pdev, lwz_pass_stats_t *stats, bool *pquery)
+{
+	*pquery = false;
+
+	const char * const path = lwz_device_path(pdev);
+	pdev->path_hash = lwz_path_hash(path);
+	stats->interfaces += 1;
+
+	lwz_probe_cache_entry_t cached;
+	bool have_cached = false;
+
+	{
+		AUTOLOCK(g_cs);
+
+		// if we already have this interface open, there's nothing to do
+		for (int i = 0 ; i < h->num_units ; ++i)
+		{
+			lwz_device_t * const dev = lwz_dev(h, i);
+			if (dev->hudev != NULL
+				&& dev->path_hash == pdev->path_hash
+				&& _stricmp(lwz_device_path(dev), path) == 0)
+			{
+				lwz_probe_cache_entry_t * const e = lwz_cache_find(h, path, pdev->path_hash);
+				if (e != NULL)
+					e->seen = true;
+
+				stats->cached += 1;
+				return -1;
+			}
+		}
+
+		lwz_probe_cache_entry_t * const e = lwz_cache_find(h, path, pdev->path_hash);
+		if (e != NULL)
+		{
+			e->seen = true;
+			stats->cached += 1;
+
+			// if we rejected it before, skip it without opening it
+			if (e->indx < 0)
+				return -1;
+
+			cached = *e;
+			have_cached = true;
+		}
+	}
+
+	if (have_cached)
+	{
+		// we accepted it before - just open it and fill in the saved details
+		pdev->hudev = usbdev_create(path);
+
+		// If the result came from the cache file, make sure it's still the
+		// same device before trusting it.  The VID and PID are part of the
+		// path, but the version changes with a firmware update, which can
+		// change the device's capabilities.
+		if (pdev->hudev != NULL && cached.validate)
+		{
+			HIDD_ATTRIBUTES attrib = {};
+			attrib.Size = sizeof(HIDD_ATTRIBUTES);
+			if (!HidD_GetAttributes(usbdev_handle(pdev->hudev), &attrib)
+				|| attrib.VendorID != cached.vid
+				|| attrib.ProductID != cached.pid
+				|| attrib.VersionNumber != cached.version)
+			{
+				LOG(". cached probe result for %s is stale\n", path);
+				usbdev_release(pdev->hudev);
+				pdev->hudev = NULL;
+			}
+			else
+			{
+				pdev->attrib = attrib;
+
+				AUTOLOCK(g_cs);
+				lwz_probe_cache_entry_t * const e = lwz_cache_find(h, path, pdev->path_hash);
+				if (e != NULL)
+					e->validate = false;
+			}
+		}
+
+		if (pdev->hudev != NULL)
+		{
+			pdev->attrib.Size = sizeof(HIDD_ATTRIBUTES);
+			pdev->attrib.VendorID = cached.vid;
+			pdev->attrib.ProductID = cached.pid;
+			pdev->attrib.VersionNumber = cached.version;
+			pdev->device_type = cached.device_type;
+			pdev->input_rpt_len = cached.input_rpt_len;
+			pdev->num_outputs = cached.num_outputs;
+			pdev->supports_sbx_pbx = cached.supports_sbx_pbx;
+			pdev->lwcloneu2_caps = cached.lwcloneu2_caps;
+			safe_strcpy(pdev->device_name, sizeof(pdev->device_name), cached.device_name);
+
+			// only real LedWiz units need the USB write pacing
+			if (pdev->device_type != LWZ_DEVICE_TYPE_LEDWIZ)
+				usbdev_set_min_write_interval(pdev->hudev, 0);
+
+			// a Pinscape unit's configuration can change without anything
+			// we can see in the HID attributes, so query it again; the
+			// cached settings stand if it doesn't answer
+			if (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE)
+				*pquery = true;
+
+			return cached.indx;
+		}
+
+		// it wouldn't open or didn't validate, so the cached result is
+		// stale; probe it again
+		stats->cached -= 1;
+	}
+
+	// Do the full probe, without holding the lock, and remember the
+	// result.  A device that failed to open or answer might just be busy
+	// or still starting up, so only cache a definite answer, and try
+	// again on the next search otherwise.
+	bool rejected;
+	int const indx = lwz_probe_device(pdev, &rejected);
+	stats->probed += 1;
+
+	if (indx >= 0 && (pdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE || lwz_lwcloneu2_pingable(pdev)))
+		*pquery = true;
+	else if (indx >= 0 || rejected)
+		lwz_cache_store(h, pdev, indx);
+
+	return indx;
+}
+
+// Device query state for one unit
+typedef struct {
+	lwz_device_t *pdev;			// device being probed
+	int indx;					// unit index from the probe
+	DWORD rnum;					// next input report to examine
+	bool done;					// reply received, or given up
+} lwz_unit_query_t;
+
+// query completion callback; 'answered' is false if the unit didn't reply in time
+typedef void (*LWZ_UNIT_QUERY_DONE)(lwz_context_t *h, lwz_unit_query_t *q, bool answered, void *ctx);
+
+// LWCloneU2 ping sequence number for the capability query; any value
+// does, since each unit gets its own request
+#define LWZ_CAPS_PING_SEQ   0x5A
+
+// Query a set of newly probed units.  A Pinscape unit gets the QUERY
+// CONFIGURATION request (65 4), to find out how many outputs it has, and
+// answers with a CONFIGURATION REPORT (00 88 ...).  An LWCloneU2 unit
+// gets a ping (69 s0 s1 s2 s3 FF FF ~s0), and the reply (69 s0 s1 s2 s3
+// ...) ends with its capability bits.  The requests go out to all units
+// at once, and then we watch all of their input streams for the replies
+// until one overall deadline.  Pinscape units stream joystick reports
+// continuously, so the reply is usually mixed in with those; we start
+// with the first report that arrived after each request, which skips
+// anything that was already buffered.  A unit that doesn't reply in time
+// keeps the default 32 outputs, or no LWCloneU2 capabilities, without
+// holding up the others.
+//
+// 'done' is invoked for each unit as soon as it's resolved, and the
+// answered units' probe results go into the cache.  If 'habort' is
+// signaled, we give up immediately without invoking any more callbacks.
+static void lwz_query_units(lwz_context_t *h, lwz_unit_query_t *q, int nq,
+	LWZ_UNIT_QUERY_DONE done, void *ctx, HANDLE habort)
+{
+	if (nq <= 0)
+		return;
+
+	// send the request to every unit
+	for (int i = 0 ; i < nq ; ++i)
+	{
+		lwz_device_t * const pdev = q[i].pdev;
+		char qbuf[8] = { 65, 4, 0, 0, 0, 0, 0, 0 };
+		if (pdev->device_type == LWZ_DEVICE_TYPE_LWCLONEU2)
+		{
+			char const ping[8] = { LWCLONEU2_CMD_PING, LWZ_CAPS_PING_SEQ, 0, 0, 0, (char)0xFF, (char)0xFF, (char)~LWZ_CAPS_PING_SEQ };
+			memcpy(qbuf, ping, 8);
+		}
+
+		usbdev_start_reader(pdev->hudev, pdev->input_rpt_len);
+		q[i].rnum = usbdev_input_count(pdev->hudev);
+		q[i].done = false;
+		usbdev_write(pdev->hudev, qbuf, 8);
+	}
+
+	DWORD const t0 = GetTickCount();
+	int npending = nq;
+
+	for (;;)
+	{
+		// check each unit still pending for new reports
+		for (int i = 0 ; i < nq ; ++i)
+		{
+			if (q[i].done)
+				continue;
+
+			lwz_device_t * const pdev = q[i].pdev;
+			BYTE rbuf[64];
+			while (usbdev_read_next(pdev->hudev, &q[i].rnum, rbuf, pdev->input_rpt_len, 0) > 0)
+			{
+				bool answered = false;
+				if (pdev->device_type == LWZ_DEVICE_TYPE_LWCLONEU2)
+				{
+					// it's the ping reply if it echoes our sequence number
+					if (rbuf[0] == LWCLONEU2_CMD_PING && rbuf[1] == LWZ_CAPS_PING_SEQ
+						&& rbuf[2] == 0 && rbuf[3] == 0 && rbuf[4] == 0)
+					{
+						pdev->lwcloneu2_caps = rbuf[LWCLONEU2_PING_REPLY_LEN - 1];
+						answered = true;
+					}
+				}
+				else if (rbuf[0] == 0x00 && rbuf[1] == 0x88)
+				{
+					// it's the configuration report
+					lwz_apply_pinscape_config(pdev, rbuf);
+					answered = true;
+				}
+
+				if (answered)
+				{
+					lwz_cache_store(h, pdev, q[i].indx);
+
+					q[i].done = true;
+					npending -= 1;
+
+					if (done != NULL)
+						done(h, &q[i], true, ctx);
+
+					break;
+				}
+			}
+		}
+
+		if (npending == 0)
+			return;
+
+		// stop at the deadline
+		DWORD const dt = GetTickCount() - t0;
+		if (dt >= PINSCAPE_CONFIG_QUERY_TIMEOUT_MS)
+			break;
+
+		// wait for a report from any unit still pending
+		HANDLE hwait[MAXIMUM_WAIT_OBJECTS];
+		DWORD nwait = 0;
+		if (habort != NULL)
+			hwait[nwait++] = habort;
+
+		for (int i = 0 ; i < nq && nwait < MAXIMUM_WAIT_OBJECTS ; ++i)
+		{
+			if (!q[i].done)
+				hwait[nwait++] = usbdev_input_event(q[i].pdev->hudev);
+		}
+
+		DWORD const res = WaitForMultipleObjects(nwait, hwait, FALSE, PINSCAPE_CONFIG_QUERY_TIMEOUT_MS - dt);
+		if (habort != NULL && res == WAIT_OBJECT_0)
+			return;
+	}
+
+	// the rest of the units didn't answer - they keep the default 32
+	// outputs, or their cached configuration
+	for (int i = 0 ; i < nq ; ++i)
+	{
+		if (!q[i].done)
+		{
+			if (q[i].pdev->device_type == LWZ_DEVICE_TYPE_LWCLONEU2)
+				LOG(".. LWCloneU2 unit didn't answer the ping; assuming no extended commands\n");
+			else
+				LOG(".. Pinscape unit didn't answer the configuration query; assuming %d outputs\n", q[i].pdev->num_outputs);
+			q[i].done = true;
+
+			if (done != NULL)
+				done(h, &q[i], false, ctx);
+		}
+	}
+}
+
+// get a timestamp for the pass statistics
+static LONGLONG lwz_qpc_now()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+// microseconds elapsed since a lwz_qpc_now() time
+static DWORD lwz_qpc_elapsed_us(LONGLONG t0)
+{
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	return (DWORD)((lwz_qpc_now() - t0) * 1000000 / freq.QuadPart);
+}
+
+// finish a discovery pass: prune and save the cache, and record the statistics
+static void lwz_pass_finish(lwz_context_t *h, lwz_pass_stats_t *stats)
+{
+	lwz_cache_prune(h);
+	lwz_cache_save(h);
+
+	DWORD const us = lwz_qpc_elapsed_us(stats->t0);
+
+	AUTOLOCK(g_cs);
+
+	LWZDISCOVERYSTATS * const ds = &h->discovery_stats;
+	if (ds->dwPasses == 0)
+	{
+		ds->dwColdStartUs = lwz_qpc_elapsed_us(h->cold_start_t0);
+		LOG("Cold start: %d cached probe results loaded in %d us, first search done after %d us\n",
+			ds->dwFileEntries, ds->dwFileLoadUs, ds->dwColdStartUs);
+	}
+
+	ds->cbSize = sizeof(*ds);
+	ds->dwPasses += 1;
+	ds->dwInterfaces = stats->interfaces;
+	ds->dwProbed = stats->probed;
+	ds->dwCached = stats->cached;
+	ds->dwAdded = stats->added;
+	ds->dwLastPassUs = us;
+
+	LOG("Discovery pass %d: %d interfaces, %d probed, %d cached, %d added, %d.%03d ms\n",
+		ds->dwPasses, stats->interfaces, stats->probed, stats->cached, stats->added, us / 1000, us % 1000);
+}
+
+static void lwz_refreshlist_attached(lwz_context_t *h)
+{
+	LOG("Refreshing attached device list\n");
+
+	lwz_pass_stats_t stats = {};
+	stats.t0 = lwz_qpc_now();
+	lwz_cache_load_once(h);
+
+	// no new devices found yet
+	int num_new_devices = 0;
+	int new_devices[LWZ_MAX_UNITS];
+
+	// get the current HID interfaces
+	lwz_device_t *pdevs = NULL;
+	int const ndevs = lwz_enum_interfaces(&pdevs);
+	int * const indices = (int *)malloc((ndevs + 1) * sizeof(int));
+	lwz_unit_query_t * const queries = (lwz_unit_query_t *)malloc((ndevs + 1) * sizeof(lwz_unit_query_t));
+	int nqueries = 0;
+
+	if (indices == NULL || queries == NULL)
+	{
+		free(indices);
+		free(queries);
+		free(pdevs);
+		return;
+	}
+
+	// go through all available devices and look for the proper VID/PID
+	for (int i = 0 ; i < ndevs ; ++i)
+	{
+		bool query;
+		indices[i] = lwz_probe_cached(h, &pdevs[i], &stats, &query);
+		if (query)
+		{
+			queries[nqueries].pdev = &pdevs[i];
+			queries[nqueries].indx = indices[i];
+			nqueries += 1;
+		}
+	}
+
+	// query all of the new Pinscape and LWCloneU2 units at once
+	lwz_query_units(h, queries, nqueries, NULL, NULL, NULL);
+
+	// add the devices, in enumeration order
+	for (int i = 0 ; i < ndevs ; ++i)
+	{
+		int const indx = indices[i];
+		if (indx >= 0)
+		{
+			// If the temp struct still has a valid file handle after the
+			// install attempt, the device wasn't added, so close it.
+			lwz_install_device(h, &pdevs[i], indx, new_devices, &num_new_devices);
+			if (pdevs[i].hudev != NULL)
+			{
+				usbdev_release(pdevs[i].hudev);
+				pdevs[i].hudev = NULL;
+			}
+		}
+	}
+
+	free(indices);
+	free(queries);
+	free(pdevs);
+
+	// Set up any needed Pinsape virtual LedWiz interfaces.  Do this after
+	// adding all of the real devices, since a real device always takes
+	// precedence over a virtual unit at the same unit number.
+	for (int i = 0, n = num_new_devices ; i < n ; ++i)
+		lwz_add_virtual_units(h, new_devices[i], new_devices, &num_new_devices);
+
+	stats.added = num_new_devices;
+	lwz_pass_finish(h, &stats);
+
+	// add all of the newly found devices
+	lwz_add(h, num_new_devices, new_devices);
+}
+
+// Install a device found by a background pass and announce it right away
+static void lwz_discovery_install(lwz_context_t *h, lwz_device_t *pdev, int indx, lwz_pass_stats_t *stats)
+{
+	{
+		AUTOLOCK(g_cs);
+
+		// install the device and any virtual units, and announce them
+		int num_new_devices = 0;
+		int new_devices[LWZ_MAX_UNITS];
+		int const newidx = lwz_install_device(h, pdev, indx, new_devices, &num_new_devices);
+		if (newidx >= 0)
+			lwz_add_virtual_units(h, newidx, new_devices, &num_new_devices);
+
+		lwz_add(h, num_new_devices, new_devices);
+		stats->added += num_new_devices;
+	}
+
+	// if the device wasn't added, close our handle
+	if (pdev->hudev != NULL)
+	{
+		usbdev_release(pdev->hudev);
+		pdev->hudev = NULL;
+	}
+}
+
+// Unit query completion for a background pass
+static void lwz_discovery_query_done(lwz_context_t *h, lwz_unit_query_t *q, bool answered, void *ctx)
+{
+	lwz_discovery_install(h, q->pdev, q->indx, (lwz_pass_stats_t *)ctx);
+}
+
+// Background discovery.  In LWZ_DISCOVERY_ASYNC mode, the slow part of
+// the device search - opening each HID interface, querying descriptors,
+// waiting for Pinscape configuration reports and LWCloneU2 ping replies -
+// runs on this thread without holding 'g_cs', so it doesn't hold up the
+// caller or any lighting traffic.  Each device is installed and announced
+// through the notify callback as soon as it's confirmed: most devices
+// right after their probe, and queried units as their replies arrive.
+static void lwz_discovery_pass(lwz_context_t *h)
+{
+	LOG("Background discovery pass\n");
+
+	lwz_pass_stats_t stats = {};
+	stats.t0 = lwz_qpc_now();
+	lwz_cache_load_once(h);
+
+	lwz_device_t *pdevs = NULL;
+	int const ndevs = lwz_enum_interfaces(&pdevs);
+	lwz_unit_query_t * const queries = (lwz_unit_query_t *)malloc((ndevs + 1) * sizeof(lwz_unit_query_t));
+	int nqueries = 0;
+
+	if (queries == NULL)
+	{
+		free(pdevs);
+		return;
+	}
+
+	for (int i = 0 ; i < ndevs ; ++i)
+	{
+		// stop early if the DLL is unloading
+		if (WaitForSingleObject(h->discovery.hquit, 0) == WAIT_OBJECT_0)
+			break;
+
+		bool query;
+		int const indx = lwz_probe_cached(h, &pdevs[i], &stats, &query);
+		if (query)
+		{
+			// a new Pinscape or LWCloneU2 unit - hold it for its query
+			queries[nqueries].pdev = &pdevs[i];
+			queries[nqueries].indx = indx;
+			nqueries += 1;
+		}
+		else if (indx >= 0)
+		{
+			lwz_discovery_install(h, &pdevs[i], indx, &stats);
+		}
+	}
+
+	// query the new units, installing each one as it answers
+	lwz_query_units(h, queries, nqueries, lwz_discovery_query_done, &stats, h->discovery.hquit);
+
+	// close anything left over if we stopped early
+	for (int i = 0 ; i < ndevs ; ++i)
+	{
+		if (pdevs[i].hudev != NULL)
+		{
+			usbdev_release(pdevs[i].hudev);
+			pdevs[i].hudev = NULL;
+		}
+	}
+
+	free(queries);
+	free(pdevs);
+
+	// only prune the cache after a complete pass
+	if (WaitForSingleObject(h->discovery.hquit, 0) != WAIT_OBJECT_0)
+		lwz_pass_finish(h, &stats);
+}
+
+static DWORD WINAPI DiscoveryThreadProc(LPVOID lpParameter)
+{
+	lwz_context_t * const h = (lwz_context_t*)lpParameter;
+	HANDLE const hwait[2] = { h->discovery.hquit, h->discovery.hkick };
+
+	// run a pass each time we're kicked, until we're told to quit
+	while (WaitForMultipleObjects(2, hwait, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+		lwz_discovery_pass(h);
+
+	SetEvent(h->discovery.hdone);
+
+	return 0;
+}
+
+// Request a background discovery pass, starting the discovery thread if
+// it's not already running.  Requests made while a pass is in progress
+// are merged into one more pass after it finishes.  Must be called with
+// 'g_cs' held.
+static bool lwz_discovery_kick(lwz_context_t *h)
+{
+	if (h->discovery.hthread == NULL)
+	{
+		if (h->discovery.hkick == NULL)
+		{
+			h->discovery.hkick = CreateEvent(NULL, FALSE, FALSE, NULL);
+			h->discovery.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+			h->discovery.hdone = CreateEvent(NULL, TRUE, FALSE, NULL);
+		}
+
+		if (h->discovery.hkick == NULL ||
+			h->discovery.hquit == NULL ||
+			h->discovery.hdone == NULL)
+		{
+			return false;
+		}
+
+		h->discovery.hthread = CreateThread(NULL, 0, DiscoveryThreadProc, (void*)h, 0, NULL);
+		if (h->discovery.hthread == NULL)
+			return false;
+	}
+
+	SetEvent(h->discovery.hkick);
+	return true;
+}
+
+// Stop the discovery thread.  This must be called WITHOUT 'g_cs' held,
+// since the thread might be waiting for it to install a device.
+static void lwz_discovery_stop(lwz_context_t *h)
+{
+	if (h == NULL)
+		return;
+
+	if (h->discovery.hthread != NULL)
+	{
+		// as with the I/O queue thread, sync with the 'done' event rather
+		// than the thread handle, since we might be in the DLL unload
+		SetEvent(h->discovery.hquit);
+		WaitForSingleObject(h->discovery.hdone, INFINITE);
+		CloseHandle(h->discovery.hthread);
+		h->discovery.hthread = NULL;
+	}
+
+	if (h->discovery.hkick != NULL)
+	{
+		CloseHandle(h->discovery.hkick);
+		h->discovery.hkick = NULL;
+	}
+
+	if (h->discovery.hquit != NULL)
+	{
+		CloseHandle(h->discovery.hquit);
+		h->discovery.hquit = NULL;
+	}
+
+	if (h->discovery.hdone != NULL)
+	{
+		CloseHandle(h->discovery.hdone);
+		h->discovery.hdone = NULL;
+	}
+}
+
+// Send a reconnected unit's output state again.  The device lost its
+// state when it dropped off the bus, so everything the client set goes
+// out in full, including on the unit's Pinscape virtual units.  Running
+// effects repaint themselves on their next tick.  Must be called with
+// 'g_cs' held.
+static void lwz_reconnect_replay(lwz_context_t *h, int indx)
+{
+	lwz_device_t * const dev = lwz_dev(h, indx);
+
+	// send right away, even in the staged flush modes
+	bool const flushing = h->flush.flushing;
+	h->flush.flushing = true;
+
+	for (int block = -1 ; block < LWZ_PS_MAX_BLOCKS ; ++block)
+	{
+		int const unit = (block < 0) ? indx : dev->ps_virtual_units[block];
+		if (unit < 0 || (block >= 0 && dev->device_type != LWZ_DEVICE_TYPE_PINSCAPE))
+			continue;
+
+		lwz_device_t * const udev = lwz_dev(h, unit);
+		udev->shadow.sba_sent_valid = false;
+		udev->shadow.pba_sent_valid = false;
+
+		if (udev->shadow.pba_known)
+			lwz_send_pba(h, unit, false);
+		if (udev->shadow.sba_known)
+			lwz_send_sba(h, unit);
+		else
+			lwz_state_publish(h, unit);
+	}
+
+	h->flush.flushing = flushing;
+}
+
+// Reopen the devices whose handles have failed and are due for another
+// attempt, and replay their output state.  The devices are reopened
+// without 'g_cs' held, since opening a device can take a while.  Returns
+// the time until the next attempt is due, or INFINITE if no devices are
+// left to reopen.
+static DWORD lwz_reconnect_pass(lwz_context_t *h)
+{
+	typedef struct {
+		int indx;
+		HUDEV hudev;
+		DWORD fail_ticks;
+	} failed_t;
+
+	failed_t *failed = NULL;
+	int nfailed = 0;
+	{
+		AUTOLOCK(g_cs);
+
+		for (int i = 0 ; i < h->num_units ; ++i)
+		{
+			HUDEV const hudev = lwz_dev(h, i)->hudev;
+			DWORD fail_ticks;
+			if (hudev == NULL || !usbdev_failed(hudev, &fail_ticks))
+				continue;
+
+			if (failed == NULL && (failed = (failed_t *)malloc(h->num_units * sizeof(failed_t))) == NULL)
+				return LWZ_RECONNECT_RETRY_MS;
+
+			// hold a reference, in case the device is removed while we're
+			// working on it
+			usbdev_addref(hudev);
+			failed[nfailed].indx = i;
+			failed[nfailed].hudev = hudev;
+			failed[nfailed].fail_ticks = fail_ticks;
+			nfailed += 1;
+		}
+	}
+
+	DWORD next = INFINITE;
+	for (int i = 0 ; i < nfailed ; ++i)
+	{
+		DWORD const wait = usbdev_reopen_wait(failed[i].hudev);
+		if (wait != 0)
+		{
+			// it's not due yet
+			if (wait < next)
+				next = wait;
+		}
+		else if (usbdev_reopen(failed[i].hudev))
+		{
+			AUTOLOCK(g_cs);
+
+			// make sure it's still the same device
+			int const indx = failed[i].indx;
+			if (lwz_dev(h, indx)->hudev == failed[i].hudev)
+			{
+				DWORD const ms = GetTickCount() - failed[i].fail_ticks;
+				LOG("Unit %d reconnected, %u ms after the first write failure\n", indx + 1, ms);
+
+				LWZDISCOVERYSTATS * const ds = &h->discovery_stats;
+				ds->dwReconnects += 1;
+				ds->dwLastReconnectMs = ms;
+				if (ms > ds->dwMaxReconnectMs)
+					ds->dwMaxReconnectMs = ms;
+
+				lwz_reconnect_replay(h, indx);
+			}
+		}
+		else
+		{
+			DWORD const retry = usbdev_reopen_wait(failed[i].hudev);
+			if (retry < next)
+				next = retry;
+		}
+
+		usbdev_release(failed[i].hudev);
+	}
+
+	free(failed);
+
+	return next;
+}
+
+static DWORD WINAPI ReconnectThreadProc(LPVOID lpParameter)
+{
+	lwz_context_t * const h = (lwz_context_t*)lpParameter;
+	HANDLE const hwait[2] = { h->reconnect.hquit, h->reconnect.hkick };
+	DWORD timeout = INFINITE;
+
+	// Make a pass each time a device fails, and keep retrying while any
+	// device can't be reopened yet, backing off for each device that
+	// keeps failing.  A device that's really gone is removed when the
+	// device change notification comes in; until then, each retry is
+	// just a failed open, every few seconds.
+	while (WaitForMultipleObjects(2, hwait, FALSE, timeout) != WAIT_OBJECT_0)
+		timeout = lwz_reconnect_pass(h);
+
+	SetEvent(h->reconnect.hdone);
+
+	return 0;
+}
+
+// Start the reconnect thread, if it's not already running.  Must be
+// called with 'g_cs' held.
+static bool lwz_reconnect_start(lwz_context_t *h)
+{
+	if (h->reconnect.hthread != NULL)
+		return true;
+
+	if (h->reconnect.hquit == NULL)
+	{
+		h->reconnect.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+		h->reconnect.hdone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+
+	if (h->reconnect.hkick == NULL ||
+		h->reconnect.hquit == NULL ||
+		h->reconnect.hdone == NULL)
+	{
+		return false;
+	}
+
+	h->reconnect.hthread = CreateThread(NULL, 0, ReconnectThreadProc, (void*)h, 0, NULL);
+	return (h->reconnect.hthread != NULL);
+}
+
+// Stop the reconnect thread.  As with lwz_discovery_stop(), this must be
+// called WITHOUT 'g_cs' held.  The kick event stays open until the
+// devices are closed (see lwz_close).
+static void lwz_reconnect_stop(lwz_context_t *h)
+{
+	if (h == NULL)
+		return;
+
+	if (h->reconnect.hthread != NULL)
+	{
+		SetEvent(h->reconnect.hquit);
+		WaitForSingleObject(h->reconnect.hdone, INFINITE);
+		CloseHandle(h->reconnect.hthread);
+		h->reconnect.hthread = NULL;
+	}
+
+	if (h->reconnect.hquit != NULL)
+	{
+		CloseHandle(h->reconnect.hquit);
+		h->reconnect.hquit = NULL;
+	}
+
+	if (h->reconnect.hdone != NULL)
+	{
+		CloseHandle(h->reconnect.hdone);
+		h->reconnect.hdone = NULL;
+	}
+}
+
+// Search for attached devices, using the current discovery mode.  In
+// broker client mode, the device list comes from the broker instead.
+static void lwz_refreshlist(lwz_context_t *h)
+{
+	if (h->broker.hclient != NULL)
+	{
+		lwz_broker_sync_units(h);
+		return;
+	}
+
+	if (h->discovery.mode == LWZ_DISCOVERY_ASYNC && lwz_discovery_kick(h))
+		return;
+
+	lwz_refreshlist_attached(h);
+}
+
+static void lwz_freelist(lwz_context_t *h)
+{
+	for (int i = 0; i < h->num_units; i++)
+	{
+		// broker client units have no handles; just forget them, so
+		// that the next sync with the broker reports them again
+		if (h->broker.hclient != NULL)
+			lwz_dev(h, i)->device_type = LWZ_DEVICE_TYPE_NONE;
+
+		if (lwz_dev(h, i)->hudev != NULL)
+		{
+			usbdev_set_input_callback(lwz_dev(h, i)->hudev, NULL, NULL, 0);
+			lwz_unpublish_input(h, i);
+			usbdev_release(lwz_dev(h, i)->hudev);
+			lwz_dev(h, i)->hudev = NULL;
+		}
+	}
+}
+
+//**********************************************************************************************************************
+// Device broker
+//**********************************************************************************************************************
+
+// Output state that one broker client has set for one unit
+typedef struct {
+	bool active;				// the client has sent something to this unit
+	BYTE banks[4];				// SBA on/off bits
+	BYTE speed;					// SBA pulse speed
+	BYTE pba[32];				// PBA brightness levels
+} lwz_broker_state_t;
+
+// Merged state last sent to a unit
+typedef struct {
+	bool valid;
+	BYTE banks[4];
+	BYTE speed;
+	BYTE pba[32];
+} lwz_broker_sent_t;
+
+// Merge the clients' states for a unit, and send the result if it
+// changed.  Each port is lit by the highest-priority client that has it
+// switched on, at that client's brightness; a port that no client has
+// switched on is off.  The pulse speed comes from the highest-priority
+// client with any state for the unit.  Ties go to the lower slot.
+static void lwz_broker_merge(HBROKER hb, lwz_broker_state_t (*state)[LWZ_MAX_DEVICES], lwz_broker_sent_t *sent, int unit)
+{
+	lwz_broker_sent_t m;
+	memset(&m, 0x00, sizeof(m));
+	m.valid = true;
+
+	// find each client's priority, and the top client for the unit
+	LONG pri[BROKER_MAX_CLIENTS];
+	int top = -1;
+	for (int c = 0 ; c < BROKER_MAX_CLIENTS ; ++c)
+	{
+		if (!broker_server_connected(hb, c) || !state[c][unit].active)
+			continue;
+
+		pri[c] = broker_server_priority(hb, c);
+		if (top < 0 || pri[c] > pri[top])
+			top = c;
+	}
+
+	if (top >= 0)
+	{
+		m.speed = state[top][unit].speed;
+		memcpy(m.pba, state[top][unit].pba, 32);
+	}
+
+	for (int port = 0 ; port < 32 ; ++port)
+	{
+		BYTE const bit = (BYTE)(1 << (port % 8));
+		int best = -1;
+		for (int c = 0 ; c < BROKER_MAX_CLIENTS ; ++c)
+		{
+			if (broker_server_connected(hb, c)
+				&& state[c][unit].active
+				&& (state[c][unit].banks[port / 8] & bit) != 0
+				&& (best < 0 || pri[c] > pri[best]))
+				best = c;
+		}
+
+		if (best >= 0)
+		{
+			m.banks[port / 8] |= bit;
+			m.pba[port] = state[best][unit].pba[port];
+		}
+	}
+
+	LWZHANDLE const hlwz = unit + 1;
+	if (!sent->valid || memcmp(m.banks, sent->banks, 4) != 0 || m.speed != sent->speed)
+		LWZ_SBA(hlwz, m.banks[0], m.banks[1], m.banks[2], m.banks[3], m.speed);
+
+	if (!sent->valid || memcmp(m.pba, sent->pba, 32) != 0)
+		LWZ_PBA(hlwz, m.pba);
+
+	*sent = m;
+}
+
+// The broker loop.  We publish our unit table for the clients, pick up
+// their messages, and send the merged output state to the devices
+// through the normal API paths, so the broker's writes get the same
+// queueing, pacing and Pinscape handling as any other program's.
+static void lwz_broker_serve(HBROKER hb, HANDLE hquit)
+{
+	lwz_context_t * const h = g_plwz;
+
+	lwz_broker_state_t (* const state)[LWZ_MAX_DEVICES] =
+		(lwz_broker_state_t (*)[LWZ_MAX_DEVICES])malloc(BROKER_MAX_CLIENTS * sizeof(*state));
+	if (state == NULL)
+		return;
+
+	memset(state, 0x00, BROKER_MAX_CLIENTS * sizeof(*state));
+
+	lwz_broker_sent_t sent[LWZ_MAX_DEVICES];
+	memset(sent, 0x00, sizeof(sent));
+
+	broker_unit_t units[BROKER_MAX_UNITS], published[BROKER_MAX_UNITS];
+	memset(published, 0x00, sizeof(published));
+	bool have_published = false;
+
+	HANDLE const hwait[2] = { hquit, broker_server_event(hb) };
+
+	for (;;)
+	{
+		bool dirty[LWZ_MAX_DEVICES] = {};
+
+		// publish the unit table if it changed
+		memset(units, 0x00, sizeof(units));
+		{
+			AUTOLOCK(g_cs);
+
+			for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
+			{
+				units[i].device_type = lwz_dev(h, i)->device_type;
+				if (units[i].device_type != LWZ_DEVICE_TYPE_NONE)
+					safe_strcpy(units[i].name, sizeof(units[i].name), lwz_dev(h, i)->device_name);
+			}
+		}
+
+		if (!have_published || memcmp(units, published, sizeof(units)) != 0)
+		{
+			// anything that came or went needs its state sent afresh
+			for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
+			{
+				if (units[i].device_type != published[i].device_type)
+				{
+					sent[i].valid = false;
+					dirty[i] = true;
+				}
+			}
+
+			broker_server_publish(hb, units);
+			memcpy(published, units, sizeof(units));
+			have_published = true;
+		}
+
+		// drop the state of clients that have gone away
+		DWORD const reset = broker_server_check_clients(hb);
+		for (int c = 0 ; c < BROKER_MAX_CLIENTS ; ++c)
+		{
+			if ((reset & (1 << c)) == 0)
+				continue;
+
+			LOG("Broker: client slot %d %s\n", c, broker_server_connected(hb, c) ? "connected" : "disconnected");
+			for (int u = 0 ; u < LWZ_MAX_DEVICES ; ++u)
+			{
+				if (state[c][u].active)
+					dirty[u] = true;
+			}
+
+			memset(state[c], 0x00, sizeof(state[c]));
+		}
+
+		// pick up new messages
+		for (int c = 0 ; c < BROKER_MAX_CLIENTS ; ++c)
+		{
+			broker_msg_t msg;
+			while (broker_server_receive(hb, c, &msg))
+			{
+				lwz_broker_state_t * const st = &state[c][msg.unit];
+
+				// a client's first message for a unit starts it from all
+				// off, at full brightness
+				if (!st->active && (msg.kind == BROKER_MSG_SBA || msg.kind == BROKER_MSG_PBA))
+				{
+					memset(st, 0x00, sizeof(*st));
+					memset(st->pba, 48, sizeof(st->pba));
+					st->speed = 2;
+					st->active = true;
+				}
+
+				switch (msg.kind)
+				{
+				case BROKER_MSG_SBA:
+					if (msg.len >= 5)
+					{
+						memcpy(st->banks, msg.data, 4);
+						st->speed = msg.data[4];
+						dirty[msg.unit] = true;
+					}
+					break;
+
+				case BROKER_MSG_PBA:
+					if (msg.len >= 32)
+					{
+						memcpy(st->pba, msg.data, 32);
+						dirty[msg.unit] = true;
+					}
+					break;
+
+				case BROKER_MSG_RAW:
+					// control messages aren't merged; pass them straight through
+					LWZ_RAWWRITE((LWZHANDLE)(msg.unit + 1), msg.data, (DWORD)msg.len);
+					break;
+				}
+			}
+		}
+
+		// send the merged state for each unit that changed
+		for (int u = 0 ; u < LWZ_MAX_DEVICES ; ++u)
+		{
+			if (dirty[u] && units[u].device_type != LWZ_DEVICE_TYPE_NONE)
+				lwz_broker_merge(hb, state, &sent[u], u);
+		}
+
+		// wait for more messages, or until it's time to check on things again
+		if (WaitForMultipleObjects(2, hwait, FALSE, LWZ_BROKER_POLL_MS) == WAIT_OBJECT_0)
+			break;
+	}
+
+	free(state);
+}
+
+// Send a message to the broker, in broker client mode.  Must be called
+// with 'g_cs' held.
+static bool lwz_broker_submit(lwz_context_t *h, int indx, LONG kind, BYTE const *pdata, DWORD ndata)
+{
+	if (!lwz_valid_unit(h, indx) || lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_NONE)
+		return false;
+
+	return broker_client_submit(h->broker.hclient, indx, kind, pdata, ndata);
+}
+
+// Bring our device list in line with the broker's unit table, notifying
+// the user callback of the changes.  Must be called with 'g_cs' held.
+static void lwz_broker_sync_units(lwz_context_t *h)
+{
+	broker_unit_t units[BROKER_MAX_UNITS];
+	h->broker.generation = broker_client_units(h->broker.hclient, units);
+
+	int new_devices[LWZ_MAX_UNITS];
+	int num_new_devices = 0;
+
+	for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
+	{
+		lwz_device_t * const dev = lwz_dev(h, i);
+		UINT const type = units[i].device_type;
+
+		// remove units that are gone or changed
+		if (dev->device_type != LWZ_DEVICE_TYPE_NONE && dev->device_type != type)
+		{
+			dev->device_type = LWZ_DEVICE_TYPE_NONE;
+			lwz_remove(h, i);
+		}
+
+		// add new units
+		if (type != LWZ_DEVICE_TYPE_NONE && dev->device_type == LWZ_DEVICE_TYPE_NONE)
+		{
+			dev->device_type = type;
+			dev->num_outputs = 32;
+			safe_strcpy(dev->device_name, sizeof(dev->device_name), units[i].name);
+			new_devices[num_new_devices++] = i;
+		}
+	}
+
+	if (num_new_devices != 0)
+		lwz_add(h, num_new_devices, new_devices);
+}
+
+// Disconnect from the broker, removing its units from our device list.
+// Must be called with 'g_cs' held.
+static void lwz_broker_disconnect(lwz_context_t *h)
+{
+	if (h->broker.hclient == NULL)
+		return;
+
+	broker_client_close(h->broker.hclient);
+	h->broker.hclient = NULL;
+
+	for (int i = 0 ; i < LWZ_MAX_DEVICES ; ++i)
+	{
+		if (lwz_dev(h, i)->device_type != LWZ_DEVICE_TYPE_NONE)
+		{
+			lwz_dev(h, i)->device_type = LWZ_DEVICE_TYPE_NONE;
+			lwz_remove(h, i);
+		}
+	}
+}
+
+// Broker client thread.  This watches for changes to the broker's unit
+// table, and for the broker going away, in which case we fall back on
+// opening the devices ourselves.
+static DWORD WINAPI BrokerClientThreadProc(LPVOID lpParameter)
+{
+	lwz_context_t * const h = (lwz_context_t*)lpParameter;
+
+	while (WaitForSingleObject(h->broker.hquit, LWZ_BROKER_POLL_MS) == WAIT_TIMEOUT)
+	{
+		AUTOLOCK(g_cs);
+
+		if (h->broker.hclient == NULL)
+			continue;
+
+		if (!broker_client_alive(h->broker.hclient))
+		{
+			LOG("Broker has exited - switching to direct device access\n");
+			lwz_broker_disconnect(h);
+			lwz_refreshlist(h);
+		}
+		else if (broker_client_generation(h->broker.hclient) != h->broker.generation)
+		{
+			lwz_broker_sync_units(h);
+		}
+	}
+
+	SetEvent(h->broker.hdone);
+
+	return 0;
+}
+
+// Connect to the broker.  Must be called with 'g_cs' held.
+static bool lwz_broker_connect(lwz_context_t *h, LONG priority)
+{
+	if (h->broker.hclient != NULL)
+		return true;
+
+	if (h->broker.hquit == NULL)
+	{
+		h->broker.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+		h->broker.hdone = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (h->broker.hquit == NULL || h->broker.hdone == NULL)
+			return false;
+	}
+
+	HBROKER const hc = broker_client_open(priority);
+	if (hc == NULL)
+		return false;
+
+	if (h->broker.hthread == NULL)
+	{
+		h->broker.hthread = CreateThread(NULL, 0, BrokerClientThreadProc, (void*)h, 0, NULL);
+		if (h->broker.hthread == NULL)
+		{
+			broker_client_close(hc);
+			return false;
+		}
+	}
+
+	// the broker owns the devices now, so let go of any we opened ourselves
+	for (int i = 0 ; i < h->num_units ; ++i)
+	{
+		lwz_device_t * const dev = lwz_dev(h, i);
+		if (dev->device_type == LWZ_DEVICE_TYPE_NONE)
+			continue;
+
+		if (dev->hudev != NULL)
+		{
+			usbdev_set_input_callback(dev->hudev, NULL, NULL, 0);
+			lwz_unpublish_input(h, i);
+			usbdev_release(dev->hudev);
+			dev->hudev = NULL;
+		}
+
+		dev->device_type = LWZ_DEVICE_TYPE_NONE;
+		lwz_remove(h, i);
+	}
+
+	h->broker.hclient = hc;
+	lwz_broker_sync_units(h);
+
+	return true;
+}
+
+// Stop the broker client thread.  As with lwz_discovery_stop(), this
+// must be called WITHOUT 'g_cs' held.
+static void lwz_broker_stop(lwz_context_t *h)
+{
+	if (h == NULL)
+		return;
+
+	if (h->broker.hthread != NULL)
+	{
+		SetEvent(h->broker.hquit);
+		WaitForSingleObject(h->broker.hdone, INFINITE);
+		CloseHandle(h->broker.hthread);
+		h->broker.hthread = NULL;
+	}
+
+	if (h->broker.hquit != NULL)
+	{
+		CloseHandle(h->broker.hquit);
+		h->broker.hquit = NULL;
 	}
 
-	if (h->cb.notify_ex != 0)
+	if (h->broker.hdone != NULL)
 	{
-		LOG("NOTIFY_EX(reason=%d (%s), unit=%d)\n",
-			reason,
-			reason == LWZ_REASON_ADD ? "Add" : reason == LWZ_REASON_DELETE ? "Delete" : "Unknown",
-			hlwz);
-		h->cb.notify_ex(h->cb.puser, reason, hlwz);
+		CloseHandle(h->broker.hdone);
+		h->broker.hdone = NULL;
 	}
 }
 
-// Add one or more new devices to the client's device list, and invoke
-// the client callback.
-//
-// For compatibility with some existing clients, it's necessary to add
-// ALL devices to the client's list before the FIRST notify callback.
-// The original LEDWIZ.DLL does this, and some clients depend on it.
-// E.g., LedBlinky apparently only pays attention to the first notify
-// callback, and ignores all subsequent invocations, so it only detects
-// devices that are in the list on the first call.  Ergo the list must
-// be populated with all devices before the first call.  This isn't
-// specified one way or the other in the API, but it would seem more
-// reasonable to me to populate the list incrementally, adding each
-// device just before calling the callback for that device.  This is
-// in fact what the original LWCloneU2 did, but that broke LedBlinky.
-// For full compatibility, we have to do things the same peculiar way
-// as the original DLL.
-static void lwz_add(lwz_context_t *h, int ndevices, const int *device_indices)
+//**********************************************************************************************************************
+// Host-side effects
+//**********************************************************************************************************************
+
+// Figure an effect's level at time 'now'.  Sets '*pdone' if the effect
+// has run its course.
+static BYTE lwz_effect_level(lwz_effect_t const *e, DWORD now, bool *pdone)
 {
+	DWORD const t = now - e->t0;
+	*pdone = false;
 
-	// First, update the user list if one was provided.  We have to
-	// add all devices to the list before invoking the callback for
-	// any device.
-	if (h->plist)
+	if (e->type == LWZ_EFFECT_RAMP)
 	{
-		for (int i = 0 ; i < ndevices ; ++i)
+		if (t >= e->period_ms)
 		{
-			// get the current unit number (== device index + 1)
-			LWZHANDLE hlwz = device_indices[i] + 1;
-
-			// check to see if it's already in the list
-			bool found = false;
-			for (int j = 0 ; j < h->plist->numdevices ; ++j)
-			{
-				if (h->plist->handles[j] == hlwz)
-				{
-					found = true;
-					break;
-				}
-			}
-
-			// if there's room, and it's not already in the list, add it
-			if (!found && h->plist->numdevices < LWZ_MAX_DEVICES)
-			{
-				h->plist->handles[h->plist->numdevices] = hlwz;
-				h->plist->numdevices += 1;
-				LOG("lwz_add(unit=%d, #devices=%d)\n", hlwz, h->plist->numdevices);
-			}
+			*pdone = true;
+			return e->to;
 		}
+
+		return (BYTE)((int)e->from + ((int)e->to - (int)e->from) * (int)t / (int)e->period_ms);
 	}
 
-	// Now invoke the user callback once for each added device
-	for (int i = 0 ; i < ndevices ; ++i)
+	// blink
+	if (e->cycles != 0 && t / e->period_ms >= e->cycles)
 	{
-		LWZHANDLE hlwz = device_indices[i] + 1;
-		lwz_notify_callback(h, LWZ_REASON_ADD, hlwz);
+		*pdone = true;
+		return e->from;
 	}
+
+	return (t % e->period_ms) < e->on_ms ? e->to : e->from;
 }
 
-static void lwz_remove(lwz_context_t *h, int indx)
+// Figure a unit's brightness levels: the client's levels, with any
+// running effects applied.  Ports the client hasn't set yet are at full
+// brightness.
+static void lwz_effects_apply(lwz_context_t *h, int indx, BYTE *pba)
 {
-	LWZHANDLE hlwz = indx + 1;
-
-	// update user list (if one waw provided)
+	lwz_device_t * const dev = lwz_dev(h, indx);
+	if (dev->shadow.pba_known)
+		memcpy(pba, dev->shadow.pba, 32);
+	else
+		memset(pba, 48, 32);
 
-	if (h->plist)
+	DWORD const now = GetTickCount();
+	for (int i = 0 ; i < h->effects.count ; ++i)
 	{
-		for (int i = 0; i < h->plist->numdevices; i++)
+		lwz_effect_t const * const e = &h->effects.list[i];
+		if (e->indx == indx)
 		{
-			LWZHANDLE hlwz = indx + 1;
-
-			if (h->plist->handles[i] != hlwz)
-				continue;
-
-			h->plist->handles[i] = h->plist->handles[h->plist->numdevices - 1];
-			h->plist->handles[h->plist->numdevices - 1] = 0;
+			bool done;
+			pba[e->port] = lwz_effect_level(e, now, &done);
+		}
+	}
+}
 
-			h->plist->numdevices -= 1;
+// Remove a unit's effects on one port, or on all ports if 'port' is -1
+static void lwz_effects_remove(lwz_context_t *h, int indx, int port)
+{
+	for (int i = 0 ; i < h->effects.count ; )
+	{
+		lwz_effect_t * const e = &h->effects.list[i];
+		if (e->indx == indx && (port < 0 || e->port == port))
+		{
+			*e = h->effects.list[--h->effects.count];
+			continue;
 		}
+
+		++i;
 	}
+}
 
-	// notify callback
+// Get the update interval for a unit.  A real LedWiz takes a full PBA
+// as four packets at the minimum write spacing, so there's no point in
+// updating it any faster than that; the other devices can keep up with
+// our regular tick.
+static DWORD lwz_effect_interval(lwz_context_t *h, int indx)
+{
+	if (lwz_dev(h, indx)->device_type == LWZ_DEVICE_TYPE_LEDWIZ)
+		return LWZ_EFFECT_TICK_MS_LEDWIZ;
 
-	lwz_notify_callback(h, LWZ_REASON_DELETE, hlwz);
+	return LWZ_EFFECT_TICK_MS;
 }
 
-static void lwz_refreshlist_detached(lwz_context_t *h)
+// Run one effect tick: update each unit with running effects, or driven
+// by the client's state buffer, that's due, retiring finished effects.  A
+// finished ramp leaves the port at its final level, as though the client
+// had set it; a finished blink puts the port back to the client's level.
+// Returns the time until the next unit is due, or INFINITE if there's
+// nothing left to do.  Must be called with 'g_cs' held.
+static DWORD lwz_effects_tick(lwz_context_t *h)
 {
-	// check for removed devices
-	// i.e. try to re-open all registered devices in our internal list
+	DWORD const now = GetTickCount();
+	DWORD wait = INFINITE;
+
+	// pick up any new state from the client's state buffer
+	lwz_statebuf_poll(h);
+
+	// Only units with effects or state buffer entries need a look, so
+	// stop after the last of those.  The state buffer only covers the
+	// legacy units.
+	int nunits = (h->statebuf.buffer != NULL) ? LWZ_MAX_DEVICES : 0;
+	for (int i = 0 ; i < h->effects.count ; ++i)
+	{
+		if (h->effects.list[i].indx >= nunits)
+			nunits = h->effects.list[i].indx + 1;
+	}
 
-	for (int i = 0; i < LWZ_MAX_DEVICES; i++)
+	for (int indx = 0 ; indx < nunits ; ++indx)
 	{
-		if (h->devices[i].hudev != NULL)
+		// find the unit's effects, retiring any that are done
+		bool had = false;
+		bool any = false;
+		for (int i = 0 ; i < h->effects.count ; )
 		{
-			// try opening the device handle again
-			SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&h->devices[i].dat[0];
-			HANDLE hdev = CreateFileA(
-				pdiddat->DevicePath,
-				GENERIC_READ | GENERIC_WRITE,
-				FILE_SHARE_READ | FILE_SHARE_WRITE,
-				NULL,
-				OPEN_EXISTING,
-				0,
-				NULL);
+			lwz_effect_t * const e = &h->effects.list[i];
+			if (e->indx != indx)
+			{
+				++i;
+				continue;
+			}
 
-			// if we couldn't open the handle, the device must have been unplugged
-			if (hdev == INVALID_HANDLE_VALUE)
+			had = true;
+
+			// drop effects on units that have gone away
+			lwz_device_t * const dev = lwz_dev(h, indx);
+			if (dev->device_type == LWZ_DEVICE_TYPE_NONE)
 			{
-				// get the device descriptor entry
-				lwz_device_t *dev = &h->devices[i];
+				*e = h->effects.list[--h->effects.count];
+				continue;
+			}
 
-				// If this is a Pinscape device, remove any virtual LedWiz units
-				// that refer back to it.
-				if (dev->device_type == LWZ_DEVICE_TYPE_PINSCAPE)
+			bool done;
+			BYTE const level = lwz_effect_level(e, now, &done);
+			if (done)
+			{
+				if (e->type == LWZ_EFFECT_RAMP)
 				{
-					// Pinscape units set up one virtual LedWiz interface per
-					// block of 32 output ports after the first 32.  The new
-					// devices are at consecutive unit numbers after the actual
-					// Pinscape unit.  The virtual devices are only created when
-					// there's no actual device at the same unit number, so we
-					// have to check each slot to see if it is indeed a virtual
-					// interface.
-					lwz_device_t *vdev = &h->devices[i+1];
-					for (int vidx = i + 1, portno = 32 ;
-						 vidx < LWZ_MAX_DEVICES && portno < dev->num_outputs ;
-						 ++vidx, portno += 32, ++vdev)
+					if (!dev->shadow.pba_known)
 					{
-						// check to see if it's a virtual LedWiz interface that's
-						// tied to the Pinscape interface we're deleting
-						if (vdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT
-							&& vdev->ps_virtual_lwz.base_unit == i)
-						{
-							// it's one of ours - remove this interface too
-							vdev->device_type = LWZ_DEVICE_TYPE_NONE;
-							lwz_remove(h, vidx);
-						}
+						memset(dev->shadow.pba, 48, 32);
+						dev->shadow.pba_known = true;
 					}
-				}
 
-				// close our existing USB file handle
-				usbdev_release(dev->hudev);
-				dev->hudev = NULL;
-				dev->device_type = LWZ_DEVICE_TYPE_NONE;
+					dev->shadow.pba[e->port] = level;
+				}
 
-				// remove the device from the user list and notify the user callback
-				lwz_remove(h, i);
-			}
-			else
-			{
-				// Success - we have a valid new handle to the file.  We only
-				// needed the new handle to see if we could create it, though,
-				// so we have no more use for it; close it.
-				CloseHandle(hdev);
+				*e = h->effects.list[--h->effects.count];
+				continue;
 			}
+
+			any = true;
+			++i;
+		}
+
+		// check if the state buffer drives the unit
+		bool const polled = h->statebuf.buffer != NULL
+			&& indx < LWZ_MAX_DEVICES
+			&& (h->statebuf.snap.dwUnitMask & (1 << indx)) != 0
+			&& lwz_dev(h, indx)->device_type != LWZ_DEVICE_TYPE_NONE;
+
+		// if the unit isn't due yet, just note when it will be
+		LONG const due = (LONG)(lwz_unit(h, indx)->next_tick - now);
+		if ((any || polled) && due > 0)
+		{
+			if ((DWORD)due < wait)
+				wait = due;
+			continue;
 		}
+
+		// send the new levels if anything changed, including the final
+		// levels of effects that just finished
+		if (polled)
+			lwz_statebuf_apply(h, indx);
+		if ((had || polled) && lwz_dev(h, indx)->device_type != LWZ_DEVICE_TYPE_NONE)
+			lwz_send_pba(h, indx, true);
+
+		if (!any && !polled)
+			continue;
+
+		// Schedule the next update at a fixed rate from the last one.  If
+		// we've fallen behind, skip the missed ticks rather than trying to
+		// catch up.
+		DWORD const interval = lwz_effect_interval(h, indx);
+		DWORD next = lwz_unit(h, indx)->next_tick + interval;
+		if ((LONG)(next - now) <= 0)
+			next = now + interval;
+
+		lwz_unit(h, indx)->next_tick = next;
+		if (next - now < wait)
+			wait = next - now;
 	}
-}
 
-static void lwz_refreshlist_attached(lwz_context_t *h)
-{
-	LOG("Refreshing attached device list\n");
+	// In timed flush mode, flush on a fixed grid of times, so the device
+	// updates come at a steady rate.  Sleep through grid times with
+	// nothing to send; lwz_flush_stage() wakes us for the next change.
+	if (h->flush.mode == LWZ_FLUSH_TIMED)
+	{
+		DWORD const period = h->flush.period_ms;
+		if ((LONG)(now - h->flush.next) >= 0)
+		{
+			lwz_flush(h);
+			h->flush.next += ((now - h->flush.next) / period + 1) * period;
+		}
 
-	// no new devices found yet
-	int num_new_devices = 0;
-	int new_devices[LWZ_MAX_DEVICES];
+		if (h->flush.nstaged != 0
+			&& h->flush.next - now < wait)
+			wait = h->flush.next - now;
+	}
 
-	// set up a search on all HID devices
-	HDEVINFO hDevInfo = SetupDiGetClassDevsA(
-		&HIDguid, 
-		NULL, 
-		NULL, 
-		DIGCF_PRESENT | DIGCF_INTERFACEDEVICE);
+	return wait;
+}
 
-	// we can't proceed unless we got the HID list
-	if (hDevInfo == INVALID_HANDLE_VALUE)
+// Take a snapshot of the client's state buffer, if it has changed since
+// the last one.  The client brackets its changes by incrementing the
+// sequence number before and after, so an odd number means a change is
+// in progress, and a number that moved while we were copying means we
+// might have a mix of old and new state.  Either way, we just try again
+// on the next tick.
+static void lwz_statebuf_poll(lwz_context_t *h)
+{
+	LWZSTATEBUFFER const * const buf = h->statebuf.buffer;
+	if (buf == NULL)
 		return;
 
-	// go through all available devices and look for the proper VID/PID
-	for (DWORD dwindex = 0 ; ; dwindex++)
-	{
-		// get the next interface in the HID list
-		SP_DEVICE_INTERFACE_DATA didat = {};
-		didat.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
-		BOOL bres = SetupDiEnumDeviceInterfaces(
-			hDevInfo,
-			NULL,
-			&HIDguid,
-			dwindex,
-			&didat);
+	LONG const seq = buf->lSequence;
+	if (seq == h->statebuf.seq || (seq & 1) != 0)
+		return;
 
-		// if that failed, we've reached the end of the list
-		if (bres == FALSE)
-			break;
+	MemoryBarrier();
+	LWZSTATEBUFFER snap;
+	memcpy(&snap, (void const *)buf, sizeof(snap));
+	MemoryBarrier();
 
-		// retrieve the device detail
-		lwz_device_t device_tmp = { };
-		SP_DEVICE_INTERFACE_DETAIL_DATA_A * pdiddat = (SP_DEVICE_INTERFACE_DETAIL_DATA_A *)&device_tmp.dat[0];
-		pdiddat->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
-		bres = SetupDiGetDeviceInterfaceDetailA(
-			hDevInfo,
-			&didat,
-			pdiddat,
-			sizeof(device_tmp.dat),
-			NULL,
-			NULL);
+	if (buf->lSequence != seq)
+		return;
 
-		// if we couldn't get the device detail, proceed to the next device
-		if (bres == FALSE)
-			continue;
-		
-		// open the file handle to the USB device
-		device_tmp.hudev = usbdev_create(pdiddat->DevicePath);
-		if (device_tmp.hudev != NULL)
-		{
-			// retrieve the HID attributes
-			HIDD_ATTRIBUTES attrib = {};
-			attrib.Size = sizeof(HIDD_ATTRIBUTES);
-			BOOLEAN bSuccess = HidD_GetAttributes(
-				usbdev_handle(device_tmp.hudev),
-				&attrib);
+	h->statebuf.snap = snap;
+	h->statebuf.seq = seq;
+	h->statebuf.pending = snap.dwUnitMask;
+}
 
-			LOG(". Found USB HID device, VID %04X, PID %04X\n", attrib.VendorID, attrib.ProductID);
-			
-			// Check to see if this looks like an LedWiz VID/PID combo.  LedWiz devices
-			// identify as Vendor ID FAFA, Product ID 00F0..00FF.  The low 4 bits of the
-			// product ID is by convention the LedWiz "unit number".  The API uses this
-			// to distinguish multiple units in one system and direct commands to the
-			// desired unit.  The nominal unit number is in the range 1..16, so it's
-			// equivalent to (ProductID & 0x000F) + 1.
-			int indx = (int)attrib.ProductID - (int)ProductID_LEDWiz_min;
-			if (bSuccess && 
-			    (attrib.VendorID == VendorID_LEDWiz || attrib.VendorID == VendorID_Zebs) &&
-			    indx >= 0 && indx < LWZ_MAX_DEVICES)
-			{
-				// It's an LedWiz, according to the VID/PID
-				LOG(".. vendor/product code matches LedWiz, checking HID descriptors\n", indx+1);
+// Apply the state buffer snapshot to a unit's output state, sending the
+// on/off state if it changed.  The caller sends the brightness levels.
+static void lwz_statebuf_apply(lwz_context_t *h, int indx)
+{
+	if ((h->statebuf.pending & (1 << indx)) == 0)
+		return;
 
-				// Before we conclude for sure that it's an LedWiz, though, do some more
-				// checks.  Retrieve the preparsed data for the device.
-				PHIDP_PREPARSED_DATA p_prepdata = NULL;
-				if (HidD_GetPreparsedData(usbdev_handle(device_tmp.hudev), &p_prepdata) == TRUE)
-				{
-					LOG(".. retrieved preparsed data OK\n");
+	h->statebuf.pending &= ~(1 << indx);
 
-					// get the HID capabilities struct
-					HIDP_CAPS caps = {};
-					if (HIDP_STATUS_SUCCESS == HidP_GetCaps(p_prepdata, &caps))
-					{
-						LOG(".. retrieved HID capabilities: "
-							" link collection nodes %d, output report length %d\n",
-							caps.NumberLinkCollectionNodes, caps.OutputReportByteLength);
-						
-						// Apply heuristic filters:
-						//
-						// 1. Output report byte length
-						// The LedWiz command interface has an eight byte output report.
-						// Note that the Windows HID drivers always include a one-byte
-						// "report ID" prefix in reports read or written through the
-						// driver.  The LedWiz itself doesn't transmit the prefix byte
-						// because (per USB HID conventions) it's never included by
-						// devices that have only one report type, as is the case for
-						// an LedWiz.  However, the Windows HID drivers normalize this
-						// by including the prefix byte to user programs whether it's
-						// in the physical reports or not.  For consistency, Windows
-						// HID also normalizes the report length seen in the HID caps,
-						// so the byte length we're looking for is 9.
-						//
-						// 2. USB Usage
-						// Test that this is NOT a keyboard interface (USB usage page 
-						// 1, usage 6).  The Pinscape controller presents a keyboard
-						// interface in addition its joystick interface, which looks
-						// to the HID scan like a completely separate device.  We want
-						// to skip that virtual device since it doesn't accept LedWiz 
-						// output reports.  (Note that it would filter out more false
-						// positivies if we "ruled in" specific HID usages rather than
-						// only "ruling out" the keyboard, but that would also be less
-						// flexible at recognizing future product updates from GGG and
-						// future clones and emulators.  In practice, false positives
-						// from random third-party devices don't actually seem to
-						// happen, so on balance it seems much better to err on the
-						// side of filtering in unknown devices that pass our other
-						// tests.)
-						//
-						// 3. Link collection count (REMOVED)
-						// In the past, we also checked the link collection count to
-						// make sure caps.NumberLinkCollectionNodes == 1.  This was a
-						// further ad hoc check that the original LedWiz device and
-						// LWCloneU2 devices both passed, and which the Pinscape device
-						// deliberately passed because it was known that LWCloneU2 did
-						// this test.  However, this test is now too restrictive in 
-						// that a newer real LedWiz product, the LedWiz+GP, fails the
-						// test.  So I'm removing the link collection node test.  That
-						// test was purely speculative anyway: as far as I know, there
-						// are no actual false positives that it filtered out, so it
-						// was just there *in case* something came along that spoofed
-						// an LedWiz as far as all of the other tests go.
-						if (caps.OutputReportByteLength == 9
-							&& !(caps.UsagePage == 1 && caps.Usage == 6)) // USB keyboard = page 1/usage 6
-						{
-							LOG(".. link collection node count, report length, and USB usage match LedWiz\n");
-
-							// presume it's a real LedWiz or some clone/emulation we don't
-							// handle specially
-							device_tmp.device_type = LWZ_DEVICE_TYPE_LEDWIZ;
-
-							// Remember the input report (device to host) length.  Note that
-							// the length in the caps is normalized to include the synthesized
-							// report ID, so subtract one to get the actual device report size.
-							device_tmp.input_rpt_len = caps.InputReportByteLength - 1;
-
-							// presume it has the standard LedWiz complement of 32 ports
-							device_tmp.num_outputs = 32;
-							device_tmp.supports_sbx_pbx = false;
-
-							// If it's using the zebsboard VID, make sure the manufacturer ID looks right
-							if (attrib.VendorID == VendorID_Zebs)
-							{
-								// get the manufacturer ID string, in lower-case, for further testing
-								wchar_t manustr[256] = { 0 };
-								HidD_GetManufacturerString(usbdev_handle(device_tmp.hudev), manustr, 256);
-								_wcslwr_s(manustr);
-
-								if (wcsstr(manustr, L"zebsboards") != NULL)
-								{
-									// mark it as a zeb's output control device
-									LOG(".. ZB Output Control detected\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_ZB;
-
-									// this device doesn't need USB delays
-									usbdev_set_min_write_interval(device_tmp.hudev, 0);
-								}
-								else
-								{
-									// it's not a Zebsboards unit, so it must not be an LedWiz
-									// emulator after all
-									LOG(".. Device uses VID 0x20A0, but manufacturer string doesn't contain 'zebsboards' - rejecting\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_NONE;
-								}
-							}
-
-							// get the product ID string, so that we can further identify
-							// whether the device is a real LedWiz or one of the specific
-							// types of clones we know about
-							wchar_t prodstr[256];
-							device_tmp.device_name[0] = '\0';
-							if (HidD_GetProductString(usbdev_handle(device_tmp.hudev), prodstr, 256))
-							{
-								// save the product string
-								size_t retlen;
-								wcstombs_s(
-									&retlen,
-									device_tmp.device_name,
-									sizeof(device_tmp.device_name),
-									prodstr,
-									_TRUNCATE);
-								
-								// check for the special device types
-								if (wcsstr(prodstr, L"Pinscape Controller") != 0)
-								{
-									// It's a Pinscape unit
-									LOG(".. Pinscape Controller identified\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_PINSCAPE;
-
-									// Pinscape doesn't need USB delays
-									usbdev_set_min_write_interval(device_tmp.hudev, 0);
-									
-									// Query the number of outputs by sending a QUERY CONFIGURATION
-									// special request (65 4).  Clear the input buffer before making
-									// the request, since the input buffer could be full of regular
-									// joystick reports.  We could time out before getting to the
-									// config report reply if we don't clear out old joystick
-									// reports first.
-									char qbuf[8] = { 65, 4, 0, 0, 0, 0, 0, 0 };
-									usbdev_clear_input(device_tmp.hudev, caps.InputReportByteLength);
-									usbdev_write(device_tmp.hudev, qbuf, 8);
-
-									// wait for the proper reply; retry a few times if necessary
-									BYTE rbuf[65];
-									for (int i = 0 ; i < 64 ; ++i)
-									{
-										// Read a report, and check for a CONFIGURATION REPORT
-										// reply (00 88 ...).  We're interested in the number of
-										// outputs at bytes 2:3, and the bit flags at byte 11.
-										if (usbdev_read(device_tmp.hudev, rbuf, device_tmp.input_rpt_len) > 0
-											&& (rbuf[0] == 0x00 && rbuf[1] == 0x88))
-										{
-											// It's the configuration report.
-											//
-											// If byte 11 has bit 0x02 set, the installed firmware
-											// supports the SBX/PBX protocol extensions that we need
-											// to access ports beyond the first 32.
-											if ((rbuf[11] & 0x02) != 0)
-											{
-												// SBX/PBX are supported, so we can access all
-												// output ports.  Note that actual number of ports.
-												device_tmp.supports_sbx_pbx = true;
-												device_tmp.num_outputs = rbuf[2] | (rbuf[3] << 8);
-											}
-
-											// add the pinscape unit number to the name
-											char unitno[20];
-											_snprintf_s(
-												unitno, sizeof(unitno), _TRUNCATE,
-												" (Unit %d)", int(rbuf[4] + 1));
-											safe_strcat(
-												device_tmp.device_name,
-												sizeof(device_tmp.device_name),
-												unitno);
-											
-											// we can stop looking for a report now
-											break;
-										}
-									}
-								}
-								else if (wcslen(prodstr) >= 9
-										 && memcmp(prodstr, L"LWCloneU2", 9*sizeof(wchar_t)) == 0)
-								{
-									// It's an LWCloneU2 unit
-									LOG(".. LWCloneU2 identified\n");
-									device_tmp.device_type = LWZ_DEVICE_TYPE_LWCLONEU2;
-
-									// LWCloneU2 doesn't need USB delays
-									usbdev_set_min_write_interval(device_tmp.hudev, 0);
-								}
-							}
-
-							// if we decided to keep this device, add it
-							if (device_tmp.device_type != LWZ_DEVICE_TYPE_NONE)
-							{
-								LOG(".. attempting to add device\n");
-
-								// If this slot contains a Pinscape virtual LedWiz interface,
-								// remove the virtual device so that we can use the slot for
-								// the real device.  Real devices always override virtual ones.
-								if (h->devices[indx].device_type == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
-								{
-									// remove the virtual interface and notify the user callback
-									LOG(".. this slot has a Pinscape virtual LedWiz; this real device overrides that\n");
-									h->devices[indx].device_type = LWZ_DEVICE_TYPE_NONE;
-									lwz_remove(h, indx);
-								}
-
-								// if this slot isn't populated yet, add the device
-								if (h->devices[indx].hudev == NULL)
-								{
-									// copy the temp device struct to the active device list entry
-									memcpy(&h->devices[indx], &device_tmp, sizeof(device_tmp));
-
-									// the device list entry now owns the file handle, so forget it
-									// in the temp struct
-									device_tmp.hudev = NULL;
-
-									LOG(".. device added successfully, %d devices total\n", num_new_devices);
-
-									// add it to our list of new devices found on this search
-									if (num_new_devices < LWZ_MAX_DEVICES)
-										new_devices[num_new_devices++] = indx;
-
-								}
-								else
-								{
-									LOG(".. unit slot already in use; device not added\n");
-								}
-							}
-						}
-					}
+	LWZSTATEBUFFER const * const snap = &h->statebuf.snap;
+	lwz_device_t * const pdev = lwz_dev(h, indx);
+	memcpy(pdev->shadow.pba, snap->level[indx], 32);
+	pdev->shadow.pba_known = true;
 
-					HidD_FreePreparsedData(p_prepdata);
-				}
-			}
+	if (!pdev->shadow.sba_known
+		|| memcmp(pdev->shadow.banks, snap->on[indx], 4) != 0
+		|| pdev->shadow.speed != snap->speed[indx])
+	{
+		memcpy(pdev->shadow.banks, snap->on[indx], 4);
+		pdev->shadow.speed = snap->speed[indx];
+		pdev->shadow.sba_known = true;
+		lwz_send_sba(h, indx);
+	}
+}
 
-			// If the temp struct has a valid file handle, close it.  Note that if
-			// we decided the entry was a valid device, the temp struct won't have
-			// a file handle because the active device list entry took ownership
-			// of it, and nulled the reference here.
-			if (device_tmp.hudev != NULL)
-			{
-				usbdev_release(device_tmp.hudev);
-				device_tmp.hudev = NULL;
-			}
-		}
+static DWORD WINAPI EffectThreadProc(LPVOID lpParameter)
+{
+	lwz_context_t * const h = (lwz_context_t*)lpParameter;
+	HANDLE const hwait[2] = { h->effects.hquit, h->effects.hkick };
+	DWORD timeout = 0;
+
+	// tick until we're told to quit, sleeping while there are no effects
+	while (WaitForMultipleObjects(2, hwait, FALSE, timeout) != WAIT_OBJECT_0)
+	{
+		AUTOLOCK(g_cs);
+		timeout = lwz_effects_tick(h);
 	}
 
-	// done with the HID device list
-	if (hDevInfo != NULL)
-		SetupDiDestroyDeviceInfoList(hDevInfo);
+	SetEvent(h->effects.hdone);
 
-	// Set up any needed Pinsape virtual LedWiz interfaces.  For each
-	// Pinscape unit with more than 32 outputs, we'll set up one virtual
-	// LedWiz object for each block of 32 outputs beyond the first 32.
-	for (int i = 0 ; i < num_new_devices ; ++i)
+	return 0;
+}
+
+// Wake up the effect thread, starting it if it's not already running.
+// Must be called with 'g_cs' held.
+static bool lwz_effects_kick(lwz_context_t *h)
+{
+	if (h->effects.hthread == NULL)
 	{
-		// get the added device
-		int newidx = new_devices[i];
-		lwz_device_t *newdev = &h->devices[newidx];
+		if (h->effects.hkick == NULL)
+		{
+			h->effects.hkick = CreateEvent(NULL, FALSE, FALSE, NULL);
+			h->effects.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+			h->effects.hdone = CreateEvent(NULL, TRUE, FALSE, NULL);
+		}
 
-		// check if it's an LedWiz with more than 32 ports
-		if (newdev->device_type == LWZ_DEVICE_TYPE_PINSCAPE && newdev->num_outputs > 32)
+		if (h->effects.hkick == NULL ||
+			h->effects.hquit == NULL ||
+			h->effects.hdone == NULL)
 		{
-			// add a virtual device for each additional block of ports
-			for (int vidx = newidx + 1, portno = 32 ;
-				 vidx < LWZ_MAX_DEVICES && portno < newdev->num_outputs ;
-				 ++vidx, portno += 32)
-			{
-				// if this slot isn't already populated with a real device,
-				// add the virtual device
-				lwz_device_t *vdev = &h->devices[vidx];
-				if (vdev->device_type == LWZ_DEVICE_TYPE_NONE)
-				{
-					// set it up as a virtual LedWiz for this block of
-					// ports, referring back to the real Pinscape device
-					vdev->device_type = LWZ_DEVICE_TYPE_PINSCAPE_VIRT;
-					vdev->ps_virtual_lwz.base_unit = newidx;
-
-					// synthesize a name based on the base unit name
-					_snprintf_s(vdev->device_name, sizeof(vdev->device_name), _TRUNCATE,
-								"%s Ports %d-%d", h->devices[newidx].device_name, portno+1, portno+32);
-
-					// count this as a new device in the notification list
-					if (num_new_devices < LWZ_MAX_DEVICES)
-						new_devices[num_new_devices++] = vidx;
-				}
-			}
+			return false;
 		}
+
+		h->effects.hthread = CreateThread(NULL, 0, EffectThreadProc, (void*)h, 0, NULL);
+		if (h->effects.hthread == NULL)
+			return false;
 	}
 
-	// add all of the newly found devices
-	lwz_add(h, num_new_devices, new_devices);
+	SetEvent(h->effects.hkick);
+	return true;
 }
 
-static void lwz_freelist(lwz_context_t *h)
+// Stop the effect thread.  As with lwz_discovery_stop(), this must be
+// called WITHOUT 'g_cs' held.
+static void lwz_effects_stop(lwz_context_t *h)
 {
-	for (int i = 0; i < LWZ_MAX_DEVICES; i++)
+	if (h == NULL)
+		return;
+
+	if (h->effects.hthread != NULL)
 	{
-		if (h->devices[i].hudev != NULL)
-		{
-			usbdev_release(h->devices[i].hudev);
-			h->devices[i].hudev = NULL;
-		}
+		SetEvent(h->effects.hquit);
+		WaitForSingleObject(h->effects.hdone, INFINITE);
+		CloseHandle(h->effects.hthread);
+		h->effects.hthread = NULL;
+	}
+
+	if (h->effects.hkick != NULL)
+	{
+		CloseHandle(h->effects.hkick);
+		h->effects.hkick = NULL;
+	}
+
+	if (h->effects.hquit != NULL)
+	{
+		CloseHandle(h->effects.hquit);
+		h->effects.hquit = NULL;
+	}
+
+	if (h->effects.hdone != NULL)
+	{
+		CloseHandle(h->effects.hdone);
+		h->effects.hdone = NULL;
 	}
 }
 
@@ -1389,6 +4856,7 @@ typedef struct {
 	HUDEV hudev;
 	packet_type_t typ;
 	size_t ndata;
+	LONGLONG t_queued;	// QueryPerformanceCounter() time the chunk was added
 	uint8_t data[32];
 } chunk_t;
 
@@ -1408,6 +4876,7 @@ typedef struct {
 	bool rblocked;
 	bool wblocked;
 	bool eblocked;
+	LONGLONG perf_freq;
 	chunk_t buf[QUEUE_LENGTH];
 } queue_t;
 
@@ -1421,7 +4890,8 @@ static DWORD WINAPI QueueThreadProc(LPVOID lpParameter)
 		uint8_t buffer[64];
 
 		HUDEV hudev = NULL;
-		size_t ndata = queue_shift(h, &hudev, &buffer[0], sizeof(buffer));
+		LONGLONG t_queued = 0;
+		size_t ndata = queue_shift(h, &hudev, &t_queued, &buffer[0], sizeof(buffer));
 
 		// exit thread if required
 
@@ -1429,7 +4899,19 @@ static DWORD WINAPI QueueThreadProc(LPVOID lpParameter)
 			break;
 		}
 
-		usbdev_write(hudev, &buffer[0], ndata);
+		size_t const nwritten = usbdev_write(hudev, &buffer[0], ndata);
+
+		// count the time the message spent in the queue and on the wire;
+		// a coalesced message counts from when its slot was first queued
+		usbdev_stats_t * const stats = usbdev_stats(hudev);
+		if (nwritten == ndata && h->perf_freq != 0)
+		{
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			usbdev_latency_add(&stats->queue_latency, (LONG)((now.QuadPart - t_queued) * 1000000 / h->perf_freq));
+		}
+
+		InterlockedDecrement(&stats->queue_depth);
 		usbdev_release(hudev);
 	}
 
@@ -1471,6 +4953,23 @@ static void queue_close(HQUEUE hqueue, bool unload)
 		}
 	}
 
+	// Discard anything that was pushed after the "quit" item, which the
+	// thread never got to.  Each one still holds a device reference and
+	// counts in the device's queue depth.
+	while (h->level > 0)
+	{
+		chunk_t * const pc = &h->buf[h->rpos];
+		if (pc->hudev != NULL)
+		{
+			InterlockedDecrement(&usbdev_stats(pc->hudev)->queue_depth);
+			usbdev_release(pc->hudev);
+			pc->hudev = NULL;
+		}
+
+		h->rpos = (h->rpos + 1) % QUEUE_LENGTH;
+		h->level -= 1;
+	}
+
 	if (h->hrevent)
 	{
 		CloseHandle(h->hrevent);
@@ -1506,6 +5005,10 @@ static HQUEUE queue_open(void)
 
 	InitializeCriticalSection(&h->cs);
 
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	h->perf_freq = freq.QuadPart;
+
 	h->hrevent = CreateEvent(NULL, FALSE, FALSE, NULL);
 	h->hwevent = CreateEvent(NULL, FALSE, FALSE, NULL);
 	h->heevent = CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -1600,8 +5103,13 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 			// much better to have the real-time device state match the client
 			// state so that effects aren't delayed from what's going on in the
 			// game.
+			//
+			// A raw message to the same device after the PBA, such as an
+			// LWCloneU2 level message (see lwz_send_levels), can set some of
+			// the same ports, so the new PBA mustn't move ahead of it.
 			if (typ == PACKET_TYPE_PBA)
 			{
+				chunk_t *pba = NULL;
 				for (int i = 0, pos = h->rpos ; i < h->level ;
 					 ++i, pos = (pos + 1) % QUEUE_LENGTH)
 				{
@@ -1609,13 +5117,17 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 					if (chunk->hudev == hudev)
 					{
 						if (chunk->typ == PACKET_TYPE_PBA)
-						{
-							memcpy(chunk->data, pdata, ndata);
-							combined = true;
-							break;
-						}
+							pba = chunk;
+						else if (chunk->typ == PACKET_TYPE_RAW)
+							pba = NULL;
 					}
 				}
+
+				if (pba != NULL)
+				{
+					memcpy(pba->data, pdata, ndata);
+					combined = true;
+				}
 			}
 
 			// If this is an SBA message, we can overwrite the last SBA in
@@ -1668,6 +5180,7 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 			{
 				// we combined this message with a prior message, so
 				// there's no need to write it separately - we're done
+				InterlockedIncrement(&usbdev_stats(hudev)->coalesced);
 			}
 			else if (nfree <= 0)
 			{
@@ -1680,11 +5193,21 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 
 				if (hudev != NULL) {
 					usbdev_addref(hudev);
+
+					// count it in the device's queue statistics
+					usbdev_stats_t * const stats = usbdev_stats(hudev);
+					LONG const depth = InterlockedIncrement(&stats->queue_depth);
+					InterlockedIncrement(&stats->queued);
+					usbdev_stats_max(&stats->max_queue_depth, depth);
 				}
 
+				LARGE_INTEGER now;
+				QueryPerformanceCounter(&now);
+
 				pc->hudev = hudev;
 				pc->ndata = ndata;
 				pc->typ = typ;
+				pc->t_queued = now.QuadPart;
 
 				if (pdata != NULL) {
 					memcpy(&pc->data[0], pdata, ndata);
@@ -1714,7 +5237,7 @@ static size_t queue_push(HQUEUE hqueue, HUDEV hudev, packet_type_t typ, uint8_t
 	}
 }
 
-static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t nsize)
+static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, LONGLONG *pt_queued, uint8_t *pbuffer, size_t nsize)
 {
 	queue_t * const h = (queue_t*)hqueue;
 
@@ -1751,6 +5274,7 @@ static size_t queue_shift(HQUEUE hqueue, HUDEV *phudev, uint8_t *pbuffer, size_t
 				chunk_t * const pc = &h->buf[h->rpos];
 
 				*phudev = pc->hudev;
+				*pt_queued = pc->t_queued;
 				pc->hudev = NULL;
 
 				if (pc->ndata > 0) 
@@ -0,0 +1,184 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// LedWiz wire protocol codec.
+//
+// Every message to the device is an 8-byte packet:
+//
+//   64 b0 b1 b2 b3 ss 00 00   SBA: on/off bits for ports 1-32 (b0 = ports
+//                             1-8, low bit first) and pulse speed ss
+//
+//   67 b0 b1 b2 b3 ss bb 00   Pinscape SBX: as SBA, for block bb of 32
+//                             ports (0 = ports 1-32, 1 = 33-64, ...)
+//
+//   68 gg ee ee ee ee ee ee   Pinscape PBX: levels for group gg of 8
+//                             ports (0 = ports 1-8, 1 = 9-16, ...),
+//                             6 bits per port, low bits first
+//
+//   70 pp l0 l1 l2 l3 l4 l5   LWCloneU2 levels: 8-bit levels for the
+//                             ports from p on (0 = port 1), where p is
+//                             the low 5 bits of pp, and the high 3 bits
+//                             are the number of levels, 1-6 (0 = 6)
+//
+//   anything else             PBA: levels for the next 8 of ports 1-32,
+//                             where "next" is tracked by the device
+//
+// PBX only has 6 bits per port, so the flash modes 129-132 travel as
+// 60-63.  PBA and SBA are stateless on our side; a full PBA is just the
+// 32 level bytes as four packets.
+//
+// The encoders here are the only place the DLL builds SBX and PBX
+// packets, and the decoders are what we use to interpret packets that
+// other code (or other processes) have sent (see devshare.cpp).  The
+// PBX encoder takes all of the groups of a PBA update at once and
+// produces the packets for the changed ones in one pass; the level
+// conversion and comparison loops run over plain arrays, so the
+// compiler can vectorize them.
+
+#include <string.h>
+#include "lwzcodec.h"
+
+
+// Encode an SBA packet.  'banks' is the four bytes of on/off bits.
+void lwzcodec_encode_sba(uint8_t *pkt, uint8_t const *banks, uint8_t speed)
+{
+	pkt[0] = LWZCODEC_CMD_SBA;
+	memcpy(&pkt[1], banks, 4);
+	pkt[5] = speed;
+	pkt[6] = 0;
+	pkt[7] = 0;
+}
+
+// Encode an SBX packet for a block of 32 ports
+void lwzcodec_encode_sbx(uint8_t *pkt, uint8_t const *banks, uint8_t speed, int block)
+{
+	pkt[0] = LWZCODEC_CMD_SBX;
+	memcpy(&pkt[1], banks, 4);
+	pkt[5] = speed;
+	pkt[6] = (uint8_t)block;
+	pkt[7] = 0;
+}
+
+// Pack eight 6-bit codes into the six data bytes of a PBX packet
+static void lwzcodec_pack_pbx(uint8_t *pkt, uint8_t const *codes, int group)
+{
+	unsigned int const tmp1 = codes[0] | (codes[1] << 6) | (codes[2] << 12) | (codes[3] << 18);
+	unsigned int const tmp2 = codes[4] | (codes[5] << 6) | (codes[6] << 12) | (codes[7] << 18);
+
+	pkt[0] = LWZCODEC_CMD_PBX;
+	pkt[1] = (uint8_t)group;
+	pkt[2] = (uint8_t)(tmp1 & 0xFF);
+	pkt[3] = (uint8_t)((tmp1 >> 8) & 0xFF);
+	pkt[4] = (uint8_t)((tmp1 >> 16) & 0xFF);
+	pkt[5] = (uint8_t)(tmp2 & 0xFF);
+	pkt[6] = (uint8_t)((tmp2 >> 8) & 0xFF);
+	pkt[7] = (uint8_t)((tmp2 >> 16) & 0xFF);
+}
+
+// Compare two sets of levels, 'ngroups' groups of 8 ports each, and
+// return a mask with a bit set for each group that differs
+unsigned int lwzcodec_changed_groups(uint8_t const *levels, uint8_t const *sent, int ngroups)
+{
+	unsigned int mask = 0;
+	for (int g = 0 ; g < ngroups ; ++g)
+	{
+		// OR the byte differences together rather than stopping at the
+		// first one, which keeps the loop free of branches
+		uint8_t diff = 0;
+		for (int i = 0 ; i < 8 ; ++i)
+			diff |= (uint8_t)(levels[g*8 + i] ^ sent[g*8 + i]);
+
+		if (diff != 0)
+			mask |= (1u << g);
+	}
+
+	return mask;
+}
+
+// Encode PBX packets for the groups in 'group_mask' out of 'ngroups'
+// groups of 8 levels, numbering the groups from 'first_group' on the
+// device.  Writes 8 bytes per group to 'out', which must have room for
+// 'ngroups' packets.  Returns the number of bytes written.
+size_t lwzcodec_encode_pbx_groups(uint8_t *out, uint8_t const *levels, int first_group, int ngroups, unsigned int group_mask)
+{
+	// convert all of the levels in one pass
+	uint8_t codes[LWZCODEC_MAX_PORTS];
+	int const nports = ngroups * 8;
+	for (int i = 0 ; i < nports ; ++i)
+		codes[i] = lwzcodec_pbx_code(levels[i]);
+
+	uint8_t *pkt = out;
+	for (int g = 0 ; g < ngroups ; ++g)
+	{
+		if ((group_mask & (1u << g)) == 0)
+			continue;
+
+		lwzcodec_pack_pbx(pkt, &codes[g*8], first_group + g);
+		pkt += 8;
+	}
+
+	return pkt - out;
+}
+
+// Encode LWCloneU2 level packets for 'nports' 8-bit levels, for the ports
+// from 'first_port' on (0-31).  Writes 8 bytes per 6 ports, rounded up,
+// to 'out'.  Returns the number of bytes written.
+size_t lwzcodec_encode_levels(uint8_t *out, uint8_t const *levels, int first_port, int nports)
+{
+	uint8_t *pkt = out;
+	for (int i = 0 ; i < nports ; i += 6, pkt += 8)
+	{
+		int const n = (nports - i < 6) ? nports - i : 6;
+
+		pkt[0] = LWZCODEC_CMD_LEVELS;
+		pkt[1] = (uint8_t)(((first_port + i) & 0x1F) | ((n & 0x07) << 5));
+		memcpy(&pkt[2], &levels[i], n);
+		memset(&pkt[2 + n], 0x00, 6 - n);
+	}
+
+	return pkt - out;
+}
+
+// Decode an SBA or SBX packet into its four bytes of on/off bits and
+// the pulse speed.  Returns the block of 32 ports it addresses (always
+// 0 for SBA), or -1 if it's not an SBA or SBX packet.
+int lwzcodec_decode_sbx(uint8_t const *pkt, uint8_t *banks, uint8_t *pspeed)
+{
+	if (pkt[0] != LWZCODEC_CMD_SBA && pkt[0] != LWZCODEC_CMD_SBX)
+		return -1;
+
+	memcpy(banks, &pkt[1], 4);
+	*pspeed = pkt[5];
+
+	return (pkt[0] == LWZCODEC_CMD_SBA) ? 0 : pkt[6];
+}
+
+// Decode a PBX packet into eight brightness levels.  Returns the group
+// of 8 ports it addresses, or -1 if it's not a PBX packet.
+int lwzcodec_decode_pbx(uint8_t const *pkt, uint8_t *levels)
+{
+	if (pkt[0] != LWZCODEC_CMD_PBX)
+		return -1;
+
+	unsigned int const tmp1 = pkt[2] | (pkt[3] << 8) | (pkt[4] << 16);
+	unsigned int const tmp2 = pkt[5] | (pkt[6] << 8) | (pkt[7] << 16);
+	for (int k = 0 ; k < 8 ; ++k)
+		levels[k] = lwzcodec_pbx_level((uint8_t)(((k < 4 ? tmp1 : tmp2) >> (6 * (k & 3))) & 0x3F));
+
+	return pkt[1];
+}
@@ -0,0 +1,51 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef LWZCODEC_H__INCLUDED
+#define LWZCODEC_H__INCLUDED
+
+
+// LedWiz wire protocol encoding and decoding (see lwzcodec.cpp).  This
+// header sticks to the standard integer types, which ledwiz.h provides
+// where the compiler has no <stdint.h> (VS2008).
+
+#include <stddef.h>
+#include "../include/ledwiz.h"
+
+// command codes
+#define LWZCODEC_CMD_SBA        64      // SBA: on/off bits for ports 1-32, and the pulse speed
+#define LWZCODEC_CMD_SBX        67      // Pinscape SBX: SBA for the block of 32 ports in byte 6
+#define LWZCODEC_CMD_PBX        68      // Pinscape PBX: levels for the group of 8 ports in byte 1
+#define LWZCODEC_CMD_LEVELS     70      // LWCloneU2: 8-bit levels for up to 6 ports from the port in byte 1
+
+#define LWZCODEC_MAX_PORTS      128     // largest port count the encoders handle (Pinscape)
+
+// brightness level and 6-bit PBX code conversions; PBX codes 60-63 are
+// the flash modes 129-132
+static inline uint8_t lwzcodec_pbx_code(uint8_t level) { return (uint8_t)((level >= 129 ? level - 129 + 60 : level) & 0x3F); }
+static inline uint8_t lwzcodec_pbx_level(uint8_t code) { return (uint8_t)(code >= 60 ? code - 60 + 129 : code); }
+
+void lwzcodec_encode_sba(uint8_t *pkt, uint8_t const *banks, uint8_t speed);
+void lwzcodec_encode_sbx(uint8_t *pkt, uint8_t const *banks, uint8_t speed, int block);
+unsigned int lwzcodec_changed_groups(uint8_t const *levels, uint8_t const *sent, int ngroups);
+size_t lwzcodec_encode_pbx_groups(uint8_t *out, uint8_t const *levels, int first_group, int ngroups, unsigned int group_mask);
+size_t lwzcodec_encode_levels(uint8_t *out, uint8_t const *levels, int first_port, int nports);
+int lwzcodec_decode_sbx(uint8_t const *pkt, uint8_t *banks, uint8_t *pspeed);
+int lwzcodec_decode_pbx(uint8_t const *pkt, uint8_t *levels);
+
+
+
+#endif
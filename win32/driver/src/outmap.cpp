@@ -0,0 +1,162 @@
+/*
+ *   LWCloneU2 Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, write to the Free Software Foundation, Inc.,
+ *   59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+// Logical output map.
+//
+// A cabinet with several LedWiz units and Pinscape boards has its outputs
+// spread over many unit numbers, and a Pinscape board's ports beyond 32
+// show up as virtual LedWiz units after the board's own unit.  The output
+// map lets a program number the outputs once, in a text file, and address
+// them by that number regardless of where they're attached.
+//
+// Each line of the file maps a run of logical outputs onto consecutive
+// ports of one unit:
+//
+//   <output> <unit> <port> [<count>]
+//
+// <output> is the first logical output number, <unit> the LedWiz unit
+// number (1-16, or an extended unit number up to 1024), <port> the first
+// port number on that unit, and <count> the number of outputs in the run
+// (1 if omitted).  Port numbers run over the unit's full port range, so
+// port 33 on a Pinscape unit is the first port of its first virtual
+// unit.  Blank lines are ignored, and '#' or ';' starts a comment.  For
+// example:
+//
+//   # flashers on the first LedWiz, solenoids on the Pinscape board
+//   1    1  1  16
+//   17   3  1  64
+//
+// The file is compiled into flat arrays of unit index and port, so a
+// lookup is just an index.  Ports past 32 are kept as port numbers on
+// the physical unit, and resolved to the virtual unit that covers them
+// when they're used, since a virtual unit doesn't necessarily get the
+// next unit number.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "outmap.h"
+
+
+// Parse one line into its numbers.  Returns the number of fields, or -1
+// for anything that isn't a number.
+static int outmap_parse_line(char *line, unsigned long *fields, int maxfields)
+{
+	// strip comments
+	char *p = strpbrk(line, "#;");
+	if (p != NULL)
+		*p = '\0';
+
+	int n = 0;
+	for (p = line ; ; )
+	{
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			++p;
+
+		if (*p == '\0')
+			return n;
+
+		char *end;
+		unsigned long const v = strtoul(p, &end, 10);
+		if (end == p || n >= maxfields)
+			return -1;
+
+		fields[n++] = v;
+		p = end;
+	}
+}
+
+// Load and compile a map file.  Returns NULL if the file can't be read
+// or isn't valid; for a syntax error, '*perror_line' gets the line number.
+outmap_t *outmap_load(LPCSTR path, UINT *perror_line)
+{
+	outmap_t *map = NULL;
+	FILE *fp = NULL;
+	char line[256];
+	UINT lineno = 0;
+
+	*perror_line = 0;
+
+	if (fopen_s(&fp, path, "r") != 0 || fp == NULL)
+		return NULL;
+
+	map = (outmap_t *)malloc(sizeof(outmap_t));
+	if (map == NULL)
+		goto Failed;
+
+	memset(map, 0x00, sizeof(*map));
+	map->unit = (WORD *)malloc(OUTMAP_MAX_OUTPUTS * sizeof(WORD));
+	map->port = (WORD *)malloc(OUTMAP_MAX_OUTPUTS * sizeof(WORD));
+	if (map->unit == NULL || map->port == NULL)
+		goto Failed;
+
+	for (UINT i = 0 ; i < OUTMAP_MAX_OUTPUTS ; ++i)
+		map->unit[i] = OUTMAP_UNMAPPED;
+	memset(map->port, 0x00, OUTMAP_MAX_OUTPUTS * sizeof(WORD));
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		++lineno;
+
+		unsigned long f[4];
+		int const n = outmap_parse_line(line, f, 4);
+		if (n == 0)
+			continue;
+
+		// output, unit and port are required, the count is optional
+		unsigned long const count = (n == 4) ? f[3] : 1;
+		if (n < 3
+			|| f[0] < 1 || count < 1 || count > OUTMAP_MAX_OUTPUTS || f[0] - 1 + count > OUTMAP_MAX_OUTPUTS
+			|| f[1] < 1 || f[1] > OUTMAP_MAX_UNITS
+			|| f[2] < 1 || f[2] > OUTMAP_MAX_PORTS || (f[2] - 1) + count > OUTMAP_MAX_PORTS)
+		{
+			*perror_line = lineno;
+			goto Failed;
+		}
+
+		// fill in the run
+		for (unsigned long i = 0 ; i < count ; ++i)
+		{
+			unsigned long const output = f[0] - 1 + i;
+			map->unit[output] = (WORD)(f[1] - 1);
+			map->port[output] = (WORD)(f[2] - 1 + i);
+			if (output + 1 > map->count)
+				map->count = output + 1;
+		}
+	}
+
+	fclose(fp);
+	return map;
+
+	Failed:
+	if (fp != NULL)
+		fclose(fp);
+	outmap_free(map);
+	return NULL;
+}
+
+void outmap_free(outmap_t *map)
+{
+	if (map == NULL)
+		return;
+
+	free(map->unit);
+	free(map->port);
+	free(map);
+}
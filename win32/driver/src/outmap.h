@@ -0,0 +1,40 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef OUTMAP_H__INCLUDED
+#define OUTMAP_H__INCLUDED
+
+
+// Logical output map (see outmap.cpp).  Logical output N (1-based) is
+// port[N-1] on unit index unit[N-1].  The port counts over the physical
+// unit's full range, so ports from 32 up are on Pinscape virtual units.
+#define OUTMAP_MAX_OUTPUTS   4096   // highest logical output number
+#define OUTMAP_MAX_UNITS     1024   // unit indices are 0 to this - 1 (LWZ_MAX_UNITS, including extended units)
+#define OUTMAP_MAX_PORTS     512    // highest port number on a unit
+#define OUTMAP_UNMAPPED      0xFFFF // unit[] value for an output the map doesn't cover
+
+typedef struct {
+	UINT count;             // number of logical outputs (the highest output number in the file)
+	WORD *unit;             // unit index for each output
+	WORD *port;             // port on the unit, from 0
+} outmap_t;
+
+outmap_t *outmap_load(LPCSTR path, UINT *perror_line);
+void outmap_free(outmap_t *map);
+
+
+
+#endif
@@ -18,10 +18,13 @@
 
 #include <crtdbg.h>
 #include <windows.h>
+#include <string.h>
 #include "usbdev.h"
+#include "devshare.h"
 
 
 static void usbdev_close_internal(HUDEV hudev);
+static DWORD WINAPI usbdev_reader_proc(LPVOID lpParameter);
 
 // maximum wait time for reading/writing, in milliseconds
 #define USB_READ_TIMEOUT_MS             500
@@ -30,6 +33,19 @@ static void usbdev_close_internal(HUDEV hudev);
 // minimum interval between consecutive writes for a real LedWiz unit, in milliseconds
 #define LEDWIZ_MIN_WRITE_INTERVAL_MS    5
 
+// number of input reports retained by the background reader; must be a power of two
+#define USB_INPUT_RING_LENGTH           16
+
+// number of consecutive failed writes after which we consider the device
+// handle dead (see usbdev_failed)
+#define USB_FAILED_WRITE_LIMIT          3
+
+// Reopen retry backoff, in milliseconds: the wait after the first failed
+// attempt, doubling with each further failure up to the maximum (see
+// usbdev_reopen_wait)
+#define USB_REOPEN_RETRY_MS             100
+#define USB_REOPEN_MAX_RETRY_MS         5000
+
 
 struct CAutoLockCS  // helper class to lock a critical section, and unlock it automatically
 {
@@ -42,13 +58,54 @@ struct CAutoLockCS  // helper class to lock a critical section, and unlock it au
 
 
 
+// One slot of the input report ring.  The reader thread is the only
+// writer; any number of threads can read.  'seq' works as a sequence
+// lock: it's odd while the slot is being rewritten, so a reader that
+// sees the same even value before and after copying the data knows
+// that it got a consistent snapshot.
+typedef struct {
+	volatile LONG seq;
+	DWORD num;					// report number (running count) stored in this slot
+	DWORD len;					// report length, excluding the HID report ID prefix
+	BYTE data[64];
+} usbdev_input_slot_t;
+
+// Input callback subscription.  Subscriptions are immutable once
+// published, so the reader thread can pick one up with a single pointer
+// read.  Replaced subscriptions are kept on a list until the device is
+// closed, since the reader thread might still be using one.
+typedef struct usbdev_input_sub_s {
+	USBDEV_INPUT_PROC proc;
+	void *puser;
+	LONG tag;
+	struct usbdev_input_sub_s *next;
+} usbdev_input_sub_t;
+
 typedef struct {
 	CRITICAL_SECTION cslock;
+	CRITICAL_SECTION rlock;
 	HANDLE hrevent;
 	HANDLE hwevent;
 	HANDLE hdev;
 	LONG refcount;
 
+	// Background input reader.  Devices that send input reports (such as
+	// the Pinscape joystick and plunger reports) stream them continuously,
+	// so if nobody reads them, the HID driver's buffer fills up and a
+	// later synchronous read gets a stale report from the head of the
+	// queue.  The reader thread keeps one overlapped read in flight at
+	// all times and moves each report into the ring as it arrives.
+	HANDLE hreader;						// reader thread
+	HANDLE hstopevent;					// signaled to tell the reader thread to exit
+	HANDLE hdoneevent;					// signaled by the reader thread as its last act
+	HANDLE hinputevent;					// auto-reset, signaled on each new report
+	DWORD input_rpt_len;				// device input report length
+	volatile LONG input_count;			// total number of reports received
+	DWORD input_rnum;					// next report number for usbdev_read()
+	usbdev_input_sub_t * volatile input_sub;	// current input callback, if any
+	usbdev_input_sub_t *input_sub_retired;		// replaced subscriptions, freed on close
+	usbdev_input_slot_t input_ring[USB_INPUT_RING_LENGTH];
+
 	// The firmware in real LedWiz units seems to have a serious bug
 	// in its USB interface that allows an incoming packet to overwite
 	// the previous packet while the previous packet is still being
@@ -85,8 +142,37 @@ typedef struct {
 	// For a real LedWiz, the timing should be 5 to 10 ms.  For 
 	// an emulator, it can be 0 ms.
 
+	//
+	// Other processes can be writing to the same device, so when the
+	// device has a shared state block (see devshare.cpp), the pacing
+	// follows the schedule in the shared block instead of our own
+	// last write time.
+
 	DWORD last_write_ticks;				// system tick count (milliseconds) at time of last write operation
 	unsigned int min_write_interval;	// minimum delay time between consecutive writes
+
+	HDEVSHARE share;					// state shared with other processes, or NULL
+
+	// Write failure tracking.  A USB bus reset or a hub power glitch
+	// leaves the handle dead even though the device comes back at the
+	// same path a moment later, and nothing tells us about it unless
+	// the client registered a window for device change notifications.
+	// So after a run of failed writes, we stop writing (rather than
+	// waiting out the write timeout on every message), and signal the
+	// failure event, so that the owner can reopen the device by its
+	// path (see usbdev_reopen).
+	char *path;							// device interface path, for reopening
+	volatile LONG write_failures;		// consecutive failed writes
+	DWORD fail_ticks;					// GetTickCount() time of the first failure in the run
+	HANDLE hfailevent;					// signaled when the device is considered failed, or NULL
+	DWORD reopen_ticks;					// GetTickCount() time of the last failed reopen attempt
+	DWORD reopen_delay;					// wait before the next attempt, 0 if none has failed
+
+	// I/O counters, for when there's no shared state block (see
+	// usbdev_stats).  All updates use the Interlocked functions, since
+	// other processes update the shared counters too.
+	usbdev_stats_t stats;
+	LONGLONG perf_freq;					// QueryPerformanceFrequency(), for timing writes
 } usbdev_context_t;
 
 
@@ -106,20 +192,38 @@ HUDEV usbdev_create(LPCSTR devicepath)
 	h->min_write_interval = LEDWIZ_MIN_WRITE_INTERVAL_MS;
 	h->last_write_ticks = GetTickCount();
 
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	h->perf_freq = freq.QuadPart;
+
 	InitializeCriticalSection(&h->cslock);
+	InitializeCriticalSection(&h->rlock);
 
 	h->hrevent = CreateEvent(NULL, TRUE, FALSE, NULL);
 	h->hwevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	h->hstopevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	h->hdoneevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	h->hinputevent = CreateEvent(NULL, FALSE, FALSE, NULL);
 
 	if (h->hrevent == NULL ||
-		h->hwevent == NULL)
+		h->hwevent == NULL ||
+		h->hstopevent == NULL ||
+		h->hdoneevent == NULL ||
+		h->hinputevent == NULL)
 	{
 		goto Failed;
 	}
 
+	// remember the path, for reopening the device after a failure
+
+	h->path = _strdup(devicepath);
+	if (h->path == NULL)
+		goto Failed;
+
 	// open device
 
-	HANDLE hdev  = CreateFileA(
+	HANDLE hdev;
+	hdev = CreateFileA(
 		devicepath,
 		GENERIC_READ | GENERIC_WRITE,
 		FILE_SHARE_READ | FILE_SHARE_WRITE,
@@ -149,6 +253,250 @@ void usbdev_set_min_write_interval(HUDEV hudev, unsigned int interval_ms)
 	}
 }
 
+// Attach the device's cross-process shared state.  The device takes
+// ownership of the handle and closes it along with the device.
+void usbdev_set_share(HUDEV hudev, HDEVSHARE hshare)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h == NULL)
+	{
+		devshare_close(hshare);
+		return;
+	}
+
+	AUTOLOCK(h->cslock);
+
+	if (h->share != NULL)
+		devshare_close(h->share);
+
+	h->share = hshare;
+}
+
+// Set an event to signal when writes to the device start failing (see
+// usbdev_failed).  The caller keeps ownership of the event handle.
+void usbdev_set_failure_event(HUDEV hudev, HANDLE hevent)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h == NULL)
+		return;
+
+	AUTOLOCK(h->cslock);
+
+	h->hfailevent = hevent;
+}
+
+// Has the device handle failed?  It has after USB_FAILED_WRITE_LIMIT
+// consecutive failed writes; from then on, writes are dropped until the
+// device is reopened.  '*pfail_ticks' gets the GetTickCount() time of
+// the first failure.
+bool usbdev_failed(HUDEV hudev, DWORD *pfail_ticks)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h == NULL)
+		return false;
+
+	AUTOLOCK(h->cslock);
+
+	if (pfail_ticks != NULL)
+		*pfail_ticks = h->fail_ticks;
+
+	return h->write_failures >= USB_FAILED_WRITE_LIMIT;
+}
+
+// How long until the next reopen attempt is due, in milliseconds.  The
+// first attempt is due right away; after that, the wait doubles with each
+// failed attempt, up to USB_REOPEN_MAX_RETRY_MS.  A device that's gone for
+// good is only removed when the device change notification arrives, which
+// never comes if the client didn't register a window, so the retries
+// have to get cheap rather than stop.
+DWORD usbdev_reopen_wait(HUDEV hudev)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h == NULL)
+		return 0;
+
+	AUTOLOCK(h->cslock);
+
+	DWORD const elapsed = GetTickCount() - h->reopen_ticks;
+	return (elapsed >= h->reopen_delay) ? 0 : h->reopen_delay - elapsed;
+}
+
+// Reopen the device at its original path, replacing a failed handle.
+// Everything else about the device carries over: the input reader and
+// its subscriber, the write pacing, and the shared state block, whose
+// recorded device state is discarded, since a device that dropped off
+// the bus has been reset.  Returns false if the device can't be opened
+// (yet), leaving the old handle in place.
+bool usbdev_reopen(HUDEV hudev)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h == NULL)
+		return false;
+
+	HANDLE const hdev = CreateFileA(
+		h->path,
+		GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED,
+		NULL);
+
+	if (hdev == INVALID_HANDLE_VALUE)
+	{
+		AUTOLOCK(h->cslock);
+
+		h->reopen_ticks = GetTickCount();
+		h->reopen_delay = (h->reopen_delay == 0) ? USB_REOPEN_RETRY_MS : h->reopen_delay * 2;
+		if (h->reopen_delay > USB_REOPEN_MAX_RETRY_MS)
+			h->reopen_delay = USB_REOPEN_MAX_RETRY_MS;
+
+		return false;
+	}
+
+	AUTOLOCK(h->rlock);
+
+	// Stop the reader thread, which has most likely exited already on
+	// a read error.  It's restarted on the new handle below.
+	bool const had_reader = (h->hreader != NULL);
+	if (had_reader)
+	{
+		SetEvent(h->hstopevent);
+		WaitForSingleObject(h->hdoneevent, INFINITE);
+		CloseHandle(h->hreader);
+		h->hreader = NULL;
+		ResetEvent(h->hstopevent);
+		ResetEvent(h->hdoneevent);
+	}
+
+	{
+		AUTOLOCK(h->cslock);
+
+		CloseHandle(h->hdev);
+		h->hdev = hdev;
+		h->write_failures = 0;
+		h->reopen_delay = 0;
+
+		if (h->share != NULL)
+			devshare_forget(h->share);
+	}
+
+	if (had_reader)
+		h->hreader = CreateThread(NULL, 0, usbdev_reader_proc, (void*)h, 0, NULL);
+
+	return true;
+}
+
+// Get the device's I/O counters: the ones in the shared state block if
+// the device has one, otherwise our own.  The owner's write queue
+// updates the queue counters directly, with the Interlocked functions.
+usbdev_stats_t *usbdev_stats(HUDEV hudev)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+	if (h == NULL)
+		return NULL;
+
+	if (h->share != NULL)
+		return devshare_stats(h->share);
+
+	return &h->stats;
+}
+
+// Zero the device's I/O counters, other than the current queue depth,
+// which still has to balance out as the queue drains
+void usbdev_reset_stats(HUDEV hudev)
+{
+	usbdev_stats_t * const stats = usbdev_stats(hudev);
+	if (stats == NULL)
+		return;
+
+	// the structure is all LONGs
+	volatile LONG * const p = (volatile LONG *)stats;
+	for (size_t i = 0 ; i < sizeof(*stats) / sizeof(LONG) ; ++i)
+	{
+		if (&p[i] != &stats->queue_depth)
+			InterlockedExchange(&p[i], 0);
+	}
+}
+
+// Raise a shared maximum counter to 'value'.  Other threads and
+// processes can be raising it at the same time, so this retries until
+// the counter is at least 'value'.
+void usbdev_stats_max(volatile LONG *pmax, LONG value)
+{
+	for (;;)
+	{
+		LONG const cur = *pmax;
+		if (value <= cur || InterlockedCompareExchange(pmax, value, cur) == cur)
+			return;
+	}
+}
+
+// latency histogram bucket for a time in microseconds, and the upper
+// edge of a bucket (see usbdev.h)
+static int usbdev_latency_bucket(LONG us)
+{
+	if (us < 10000)
+		return us / 100;
+	if (us < 100000)
+		return 100 + (us - 10000) / 1000;
+	if (us < 1000000)
+		return 190 + (us - 100000) / 100000;
+
+	return USBDEV_LATENCY_BUCKETS - 1;
+}
+
+static DWORD usbdev_latency_edge(int bucket)
+{
+	if (bucket < 100)
+		return (bucket + 1) * 100;
+	if (bucket < 190)
+		return 10000 + (bucket - 99) * 1000;
+
+	return 100000 + (bucket - 189) * 100000;
+}
+
+// Add a time, in microseconds, to a latency histogram
+void usbdev_latency_add(usbdev_latency_t *lat, LONG us)
+{
+	if (us < 0)
+		us = 0;
+
+	InterlockedIncrement(&lat->bucket[usbdev_latency_bucket(us)]);
+	usbdev_stats_max(&lat->max_us, us);
+}
+
+// Figure a percentile from a latency histogram, in microseconds.  The
+// result is the upper edge of the bucket it falls in, or the longest
+// time if it falls in the overflow bucket.  Returns 0 if the histogram
+// is empty.
+DWORD usbdev_latency_percentile(usbdev_latency_t const *lat, unsigned int percent)
+{
+	// take a snapshot, since writers can update the buckets as we go
+	LONG hist[USBDEV_LATENCY_BUCKETS];
+	LONGLONG total = 0;
+	for (int i = 0 ; i < USBDEV_LATENCY_BUCKETS ; ++i)
+	{
+		hist[i] = lat->bucket[i];
+		total += hist[i];
+	}
+
+	if (total == 0)
+		return 0;
+
+	// find the bucket containing the requested rank
+	LONGLONG const rank = (total * percent + 99) / 100;
+	LONGLONG count = 0;
+	for (int i = 0 ; i < USBDEV_LATENCY_BUCKETS - 1 ; ++i)
+	{
+		count += hist[i];
+		if (count >= rank)
+			return usbdev_latency_edge(i);
+	}
+
+	return lat->max_us;
+}
+
 static void usbdev_close_internal(HUDEV hudev)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
@@ -156,6 +504,39 @@ static void usbdev_close_internal(HUDEV hudev)
 	if (h == NULL)
 		return;
 
+	if (h->hreader)
+	{
+		// Stop the reader thread.  As with the I/O queue thread, we can't
+		// wait for the thread handle itself, since we might be called from
+		// within the DLL unload; sync with the 'done' event instead.
+		SetEvent(h->hstopevent);
+		WaitForSingleObject(h->hdoneevent, INFINITE);
+		CloseHandle(h->hreader);
+		h->hreader = NULL;
+	}
+
+	usbdev_input_sub_t *sub = h->input_sub;
+	while (sub != NULL)
+	{
+		usbdev_input_sub_t * const next = sub->next;
+		free(sub);
+		sub = next;
+	}
+
+	sub = h->input_sub_retired;
+	while (sub != NULL)
+	{
+		usbdev_input_sub_t * const next = sub->next;
+		free(sub);
+		sub = next;
+	}
+
+	if (h->share)
+	{
+		devshare_close(h->share);
+		h->share = NULL;
+	}
+
 	if (h->hrevent)
 	{
 		CloseHandle(h->hrevent);
@@ -168,12 +549,33 @@ static void usbdev_close_internal(HUDEV hudev)
 		h->hwevent = NULL;
 	}
 
+	if (h->hstopevent)
+	{
+		CloseHandle(h->hstopevent);
+		h->hstopevent = NULL;
+	}
+
+	if (h->hdoneevent)
+	{
+		CloseHandle(h->hdoneevent);
+		h->hdoneevent = NULL;
+	}
+
+	if (h->hinputevent)
+	{
+		CloseHandle(h->hinputevent);
+		h->hinputevent = NULL;
+	}
+
 	if (h->hdev != INVALID_HANDLE_VALUE)
 	{
 		CloseHandle(h->hdev);
 		h->hdev = INVALID_HANDLE_VALUE;
 	}
 
+	free(h->path);
+
+	DeleteCriticalSection(&h->rlock);
 	DeleteCriticalSection(&h->cslock);
 
 	free(h);
@@ -214,119 +616,301 @@ HANDLE usbdev_handle(HUDEV hudev)
 	return h->hdev;
 }
 
-size_t usbdev_read(HUDEV hudev, void *psrc, size_t ndata)
+// Store a newly received report in the input ring and hand it to the
+// subscriber, if any.  Called only on the reader thread.
+static void usbdev_input_push(usbdev_context_t *h, BYTE const *pdata, DWORD ndata)
+{
+	DWORD const num = (DWORD)h->input_count;
+	usbdev_input_slot_t * const s = &h->input_ring[num % USB_INPUT_RING_LENGTH];
+
+	if (ndata > sizeof(s->data))
+		ndata = sizeof(s->data);
+
+	// odd sequence number while we rewrite the slot, even again when done
+	InterlockedIncrement(&s->seq);
+	s->num = num;
+	s->len = ndata;
+	memcpy(s->data, pdata, ndata);
+	InterlockedIncrement(&s->seq);
+
+	// publish the report and wake up any waiting reader
+	InterlockedExchange(&h->input_count, (LONG)(num + 1));
+	SetEvent(h->hinputevent);
+
+	// invoke the subscriber callback
+	usbdev_input_sub_t * const sub = h->input_sub;
+	if (sub != NULL && sub->proc != NULL)
+		sub->proc(sub->puser, sub->tag, pdata, ndata);
+}
+
+// Copy report number 'num' out of the ring.  Returns false if the slot
+// has already been reused for a newer report.
+static bool usbdev_input_fetch(usbdev_context_t *h, DWORD num, BYTE *pdata, size_t *pndata)
+{
+	usbdev_input_slot_t * const s = &h->input_ring[num % USB_INPUT_RING_LENGTH];
+
+	for (;;)
+	{
+		LONG const seq = s->seq;
+		MemoryBarrier();
+
+		// if the reader thread is rewriting the slot right now, try again
+		if ((seq & 1) != 0)
+		{
+			YieldProcessor();
+			continue;
+		}
+
+		DWORD const snum = s->num;
+		size_t n = s->len;
+		if (n > *pndata)
+			n = *pndata;
+
+		memcpy(pdata, s->data, n);
+
+		MemoryBarrier();
+
+		// if the slot didn't change while we were copying, we have a consistent copy
+		if (s->seq == seq)
+		{
+			*pndata = n;
+			return (snum == num);
+		}
+	}
+}
+
+static DWORD WINAPI usbdev_reader_proc(LPVOID lpParameter)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)lpParameter;
+	HANDLE const hwait[2] = { h->hstopevent, h->hrevent };
+
+	for (;;)
+	{
+		// stop if we've been asked to, even if reads keep completing immediately
+		if (WaitForSingleObject(h->hstopevent, 0) == WAIT_OBJECT_0)
+			break;
+
+		BYTE buffer[65];
+		DWORD nread = 0;
+
+		OVERLAPPED ol = {};
+		ol.hEvent = h->hrevent;
+
+		BOOL bres = ReadFile(h->hdev, buffer, h->input_rpt_len + 1, NULL, &ol);
+
+		if (bres != TRUE)
+		{
+			// anything other than "pending" means the device is gone
+			if (GetLastError() != ERROR_IO_PENDING)
+				break;
+
+			// wait for the read to complete, or for a request to stop
+			if (WaitForMultipleObjects(2, hwait, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+			{
+				// Cancel the read.  This has to be done on this thread, since
+				// CancelIo() only cancels I/O issued by the calling thread.
+				// Wait for the cancellation to finish before the buffer and
+				// OVERLAPPED struct go out of scope.
+				CancelIo(h->hdev);
+				GetOverlappedResult(h->hdev, &ol, &nread, TRUE);
+				break;
+			}
+		}
+
+		if (GetOverlappedResult(h->hdev, &ol, &nread, TRUE) != TRUE)
+			break;
+
+		// store the report, minus the report ID prefix
+		if (nread > 1)
+			usbdev_input_push(h, &buffer[1], nread - 1);
+	}
+
+	SetEvent(h->hdoneevent);
+
+	return 0;
+}
+
+// Start the background input reader.  'input_report_len' is the device's
+// input report length, excluding the report ID prefix.  Devices without
+// input reports don't get a reader.
+bool usbdev_start_reader(HUDEV hudev, size_t input_report_len)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	if (h == NULL || input_report_len == 0)
+		return false;
+
+	if (input_report_len > 64)
+		input_report_len = 64;
+
+	AUTOLOCK(h->rlock);
+
+	if (h->hreader != NULL)
+		return true;
+
+	h->input_rpt_len = input_report_len;
+	h->input_rnum = (DWORD)h->input_count;
+	h->hreader = CreateThread(NULL, 0, usbdev_reader_proc, (void*)h, 0, NULL);
+
+	return (h->hreader != NULL);
+}
+
+// Get the number of input reports received so far.  This is the report
+// number that the next report to arrive will have.
+DWORD usbdev_input_count(HUDEV hudev)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	if (h == NULL)
+		return 0;
+
+	return (DWORD)h->input_count;
+}
+
+// Get the event that's signaled when a new input report arrives.  This is
+// an auto-reset event, so it's only useful to a single waiter; it lets a
+// caller wait for input from several devices at once.
+HANDLE usbdev_input_event(HUDEV hudev)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
 
 	if (h == NULL)
 		return NULL;
 
-	BYTE * pdata = (BYTE*)psrc;
+	return h->hinputevent;
+}
 
-	if (pdata == NULL)
+// Read report number '*pnum', waiting up to 'timeout_ms' for it to arrive,
+// and advance '*pnum' past it.  If the report has already been overwritten
+// in the ring, this skips ahead to the oldest report still available.
+size_t usbdev_read_next(HUDEV hudev, DWORD *pnum, void *pdata, size_t ndata, DWORD timeout_ms)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	if (h == NULL || pnum == NULL || pdata == NULL || ndata == 0)
 		return 0;
 
 	if (ndata > 64)
 		ndata = 64;
 
-	AUTOLOCK(h->cslock);
-
-	int res = 0;
-	BYTE buffer[65];
-	DWORD nread = 0;
-	BOOL bres = FALSE;
+	// only one blocking reader at a time, since the input event is auto-reset
+	AUTOLOCK(h->rlock);
 
-	OVERLAPPED ol = {};
-	ol.hEvent = h->hrevent;
+	if (h->hreader == NULL)
+		return 0;
 
-	bres = ReadFile(h->hdev, buffer, ndata + 1, NULL, &ol);
+	DWORD const t0 = GetTickCount();
 
-	if (bres != TRUE)
+	for (;;)
 	{
-		DWORD dwerror = GetLastError();
+		// if we've fallen more than a ring's length behind, skip the lost reports
+		DWORD const count = (DWORD)h->input_count;
+		DWORD const behind = count - *pnum;
+		if (behind > USB_INPUT_RING_LENGTH && behind < 0x80000000)
+			*pnum = count - USB_INPUT_RING_LENGTH;
 
-		if (dwerror == ERROR_IO_PENDING)
+		if (*pnum != count)
 		{
-			if (WaitForSingleObject(h->hrevent, USB_READ_TIMEOUT_MS) != WAIT_OBJECT_0)
+			size_t n = ndata;
+			if (usbdev_input_fetch(h, *pnum, (BYTE*)pdata, &n))
 			{
-				CancelIo(h->hdev);
+				*pnum += 1;
+				return n;
 			}
 
-			bres = TRUE;
+			// overwritten while we were looking - resync and try again
+			continue;
 		}
-	}
 
-	if (bres == TRUE)
-	{
-		bres = GetOverlappedResult(
-			h->hdev,
-			&ol,
-			&nread,
-			TRUE);
-	}
+		// nothing new yet - wait for the next report, up to the timeout
+		DWORD const dt = GetTickCount() - t0;
+		if (dt >= timeout_ms)
+			return 0;
 
-	if (bres != TRUE)
-	{
-		DWORD dwerror = GetLastError();
-		_ASSERT(0);
+		WaitForSingleObject(h->hinputevent, timeout_ms - dt);
 	}
+}
 
-	if (nread <= 1 || bres != TRUE)
-		return 0;
-
-	nread -= 1; // skip report id
+// Read the next input report in arrival order, waiting up to the standard
+// read timeout if none is available.
+size_t usbdev_read(HUDEV hudev, void *pdata, size_t ndata)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
 
-	if (ndata > nread)
-		ndata = nread;
+	if (h == NULL)
+		return 0;
 
-	memcpy(pdata, &buffer[1], ndata);
+	AUTOLOCK(h->rlock);
 
-	return ndata;
+	return usbdev_read_next(hudev, &h->input_rnum, pdata, ndata, USB_READ_TIMEOUT_MS);
 }
 
-// Clear pending input.  This reads and discards input from the device
-// as long as we have buffered input, then returns.  This can be used
-// to discard unwanted joystick status reports when preparing to send
-// a control request.
-void usbdev_clear_input(HUDEV hudev, size_t input_rpt_len)
+// Get the most recent input report without waiting.  Returns 0 if no
+// report has been received yet.  The report number is returned in '*pnum'
+// if provided, so the caller can tell whether it has seen this one before.
+size_t usbdev_read_latest(HUDEV hudev, void *pdata, size_t ndata, DWORD *pnum)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
-	AUTOLOCK(h->cslock);
-	for (int i = 0 ; i < 64 ; ++i)
+
+	if (h == NULL || pdata == NULL || ndata == 0)
+		return 0;
+
+	if (ndata > 64)
+		ndata = 64;
+
+	for (;;)
 	{
-		// make sure the requested length is within range
-		BYTE buffer[65];
-		if (input_rpt_len > sizeof(buffer))
-			input_rpt_len = sizeof(buffer);
+		DWORD const count = (DWORD)h->input_count;
+		if (count == 0)
+			return 0;
 
-		// start a non-blocking read
-		OVERLAPPED ol = {};
-		ol.hEvent = h->hrevent;
-		if (ReadFile(h->hdev, buffer, input_rpt_len, NULL, &ol))
-		{
-			// success - get the result to complete the I/O, then keep
-			// going, since the point is to clear buffered input
-			DWORD nread;
-			GetOverlappedResult(h->hdev, &ol, &nread, TRUE);
-		}
-		else
+		size_t n = ndata;
+		if (usbdev_input_fetch(h, count - 1, (BYTE*)pdata, &n))
 		{
-			// The read failed.  If the result is "pending", it means that
-			// the read was successfully initiated but that there's nothing
-			// available to satisfy the read immediately, hence the buffer
-			// is empty.  That's what we're after, so failure == success in
-			// this case.  Cancel the pending read, since we didn't actually
-			// want the data, we just wanted to know that there were no data.
-			DWORD dwerror = GetLastError();
-			if (dwerror == ERROR_IO_PENDING)
-				CancelIo(h->hdev);
+			if (pnum != NULL)
+				*pnum = count - 1;
 
-			// stop looping - consider the buffer emptied
-			break;
+			return n;
 		}
 	}
 }
 
+// Set the input report callback, replacing any previous one.  Pass a
+// null 'proc' to unsubscribe.  A callback that's already in progress on
+// the reader thread can still complete after this returns.
+void usbdev_set_input_callback(HUDEV hudev, USBDEV_INPUT_PROC proc, void *puser, LONG tag)
+{
+	usbdev_context_t * const h = (usbdev_context_t*)hudev;
+
+	if (h == NULL)
+		return;
+
+	usbdev_input_sub_t *sub = NULL;
+	if (proc != NULL)
+	{
+		sub = (usbdev_input_sub_t*)malloc(sizeof(usbdev_input_sub_t));
+		if (sub == NULL)
+			return;
+
+		sub->proc = proc;
+		sub->puser = puser;
+		sub->tag = tag;
+		sub->next = NULL;
+	}
+
+	AUTOLOCK(h->rlock);
+
+	// publish the new subscription, and retire the old one
+	usbdev_input_sub_t * const old = (usbdev_input_sub_t*)InterlockedExchangePointer(
+		(void * volatile *)&h->input_sub, sub);
+
+	if (old != NULL)
+	{
+		old->next = h->input_sub_retired;
+		h->input_sub_retired = old;
+	}
+}
+
 size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 {
 	usbdev_context_t * const h = (usbdev_context_t*)hudev;
@@ -344,6 +928,42 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 
 	AUTOLOCK(h->cslock);
 
+	usbdev_stats_t * const stats = usbdev_stats(hudev);
+
+	// once the handle has failed, drop writes until it's reopened
+	if (h->write_failures >= USB_FAILED_WRITE_LIMIT)
+	{
+		InterlockedIncrement(&stats->failed);
+		return 0;
+	}
+
+	// Keep other processes out until the whole message has gone out, so
+	// that its packets aren't interleaved with theirs.  A lone SBA in the
+	// middle of a PBA sequence would throw off the device's PBA position,
+	// so this goes for all messages, paced or not.
+	HDEVSHARE const share = h->share;
+	bool const locked = (share != NULL && devshare_lock(share));
+
+	// If some process has already sent exactly this, there's no need to
+	// send it again.  Otherwise, mark the state it changes as in flight.
+	size_t const nmessage = ndata;
+	BYTE const * const pmessage = pdata;
+	if (share != NULL)
+	{
+		if (devshare_is_redundant(share, pmessage, nmessage))
+		{
+			if (locked)
+				devshare_unlock(share);
+
+			InterlockedIncrement(&stats->suppressed);
+			return nmessage;
+		}
+
+		devshare_begin_write(share, pmessage, nmessage);
+	}
+
+	bool const shared_pacing = (share != NULL && h->min_write_interval != 0);
+
 	int res = 0;
 	DWORD nbyteswritten = 0;
 
@@ -368,9 +988,30 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 
 		// make sure we space out writes by the minimum interval
 		DWORD now = GetTickCount();
-		DWORD dt = now - h->last_write_ticks;
-		if (dt < h->min_write_interval)
-			Sleep(h->min_write_interval - dt);
+		if (shared_pacing)
+		{
+			// reserve this packet's slot now rather than up front, since
+			// Sleep() can overshoot the previous one by a timer tick
+			DWORD const slot = devshare_reserve(share, 1, h->min_write_interval);
+			LONG const wait = (LONG)(slot - now);
+			if (wait > 0)
+			{
+				Sleep(wait);
+				InterlockedExchangeAdd(&stats->pacing_ms, wait);
+			}
+		}
+		else
+		{
+			DWORD dt = now - h->last_write_ticks;
+			if (dt < h->min_write_interval)
+			{
+				Sleep(h->min_write_interval - dt);
+				InterlockedExchangeAdd(&stats->pacing_ms, (LONG)(h->min_write_interval - dt));
+			}
+		}
+
+		LARGE_INTEGER t0;
+		QueryPerformanceCounter(&t0);
 
 		// write the bytes
 		BOOL bres = WriteFile(h->hdev, buf, nwrite, NULL, &ol);
@@ -394,6 +1035,16 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 
 		// update the last write time
 		h->last_write_ticks = GetTickCount();
+		if (shared_pacing)
+			devshare_write_done(share, h->min_write_interval);
+
+		// add the write time to the latency histogram
+		if (bres && h->perf_freq != 0)
+		{
+			LARGE_INTEGER t1;
+			QueryPerformanceCounter(&t1);
+			usbdev_latency_add(&stats->write_latency, (LONG)((t1.QuadPart - t0.QuadPart) * 1000000 / h->perf_freq));
+		}
 
 		// note any failure in debug builds
 		if (!bres)
@@ -408,6 +1059,32 @@ size_t usbdev_write(HUDEV hudev, void const *pdst, size_t ndata)
 
 		// success - count the bytes written and continue with anything still pending
 		nbyteswritten += ncopy;
+		InterlockedIncrement(&stats->packets);
+	}
+
+	// if the whole message went out, record the new device state
+	if (share != NULL && nbyteswritten == nmessage)
+		devshare_commit(share, pmessage, nmessage);
+
+	if (locked)
+		devshare_unlock(share);
+
+	// track the run of failed writes, and signal the owner when the
+	// handle looks dead
+	if (nbyteswritten == nmessage)
+	{
+		h->write_failures = 0;
+		InterlockedIncrement(&stats->messages);
+	}
+	else
+	{
+		InterlockedIncrement(&stats->failed);
+
+		if (h->write_failures == 0)
+			h->fail_ticks = GetTickCount();
+
+		if (++h->write_failures == USB_FAILED_WRITE_LIMIT && h->hfailevent != NULL)
+			SetEvent(h->hfailevent);
 	}
 
 	return nbyteswritten;
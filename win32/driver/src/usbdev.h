@@ -20,14 +20,59 @@
 
 typedef void * HUDEV;
 
+// input report callback; invoked on the device's reader thread for each report received
+typedef void (CALLBACK * USBDEV_INPUT_PROC)(void *puser, LONG tag, BYTE const *pdata, DWORD ndata);
+
+// I/O counters.  These live in the device's shared state block (see
+// devshare.cpp), so they cover the writes of every process using the
+// device.  The queue counters are maintained by the owner's write queue.
+//
+// Latency histograms have 100 us buckets up to 10 ms, 1 ms buckets up to
+// 100 ms, 100 ms buckets up to 1 s, and a last bucket for anything longer.
+#define USBDEV_LATENCY_BUCKETS      200
+
+typedef struct {
+	volatile LONG max_us;           // longest time so far, in microseconds
+	volatile LONG bucket[USBDEV_LATENCY_BUCKETS];
+} usbdev_latency_t;
+
+typedef struct usbdev_stats_s {
+	volatile LONG messages;         // messages written to the device
+	volatile LONG packets;          // 8-byte packets written
+	volatile LONG failed;           // messages that failed, or were dropped after a failure
+	volatile LONG suppressed;       // messages skipped because the device already had the state
+	volatile LONG pacing_ms;        // total time spent waiting out the minimum write interval
+	volatile LONG queued;           // messages added to the write queue
+	volatile LONG coalesced;        // messages merged into a message already in the queue
+	volatile LONG queue_depth;      // messages currently in the write queue
+	volatile LONG max_queue_depth;  // highest queue_depth so far
+	usbdev_latency_t write_latency; // time taken by each 8-byte packet write
+	usbdev_latency_t queue_latency; // time from adding a message to the write queue until it's written
+} usbdev_stats_t;
+
 HUDEV usbdev_create(LPCSTR devicepath);
 void usbdev_addref(HUDEV hudev);
 void usbdev_release(HUDEV hudev);
+bool usbdev_start_reader(HUDEV hudev, size_t input_report_len);
+DWORD usbdev_input_count(HUDEV hudev);
+HANDLE usbdev_input_event(HUDEV hudev);
 size_t usbdev_read(HUDEV hudev, void *pdata, size_t ndata);
-void usbdev_clear_input(HUDEV hudev, size_t input_report_len);
+size_t usbdev_read_next(HUDEV hudev, DWORD *pnum, void *pdata, size_t ndata, DWORD timeout_ms);
+size_t usbdev_read_latest(HUDEV hudev, void *pdata, size_t ndata, DWORD *pnum);
+void usbdev_set_input_callback(HUDEV hudev, USBDEV_INPUT_PROC proc, void *puser, LONG tag);
 size_t usbdev_write(HUDEV hudev, void const *pdata, size_t ndata);
 HANDLE usbdev_handle(HUDEV hudev);
 void usbdev_set_min_write_interval(HUDEV hudev, unsigned int interval_ms);
+void usbdev_set_share(HUDEV hudev, void *hshare);	// HDEVSHARE, see devshare.h
+void usbdev_set_failure_event(HUDEV hudev, HANDLE hevent);
+bool usbdev_failed(HUDEV hudev, DWORD *pfail_ticks);
+DWORD usbdev_reopen_wait(HUDEV hudev);
+bool usbdev_reopen(HUDEV hudev);
+usbdev_stats_t *usbdev_stats(HUDEV hudev);
+void usbdev_reset_stats(HUDEV hudev);
+void usbdev_stats_max(volatile LONG *pmax, LONG value);
+void usbdev_latency_add(usbdev_latency_t *lat, LONG us);
+DWORD usbdev_latency_percentile(usbdev_latency_t const *lat, unsigned int percent);
 
 
 
@@ -0,0 +1,317 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Device broker transport test, against the mock Win32 layer.
+//
+// broker.cpp is built into this file, so the test can see the ring
+// length.  The broker and its clients are played by threads, each
+// claiming to be a different process.
+
+#include "../src/broker.cpp"
+#include "test.h"
+
+#include <pthread.h>
+
+
+#define PID_BROKER     100
+#define PID_CLIENT     200
+#define PID_CLIENT2    201
+
+// number of messages for the backpressure test; several times the ring length
+#define FLOOD_COUNT    (BROKER_RING_LENGTH * 8)
+
+
+// broker and one connected client
+typedef struct {
+	HBROKER hserver;
+	HBROKER hclient;
+	int slot;
+} pair_t;
+
+static bool pair_open(pair_t *pair, LONG priority)
+{
+	mock_reset();
+
+	mock_set_process(PID_BROKER);
+	pair->hserver = broker_server_open();
+
+	mock_set_process(PID_CLIENT);
+	pair->hclient = broker_client_open(priority);
+
+	mock_set_process(PID_BROKER);
+	DWORD const reset = broker_server_check_clients(pair->hserver);
+
+	pair->slot = -1;
+	for (int i = 0 ; i < BROKER_MAX_CLIENTS ; ++i)
+	{
+		if (reset & (1 << i))
+			pair->slot = i;
+	}
+
+	return pair->hserver != NULL && pair->hclient != NULL && pair->slot >= 0;
+}
+
+static void pair_close(pair_t *pair)
+{
+	mock_set_process(PID_CLIENT);
+	broker_client_close(pair->hclient);
+
+	mock_set_process(PID_BROKER);
+	broker_server_close(pair->hserver);
+}
+
+static bool submit_seq(HBROKER hclient, LONG seq)
+{
+	BYTE data[32];
+	for (int i = 0 ; i < 32 ; ++i)
+		data[i] = (BYTE)(seq + i);
+
+	return broker_client_submit(hclient, seq % BROKER_MAX_UNITS, BROKER_MSG_PBA, data, sizeof(data));
+}
+
+static bool check_seq(broker_msg_t const *msg, LONG seq)
+{
+	if (msg->unit != seq % BROKER_MAX_UNITS || msg->kind != BROKER_MSG_PBA || msg->len != 32)
+		return false;
+
+	for (int i = 0 ; i < 32 ; ++i)
+	{
+		if (msg->data[i] != (BYTE)(seq + i))
+			return false;
+	}
+
+	return true;
+}
+
+
+TEST(no_broker)
+{
+	mock_reset();
+	mock_set_process(PID_CLIENT);
+	CHECK(broker_client_open(0) == NULL);
+}
+
+TEST(one_broker_at_a_time)
+{
+	mock_reset();
+
+	mock_set_process(PID_BROKER);
+	HBROKER const h1 = broker_server_open();
+	CHECK(h1 != NULL);
+
+	// a second broker is refused while the first one runs
+	mock_set_process(PID_BROKER + 1);
+	CHECK(broker_server_open() == NULL);
+
+	// and can take over once it's gone, even without a clean shutdown
+	mock_kill_process(PID_BROKER);
+	HBROKER const h2 = broker_server_open();
+	CHECK(h2 != NULL);
+
+	broker_server_close(h2);
+	broker_server_close(h1);
+}
+
+TEST(connect_and_priority)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 7));
+	CHECK(broker_server_connected(pair.hserver, pair.slot));
+	CHECK(broker_server_priority(pair.hserver, pair.slot) == 7);
+
+	// a clean disconnect frees the slot
+	mock_set_process(PID_CLIENT);
+	broker_client_close(pair.hclient);
+	mock_set_process(PID_BROKER);
+	CHECK(broker_server_check_clients(pair.hserver) == (DWORD)(1 << pair.slot));
+	CHECK(!broker_server_connected(pair.hserver, pair.slot));
+
+	broker_server_close(pair.hserver);
+}
+
+TEST(client_exit_frees_slot)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 0));
+
+	// the client dies without releasing its slot
+	mock_kill_process(PID_CLIENT);
+	mock_set_process(PID_BROKER);
+	CHECK(broker_server_check_clients(pair.hserver) == (DWORD)(1 << pair.slot));
+	CHECK(!broker_server_connected(pair.hserver, pair.slot));
+
+	// so a new client can have it
+	mock_set_process(PID_CLIENT2);
+	HBROKER const hclient2 = broker_client_open(0);
+	CHECK(hclient2 != NULL);
+
+	broker_client_close(hclient2);
+	broker_server_close(pair.hserver);
+}
+
+TEST(messages_in_order)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 0));
+
+	mock_set_process(PID_CLIENT);
+	for (LONG seq = 0 ; seq < BROKER_RING_LENGTH ; ++seq)
+		CHECK(submit_seq(pair.hclient, seq));
+
+	mock_set_process(PID_BROKER);
+	broker_msg_t msg;
+	for (LONG seq = 0 ; seq < BROKER_RING_LENGTH ; ++seq)
+	{
+		CHECK(broker_server_receive(pair.hserver, pair.slot, &msg));
+		CHECK(check_seq(&msg, seq));
+	}
+
+	CHECK(!broker_server_receive(pair.hserver, pair.slot, &msg));
+
+	pair_close(&pair);
+}
+
+TEST(malformed_messages_skipped)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 0));
+
+	BYTE const data[5] = { 1, 2, 3, 4, 5 };
+	mock_set_process(PID_CLIENT);
+	CHECK(broker_client_submit(pair.hclient, BROKER_MAX_UNITS, BROKER_MSG_SBA, data, sizeof(data)));
+	CHECK(broker_client_submit(pair.hclient, 3, BROKER_MSG_SBA, data, sizeof(data)));
+
+	mock_set_process(PID_BROKER);
+	broker_msg_t msg;
+	CHECK(broker_server_receive(pair.hserver, pair.slot, &msg));
+	CHECK(msg.unit == 3 && msg.kind == BROKER_MSG_SBA && msg.len == 5 && memcmp(msg.data, data, 5) == 0);
+	CHECK(!broker_server_receive(pair.hserver, pair.slot, &msg));
+
+	pair_close(&pair);
+}
+
+// the client side of the backpressure test
+typedef struct {
+	HBROKER hclient;
+	LONG sent;
+	bool ok;
+} flood_t;
+
+static void * flood_thread(void *param)
+{
+	flood_t * const f = (flood_t *)param;
+	mock_set_process(PID_CLIENT);
+
+	f->ok = true;
+	for (LONG seq = 0 ; seq < FLOOD_COUNT && f->ok ; ++seq)
+	{
+		f->ok = submit_seq(f->hclient, seq);
+		__sync_fetch_and_add(&f->sent, 1);
+	}
+
+	return NULL;
+}
+
+TEST(backpressure_blocks_without_dropping)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 0));
+
+	flood_t flood = { pair.hclient, 0, false };
+	pthread_t thread;
+	pthread_create(&thread, NULL, flood_thread, &flood);
+
+	// with nobody reading, the client fills the ring and then waits
+	Sleep(200);
+	CHECK(flood.sent == BROKER_RING_LENGTH);
+
+	// a slow reader gets every message, in order
+	mock_set_process(PID_BROKER);
+	broker_msg_t msg;
+	LONG seq = 0;
+	DWORD const t0 = GetTickCount();
+	while (seq < FLOOD_COUNT && GetTickCount() - t0 < 10000)
+	{
+		if (broker_server_receive(pair.hserver, pair.slot, &msg))
+		{
+			CHECK(check_seq(&msg, seq));
+			seq += 1;
+
+			if ((seq % 16) == 0)
+				Sleep(1);
+		}
+		else
+		{
+			Sleep(0);
+		}
+	}
+
+	pthread_join(thread, NULL);
+	CHECK(flood.ok);
+	CHECK(seq == FLOOD_COUNT);
+
+	pair_close(&pair);
+}
+
+TEST(broker_exit_ends_wait)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 0));
+
+	flood_t flood = { pair.hclient, 0, false };
+	pthread_t thread;
+	pthread_create(&thread, NULL, flood_thread, &flood);
+	Sleep(200);
+
+	// the broker dies with the ring full, so the waiting submit fails
+	mock_kill_process(PID_BROKER);
+	pthread_join(thread, NULL);
+	CHECK(!flood.ok);
+	CHECK(flood.sent == BROKER_RING_LENGTH + 1);
+
+	mock_set_process(PID_CLIENT);
+	CHECK(!broker_client_alive(pair.hclient));
+
+	pair_close(&pair);
+}
+
+TEST(unit_table)
+{
+	pair_t pair;
+	CHECK(pair_open(&pair, 0));
+
+	broker_unit_t units[BROKER_MAX_UNITS];
+	memset(units, 0x00, sizeof(units));
+	units[2].device_type = 2;
+	strcpy(units[2].name, "LWCloneU2");
+
+	mock_set_process(PID_CLIENT);
+	LONG const gen0 = broker_client_generation(pair.hclient);
+
+	mock_set_process(PID_BROKER);
+	broker_server_publish(pair.hserver, units);
+
+	mock_set_process(PID_CLIENT);
+	broker_unit_t seen[BROKER_MAX_UNITS];
+	LONG const gen1 = broker_client_units(pair.hclient, seen);
+	CHECK(gen1 != gen0);
+	CHECK(gen1 == broker_client_generation(pair.hclient));
+	CHECK(memcmp(seen, units, sizeof(units)) == 0);
+
+	pair_close(&pair);
+}
+
+TEST_MAIN()
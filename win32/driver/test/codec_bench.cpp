@@ -0,0 +1,121 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Wire protocol codec benchmark ('make bench').
+//
+// Times the PBA send path's codec work: finding the changed groups and
+// encoding them as PBX, for a 32-port update as lwz_send_pba does it,
+// and for a whole 128-port Pinscape unit.  The "bytewise" line is the
+// same work done the plain way, one port at a time, for comparison.
+
+#include "../src/lwzcodec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+#define ITERATIONS     2000000
+
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// the reference: compare and encode one port at a time
+static size_t encode_bytewise(uint8_t *out, uint8_t const *levels, uint8_t const *sent, int ngroups)
+{
+	uint8_t *pkt = out;
+	for (int g = 0 ; g < ngroups ; ++g)
+	{
+		bool changed = false;
+		for (int i = 0 ; i < 8 && !changed ; ++i)
+			changed = (levels[g*8 + i] != sent[g*8 + i]);
+
+		if (!changed)
+			continue;
+
+		unsigned int tmp1 = 0;
+		unsigned int tmp2 = 0;
+		for (int i = 0 ; i < 4 ; ++i)
+		{
+			tmp1 |= lwzcodec_pbx_code(levels[g*8 + i]) << (6 * i);
+			tmp2 |= lwzcodec_pbx_code(levels[g*8 + 4 + i]) << (6 * i);
+		}
+
+		pkt[0] = LWZCODEC_CMD_PBX;
+		pkt[1] = (uint8_t)g;
+		pkt[2] = (uint8_t)tmp1;
+		pkt[3] = (uint8_t)(tmp1 >> 8);
+		pkt[4] = (uint8_t)(tmp1 >> 16);
+		pkt[5] = (uint8_t)tmp2;
+		pkt[6] = (uint8_t)(tmp2 >> 8);
+		pkt[7] = (uint8_t)(tmp2 >> 16);
+		pkt += 8;
+	}
+
+	return pkt - out;
+}
+
+// Run one case.  Each iteration changes one port, so about one group
+// goes out per update, as in a typical effect update.
+static void bench(char const *name, int ngroups, bool bytewise)
+{
+	uint8_t levels[LWZCODEC_MAX_PORTS];
+	uint8_t sent[LWZCODEC_MAX_PORTS];
+	uint8_t out[LWZCODEC_MAX_PORTS];
+	for (int i = 0 ; i < ngroups * 8 ; ++i)
+		levels[i] = sent[i] = (uint8_t)(rand() % 49);
+
+	int const nports = ngroups * 8;
+	size_t total = 0;
+	double const t0 = now_ns();
+	for (int n = 0 ; n < ITERATIONS ; ++n)
+	{
+		levels[(n * 7) % nports] = (uint8_t)(n % 49);
+
+		if (bytewise)
+		{
+			total += encode_bytewise(out, levels, sent, ngroups);
+		}
+		else
+		{
+			unsigned int const mask = lwzcodec_changed_groups(levels, sent, ngroups);
+			total += lwzcodec_encode_pbx_groups(out, levels, 0, ngroups, mask);
+		}
+
+		memcpy(sent, levels, nports);
+	}
+	double const t1 = now_ns();
+
+	printf("%-24s %3d ports  %7.1f ns/update  (%.2f packets/update)\n",
+		name, nports, (t1 - t0) / ITERATIONS, (double)total / 8 / ITERATIONS);
+}
+
+int main(int argc, char *argv[])
+{
+	srand(1);
+	bench("changed_groups+encode", 4, false);
+	bench("bytewise", 4, true);
+	bench("changed_groups+encode", 16, false);
+	bench("bytewise", 16, true);
+
+	return 0;
+}
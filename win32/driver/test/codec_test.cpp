@@ -0,0 +1,196 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Wire protocol codec test.  The codec doesn't need the Windows headers,
+// so this builds without the mock layer.
+//
+// The round trip tests encode random port states, decode the packets
+// again, and compare, over the whole range of values the wire format can
+// carry.  A fixed seed keeps failures reproducible.
+
+#include "../src/lwzcodec.h"
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define ROUNDS         20000
+
+
+// A random level that PBX can carry: 0-59, or a flash mode 129-132.
+// (Levels 60-128 don't fit in the 6-bit codes; PBA never uses them.)
+static uint8_t random_level(void)
+{
+	int const r = rand() % 64;
+	return (uint8_t)(r < 60 ? r : r - 60 + 129);
+}
+
+static int popcount(unsigned int x)
+{
+	int n = 0;
+	for ( ; x != 0 ; x &= x - 1)
+		++n;
+
+	return n;
+}
+
+
+TEST(pbx_code_round_trip)
+{
+	for (int level = 0 ; level < 60 ; ++level)
+		CHECK(lwzcodec_pbx_level(lwzcodec_pbx_code((uint8_t)level)) == level);
+
+	for (int level = 129 ; level <= 132 ; ++level)
+		CHECK(lwzcodec_pbx_level(lwzcodec_pbx_code((uint8_t)level)) == level);
+
+	for (int code = 0 ; code < 64 ; ++code)
+		CHECK(lwzcodec_pbx_code(lwzcodec_pbx_level((uint8_t)code)) == code);
+}
+
+TEST(sba_sbx_round_trip)
+{
+	srand(1);
+	for (int n = 0 ; n < ROUNDS ; ++n)
+	{
+		uint8_t banks[4];
+		for (int i = 0 ; i < 4 ; ++i)
+			banks[i] = (uint8_t)rand();
+		uint8_t const speed = (uint8_t)(1 + rand() % 7);
+		int const block = rand() % (LWZCODEC_MAX_PORTS / 32);
+
+		uint8_t pkt[8];
+		uint8_t out[4];
+		uint8_t out_speed = 0;
+
+		lwzcodec_encode_sba(pkt, banks, speed);
+		CHECK(pkt[0] == LWZCODEC_CMD_SBA);
+		CHECK(lwzcodec_decode_sbx(pkt, out, &out_speed) == 0);
+		CHECK(memcmp(out, banks, 4) == 0 && out_speed == speed);
+
+		lwzcodec_encode_sbx(pkt, banks, speed, block);
+		CHECK(pkt[0] == LWZCODEC_CMD_SBX);
+		CHECK(lwzcodec_decode_sbx(pkt, out, &out_speed) == block);
+		CHECK(memcmp(out, banks, 4) == 0 && out_speed == speed);
+
+		// neither decodes as PBX
+		uint8_t levels[8];
+		CHECK(lwzcodec_decode_pbx(pkt, levels) == -1);
+	}
+}
+
+TEST(pbx_groups_round_trip)
+{
+	srand(2);
+	for (int n = 0 ; n < ROUNDS ; ++n)
+	{
+		int const ngroups = 1 + rand() % (LWZCODEC_MAX_PORTS / 8);
+		int const first_group = rand() % 16;
+		unsigned int const mask = (unsigned int)rand() & ((1u << ngroups) - 1);
+
+		uint8_t levels[LWZCODEC_MAX_PORTS];
+		for (int i = 0 ; i < ngroups * 8 ; ++i)
+			levels[i] = random_level();
+
+		// one packet per group in the mask, in group order
+		uint8_t out[LWZCODEC_MAX_PORTS];
+		size_t const nout = lwzcodec_encode_pbx_groups(out, levels, first_group, ngroups, mask);
+		CHECK(nout == (size_t)popcount(mask) * 8);
+
+		size_t ofs = 0;
+		for (int g = 0 ; g < ngroups ; ++g)
+		{
+			if ((mask & (1u << g)) == 0)
+				continue;
+
+			uint8_t decoded[8];
+			CHECK(lwzcodec_decode_pbx(&out[ofs], decoded) == first_group + g);
+			CHECK(memcmp(decoded, &levels[g*8], 8) == 0);
+
+			// and none decodes as SBA or SBX
+			uint8_t banks[4];
+			uint8_t speed;
+			CHECK(lwzcodec_decode_sbx(&out[ofs], banks, &speed) == -1);
+
+			ofs += 8;
+		}
+	}
+}
+
+TEST(changed_groups_matches_bytewise_compare)
+{
+	srand(3);
+	for (int n = 0 ; n < ROUNDS ; ++n)
+	{
+		int const ngroups = 1 + rand() % (LWZCODEC_MAX_PORTS / 8);
+
+		uint8_t levels[LWZCODEC_MAX_PORTS];
+		uint8_t sent[LWZCODEC_MAX_PORTS];
+		for (int i = 0 ; i < ngroups * 8 ; ++i)
+			levels[i] = sent[i] = random_level();
+
+		// change a few ports, sometimes none
+		int const nchanges = rand() % 4;
+		for (int i = 0 ; i < nchanges ; ++i)
+			sent[rand() % (ngroups * 8)] ^= (uint8_t)(1 << (rand() % 8));
+
+		unsigned int expect = 0;
+		for (int i = 0 ; i < ngroups * 8 ; ++i)
+		{
+			if (levels[i] != sent[i])
+				expect |= 1u << (i / 8);
+		}
+
+		CHECK(lwzcodec_changed_groups(levels, sent, ngroups) == expect);
+	}
+}
+
+TEST(levels_packets_carry_each_port)
+{
+	srand(4);
+	for (int n = 0 ; n < ROUNDS ; ++n)
+	{
+		int const first = rand() % 32;
+		int const nports = 1 + rand() % (32 - first);
+
+		uint8_t levels[32];
+		for (int i = 0 ; i < nports ; ++i)
+			levels[i] = (uint8_t)rand();
+
+		uint8_t out[6 * 8];
+		memset(out, 0xA5, sizeof(out));
+		size_t const len = lwzcodec_encode_levels(out, levels, first, nports);
+		CHECK(len == (size_t)((nports + 5) / 6) * 8);
+
+		// walk the packets the way the firmware does
+		int port = 0;
+		for (size_t i = 0 ; i < len ; i += 8)
+		{
+			uint8_t const *pkt = &out[i];
+			int const count = (pkt[1] >> 5) ? (pkt[1] >> 5) : 6;
+
+			CHECK(pkt[0] == LWZCODEC_CMD_LEVELS);
+			CHECK((pkt[1] & 0x1F) == first + port);
+			CHECK(count <= 6 && port + count <= nports);
+			CHECK(memcmp(&pkt[2], &levels[port], count) == 0);
+			port += count;
+		}
+
+		CHECK(port == nports);
+	}
+}
+
+TEST_MAIN()
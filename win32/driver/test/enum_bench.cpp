@@ -0,0 +1,161 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Device discovery benchmark ('make bench').
+//
+// ledwiz.cpp is built into this file, as in ledwiz_test, and driven
+// through a set of mock LedWiz units.  It times the DLL's own work; the
+// mock's device opens and HID queries take next to no time, where on
+// Windows each one goes to the driver, so the opens and HID queries are
+// counted too.
+//
+// The detach lines time the handling of a removal notification: the
+// lookup by the interface path that the notification carries, and the
+// sweep that re-opens every device when it doesn't carry one.  The
+// search lines time a full device search (LWZ_SET_NOTIFY) with every
+// interface found in the probe cache, and with an empty cache, where
+// every interface gets the full probe.
+
+#include "../src/ledwiz.cpp"
+
+#include <time.h>
+
+
+#define UNITS          LWZ_MAX_DEVICES
+#define ITERATIONS     2000
+#define GUID_SUFFIX    "#{4d1e55b2-f16f-11cf-88cb-001111000030}"
+
+
+static char g_paths[UNITS][MAX_PATH];
+static LWZDEVICELIST g_list;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static LONG total_opens(void)
+{
+	LONG n = 0;
+	for (int i = 0 ; i < UNITS ; ++i)
+		n += mock_device_opens(g_paths[i]);
+
+	return n;
+}
+
+static LONG total_hid_queries(void)
+{
+	LONG n = 0;
+	for (int i = 0 ; i < UNITS ; ++i)
+		n += mock_device_hid_queries(g_paths[i]);
+
+	return n;
+}
+
+// Send a removal notification, naming the interface or not
+static void notify_removal(char const *path)
+{
+	BYTE buf[sizeof(DEV_BROADCAST_DEVICEINTERFACE_A) + MAX_PATH];
+	memset(buf, 0x00, sizeof(buf));
+	DEV_BROADCAST_DEVICEINTERFACE_A * const pdi = (DEV_BROADCAST_DEVICEINTERFACE_A *)buf;
+	pdi->dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+	pdi->dbcc_size = offsetof(DEV_BROADCAST_DEVICEINTERFACE_A, dbcc_name);
+	if (path != NULL)
+	{
+		strcpy(pdi->dbcc_name, path);
+		pdi->dbcc_size += strlen(path) + 1;
+	}
+
+	lwz_wndproc(NULL, WM_DEVICECHANGE, DBT_DEVICEREMOVECOMPLETE, (LPARAM)pdi);
+}
+
+// Unplug a unit and time the removal notification, then plug it back in
+// and let the DLL find it again
+static void bench_detach(char const *name, bool with_path)
+{
+	double total = 0;
+	LONG opens = 0;
+	for (int n = 0 ; n < ITERATIONS ; ++n)
+	{
+		char const * const path = g_paths[n % UNITS];
+		mock_plug_device(path, false);
+
+		LONG const opens0 = total_opens();
+		double const t0 = now_ns();
+		notify_removal(with_path ? path : NULL);
+		total += now_ns() - t0;
+		opens += total_opens() - opens0;
+
+		mock_plug_device(path, true);
+		lwz_wndproc(NULL, WM_DEVICECHANGE, DBT_DEVICEARRIVAL, 0);
+	}
+
+	printf("%-24s %3d units  %9.1f us/notification  (%.1f opens/notification)\n",
+		name, g_list.numdevices, total / ITERATIONS / 1000, (double)opens / ITERATIONS);
+}
+
+// Time a full search, with every interface in the probe cache or none
+static void bench_search(char const *name, bool cached)
+{
+	int const iterations = ITERATIONS / 10;
+	double total = 0;
+	LONG opens = 0, queries = 0;
+	for (int n = 0 ; n < iterations ; ++n)
+	{
+		if (!cached)
+		{
+			AUTOLOCK(g_cs);
+			g_plwz->probe_cache.count = 0;
+		}
+
+		LONG const opens0 = total_opens();
+		LONG const queries0 = total_hid_queries();
+		double const t0 = now_ns();
+		LWZ_SET_NOTIFY(NULL, &g_list);
+		total += now_ns() - t0;
+		opens += total_opens() - opens0;
+		queries += total_hid_queries() - queries0;
+	}
+
+	printf("%-24s %3d units  %9.1f us/search        (%.1f opens, %.1f HID queries/search)\n",
+		name, g_list.numdevices, total / iterations / 1000, (double)opens / iterations, (double)queries / iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	// a full set of LedWiz units
+	for (int i = 0 ; i < UNITS ; ++i)
+	{
+		_snprintf_s(g_paths[i], sizeof(g_paths[i]), _TRUNCATE,
+			"\\\\?\\hid#vid_fafa&pid_%04x#7&%08x&0&0000" GUID_SUFFIX, ProductID_LEDWiz_min + i, 0x1a2b3c00 + i);
+		mock_set_device_hid(g_paths[i], VendorID_LEDWiz, ProductID_LEDWiz_min + i, 0x0100, 0, 8, L"LED-WIZ");
+		mock_plug_device(g_paths[i], true);
+	}
+
+	DllMain(NULL, DLL_PROCESS_ATTACH, NULL);
+	LWZ_SET_NOTIFY(NULL, &g_list);
+
+	bench_detach("detach by path", true);
+	bench_detach("detach sweep", false);
+	bench_search("search, cached", true);
+	bench_search("search, full probe", false);
+
+	DllMain(NULL, DLL_PROCESS_DETACH, NULL);
+
+	return 0;
+}
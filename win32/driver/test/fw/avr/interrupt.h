@@ -0,0 +1,34 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Host stand-ins for the AVR interrupt macros.  An ISR is a plain
+// function the test calls, and sei() and cli() go to the test, which
+// keeps track of whether interrupts are enabled.
+
+#ifndef FW_AVR_INTERRUPT_H__INCLUDED
+#define FW_AVR_INTERRUPT_H__INCLUDED
+
+#define ISR(vect)  void vect(void)
+
+void host_sei(void);
+void host_cli(void);
+
+#define sei()  host_sei()
+#define cli()  host_cli()
+
+
+
+#endif
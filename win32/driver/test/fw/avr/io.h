@@ -0,0 +1,56 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Host stand-ins for the AVR registers that the firmware's LED driver
+// and the test board's hwconfig.h use.  They're plain variables, defined
+// in the test, except for the timer count, which the test works out on
+// each read from its simulated clock.
+
+#ifndef FW_AVR_IO_H__INCLUDED
+#define FW_AVR_IO_H__INCLUDED
+
+#include <stdint.h>
+
+extern uint8_t host_PORTA, host_PORTB, host_PORTC, host_PORTD;
+extern uint8_t host_DDRA, host_DDRB, host_DDRC, host_DDRD;
+extern uint8_t host_OCR0A, host_TCCR0A, host_TCCR0B, host_TIMSK0;
+uint8_t volatile *host_tcnt0(void);
+
+#define PORTA   host_PORTA
+#define PORTB   host_PORTB
+#define PORTC   host_PORTC
+#define PORTD   host_PORTD
+#define DDRA    host_DDRA
+#define DDRB    host_DDRB
+#define DDRC    host_DDRC
+#define DDRD    host_DDRD
+#define OCR0A   host_OCR0A
+#define TCCR0A  host_TCCR0A
+#define TCCR0B  host_TCCR0B
+#define TIMSK0  host_TIMSK0
+#define TCNT0   (*host_tcnt0())
+
+#define _BV(bit)  (1 << (bit))
+
+#define CS00    0
+#define CS01    1
+#define CS02    2
+#define WGM01   1
+#define OCIE0A  1
+
+
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Hardware configuration of the test board that the firmware's LED
+// driver is built for on the host: 32 LEDs on ports A to D, with the
+// port D pins inverted.  Building with LED_BCM_TEST selects binary code
+// modulation, with the timer constants of the ATmega328 boards;
+// otherwise it's the soft-PWM.
+
+#ifndef HWCONFIG_H__INCLUDED
+#define HWCONFIG_H__INCLUDED
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#define LED_MAPPING_TABLE(_map_) \
+	_map_( A, 0, 0 ) _map_( A, 1, 0 ) _map_( A, 2, 0 ) _map_( A, 3, 0 ) \
+	_map_( A, 4, 0 ) _map_( A, 5, 0 ) _map_( A, 6, 0 ) _map_( A, 7, 0 ) \
+	_map_( B, 0, 0 ) _map_( B, 1, 0 ) _map_( B, 2, 0 ) _map_( B, 3, 0 ) \
+	_map_( B, 4, 0 ) _map_( B, 5, 0 ) _map_( B, 6, 0 ) _map_( B, 7, 0 ) \
+	_map_( C, 0, 0 ) _map_( C, 1, 0 ) _map_( C, 2, 0 ) _map_( C, 3, 0 ) \
+	_map_( C, 4, 0 ) _map_( C, 5, 0 ) _map_( C, 6, 0 ) _map_( C, 7, 0 ) \
+	_map_( D, 0, 1 ) _map_( D, 1, 1 ) _map_( D, 2, 1 ) _map_( D, 3, 1 ) \
+	_map_( D, 4, 1 ) _map_( D, 5, 1 ) _map_( D, 6, 1 ) _map_( D, 7, 1 ) \
+	/* end */
+
+#define LED_TIMER_vect led_timer_vect
+
+#if defined(LED_BCM_TEST)
+
+#define LED_BCM
+
+#define LED_BCM_OCR             OCR0A
+#define LED_BCM_TCNT            TCNT0
+#define LED_BCM_TCCRB           TCCR0B
+#define LED_BCM_LSB_TICKS       32                      // 16 us at prescale 8
+#define LED_BCM_CLOCK_SHORT     _BV(CS01)               // prescale 8
+#define LED_BCM_CLOCK_LONG      (_BV(CS01) | _BV(CS00)) // prescale 64
+#define LED_BCM_LONG_PLANE      3                       // first long plane; 64 / 8 == 1 << 3
+
+static void inline led_timer_init(void)
+{
+	TCCR0A = _BV(WGM01);
+	TIMSK0 = _BV(OCIE0A);
+	TCNT0 = 0x00;
+}
+
+#else
+
+static void inline led_timer_init(void)
+{
+	const int T0_CYCLE_US = 200;
+	OCR0A = (((T0_CYCLE_US * (16000000L / 1000L)) / (64 * 1000L)) - 1);
+	TCCR0A = _BV(WGM01);
+	TCCR0B = _BV(CS01) |_BV(CS00);
+	TIMSK0 = _BV(OCIE0A);
+	TCNT0 = 0x00;
+}
+
+#endif
+
+
+
+#endif
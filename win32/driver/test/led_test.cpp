@@ -0,0 +1,534 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Firmware LED driver test.
+//
+// The firmware's led.c is built into this file for the host, against
+// the stand-in AVR headers and the test board in fw/, so the tests can
+// feed the DLL's encoder output through led_update() and look at the
+// driver's state.  The makefile builds it twice: as led_test with the
+// soft-PWM, and as led_bcm_test with binary code modulation.
+//
+// The timing tests run the LED timer ISR on a simulated timer 0, and add
+// up how long each LED is on from the port writes.
+
+#include <string.h>
+#include "../src/lwzcodec.h"
+#include "../../../firmware/led.c"
+#include "test.h"
+
+
+uint8_t host_PORTA, host_PORTB, host_PORTC, host_PORTD;
+uint8_t host_DDRA, host_DDRB, host_DDRC, host_DDRD;
+uint8_t host_OCR0A, host_TCCR0A, host_TCCR0B, host_TIMSK0;
+
+#define CPU_HZ         16000000
+
+// Simulated timer 0, in CPU cycles.  The ISR's port writes take no time,
+// but each read of the count after the first moves the clock on by one timer
+// tick, so a wait on the timer takes as long as on the chip.
+static uint64_t g_now;					// current time
+static uint64_t g_irq;					// time of the current interrupt
+static uint8_t g_tcnt;
+static int g_depth;						// ISR nesting depth
+static int g_nirq;						// interrupts taken
+
+// LED on-times, from the port writes
+static uint64_t g_on[32];
+static bool g_lit[32];
+static uint64_t g_last;					// time of the last port change seen
+static bool g_logged;					// the ISR's first writes are counted
+
+static unsigned int timer_prescale(void)
+{
+	return (TCCR0B == (_BV(CS01) | _BV(CS00))) ? 64 : 8;
+}
+
+static bool led_is_on(int i)
+{
+	uint8_t const ports[4] = { PORTA, PORTB, PORTC, PORTD };
+	bool const bit = ((ports[i / 8] >> (i % 8)) & 1) != 0;
+	return (i / 8 == 3) ? !bit : bit;	// port D is inverted
+}
+
+// The ports were written at 'now': add up the on-times until then
+static void log_ports(uint64_t now)
+{
+	for (int i = 0 ; i < 32 ; ++i)
+	{
+		if (g_lit[i])
+			g_on[i] += now - g_last;
+		g_lit[i] = led_is_on(i);
+	}
+
+	g_last = now;
+}
+
+uint8_t volatile *host_tcnt0(void)
+{
+	if (g_depth == 1)
+	{
+		// what the ISR wrote before it first looked at the timer went out
+		// when the interrupt came in
+		if (!g_logged)
+		{
+			log_ports(g_irq);
+			g_logged = true;
+		}
+		else
+		{
+			g_now += timer_prescale();
+		}
+
+		g_tcnt = (uint8_t)((g_now - g_irq) / timer_prescale());
+	}
+	else
+	{
+		// a nested ISR: just keep the count moving
+		g_tcnt += 1;
+	}
+
+	return &g_tcnt;
+}
+
+static bool g_sei;						// interrupts enabled
+static int g_sei_count;					// sei() calls by the outer ISR
+static bool g_nest;						// take a period's interrupts in the next sei()
+static bool g_reentered;				// a nested ISR enabled interrupts
+
+void host_sei(void)
+{
+	g_sei = true;
+	if (g_depth > 1)
+	{
+		g_reentered = true;
+		return;
+	}
+
+	g_sei_count += 1;
+	if (g_nest)
+	{
+		// the ISR overran its plane: the timer comes back for a whole
+		// period's worth of interrupts
+		g_nest = false;
+		for (int i = 0 ; i < 5 ; ++i)
+		{
+			g_depth += 1;
+			led_timer_vect();
+			g_depth -= 1;
+		}
+	}
+}
+
+void host_cli(void) { g_sei = false; }
+
+// Take the next timer interrupt
+static void run_irq(void)
+{
+	g_irq = g_now;
+	g_logged = false;
+
+	g_depth += 1;
+	led_timer_vect();
+	g_depth -= 1;
+
+	log_ports(g_now);
+	g_nirq += 1;
+
+	// the timer restarted at the interrupt, and counts up to the compare
+	// value that's set now
+	g_now = g_irq + (uint64_t)(OCR0A + 1) * timer_prescale();
+}
+
+// Start adding up the on-times from now
+static void start_window(void)
+{
+	log_ports(g_now);
+	memset(g_on, 0x00, sizeof(g_on));
+	g_nirq = 0;
+}
+
+static void end_window(void)
+{
+	log_ports(g_now);
+}
+
+
+// Send a message to the driver, one 8-byte packet at a time
+static void send(uint8_t const *pdata, size_t ndata)
+{
+	for (size_t i = 0 ; i < ndata ; i += 8)
+	{
+		uint8_t pkt[8];
+		memcpy(pkt, pdata + i, 8);
+		led_update(pkt);
+	}
+}
+
+// Power up: everything off, and the PBA position at the first bank
+static void reset_leds(void)
+{
+	memset((void *)g_LED, 0x00, sizeof(g_LED));
+
+	uint8_t const banks[4] = { 0 };
+	uint8_t pkt[8];
+	lwzcodec_encode_sba(pkt, banks, 1);
+	send(pkt, 8);
+}
+
+static void send_pba(uint8_t const *pba)
+{
+	send(pba, 32);
+}
+
+
+TEST(sba_round_trip)
+{
+	reset_leds();
+
+	uint8_t const banks[4] = { 0xA5, 0x3C, 0x01, 0x80 };
+	for (uint8_t speed = 0 ; speed <= 9 ; ++speed)
+	{
+		uint8_t pkt[8];
+		lwzcodec_encode_sba(pkt, banks, speed);
+		send(pkt, 8);
+
+		for (int i = 0 ; i < 32 ; ++i)
+			CHECK(g_LED[i].enable == ((banks[i / 8] >> (i % 8)) & 1));
+
+		// the speed is clamped to 1-7
+		uint8_t const clamped = speed < 1 ? 1 : speed > 7 ? 7 : speed;
+		CHECK(g_dt == clamped * 128);
+	}
+}
+
+TEST(pba_round_trip)
+{
+	reset_leds();
+
+	// two PBAs in a row: the position wraps around to the first bank
+	for (int pass = 0 ; pass < 2 ; ++pass)
+	{
+		uint8_t pba[32];
+		for (int i = 0 ; i < 32 ; ++i)
+			pba[i] = (uint8_t)((i * 7 + pass * 13) % 50);
+		pba[5] = 129;
+		pba[17] = 132;
+
+		send_pba(pba);
+		for (int i = 0 ; i < 32 ; ++i)
+			CHECK(g_LED[i].mode == pba[i]);
+	}
+
+	// and an SBA part way through starts over
+	uint8_t pba[32];
+	memset(pba, 7, sizeof(pba));
+	send(pba, 16);
+
+	uint8_t const banks[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+	uint8_t pkt[8];
+	lwzcodec_encode_sba(pkt, banks, 2);
+	send(pkt, 8);
+
+	memset(pba, 30, sizeof(pba));
+	send_pba(pba);
+	for (int i = 0 ; i < 32 ; ++i)
+		CHECK(g_LED[i].mode == 30);
+}
+
+TEST(levels_round_trip)
+{
+	for (int first = 0 ; first < 32 ; ++first)
+	{
+		for (int n = 1 ; first + n <= 32 ; n += 5)
+		{
+			reset_leds();
+
+			uint8_t pba[32];
+			memset(pba, 20, sizeof(pba));
+			send_pba(pba);
+
+			uint8_t levels[32], msg[48];
+			for (int i = 0 ; i < n ; ++i)
+				levels[i] = (uint8_t)(first * 8 + i * 3 + 1);
+
+			size_t const len = lwzcodec_encode_levels(msg, levels, first, n);
+			CHECK(len == (size_t)((n + 5) / 6) * 8);
+			send(msg, len);
+
+			for (int i = 0 ; i < 32 ; ++i)
+			{
+				if (i >= first && i < first + n)
+					CHECK(g_LED[i].mode == MODE_LEVEL && g_LED[i].level == levels[i - first]);
+				else
+					CHECK(g_LED[i].mode == 20);
+			}
+		}
+	}
+}
+
+TEST(levels_leave_the_pba_position_alone)
+{
+	reset_leds();
+
+	uint8_t pba[32];
+	for (int i = 0 ; i < 32 ; ++i)
+		pba[i] = (uint8_t)(i + 1);
+
+	// a levels message in the middle of a PBA doesn't count as a bank
+	uint8_t const level = 200;
+	uint8_t msg[8];
+	lwzcodec_encode_levels(msg, &level, 31, 1);
+
+	send(pba, 8);
+	send(msg, 8);
+	send(pba + 8, 24);
+
+	for (int i = 0 ; i < 31 ; ++i)
+		CHECK(g_LED[i].mode == pba[i]);
+
+	// the last bank's PBA replaces the level
+	CHECK(g_LED[31].mode == 32);
+}
+
+TEST(levels_and_pba_give_the_same_brightness)
+{
+	reset_leds();
+
+	uint8_t const banks[4] = { 0xFF, 0xFF, 0xFF, 0x7F };
+	uint8_t pkt[8];
+	lwzcodec_encode_sba(pkt, banks, 2);
+	send(pkt, 8);
+
+	uint8_t pba[32];
+	for (int i = 0 ; i < 32 ; ++i)
+		pba[i] = (uint8_t)(i < 30 ? i * 49 / 30 : 49);
+	send_pba(pba);
+
+	uint8_t level[32];
+	update_pwm(level, 32, 0);
+
+	// port 32 is switched off
+	CHECK(level[31] == 0);
+
+	// PBA 0-49 is level 0-255, and the same level sent directly as an
+	// 8-bit level comes out the same
+	CHECK(level[0] == 0);
+	CHECK(level[30] == 255);
+	for (int i = 0 ; i < 31 ; ++i)
+	{
+		CHECK(level[i] == LEVEL_FROM_PWM(pba[i]));
+
+		uint8_t msg[8];
+		lwzcodec_encode_levels(msg, &level[i], i, 1);
+		send(msg, 8);
+	}
+
+	uint8_t level2[32];
+	update_pwm(level2, 32, 0);
+	CHECK(memcmp(level, level2, 32) == 0);
+}
+
+TEST(gamma_covers_the_duties_in_order)
+{
+	// 0 is off, 255 is full on, any other level is on at all, and a
+	// brighter level is never dimmer
+	CHECK(DUTY_FROM_LEVEL(0) == 0);
+	CHECK(DUTY_FROM_LEVEL(255) == 252);
+	for (int i = 1 ; i < 256 ; ++i)
+	{
+		CHECK(DUTY_FROM_LEVEL(i) >= 1);
+		CHECK(DUTY_FROM_LEVEL(i) >= DUTY_FROM_LEVEL(i - 1));
+	}
+
+	// and the PBA levels keep their order and their legacy duty at least
+	for (int x = 1 ; x <= MAX_PWM ; ++x)
+	{
+		CHECK(DUTY_FROM_LEVEL(LEVEL_FROM_PWM(x)) >= x);
+		CHECK(DUTY_FROM_LEVEL(LEVEL_FROM_PWM(x)) > DUTY_FROM_LEVEL(LEVEL_FROM_PWM(x - 1)));
+	}
+
+	// the soft-PWM steps are the duties scaled to 0-49, rounded up
+	for (int d = 0 ; d <= 252 ; ++d)
+		CHECK(PWM_FROM_DUTY(d) == (d * MAX_PWM + 251) / 252);
+}
+
+
+// Switch all LEDs on, at levels 0-255 sent as a levels message
+static void send_level_ramp(uint8_t *levels)
+{
+	reset_leds();
+
+	uint8_t const banks[4] = { 0xFF, 0xFF, 0xFF, 0xFF };
+	uint8_t pkt[8];
+	lwzcodec_encode_sba(pkt, banks, 2);
+	send(pkt, 8);
+
+	for (int i = 0 ; i < 32 ; ++i)
+		levels[i] = (uint8_t)(i * 255 / 31);
+
+	uint8_t msg[48];
+	size_t const len = lwzcodec_encode_levels(msg, levels, 0, 32);
+	send(msg, len);
+}
+
+#if defined(LED_BCM)
+
+#define LSB_CYCLES     (LED_BCM_LSB_TICKS * 8)
+#define PERIOD_CYCLES  (63 * LSB_CYCLES)
+
+// Run up to the start of a PWM period, after a few periods to take the new
+// levels.  Planes 0 and 1 share an interrupt, and only that one reads the
+// timer.
+static void run_to_period_start(void)
+{
+	for (int i = 0 ; i < BCM_UPDATE_PERIODS + 2 ; ++i)
+		for (int k = 0 ; k < 5 ; ++k)
+			run_irq();
+
+	do
+		run_irq();
+	while (!g_logged);
+
+	for (int k = 0 ; k < 4 ; ++k)
+		run_irq();
+}
+
+// Over the 4 periods of the dither pattern, each LED is on for its duty
+// times the LSB
+static void check_duties(uint8_t const *levels)
+{
+	run_to_period_start();
+
+	start_window();
+	for (int i = 0 ; i < 4 * 5 ; ++i)
+		run_irq();
+	end_window();
+
+	CHECK(g_nirq == 20);
+	for (int i = 0 ; i < 32 ; ++i)
+	{
+		uint64_t const expected = (uint64_t)DUTY_FROM_LEVEL(levels[i]) * LSB_CYCLES;
+		uint64_t const diff = g_on[i] > expected ? g_on[i] - expected : expected - g_on[i];
+		CHECK(diff <= 32);
+	}
+}
+
+TEST(bcm_on_time_follows_the_duty)
+{
+	led_init();
+
+	uint8_t levels[32];
+	send_level_ramp(levels);
+	check_duties(levels);
+
+	// level 255 is on all the time
+	CHECK(g_on[31] == 4 * PERIOD_CYCLES);
+}
+
+TEST(bcm_interrupt_rate)
+{
+	led_init();
+
+	uint8_t levels[32];
+	send_level_ramp(levels);
+	run_to_period_start();
+
+	uint64_t const start = g_now;
+	start_window();
+	for (int i = 0 ; i < 100 * 5 ; ++i)
+		run_irq();
+	end_window();
+
+	// 5 interrupts per 1008 us period, no more than the soft-PWM's 5k/s
+	CHECK(g_now - start == 100 * PERIOD_CYCLES);
+	CHECK(PERIOD_CYCLES * 1000000ull / CPU_HZ == 1008);
+	CHECK((uint64_t)g_nirq * CPU_HZ <= 5000 * (g_now - start));
+}
+
+TEST(bcm_rebuild_is_not_reentered)
+{
+	led_init();
+
+	uint8_t levels[32];
+	send_level_ramp(levels);
+	run_to_period_start();
+
+	// the last plane of this period runs over its rebuild by a whole period
+	for (int k = 0 ; k < 4 ; ++k)
+		run_irq();
+
+	g_nest = true;
+	g_reentered = false;
+	g_sei_count = 0;
+	run_irq();
+
+	CHECK(!g_nest);
+	CHECK(g_sei_count == 1);
+	CHECK(!g_reentered);
+	CHECK(!g_sei);
+
+	// and the LEDs carry on as before
+	check_duties(levels);
+}
+
+#else
+
+#define STEP_CYCLES    (50 * 64)
+
+TEST(soft_pwm_on_time_follows_the_level)
+{
+	led_init();
+
+	uint8_t levels[32];
+	send_level_ramp(levels);
+
+	// a period to take the new levels, and one to make sure
+	for (int i = 0 ; i < 2 * MAX_PWM ; ++i)
+		run_irq();
+
+	start_window();
+	for (int i = 0 ; i < MAX_PWM ; ++i)
+		run_irq();
+	end_window();
+
+	// the same gamma curve as BCM, rounded up to the next step
+	for (int i = 0 ; i < 32 ; ++i)
+	{
+		uint64_t const duty = DUTY_FROM_LEVEL(levels[i]);
+		CHECK(g_on[i] == (duty * MAX_PWM + 251) / 252 * STEP_CYCLES);
+		CHECK((g_on[i] > 0) == (levels[i] > 0));
+	}
+
+	CHECK(g_on[0] == 0);
+	CHECK(g_on[31] == MAX_PWM * STEP_CYCLES);
+}
+
+TEST(soft_pwm_interrupt_rate)
+{
+	led_init();
+
+	uint64_t const start = g_now;
+	for (int i = 0 ; i < 5000 ; ++i)
+		run_irq();
+
+	// 200 us per step
+	CHECK(g_now - start == (uint64_t)CPU_HZ);
+}
+
+#endif
+
+TEST_MAIN()
@@ -0,0 +1,298 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// ledwiz.cpp is built into this file, so the tests can drive the DLL
+// through DllMain() and the API, and look at the device table.  Each
+// DllMain() attach/detach pair plays one process using the DLL; the
+// probe cache file they share lives in the mock's memory.  The devices
+// are mock HID devices, whose side of the conversation is played by
+// the device procs below.
+
+#include "../src/ledwiz.cpp"
+#include "test.h"
+
+
+#define PS_PATH        "\\\\?\\hid#vid_fafa&pid_00f2&mi_00#7&1a2b3c4d&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030}"
+#define PS_UNIT        3					// LedWiz unit number, from the PID
+#define PS_VERSION     0x0100
+
+// a Pinscape unit, answering the configuration query
+typedef struct {
+	int num_outputs;
+	bool sbx_pbx;						// the firmware has the SBX/PBX extensions
+	LONG volatile queries;				// configuration queries received
+} pinscape_t;
+
+static void CALLBACK pinscape_proc(void *ctx, LPCSTR path, BYTE const *pkt)
+{
+	pinscape_t * const ps = (pinscape_t *)ctx;
+
+	// QUERY CONFIGURATION (65 4) gets a CONFIGURATION REPORT (00 88 ...)
+	if (pkt[0] == 65 && pkt[1] == 4)
+	{
+		InterlockedIncrement(&ps->queries);
+
+		BYTE rpt[14] = { 0x00, 0x88 };
+		rpt[2] = (BYTE)ps->num_outputs;
+		rpt[3] = (BYTE)(ps->num_outputs >> 8);
+		rpt[4] = PS_UNIT - 1;
+		rpt[11] = ps->sbx_pbx ? 0x02 : 0x00;
+		mock_device_input(path, rpt, sizeof(rpt));
+	}
+}
+
+static void plug_pinscape(pinscape_t *ps)
+{
+	mock_set_device_hid(PS_PATH, VendorID_LEDWiz, ProductID_LEDWiz_min + PS_UNIT - 1, PS_VERSION,
+		14, 8, L"Pinscape Controller");
+	mock_set_device_proc(PS_PATH, pinscape_proc, ps);
+	mock_plug_device(PS_PATH, true);
+}
+
+static LWZDEVICELIST g_list;
+
+// Start a process using the DLL, and search for devices
+static void dll_load(DWORD pid)
+{
+	mock_set_process(pid);
+	DllMain(NULL, DLL_PROCESS_ATTACH, NULL);
+	LWZ_SET_NOTIFY(NULL, &g_list);
+}
+
+static void dll_unload(void)
+{
+	DllMain(NULL, DLL_PROCESS_DETACH, NULL);
+}
+
+static bool unit_name_is(int unit, char const *name)
+{
+	LWZDEVICEINFO info = { sizeof(info) };
+	return LWZ_GET_DEVICE_INFO(unit, &info) && strcmp(info.szName, name) == 0;
+}
+
+
+TEST(cached_pinscape_unit_is_queried_and_keeps_its_name)
+{
+	mock_reset();
+	pinscape_t ps = { 64, true, 0 };
+	plug_pinscape(&ps);
+
+	// the first process probes the unit and queries it, and the second
+	// one finds it in the cache file; each search after that finds it in
+	// the cache, and queries it again
+	for (int pass = 0 ; pass < 3 ; ++pass)
+	{
+		dll_load(100 + pass);
+		CHECK(ps.queries == pass * 2 + 1);
+		CHECK(g_list.numdevices == 2);
+		CHECK(unit_name_is(PS_UNIT, "Pinscape Controller (Unit 3)"));
+		CHECK(unit_name_is(PS_UNIT + 1, "Pinscape Controller (Unit 3) Ports 33-64"));
+
+		LWZ_SET_NOTIFY(NULL, &g_list);
+		CHECK(ps.queries == pass * 2 + 2);
+		CHECK(unit_name_is(PS_UNIT, "Pinscape Controller (Unit 3)"));
+
+		{
+			AUTOLOCK(g_cs);
+			lwz_probe_cache_entry_t const * const e = lwz_cache_find(g_plwz, PS_PATH, lwz_path_hash(PS_PATH));
+			CHECK(e != NULL && strcmp(e->device_name, "Pinscape Controller (Unit 3)") == 0);
+		}
+
+		dll_unload();
+	}
+}
+
+TEST(cached_pinscape_unit_loses_dropped_extensions)
+{
+	mock_reset();
+	pinscape_t ps = { 64, true, 0 };
+	plug_pinscape(&ps);
+
+	dll_load(100);
+	CHECK(g_list.numdevices == 2);
+	CHECK(lwz_dev(g_plwz, PS_UNIT - 1)->supports_sbx_pbx);
+	dll_unload();
+
+	// reflash the unit with firmware that doesn't have SBX/PBX, keeping
+	// the same version number, so the cached entry still validates
+	ps.sbx_pbx = false;
+
+	dll_load(101);
+	CHECK(ps.queries == 2);
+	CHECK(g_list.numdevices == 1);
+	CHECK(!lwz_dev(g_plwz, PS_UNIT - 1)->supports_sbx_pbx);
+	CHECK(lwz_dev(g_plwz, PS_UNIT - 1)->num_outputs == 32);
+	CHECK(lwz_dev(g_plwz, PS_UNIT)->device_type == LWZ_DEVICE_TYPE_NONE);
+	dll_unload();
+
+	// and the cache file has the new configuration
+	dll_load(102);
+	{
+		AUTOLOCK(g_cs);
+		lwz_probe_cache_entry_t const * const e = lwz_cache_find(g_plwz, PS_PATH, lwz_path_hash(PS_PATH));
+		CHECK(e != NULL && !e->supports_sbx_pbx && e->num_outputs == 32);
+	}
+	dll_unload();
+}
+
+#define LW_PATH        "\\\\?\\hid#vid_fafa&pid_00f0#6&2b3c4d5e&0&0000#{4d1e55b2-f16f-11cf-88cb-001111000030}"
+#define LW_UNIT        1
+
+// reconnect backoff, as set in usbdev.cpp, and how late a reopen may be
+// on a busy machine
+#define RETRY_MS       100
+#define SLACK_MS       500
+
+// a plain LedWiz, keeping its output state the way the firmware does: an
+// SBA sets the on/off bits and restarts the PBA bank counter, and each
+// other packet is the next bank of 8 brightness levels
+typedef struct {
+	CRITICAL_SECTION cs;
+	BYTE sba[4];
+	BYTE speed;
+	BYTE pba[32];
+	int nbank;
+	int sba_count;						// SBA packets received
+} ledwiz_t;
+
+static void CALLBACK ledwiz_proc(void *ctx, LPCSTR path, BYTE const *pkt)
+{
+	ledwiz_t * const lw = (ledwiz_t *)ctx;
+
+	EnterCriticalSection(&lw->cs);
+	if (pkt[0] == 64)
+	{
+		memcpy(lw->sba, &pkt[1], 4);
+		lw->speed = pkt[5];
+		lw->nbank = 0;
+		lw->sba_count += 1;
+	}
+	else
+	{
+		memcpy(&lw->pba[lw->nbank * 8], pkt, 8);
+		lw->nbank = (lw->nbank + 1) & 3;
+	}
+	LeaveCriticalSection(&lw->cs);
+}
+
+// Power the unit up: it starts with everything off
+static void ledwiz_power_up(ledwiz_t *lw)
+{
+	EnterCriticalSection(&lw->cs);
+	memset(lw->sba, 0x00, sizeof(lw->sba));
+	memset(lw->pba, 48, sizeof(lw->pba));
+	lw->speed = 2;
+	lw->nbank = 0;
+	lw->sba_count = 0;
+	LeaveCriticalSection(&lw->cs);
+}
+
+static bool ledwiz_state_is(ledwiz_t *lw, BYTE const *sba, BYTE speed, BYTE const *pba)
+{
+	EnterCriticalSection(&lw->cs);
+	bool const same = memcmp(lw->sba, sba, 4) == 0 && lw->speed == speed && memcmp(lw->pba, pba, 32) == 0;
+	LeaveCriticalSection(&lw->cs);
+	return same;
+}
+
+// Wait for the unit to get a state, through the DLL's I/O thread
+static bool ledwiz_wait_state(ledwiz_t *lw, BYTE const *sba, BYTE speed, BYTE const *pba, DWORD timeout_ms)
+{
+	DWORD const t0 = GetTickCount();
+	while (!ledwiz_state_is(lw, sba, speed, pba))
+	{
+		if (GetTickCount() - t0 >= timeout_ms)
+			return false;
+		Sleep(1);
+	}
+
+	return true;
+}
+
+static int ledwiz_sba_count(ledwiz_t *lw)
+{
+	EnterCriticalSection(&lw->cs);
+	int const n = lw->sba_count;
+	LeaveCriticalSection(&lw->cs);
+	return n;
+}
+
+TEST(dropped_unit_gets_its_state_back_on_reconnect)
+{
+	mock_reset();
+	ledwiz_t lw;
+	InitializeCriticalSection(&lw.cs);
+	ledwiz_power_up(&lw);
+	mock_set_device_hid(LW_PATH, VendorID_LEDWiz, ProductID_LEDWiz_min + LW_UNIT - 1, 0x0100,
+		8, 8, L"LED-WIZ");
+	mock_set_device_proc(LW_PATH, ledwiz_proc, &lw);
+	mock_plug_device(LW_PATH, true);
+
+	dll_load(100);
+	CHECK(g_list.numdevices == 1);
+
+	// stream updates; the unit drops off the bus partway through, and
+	// the client carries on, not knowing
+	BYTE sba[4], pba[32];
+	BYTE speed = 0;
+	bool dropped = false;
+	for (int i = 0 ; i < 20 ; ++i)
+	{
+		for (int k = 0 ; k < 4 ; ++k)
+			sba[k] = (BYTE)(i * 37 + k * 11);
+		for (int k = 0 ; k < 32 ; ++k)
+			pba[k] = (BYTE)(1 + (i + k) % 48);
+		speed = (BYTE)(1 + i % 7);
+
+		LWZ_SBA(LW_UNIT, sba[0], sba[1], sba[2], sba[3], speed);
+		LWZ_PBA(LW_UNIT, pba);
+
+		if (i == 8)
+		{
+			CHECK(ledwiz_wait_state(&lw, sba, speed, pba, SLACK_MS));
+			mock_plug_device(LW_PATH, false);
+			dropped = true;
+		}
+
+		// give the I/O thread time to send each update on its own
+		Sleep(5);
+	}
+
+	CHECK(dropped);
+	HUDEV const hudev = lwz_dev(g_plwz, LW_UNIT - 1)->hudev;
+	for (DWORD t0 = GetTickCount() ; !usbdev_failed(hudev, NULL) && GetTickCount() - t0 < SLACK_MS ; )
+		Sleep(1);
+	CHECK(usbdev_failed(hudev, NULL));
+
+	// let the reconnect thread's first attempt fail, then bring the unit
+	// back, powered up with its outputs off
+	Sleep(RETRY_MS / 2);
+	ledwiz_power_up(&lw);
+	mock_plug_device(LW_PATH, true);
+	DWORD const t0 = GetTickCount();
+
+	// the thread reopens it at its next attempt, and sends the state the
+	// client last set
+	CHECK(ledwiz_wait_state(&lw, sba, speed, pba, RETRY_MS + SLACK_MS));
+	CHECK(ledwiz_sba_count(&lw) == 1);
+	CHECK(mock_device_opens(LW_PATH) == 2);
+	CHECK(g_plwz->discovery_stats.dwReconnects == 1);
+
+	dll_unload();
+	DeleteCriticalSection(&lw.cs);
+}
+
+TEST_MAIN()
@@ -0,0 +1,46 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Device broadcast definitions for the host tests
+
+#ifndef MOCK_DBT_H__INCLUDED
+#define MOCK_DBT_H__INCLUDED
+
+#include <windows.h>
+
+#define DBT_DEVICEARRIVAL              0x8000
+#define DBT_DEVICEREMOVECOMPLETE       0x8004
+#define DBT_DEVTYP_DEVICEINTERFACE     0x00000005
+#define DEVICE_NOTIFY_WINDOW_HANDLE    0x00000000
+
+typedef struct {
+	DWORD dbch_size;
+	DWORD dbch_devicetype;
+	DWORD dbch_reserved;
+} DEV_BROADCAST_HDR;
+
+typedef struct {
+	DWORD dbcc_size;
+	DWORD dbcc_devicetype;
+	DWORD dbcc_reserved;
+	GUID dbcc_classguid;
+	char dbcc_name[1];
+} DEV_BROADCAST_DEVICEINTERFACE_A;
+
+HDEVNOTIFY RegisterDeviceNotificationA(HANDLE hrecipient, void *pfilter, DWORD flags);
+BOOL UnregisterDeviceNotification(HDEVNOTIFY hnotify);
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// HID API stand-in for the host tests.  A mock device's attributes,
+// report lengths and strings are set with mock_set_device_hid() (see
+// windows.h).
+
+#ifndef MOCK_HIDSDI_H__INCLUDED
+#define MOCK_HIDSDI_H__INCLUDED
+
+#include <windows.h>
+
+typedef struct {
+	ULONG Size;
+	USHORT VendorID;
+	USHORT ProductID;
+	USHORT VersionNumber;
+} HIDD_ATTRIBUTES;
+
+typedef void *PHIDP_PREPARSED_DATA;
+
+typedef struct {
+	USHORT Usage;
+	USHORT UsagePage;
+	USHORT InputReportByteLength;
+	USHORT OutputReportByteLength;
+	USHORT FeatureReportByteLength;
+	USHORT Reserved[17];
+	USHORT NumberLinkCollectionNodes;
+} HIDP_CAPS;
+
+#define HIDP_STATUS_SUCCESS    0x00110000
+
+BOOLEAN HidD_GetAttributes(HANDLE h, HIDD_ATTRIBUTES *pattrib);
+BOOLEAN HidD_GetPreparsedData(HANDLE h, PHIDP_PREPARSED_DATA *ppdata);
+BOOLEAN HidD_FreePreparsedData(PHIDP_PREPARSED_DATA pdata);
+LONG HidP_GetCaps(PHIDP_PREPARSED_DATA pdata, HIDP_CAPS *pcaps);
+BOOLEAN HidD_GetProductString(HANDLE h, void *pbuf, ULONG size);
+BOOLEAN HidD_GetManufacturerString(HANDLE h, void *pbuf, ULONG size);
+
+#endif
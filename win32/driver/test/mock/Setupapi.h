@@ -0,0 +1,49 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// SetupAPI stand-in for the host tests.  The HID interface list is the
+// mock devices that are plugged in (see windows.h), in the order they
+// were first plugged in.
+
+#ifndef MOCK_SETUPAPI_H__INCLUDED
+#define MOCK_SETUPAPI_H__INCLUDED
+
+#include <windows.h>
+
+typedef HANDLE HDEVINFO;
+
+typedef struct {
+	DWORD cbSize;
+	GUID InterfaceClassGuid;
+	DWORD Flags;
+	ULONG_PTR Reserved;
+} SP_DEVICE_INTERFACE_DATA;
+
+typedef struct {
+	DWORD cbSize;
+	char DevicePath[1];
+} SP_DEVICE_INTERFACE_DETAIL_DATA_A;
+
+#define DIGCF_PRESENT          0x02
+#define DIGCF_INTERFACEDEVICE  0x10
+
+HDEVINFO SetupDiGetClassDevsA(GUID const *pguid, LPCSTR enumerator, HWND hwnd, DWORD flags);
+BOOL SetupDiEnumDeviceInterfaces(HDEVINFO hinfo, void *pdevinfo, GUID const *pguid, DWORD index, SP_DEVICE_INTERFACE_DATA *pdata);
+BOOL SetupDiGetDeviceInterfaceDetailA(HDEVINFO hinfo, SP_DEVICE_INTERFACE_DATA *pdata,
+	SP_DEVICE_INTERFACE_DETAIL_DATA_A *pdetail, DWORD size, DWORD *prequired, void *pdevinfo);
+BOOL SetupDiDestroyDeviceInfoList(HDEVINFO hinfo);
+
+#endif
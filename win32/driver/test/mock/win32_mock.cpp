@@ -0,0 +1,1143 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Mock Win32 layer for the host tests, on POSIX threads.  See windows.h
+// in this directory.
+
+#include <windows.h>
+#include <Setupapi.h>
+#include <Dbt.h>
+
+extern "C" {
+#include <Hidsdi.h>
+}
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define MOCK_MAX_OBJECTS     512
+#define MOCK_MAX_DEAD        64
+#define MOCK_MAX_DEVICES     32
+#define MOCK_MAX_INPUT       64
+#define MOCK_MAX_FILES       8
+
+enum {
+	MOCK_MAPPING = 1,
+	MOCK_EVENT,
+	MOCK_PROCESS,
+	MOCK_MUTEX,
+	MOCK_FILE,
+	MOCK_DISKFILE,
+	MOCK_DEVINFO
+};
+
+// a device that CreateFileA() can open
+typedef struct {
+	char path[MAX_PATH];
+	bool present;
+	bool fail_writes;			// writes fail even on a live handle
+	LONG gen;					// bumped on each unplug, killing the open handles
+	LONG opens;					// successful CreateFileA() calls
+	LONG packets;				// successful writes
+	LONG hid_queries;			// HID API calls on an open handle
+
+	// what the HID API reports
+	USHORT vid, pid, version;
+	USHORT input_rpt_len;		// report lengths, including the report ID
+	USHORT output_rpt_len;
+	wchar_t product[64];
+	wchar_t manufacturer[64];
+
+	// the device's side of the conversation, if any
+	MOCK_DEVICE_PROC proc;
+	void *proc_ctx;
+
+	// input reports waiting for a read, report ID first
+	BYTE input[MOCK_MAX_INPUT][65];
+	DWORD input_len[MOCK_MAX_INPUT];
+	int input_head;
+	int input_count;
+} mock_device_t;
+
+// a regular file, in memory
+typedef struct {
+	char name[MAX_PATH];
+	BYTE *data;
+	DWORD size;
+} mock_file_t;
+
+// a named object, shared by all handles opened on it
+typedef struct {
+	int type;
+	char name[64];
+	LONG refs;
+
+	// mapping
+	void *pmem;
+
+	// event
+	bool manual_reset;
+	bool signaled;
+
+	// process
+	DWORD pid;
+
+	// mutex
+	int lock_count;
+	pthread_t owner;
+
+	// file
+	mock_device_t *dev;
+	LONG gen;
+	OVERLAPPED *read_ol;		// pending read, if any
+	void *read_buf;
+	DWORD read_len;
+
+	// regular file
+	mock_file_t *file;
+
+	// device list snapshot
+	int devinfo[MOCK_MAX_DEVICES];
+	int ndevinfo;
+} mock_object_t;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
+static mock_object_t g_objects[MOCK_MAX_OBJECTS];
+static DWORD g_dead[MOCK_MAX_DEAD];
+static int g_ndead;
+static mock_device_t g_devices[MOCK_MAX_DEVICES];
+static mock_file_t g_files[MOCK_MAX_FILES];
+static int g_nthreads;					// threads that haven't released their handle yet
+static bool g_clock_manual;
+static DWORD volatile g_clock;
+static __thread DWORD t_pid = 1;
+static __thread DWORD t_error;
+
+
+LONG InterlockedIncrement(LONG volatile *p) { return __sync_add_and_fetch(p, 1); }
+LONG InterlockedDecrement(LONG volatile *p) { return __sync_sub_and_fetch(p, 1); }
+LONG InterlockedExchange(LONG volatile *p, LONG v) { __sync_synchronize(); return __sync_lock_test_and_set(p, v); }
+LONG InterlockedExchangeAdd(LONG volatile *p, LONG v) { return __sync_fetch_and_add(p, v); }
+LONG InterlockedCompareExchange(LONG volatile *p, LONG v, LONG cmp) { return __sync_val_compare_and_swap(p, cmp, v); }
+void *InterlockedExchangePointer(void * volatile *p, void *v) { __sync_synchronize(); return __sync_lock_test_and_set(p, v); }
+void *InterlockedCompareExchangePointer(void * volatile *p, void *v, void *cmp) { return __sync_val_compare_and_swap(p, cmp, v); }
+
+void InitializeCriticalSection(CRITICAL_SECTION *pcs)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(pcs, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void DeleteCriticalSection(CRITICAL_SECTION *pcs) { pthread_mutex_destroy(pcs); }
+void EnterCriticalSection(CRITICAL_SECTION *pcs) { pthread_mutex_lock(pcs); }
+void LeaveCriticalSection(CRITICAL_SECTION *pcs) { pthread_mutex_unlock(pcs); }
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *pfreq)
+{
+	pfreq->QuadPart = 1000000000;
+	return TRUE;
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER *pcount)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pcount->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return TRUE;
+}
+
+// Switch GetTickCount() over to a manual clock, starting at 'ms'.  From
+// then on, only Sleep() moves it.  mock_reset() goes back to real time.
+void mock_set_clock(DWORD ms)
+{
+	g_clock = ms;
+	g_clock_manual = true;
+}
+
+DWORD GetTickCount(void)
+{
+	if (g_clock_manual)
+		return g_clock;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (DWORD)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+void Sleep(DWORD ms)
+{
+	if (g_clock_manual)
+	{
+		__sync_fetch_and_add(&g_clock, ms);
+		sched_yield();
+	}
+	else if (ms == 0)
+		sched_yield();
+	else
+		usleep(ms * 1000);
+}
+
+DWORD GetCurrentProcessId(void)
+{
+	return t_pid;
+}
+
+DWORD GetCurrentThreadId(void)
+{
+	return (DWORD)(uintptr_t)pthread_self();
+}
+
+DWORD GetLastError(void)
+{
+	return t_error;
+}
+
+// the environment is empty
+DWORD GetEnvironmentVariableA(LPCSTR name, LPSTR buf, DWORD size)
+{
+	return 0;
+}
+
+DWORD TlsAlloc(void)
+{
+	pthread_key_t key;
+	if (pthread_key_create(&key, NULL) != 0)
+		return TLS_OUT_OF_INDEXES;
+
+	return (DWORD)key;
+}
+
+LPVOID TlsGetValue(DWORD index)
+{
+	return pthread_getspecific((pthread_key_t)index);
+}
+
+BOOL TlsSetValue(DWORD index, LPVOID value)
+{
+	return pthread_setspecific((pthread_key_t)index, value) == 0;
+}
+
+void mock_set_process(DWORD pid)
+{
+	t_pid = pid;
+}
+
+void mock_kill_process(DWORD pid)
+{
+	pthread_mutex_lock(&g_lock);
+	if (g_ndead < MOCK_MAX_DEAD)
+		g_dead[g_ndead++] = pid;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+}
+
+// forget all objects and dead processes, between tests
+void mock_reset(void)
+{
+	pthread_mutex_lock(&g_lock);
+
+	// A thread from the last test can still be on its way out after its
+	// owner stopped waiting for it, and its handle's slot mustn't be
+	// reused until it has released it.
+	while (g_nthreads > 0)
+		pthread_cond_wait(&g_cond, &g_lock);
+
+	for (int i = 0 ; i < MOCK_MAX_OBJECTS ; ++i)
+	{
+		free(g_objects[i].pmem);
+		memset(&g_objects[i], 0x00, sizeof(g_objects[i]));
+	}
+	memset(g_devices, 0x00, sizeof(g_devices));
+	for (int i = 0 ; i < MOCK_MAX_FILES ; ++i)
+		free(g_files[i].data);
+	memset(g_files, 0x00, sizeof(g_files));
+	g_ndead = 0;
+	g_clock_manual = false;
+	pthread_mutex_unlock(&g_lock);
+}
+
+static bool mock_dead(DWORD pid)
+{
+	for (int i = 0 ; i < g_ndead ; ++i)
+	{
+		if (g_dead[i] == pid)
+			return true;
+	}
+
+	return false;
+}
+
+// Find a named object, or create it if 'create' is set.  Must be called
+// with 'g_lock' held.
+static mock_object_t * mock_find(int type, LPCSTR name, bool create)
+{
+	mock_object_t *free_obj = NULL;
+
+	for (int i = 0 ; i < MOCK_MAX_OBJECTS ; ++i)
+	{
+		mock_object_t * const o = &g_objects[i];
+		if (o->type == type && name != NULL && strcmp(o->name, name) == 0)
+			return o;
+
+		if (o->type == 0 && free_obj == NULL)
+			free_obj = o;
+	}
+
+	if (!create || free_obj == NULL)
+		return NULL;
+
+	free_obj->type = type;
+	if (name != NULL)
+		strncpy(free_obj->name, name, sizeof(free_obj->name) - 1);
+
+	return free_obj;
+}
+
+// Take a reference to an object.  Named objects stay around after their
+// last handle is closed, which doesn't matter to the tests, and lets a
+// test look at what a "process" left behind.
+static HANDLE mock_handle(mock_object_t *o)
+{
+	if (o == NULL)
+		return NULL;
+
+	o->refs += 1;
+	return (HANDLE)o;
+}
+
+BOOL CloseHandle(HANDLE h)
+{
+	if (h == NULL)
+		return FALSE;
+
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = (mock_object_t *)h;
+	o->refs -= 1;
+	if (o->refs <= 0 && o->name[0] == '\0')
+	{
+		free(o->pmem);
+		memset(o, 0x00, sizeof(*o));
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return TRUE;
+}
+
+// Is the object signaled?  If so, take it, for an auto-reset event or a
+// mutex.  Must be called with 'g_lock' held.
+static bool mock_take(mock_object_t *o)
+{
+	switch (o->type)
+	{
+	case MOCK_PROCESS:
+		return mock_dead(o->pid);
+
+	case MOCK_EVENT:
+		if (!o->signaled)
+			return false;
+		if (!o->manual_reset)
+			o->signaled = false;
+		return true;
+
+	case MOCK_MUTEX:
+		if (o->lock_count != 0 && !pthread_equal(o->owner, pthread_self()))
+			return false;
+		o->owner = pthread_self();
+		o->lock_count += 1;
+		return true;
+	}
+
+	return false;
+}
+
+DWORD WaitForMultipleObjects(DWORD count, HANDLE const *ph, BOOL all, DWORD ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	if (ms != INFINITE)
+	{
+		deadline.tv_sec += ms / 1000;
+		deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	DWORD res = WAIT_TIMEOUT;
+	pthread_mutex_lock(&g_lock);
+	for (;;)
+	{
+		for (DWORD i = 0 ; i < count && res == WAIT_TIMEOUT ; ++i)
+		{
+			if (mock_take((mock_object_t *)ph[i]))
+				res = WAIT_OBJECT_0 + i;
+		}
+
+		if (res != WAIT_TIMEOUT || ms == 0)
+			break;
+
+		if (ms == INFINITE)
+			pthread_cond_wait(&g_cond, &g_lock);
+		else if (pthread_cond_timedwait(&g_cond, &g_lock, &deadline) != 0)
+			break;
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return res;
+}
+
+DWORD WaitForSingleObject(HANDLE h, DWORD ms)
+{
+	return WaitForMultipleObjects(1, &h, FALSE, ms);
+}
+
+// Threads are detached; the handle is a manual-reset event that's
+// signaled when the thread exits.
+typedef struct {
+	LPTHREAD_START_ROUTINE proc;
+	LPVOID param;
+	mock_object_t *o;
+} mock_thread_t;
+
+static void * mock_thread_proc(void *p)
+{
+	mock_thread_t * const t = (mock_thread_t *)p;
+	t->proc(t->param);
+	SetEvent((HANDLE)t->o);
+	CloseHandle((HANDLE)t->o);
+	free(t);
+
+	pthread_mutex_lock(&g_lock);
+	g_nthreads -= 1;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+HANDLE CreateThread(void *psa, size_t stack, LPTHREAD_START_ROUTINE proc, LPVOID param, DWORD flags, DWORD *ptid)
+{
+	mock_thread_t * const t = (mock_thread_t *)malloc(sizeof(mock_thread_t));
+	HANDLE const h = CreateEventA(NULL, TRUE, FALSE, NULL);
+	t->proc = proc;
+	t->param = param;
+	t->o = (mock_object_t *)h;
+
+	// the thread holds its own reference to the handle
+	pthread_mutex_lock(&g_lock);
+	t->o->refs += 1;
+	g_nthreads += 1;
+	pthread_mutex_unlock(&g_lock);
+
+	pthread_t tid;
+	pthread_create(&tid, NULL, mock_thread_proc, t);
+	pthread_detach(tid);
+
+	return h;
+}
+
+static mock_device_t * mock_device(LPCSTR path, bool create)
+{
+	mock_device_t *free_dev = NULL;
+	for (int i = 0 ; i < MOCK_MAX_DEVICES ; ++i)
+	{
+		if (strcmp(g_devices[i].path, path) == 0)
+			return &g_devices[i];
+
+		if (g_devices[i].path[0] == '\0' && free_dev == NULL)
+			free_dev = &g_devices[i];
+	}
+
+	if (create && free_dev != NULL)
+		strncpy(free_dev->path, path, sizeof(free_dev->path) - 1);
+
+	return create ? free_dev : NULL;
+}
+
+// is the handle still good?  Must be called with 'g_lock' held.
+static bool mock_file_live(mock_object_t *o)
+{
+	return o->type == MOCK_FILE && o->dev->present && o->gen == o->dev->gen;
+}
+
+// Complete the pending read on a file handle, if there is one, with
+// 'error' or with the report in 'pdata'.  Must be called with 'g_lock'
+// held.
+static void mock_complete_read(mock_object_t *o, DWORD error, BYTE const *pdata, DWORD ndata)
+{
+	OVERLAPPED * const pol = o->read_ol;
+	if (pol == NULL)
+		return;
+
+	if (ndata > o->read_len)
+		ndata = o->read_len;
+	if (error == 0)
+		memcpy(o->read_buf, pdata, ndata);
+
+	pol->Internal = error;
+	pol->InternalHigh = (error == 0) ? ndata : 0;
+	o->read_ol = NULL;
+
+	if (pol->hEvent != NULL)
+	{
+		((mock_object_t *)pol->hEvent)->signaled = true;
+		pthread_cond_broadcast(&g_cond);
+	}
+}
+
+// Plug a device in, or unplug it.  Unplugging kills the handles open on it.
+void mock_plug_device(LPCSTR path, bool present)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, true);
+	if (d->present && !present)
+	{
+		d->gen += 1;
+		d->input_count = 0;
+
+		for (int i = 0 ; i < MOCK_MAX_OBJECTS ; ++i)
+		{
+			if (g_objects[i].type == MOCK_FILE && g_objects[i].dev == d)
+				mock_complete_read(&g_objects[i], ERROR_GEN_FAILURE, NULL, 0);
+		}
+	}
+	d->present = present;
+	pthread_mutex_unlock(&g_lock);
+}
+
+// Set what the HID API reports for a device.  The report lengths don't
+// include the report ID.
+void mock_set_device_hid(LPCSTR path, USHORT vid, USHORT pid, USHORT version,
+	USHORT input_len, USHORT output_len, wchar_t const *product)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, true);
+	d->vid = vid;
+	d->pid = pid;
+	d->version = version;
+	d->input_rpt_len = input_len + 1;
+	d->output_rpt_len = output_len + 1;
+	wcsncpy(d->product, product, 63);
+	pthread_mutex_unlock(&g_lock);
+}
+
+// Play the device's side: 'proc' sees each 8-byte packet written to the
+// device, and can answer with mock_device_input()
+void mock_set_device_proc(LPCSTR path, MOCK_DEVICE_PROC proc, void *ctx)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, true);
+	d->proc = proc;
+	d->proc_ctx = ctx;
+	pthread_mutex_unlock(&g_lock);
+}
+
+// Make writes to the device fail, or work again, without unplugging it
+void mock_fail_writes(LPCSTR path, bool fail)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device(path, true)->fail_writes = fail;
+	pthread_mutex_unlock(&g_lock);
+}
+
+// Send an input report from the device, without its report ID.  It
+// completes a pending read if there is one, or waits in the device's
+// queue for the next read; when the queue is full, the report is lost,
+// as it is when the HID driver's buffer overflows.
+void mock_device_input(LPCSTR path, void const *pdata, DWORD ndata)
+{
+	BYTE report[65] = { 0 };
+	if (ndata > sizeof(report) - 1)
+		ndata = sizeof(report) - 1;
+	memcpy(&report[1], pdata, ndata);
+
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, false);
+	if (d != NULL && d->present)
+	{
+		mock_object_t *reader = NULL;
+		for (int i = 0 ; i < MOCK_MAX_OBJECTS && reader == NULL ; ++i)
+		{
+			if (g_objects[i].read_ol != NULL && g_objects[i].dev == d && mock_file_live(&g_objects[i]))
+				reader = &g_objects[i];
+		}
+
+		if (reader != NULL)
+			mock_complete_read(reader, 0, report, ndata + 1);
+		else if (d->input_count < MOCK_MAX_INPUT)
+		{
+			int const k = (d->input_head + d->input_count) % MOCK_MAX_INPUT;
+			memcpy(d->input[k], report, sizeof(report));
+			d->input_len[k] = ndata + 1;
+			d->input_count += 1;
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+}
+
+// Get the number of reads waiting for input on the device
+int mock_device_pending_reads(LPCSTR path)
+{
+	int n = 0;
+
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, false);
+	for (int i = 0 ; i < MOCK_MAX_OBJECTS && d != NULL ; ++i)
+	{
+		if (g_objects[i].read_ol != NULL && g_objects[i].dev == d)
+			n += 1;
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return n;
+}
+
+LONG mock_device_opens(LPCSTR path)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, false);
+	LONG const n = (d != NULL) ? d->opens : 0;
+	pthread_mutex_unlock(&g_lock);
+
+	return n;
+}
+
+LONG mock_device_hid_queries(LPCSTR path)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, false);
+	LONG const n = (d != NULL) ? d->hid_queries : 0;
+	pthread_mutex_unlock(&g_lock);
+
+	return n;
+}
+
+LONG mock_device_packets(LPCSTR path)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, false);
+	LONG const n = (d != NULL) ? d->packets : 0;
+	pthread_mutex_unlock(&g_lock);
+
+	return n;
+}
+
+// Find a regular file, or create an empty one if 'create' is set.  Must
+// be called with 'g_lock' held.
+static mock_file_t * mock_file(LPCSTR name, bool create)
+{
+	mock_file_t *free_file = NULL;
+	for (int i = 0 ; i < MOCK_MAX_FILES ; ++i)
+	{
+		if (g_files[i].data != NULL && strcmp(g_files[i].name, name) == 0)
+			return &g_files[i];
+
+		if (g_files[i].data == NULL && free_file == NULL)
+			free_file = &g_files[i];
+	}
+
+	if (!create || free_file == NULL || strlen(name) >= sizeof(free_file->name))
+		return NULL;
+
+	strcpy(free_file->name, name);
+	free_file->data = (BYTE *)malloc(1);
+	free_file->size = 0;
+
+	return free_file;
+}
+
+// Open a device, or a regular file.  Regular files live in memory, and
+// only a whole file can be written, with one WriteFile() call after
+// CREATE_ALWAYS.
+HANDLE CreateFileA(LPCSTR path, DWORD access, DWORD share, void *psa, DWORD disposition, DWORD flags, HANDLE htemplate)
+{
+	HANDLE h = INVALID_HANDLE_VALUE;
+
+	pthread_mutex_lock(&g_lock);
+	mock_device_t * const d = mock_device(path, false);
+	if (d != NULL && d->present)
+	{
+		mock_object_t * const o = mock_find(MOCK_FILE, NULL, true);
+		if (o != NULL)
+		{
+			o->dev = d;
+			o->gen = d->gen;
+			d->opens += 1;
+			h = mock_handle(o);
+		}
+	}
+	else if (d == NULL)
+	{
+		mock_file_t * const f = mock_file(path, disposition == CREATE_ALWAYS);
+		mock_object_t * const o = (f != NULL) ? mock_find(MOCK_DISKFILE, NULL, true) : NULL;
+		if (o != NULL)
+		{
+			if (disposition == CREATE_ALWAYS)
+				f->size = 0;
+			o->file = f;
+			h = mock_handle(o);
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	if (h == INVALID_HANDLE_VALUE)
+		t_error = ERROR_GEN_FAILURE;
+
+	return h;
+}
+
+// Writes complete right away, or fail right away.  A device write is
+// passed on to the device's handler, if it has one, after the report ID.
+BOOL WriteFile(HANDLE h, void const *pdata, DWORD ndata, DWORD *pnwritten, OVERLAPPED *pol)
+{
+	mock_object_t * const o = (mock_object_t *)h;
+	if (o->type == MOCK_DISKFILE)
+	{
+		pthread_mutex_lock(&g_lock);
+		mock_file_t * const f = o->file;
+		free(f->data);
+		f->data = (BYTE *)malloc(ndata + 1);
+		memcpy(f->data, pdata, ndata);
+		f->size = ndata;
+		pthread_mutex_unlock(&g_lock);
+
+		*pnwritten = ndata;
+		return TRUE;
+	}
+
+	pthread_mutex_lock(&g_lock);
+	bool const ok = mock_file_live(o) && !o->dev->fail_writes;
+	if (ok)
+		o->dev->packets += 1;
+	MOCK_DEVICE_PROC const proc = ok ? o->dev->proc : NULL;
+	void * const proc_ctx = o->dev->proc_ctx;
+	char path[MAX_PATH];
+	strcpy(path, o->dev->path);
+	pthread_mutex_unlock(&g_lock);
+
+	if (proc != NULL && ndata == 9)
+		proc(proc_ctx, path, (BYTE const *)pdata + 1);
+
+	pol->Internal = ok ? 0 : ERROR_GEN_FAILURE;
+	pol->InternalHigh = ok ? ndata : 0;
+	if (!ok)
+		t_error = ERROR_GEN_FAILURE;
+
+	return ok ? TRUE : FALSE;
+}
+
+// A read takes the oldest queued input report, or stays pending until
+// mock_device_input() sends one, the device is unplugged, or CancelIo()
+BOOL ReadFile(HANDLE h, void *pdata, DWORD ndata, DWORD *pnread, OVERLAPPED *pol)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = (mock_object_t *)h;
+	bool const live = mock_file_live(o);
+	mock_device_t * const d = o->dev;
+
+	// the event is reset when the read starts, as on Windows
+	if (pol->hEvent != NULL)
+		((mock_object_t *)pol->hEvent)->signaled = false;
+
+	pol->Internal = live ? ERROR_IO_PENDING : ERROR_GEN_FAILURE;
+	pol->InternalHigh = 0;
+
+	if (live)
+	{
+		o->read_ol = pol;
+		o->read_buf = pdata;
+		o->read_len = ndata;
+
+		if (d->input_count > 0)
+		{
+			mock_complete_read(o, 0, d->input[d->input_head], d->input_len[d->input_head]);
+			d->input_head = (d->input_head + 1) % MOCK_MAX_INPUT;
+			d->input_count -= 1;
+		}
+	}
+
+	DWORD const error = (DWORD)pol->Internal;
+	pthread_mutex_unlock(&g_lock);
+
+	if (error == 0)
+	{
+		if (pnread != NULL)
+			*pnread = (DWORD)pol->InternalHigh;
+		return TRUE;
+	}
+
+	t_error = error;
+	return FALSE;
+}
+
+BOOL GetOverlappedResult(HANDLE h, OVERLAPPED *pol, DWORD *pn, BOOL wait)
+{
+	*pn = (DWORD)pol->InternalHigh;
+	if (pol->Internal != 0)
+	{
+		t_error = (DWORD)pol->Internal;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL CancelIo(HANDLE h)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_complete_read((mock_object_t *)h, ERROR_OPERATION_ABORTED, NULL, 0);
+	pthread_mutex_unlock(&g_lock);
+
+	return TRUE;
+}
+
+DWORD GetFileSize(HANDLE h, DWORD *psize_high)
+{
+	mock_object_t * const o = (mock_object_t *)h;
+	if (o->type != MOCK_DISKFILE)
+		return INVALID_FILE_SIZE;
+
+	if (psize_high != NULL)
+		*psize_high = 0;
+
+	return o->file->size;
+}
+
+BOOL MoveFileExA(LPCSTR from, LPCSTR to, DWORD flags)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_file_t * const f = mock_file(from, false);
+	mock_file_t * const old = mock_file(to, false);
+	bool const ok = (f != NULL && strlen(to) < sizeof(f->name)
+		&& (old == NULL || (flags & MOVEFILE_REPLACE_EXISTING) != 0));
+	if (ok)
+	{
+		if (old != NULL && old != f)
+		{
+			free(old->data);
+			memset(old, 0x00, sizeof(*old));
+		}
+		strcpy(f->name, to);
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return ok ? TRUE : FALSE;
+}
+
+BOOL DeleteFileA(LPCSTR path)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_file_t * const f = mock_file(path, false);
+	if (f != NULL)
+	{
+		free(f->data);
+		memset(f, 0x00, sizeof(*f));
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return (f != NULL) ? TRUE : FALSE;
+}
+
+DWORD GetTempPathA(DWORD size, LPSTR buf)
+{
+	static char const tmp[] = "C:\\Temp\\";
+	if (size < sizeof(tmp))
+		return sizeof(tmp);
+
+	strcpy(buf, tmp);
+	return sizeof(tmp) - 1;
+}
+
+// A named mapping is shared memory; a mapping of a regular file is a
+// snapshot of the file's contents
+HANDLE CreateFileMappingA(HANDLE hfile, void *psa, DWORD protect, DWORD size_high, DWORD size_low, LPCSTR name)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = mock_find(MOCK_MAPPING, name, true);
+	mock_object_t * const of = (hfile != INVALID_HANDLE_VALUE) ? (mock_object_t *)hfile : NULL;
+	if (o != NULL && o->pmem == NULL && of != NULL && of->type == MOCK_DISKFILE)
+	{
+		o->pmem = malloc(of->file->size + 1);
+		memcpy(o->pmem, of->file->data, of->file->size);
+	}
+	else if (o != NULL && o->pmem == NULL)
+		o->pmem = calloc(1, size_low);
+	HANDLE const h = mock_handle(o);
+	pthread_mutex_unlock(&g_lock);
+
+	return h;
+}
+
+HANDLE OpenFileMappingA(DWORD access, BOOL inherit, LPCSTR name)
+{
+	pthread_mutex_lock(&g_lock);
+	HANDLE const h = mock_handle(mock_find(MOCK_MAPPING, name, false));
+	pthread_mutex_unlock(&g_lock);
+
+	return h;
+}
+
+LPVOID MapViewOfFile(HANDLE hmap, DWORD access, DWORD ofs_high, DWORD ofs_low, size_t size)
+{
+	return ((mock_object_t *)hmap)->pmem;
+}
+
+BOOL UnmapViewOfFile(void const *p)
+{
+	return TRUE;
+}
+
+HANDLE CreateEventA(void *psa, BOOL manual_reset, BOOL initial, LPCSTR name)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = mock_find(MOCK_EVENT, name, true);
+	if (o != NULL && o->refs == 0)
+	{
+		o->manual_reset = (manual_reset != FALSE);
+		o->signaled = (initial != FALSE);
+	}
+	HANDLE const h = mock_handle(o);
+	pthread_mutex_unlock(&g_lock);
+
+	return h;
+}
+
+HANDLE OpenEventA(DWORD access, BOOL inherit, LPCSTR name)
+{
+	pthread_mutex_lock(&g_lock);
+	HANDLE const h = mock_handle(mock_find(MOCK_EVENT, name, false));
+	pthread_mutex_unlock(&g_lock);
+
+	return h;
+}
+
+HANDLE CreateMutexA(void *psa, BOOL owned, LPCSTR name)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = mock_find(MOCK_MUTEX, name, true);
+	if (o != NULL && owned && o->lock_count == 0)
+	{
+		o->owner = pthread_self();
+		o->lock_count = 1;
+	}
+	HANDLE const h = mock_handle(o);
+	pthread_mutex_unlock(&g_lock);
+
+	return h;
+}
+
+BOOL ReleaseMutex(HANDLE h)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = (mock_object_t *)h;
+	bool const owned = (o->lock_count != 0 && pthread_equal(o->owner, pthread_self()));
+	if (owned && --o->lock_count == 0)
+		pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+
+	return owned ? TRUE : FALSE;
+}
+
+BOOL ResetEvent(HANDLE h)
+{
+	pthread_mutex_lock(&g_lock);
+	((mock_object_t *)h)->signaled = false;
+	pthread_mutex_unlock(&g_lock);
+
+	return TRUE;
+}
+
+BOOL SetEvent(HANDLE h)
+{
+	pthread_mutex_lock(&g_lock);
+	((mock_object_t *)h)->signaled = true;
+	pthread_cond_broadcast(&g_cond);
+	pthread_mutex_unlock(&g_lock);
+
+	return TRUE;
+}
+
+HANDLE OpenProcess(DWORD access, BOOL inherit, DWORD pid)
+{
+	pthread_mutex_lock(&g_lock);
+	HANDLE h = NULL;
+	if (!mock_dead(pid))
+	{
+		mock_object_t * const o = mock_find(MOCK_PROCESS, NULL, true);
+		if (o != NULL)
+		{
+			o->pid = pid;
+			h = mock_handle(o);
+		}
+	}
+	pthread_mutex_unlock(&g_lock);
+
+	return h;
+}
+
+LONG_PTR SetWindowLongPtrA(HWND hwnd, int index, LONG_PTR value)
+{
+	return 0;
+}
+
+LRESULT CallWindowProc(WNDPROC proc, HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam)
+{
+	return proc(hwnd, msg, wparam, lparam);
+}
+
+HDEVNOTIFY RegisterDeviceNotificationA(HANDLE hrecipient, void *pfilter, DWORD flags)
+{
+	return NULL;
+}
+
+BOOL UnregisterDeviceNotification(HDEVNOTIFY hnotify)
+{
+	return TRUE;
+}
+
+// The device list is a snapshot of the devices plugged in, in slot order
+HDEVINFO SetupDiGetClassDevsA(GUID const *pguid, LPCSTR enumerator, HWND hwnd, DWORD flags)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = mock_find(MOCK_DEVINFO, NULL, true);
+	if (o != NULL)
+	{
+		for (int i = 0 ; i < MOCK_MAX_DEVICES ; ++i)
+		{
+			if (g_devices[i].present)
+				o->devinfo[o->ndevinfo++] = i;
+		}
+	}
+	HANDLE const h = mock_handle(o);
+	pthread_mutex_unlock(&g_lock);
+
+	return (h != NULL) ? h : INVALID_HANDLE_VALUE;
+}
+
+BOOL SetupDiEnumDeviceInterfaces(HDEVINFO hinfo, void *pdevinfo, GUID const *pguid, DWORD index, SP_DEVICE_INTERFACE_DATA *pdata)
+{
+	mock_object_t * const o = (mock_object_t *)hinfo;
+	if (index >= (DWORD)o->ndevinfo)
+		return FALSE;
+
+	pdata->Reserved = o->devinfo[index];
+	return TRUE;
+}
+
+BOOL SetupDiGetDeviceInterfaceDetailA(HDEVINFO hinfo, SP_DEVICE_INTERFACE_DATA *pdata,
+	SP_DEVICE_INTERFACE_DETAIL_DATA_A *pdetail, DWORD size, DWORD *prequired, void *pdevinfo)
+{
+	pthread_mutex_lock(&g_lock);
+	char const * const path = g_devices[pdata->Reserved].path;
+	DWORD const need = (DWORD)(offsetof(SP_DEVICE_INTERFACE_DETAIL_DATA_A, DevicePath) + strlen(path) + 1);
+	bool const ok = (pdetail != NULL && size >= need);
+	if (ok)
+		strcpy(pdetail->DevicePath, path);
+	pthread_mutex_unlock(&g_lock);
+
+	if (prequired != NULL)
+		*prequired = need;
+
+	return ok ? TRUE : FALSE;
+}
+
+BOOL SetupDiDestroyDeviceInfoList(HDEVINFO hinfo)
+{
+	return CloseHandle(hinfo);
+}
+
+// get the device behind a handle, or NULL if it's not a live device handle
+static mock_device_t * mock_hid_device(HANDLE h)
+{
+	pthread_mutex_lock(&g_lock);
+	mock_object_t * const o = (mock_object_t *)h;
+	mock_device_t * const d = mock_file_live(o) ? o->dev : NULL;
+	if (d != NULL)
+		d->hid_queries += 1;
+	pthread_mutex_unlock(&g_lock);
+
+	return d;
+}
+
+BOOLEAN HidD_GetAttributes(HANDLE h, HIDD_ATTRIBUTES *pattrib)
+{
+	mock_device_t * const d = mock_hid_device(h);
+	if (d == NULL)
+		return FALSE;
+
+	pattrib->VendorID = d->vid;
+	pattrib->ProductID = d->pid;
+	pattrib->VersionNumber = d->version;
+	return TRUE;
+}
+
+// the "preparsed data" is just the device
+BOOLEAN HidD_GetPreparsedData(HANDLE h, PHIDP_PREPARSED_DATA *ppdata)
+{
+	mock_device_t * const d = mock_hid_device(h);
+	*ppdata = d;
+	return (d != NULL) ? TRUE : FALSE;
+}
+
+BOOLEAN HidD_FreePreparsedData(PHIDP_PREPARSED_DATA pdata)
+{
+	return TRUE;
+}
+
+LONG HidP_GetCaps(PHIDP_PREPARSED_DATA pdata, HIDP_CAPS *pcaps)
+{
+	mock_device_t * const d = (mock_device_t *)pdata;
+	memset(pcaps, 0x00, sizeof(*pcaps));
+	pcaps->UsagePage = 1;
+	pcaps->Usage = 4;
+	pcaps->InputReportByteLength = d->input_rpt_len;
+	pcaps->OutputReportByteLength = d->output_rpt_len;
+	pcaps->NumberLinkCollectionNodes = 1;
+	return HIDP_STATUS_SUCCESS;
+}
+
+// the buffer size is in bytes
+static BOOLEAN mock_hid_string(HANDLE h, void *pbuf, ULONG size, bool product)
+{
+	mock_device_t * const d = mock_hid_device(h);
+	size_t const n = size / sizeof(wchar_t);
+	if (d == NULL || n == 0)
+		return FALSE;
+
+	wchar_t const * const str = product ? d->product : d->manufacturer;
+	wcsncpy((wchar_t *)pbuf, str, n - 1);
+	((wchar_t *)pbuf)[n - 1] = 0;
+	return TRUE;
+}
+
+BOOLEAN HidD_GetProductString(HANDLE h, void *pbuf, ULONG size)
+{
+	return mock_hid_string(h, pbuf, size, true);
+}
+
+BOOLEAN HidD_GetManufacturerString(HANDLE h, void *pbuf, ULONG size)
+{
+	return mock_hid_string(h, pbuf, size, false);
+}
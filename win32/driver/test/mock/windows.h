@@ -0,0 +1,256 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Mock Win32 layer for the host tests (see win32_mock.cpp).
+//
+// This covers just the part of the API that the transport and device
+// code under test uses.  Named objects live in the one test process, and
+// so do the "processes": each test thread says which process it's playing
+// with mock_set_process(), and a process dies with mock_kill_process(),
+// which the code under test sees through its process handles.
+//
+// Devices are files that CreateFileA() can open while they're plugged in
+// (mock_plug_device()).  Unplugging one kills the handles opened on it,
+// the way a USB reset does: their writes fail, and they stay dead after
+// the device comes back.  A device sends input reports with
+// mock_device_input(), which completes the read pending on it.  A test
+// can also switch GetTickCount() over to a manual clock
+// (mock_set_clock()), which Sleep() then advances.
+//
+// The HID interface list (Setupapi.h) is the devices plugged in, with
+// the attributes and strings set by mock_set_device_hid(), and a device
+// proc (mock_set_device_proc()) can play the device's side of the
+// conversation.  Regular files live in memory, and go with mock_reset().
+
+#ifndef MOCK_WINDOWS_H__INCLUDED
+#define MOCK_WINDOWS_H__INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <pthread.h>
+
+typedef int BOOL;
+typedef unsigned char BOOLEAN;
+typedef unsigned char BYTE;
+typedef unsigned short USHORT;
+typedef unsigned short WORD;
+typedef unsigned int UINT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef wchar_t WCHAR;
+typedef void *HANDLE;
+typedef void *PVOID;
+typedef void *LPVOID;
+typedef char *LPSTR;
+typedef char const *LPCSTR;
+typedef intptr_t INT_PTR;
+typedef intptr_t LONG_PTR;
+typedef uintptr_t ULONG_PTR;
+
+typedef HANDLE HINSTANCE;
+typedef HANDLE HWND;
+typedef HANDLE HDEVNOTIFY;
+typedef uintptr_t WPARAM;
+typedef intptr_t LPARAM;
+typedef intptr_t LRESULT;
+
+typedef struct {
+	DWORD Data1;
+	WORD Data2;
+	WORD Data3;
+	BYTE Data4[8];
+} GUID;
+
+typedef union {
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct {
+	ULONG_PTR Internal;
+	ULONG_PTR InternalHigh;
+	DWORD Offset;
+	DWORD OffsetHigh;
+	HANDLE hEvent;
+} OVERLAPPED;
+
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+typedef LRESULT (*WNDPROC)(HWND, UINT, WPARAM, LPARAM);
+
+#define TRUE  1
+#define FALSE 0
+
+#define INVALID_HANDLE_VALUE   ((HANDLE)(intptr_t)-1)
+#define INFINITE               0xFFFFFFFF
+#define MAX_PATH               260
+#define MAXIMUM_WAIT_OBJECTS   64
+#define INVALID_FILE_SIZE      0xFFFFFFFF
+#define TLS_OUT_OF_INDEXES     0xFFFFFFFF
+
+#define WAIT_OBJECT_0          0
+#define WAIT_ABANDONED         0x80
+#define WAIT_TIMEOUT           258
+
+#define ERROR_GEN_FAILURE      31
+#define ERROR_OPERATION_ABORTED 995
+#define ERROR_IO_PENDING       997
+
+#define GENERIC_READ           0x80000000
+#define GENERIC_WRITE          0x40000000
+#define FILE_SHARE_READ        0x01
+#define FILE_SHARE_WRITE       0x02
+#define FILE_SHARE_DELETE      0x04
+#define CREATE_ALWAYS          2
+#define OPEN_EXISTING          3
+#define FILE_ATTRIBUTE_NORMAL  0x80
+#define FILE_FLAG_OVERLAPPED   0x40000000
+#define MOVEFILE_REPLACE_EXISTING 0x01
+
+#define PAGE_READONLY          0x02
+#define PAGE_READWRITE         0x04
+#define FILE_MAP_READ          0x04
+#define FILE_MAP_ALL_ACCESS    0xF001F
+#define SYNCHRONIZE            0x00100000
+#define EVENT_MODIFY_STATE     0x0002
+
+#define DLL_PROCESS_DETACH     0
+#define DLL_PROCESS_ATTACH     1
+#define DLL_THREAD_ATTACH      2
+#define DLL_THREAD_DETACH      3
+
+#define WM_DESTROY             0x0002
+#define WM_DEVICECHANGE        0x0219
+#define GWLP_WNDPROC           (-4)
+
+#define WINAPI
+#define CALLBACK
+
+#define _TRUNCATE              ((size_t)-1)
+#define _snprintf_s(buf, size, count, ...) snprintf(buf, size, __VA_ARGS__)
+#define _strdup strdup
+#define _stricmp strcasecmp
+#define fopen_s(pfp, path, mode) ((*(pfp) = fopen(path, mode)) == NULL ? 1 : 0)
+#define strncpy_s(dst, size, src, count) snprintf(dst, size, "%s", src)
+
+static inline int wcstombs_s(size_t *pn, char *dst, size_t size, wchar_t const *src, size_t count)
+{
+	size_t n = 0;
+	for ( ; n + 1 < size && src[n] != 0 ; ++n)
+		dst[n] = (char)src[n];
+	dst[n] = '\0';
+	*pn = n + 1;
+	return 0;
+}
+
+template <size_t N> static inline int _wcslwr_s(wchar_t (&s)[N])
+{
+	for (size_t i = 0 ; i < N && s[i] != 0 ; ++i)
+		s[i] = towlower(s[i]);
+	return 0;
+}
+
+LONG InterlockedIncrement(LONG volatile *p);
+LONG InterlockedDecrement(LONG volatile *p);
+LONG InterlockedExchange(LONG volatile *p, LONG v);
+LONG InterlockedExchangeAdd(LONG volatile *p, LONG v);
+LONG InterlockedCompareExchange(LONG volatile *p, LONG v, LONG cmp);
+#define MemoryBarrier() __sync_synchronize()
+#define YieldProcessor() __sync_synchronize()
+void *InterlockedExchangePointer(void * volatile *p, void *v);
+void *InterlockedCompareExchangePointer(void * volatile *p, void *v, void *cmp);
+
+void InitializeCriticalSection(CRITICAL_SECTION *pcs);
+void DeleteCriticalSection(CRITICAL_SECTION *pcs);
+void EnterCriticalSection(CRITICAL_SECTION *pcs);
+void LeaveCriticalSection(CRITICAL_SECTION *pcs);
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER *pfreq);
+BOOL QueryPerformanceCounter(LARGE_INTEGER *pcount);
+
+DWORD GetTickCount(void);
+void Sleep(DWORD ms);
+DWORD GetCurrentProcessId(void);
+DWORD GetCurrentThreadId(void);
+DWORD GetLastError(void);
+DWORD GetEnvironmentVariableA(LPCSTR name, LPSTR buf, DWORD size);
+
+DWORD TlsAlloc(void);
+LPVOID TlsGetValue(DWORD index);
+BOOL TlsSetValue(DWORD index, LPVOID value);
+
+BOOL CloseHandle(HANDLE h);
+DWORD WaitForSingleObject(HANDLE h, DWORD ms);
+DWORD WaitForMultipleObjects(DWORD count, HANDLE const *ph, BOOL all, DWORD ms);
+
+HANDLE CreateThread(void *psa, size_t stack, LPTHREAD_START_ROUTINE proc, LPVOID param, DWORD flags, DWORD *ptid);
+
+HANDLE CreateFileA(LPCSTR path, DWORD access, DWORD share, void *psa, DWORD disposition, DWORD flags, HANDLE htemplate);
+BOOL WriteFile(HANDLE h, void const *pdata, DWORD ndata, DWORD *pnwritten, OVERLAPPED *pol);
+BOOL ReadFile(HANDLE h, void *pdata, DWORD ndata, DWORD *pnread, OVERLAPPED *pol);
+BOOL GetOverlappedResult(HANDLE h, OVERLAPPED *pol, DWORD *pn, BOOL wait);
+BOOL CancelIo(HANDLE h);
+DWORD GetFileSize(HANDLE h, DWORD *psize_high);
+BOOL MoveFileExA(LPCSTR from, LPCSTR to, DWORD flags);
+BOOL DeleteFileA(LPCSTR path);
+DWORD GetTempPathA(DWORD size, LPSTR buf);
+
+HANDLE CreateFileMappingA(HANDLE hfile, void *psa, DWORD protect, DWORD size_high, DWORD size_low, LPCSTR name);
+HANDLE OpenFileMappingA(DWORD access, BOOL inherit, LPCSTR name);
+LPVOID MapViewOfFile(HANDLE hmap, DWORD access, DWORD ofs_high, DWORD ofs_low, size_t size);
+BOOL UnmapViewOfFile(void const *p);
+
+HANDLE CreateEventA(void *psa, BOOL manual_reset, BOOL initial, LPCSTR name);
+HANDLE OpenEventA(DWORD access, BOOL inherit, LPCSTR name);
+BOOL SetEvent(HANDLE h);
+BOOL ResetEvent(HANDLE h);
+#define CreateEvent CreateEventA
+
+HANDLE CreateMutexA(void *psa, BOOL owned, LPCSTR name);
+BOOL ReleaseMutex(HANDLE h);
+
+HANDLE OpenProcess(DWORD access, BOOL inherit, DWORD pid);
+
+// there are no windows; subclassing one fails
+LONG_PTR SetWindowLongPtrA(HWND hwnd, int index, LONG_PTR value);
+LRESULT CallWindowProc(WNDPROC proc, HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam);
+
+// test controls
+void mock_set_process(DWORD pid);
+void mock_kill_process(DWORD pid);
+void mock_reset(void);
+void mock_plug_device(LPCSTR path, bool present);
+void mock_fail_writes(LPCSTR path, bool fail);
+void mock_set_device_hid(LPCSTR path, USHORT vid, USHORT pid, USHORT version,
+	USHORT input_len, USHORT output_len, wchar_t const *product);
+typedef void (*MOCK_DEVICE_PROC)(void *ctx, LPCSTR path, BYTE const *packet);
+void mock_set_device_proc(LPCSTR path, MOCK_DEVICE_PROC proc, void *ctx);
+void mock_device_input(LPCSTR path, void const *pdata, DWORD ndata);
+int mock_device_pending_reads(LPCSTR path);
+LONG mock_device_opens(LPCSTR path);
+LONG mock_device_packets(LPCSTR path);
+LONG mock_device_hid_queries(LPCSTR path);
+void mock_set_clock(DWORD ms);
+
+#endif
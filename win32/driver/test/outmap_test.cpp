@@ -0,0 +1,145 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Output map file parser test.
+//
+// Each map is written to a scratch file in the current directory and
+// loaded back with outmap_load().
+
+#include <windows.h>
+#include <stdio.h>
+#include "../src/outmap.h"
+#include "test.h"
+
+
+#define MAPFILE        "outmap_test.tmp"
+
+
+// Write 'text' to the scratch file and load it
+static outmap_t *load_text(char const *text, UINT *perror_line)
+{
+	FILE *fp = fopen(MAPFILE, "w");
+	if (fp == NULL)
+		return NULL;
+
+	fputs(text, fp);
+	fclose(fp);
+
+	outmap_t * const map = outmap_load(MAPFILE, perror_line);
+	remove(MAPFILE);
+
+	return map;
+}
+
+// Is logical output 'output' (1-based) on 'unit' and 'port' (1-based)?
+static bool maps_to(outmap_t const *map, UINT output, UINT unit, UINT port)
+{
+	return output <= map->count
+		&& map->unit[output - 1] == unit - 1
+		&& map->port[output - 1] == port - 1;
+}
+
+TEST(comments_and_blank_lines_are_skipped)
+{
+	UINT error_line = 99;
+	outmap_t * const map = load_text(
+		"# flashers on the first LedWiz\n"
+		"\n"
+		"   \t\n"
+		"1 1 1 4   ; strobes\n"
+		"; the rest is on unit 2\r\n"
+		"5\t2\t9\n",
+		&error_line);
+
+	CHECK(map != NULL);
+	CHECK(error_line == 0);
+	CHECK(map->count == 5);
+	CHECK(maps_to(map, 1, 1, 1));
+	CHECK(maps_to(map, 4, 1, 4));
+	CHECK(maps_to(map, 5, 2, 9));
+
+	outmap_free(map);
+}
+
+TEST(gaps_are_unmapped)
+{
+	UINT error_line;
+	outmap_t * const map = load_text("3 1 1\n10 1 2 2\n", &error_line);
+
+	CHECK(map != NULL);
+	CHECK(map->count == 11);
+	CHECK(map->unit[0] == OUTMAP_UNMAPPED);
+	CHECK(maps_to(map, 3, 1, 1));
+	CHECK(map->unit[8] == OUTMAP_UNMAPPED);
+	CHECK(maps_to(map, 11, 1, 3));
+
+	outmap_free(map);
+}
+
+TEST(extended_units_and_ports_past_32)
+{
+	UINT error_line;
+	outmap_t * const map = load_text(
+		"1 17 1\n"
+		"2 1024 1\n"
+		"3 3 33 64\n",
+		&error_line);
+
+	CHECK(map != NULL);
+	CHECK(maps_to(map, 1, 17, 1));
+	CHECK(maps_to(map, 2, 1024, 1));
+	CHECK(maps_to(map, 3, 3, 33));
+	CHECK(maps_to(map, 66, 3, 96));
+	CHECK(map->count == 66);
+
+	outmap_free(map);
+}
+
+TEST(bad_lines_report_their_line_number)
+{
+	static struct {
+		char const *text;
+		UINT line;
+	} const cases[] = {
+		{ "1 1 1\n1 1\n", 2 },                      // too few fields
+		{ "1 1 1 1 1\n", 1 },                       // too many fields
+		{ "# ok\n1 one 1\n", 2 },                   // not a number
+		{ "0 1 1\n", 1 },                           // output 0
+		{ "1 0 1\n", 1 },                           // unit 0
+		{ "1 1025 1\n", 1 },                        // past the last extended unit
+		{ "1 1 0\n", 1 },                           // port 0
+		{ "1 1 512 2\n", 1 },                       // run past the last port
+		{ "1 1 1 0\n", 1 },                         // empty run
+		{ "4096 1 1 2\n", 1 },                      // run past the last output
+	};
+
+	for (size_t i = 0 ; i < sizeof(cases) / sizeof(cases[0]) ; ++i)
+	{
+		UINT error_line = 0;
+		CHECK(load_text(cases[i].text, &error_line) == NULL);
+		CHECK(error_line == cases[i].line);
+	}
+}
+
+TEST(missing_file_is_not_a_syntax_error)
+{
+	UINT error_line = 99;
+	remove(MAPFILE);
+	CHECK(outmap_load(MAPFILE, &error_line) == NULL);
+	CHECK(error_line == 0);
+}
+
+TEST_MAIN()
@@ -0,0 +1,77 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Minimal test harness for the host tests.  TEST(name) defines a test,
+// which registers itself; TEST_MAIN() runs them all and returns nonzero
+// if any check failed.
+
+#ifndef TEST_H__INCLUDED
+#define TEST_H__INCLUDED
+
+#include <stdio.h>
+
+typedef void (*test_proc_t)(void);
+
+typedef struct {
+	const char *name;
+	test_proc_t proc;
+} test_entry_t;
+
+#define TEST_MAX_TESTS 64
+
+static test_entry_t g_tests[TEST_MAX_TESTS];
+static int g_ntests;
+static int g_nfailed;
+
+static int test_register(const char *name, test_proc_t proc)
+{
+	if (g_ntests < TEST_MAX_TESTS)
+	{
+		g_tests[g_ntests].name = name;
+		g_tests[g_ntests].proc = proc;
+		g_ntests += 1;
+	}
+
+	return 0;
+}
+
+#define TEST(name) \
+	static void test_##name(void); \
+	static int const test_reg_##name = test_register(#name, test_##name); \
+	static void test_##name(void)
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			g_nfailed += 1; \
+		} \
+	} while (0)
+
+#define TEST_MAIN() \
+	int main(int argc, char *argv[]) \
+	{ \
+		for (int i = 0 ; i < g_ntests ; ++i) \
+		{ \
+			int const nfailed = g_nfailed; \
+			g_tests[i].proc(); \
+			printf("%s %s\n", (g_nfailed == nfailed) ? "ok  " : "FAIL", g_tests[i].name); \
+		} \
+		printf("%d tests, %d failed checks\n", g_ntests, g_nfailed); \
+		return (g_nfailed == 0) ? 0 : 1; \
+	}
+
+#endif
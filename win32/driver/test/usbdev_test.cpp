@@ -0,0 +1,541 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Device failure and reconnect test, against the mock Win32 layer.
+//
+// The device is unplugged and plugged back in under usbdev, and the
+// reopen attempts are driven the way the DLL's reconnect thread drives
+// them, on the mock's manual clock.
+
+#include <windows.h>
+#include "../src/usbdev.h"
+#include "../src/devshare.h"
+#include "test.h"
+
+#include <pthread.h>
+
+
+#define DEVPATH        "\\\\?\\hid#vid_fafa&pid_00f0#1"
+
+// backoff schedule, as set in usbdev.cpp
+#define RETRY_MS       100
+#define MAX_RETRY_MS   5000
+
+// age at which a redundant message is sent anyway, as set in devshare.cpp
+#define REFRESH_MS     2000
+
+
+static HUDEV open_device(HANDLE hfail)
+{
+	mock_reset();
+	mock_set_clock(1000);
+	mock_plug_device(DEVPATH, true);
+
+	HUDEV const h = usbdev_create(DEVPATH);
+	if (h != NULL)
+	{
+		usbdev_set_min_write_interval(h, 0);
+		usbdev_set_failure_event(h, hfail);
+	}
+
+	return h;
+}
+
+static bool write_msg(HUDEV h)
+{
+	BYTE const sba[8] = { 64, 0xFF, 0x00, 0xFF, 0x00, 2 };
+	return usbdev_write(h, sba, sizeof(sba)) == sizeof(sba);
+}
+
+// Unplug the device and write until usbdev gives up on the handle
+static void fail_device(HUDEV h)
+{
+	mock_plug_device(DEVPATH, false);
+	while (!usbdev_failed(h, NULL) && !write_msg(h))
+		;
+}
+
+
+TEST(write_failures_mark_device_failed)
+{
+	HANDLE const hfail = CreateEventA(NULL, TRUE, FALSE, NULL);
+	HUDEV const h = open_device(hfail);
+	CHECK(h != NULL);
+
+	CHECK(write_msg(h));
+	CHECK(mock_device_packets(DEVPATH) == 1);
+
+	// it takes a run of failures, not just one
+	mock_plug_device(DEVPATH, false);
+	CHECK(!write_msg(h));
+	CHECK(!write_msg(h));
+	CHECK(!usbdev_failed(h, NULL));
+	CHECK(WaitForSingleObject(hfail, 0) == WAIT_TIMEOUT);
+
+	CHECK(!write_msg(h));
+	DWORD fail_ticks = 0;
+	CHECK(usbdev_failed(h, &fail_ticks));
+	CHECK(fail_ticks == 1000);
+	CHECK(WaitForSingleObject(hfail, 0) == WAIT_OBJECT_0);
+
+	// from then on, writes are dropped without touching the device,
+	// even once it's back at the same path
+	mock_plug_device(DEVPATH, true);
+	CHECK(!write_msg(h));
+	CHECK(mock_device_packets(DEVPATH) == 1);
+	CHECK(usbdev_stats(h)->failed == 4);
+
+	usbdev_release(h);
+	CloseHandle(hfail);
+}
+
+TEST(a_failure_run_is_reset_by_a_good_write)
+{
+	HUDEV const h = open_device(NULL);
+
+	mock_fail_writes(DEVPATH, true);
+	CHECK(!write_msg(h));
+	CHECK(!write_msg(h));
+	mock_fail_writes(DEVPATH, false);
+	CHECK(write_msg(h));
+	mock_fail_writes(DEVPATH, true);
+	CHECK(!write_msg(h));
+	CHECK(!write_msg(h));
+	CHECK(!usbdev_failed(h, NULL));
+
+	usbdev_release(h);
+}
+
+TEST(reopen_backs_off_while_unplugged)
+{
+	HUDEV const h = open_device(NULL);
+	fail_device(h);
+
+	// the first attempt is due right away
+	CHECK(usbdev_reopen_wait(h) == 0);
+	CHECK(!usbdev_reopen(h));
+
+	// then the wait doubles with each failed attempt, up to the cap
+	DWORD expect = RETRY_MS;
+	for (int i = 0 ; i < 10 ; ++i)
+	{
+		CHECK(usbdev_reopen_wait(h) == expect);
+		Sleep(expect - 1);
+		CHECK(usbdev_reopen_wait(h) == 1);
+		Sleep(1);
+		CHECK(usbdev_reopen_wait(h) == 0);
+		CHECK(!usbdev_reopen(h));
+
+		expect = (expect * 2 > MAX_RETRY_MS) ? MAX_RETRY_MS : expect * 2;
+	}
+
+	CHECK(usbdev_reopen_wait(h) == MAX_RETRY_MS);
+	CHECK(mock_device_opens(DEVPATH) == 1);
+
+	usbdev_release(h);
+}
+
+TEST(retries_stay_cheap_for_a_device_that_is_gone)
+{
+	HUDEV const h = open_device(NULL);
+	fail_device(h);
+
+	// drive the reopen attempts for a minute, the way the reconnect
+	// thread does: attempt whenever one is due, sleep until the next
+	int attempts = 0;
+	DWORD const end = GetTickCount() + 60000;
+	while ((LONG)(end - GetTickCount()) > 0)
+	{
+		DWORD const wait = usbdev_reopen_wait(h);
+		if (wait != 0)
+		{
+			Sleep(wait);
+			continue;
+		}
+
+		++attempts;
+		CHECK(!usbdev_reopen(h));
+	}
+
+	// 100 ms up to 3.2 s is 7 attempts, plus one every 5 s after that;
+	// retrying at a fixed 100 ms would make 600
+	CHECK(attempts >= 15 && attempts <= 20);
+
+	usbdev_release(h);
+}
+
+TEST(replug_reopens_and_resets_backoff)
+{
+	HUDEV const h = open_device(NULL);
+	CHECK(usbdev_start_reader(h, 8));
+	fail_device(h);
+
+	for (int i = 0 ; i < 4 ; ++i)
+	{
+		Sleep(usbdev_reopen_wait(h));
+		CHECK(!usbdev_reopen(h));
+	}
+	CHECK(usbdev_reopen_wait(h) == RETRY_MS * 8);
+
+	// the device comes back; the next attempt gets it
+	mock_plug_device(DEVPATH, true);
+	Sleep(usbdev_reopen_wait(h));
+	CHECK(usbdev_reopen(h));
+	CHECK(mock_device_opens(DEVPATH) == 2);
+	CHECK(!usbdev_failed(h, NULL));
+	CHECK(usbdev_reopen_wait(h) == 0);
+
+	// writes go out on the new handle
+	LONG const packets = mock_device_packets(DEVPATH);
+	CHECK(write_msg(h));
+	CHECK(mock_device_packets(DEVPATH) == packets + 1);
+
+	// and the next failure starts over at the shortest wait
+	fail_device(h);
+	CHECK(usbdev_reopen_wait(h) == 0);
+	CHECK(!usbdev_reopen(h));
+	CHECK(usbdev_reopen_wait(h) == RETRY_MS);
+
+	usbdev_release(h);
+}
+
+// Open the device with a shared state block, so that redundant
+// messages are dropped
+static HUDEV open_shared_device(void)
+{
+	HUDEV const h = open_device(NULL);
+	if (h != NULL)
+		usbdev_set_share(h, devshare_open(0x1234));
+
+	return h;
+}
+
+static bool write_bytes(HUDEV h, BYTE const *pdata, size_t ndata)
+{
+	return usbdev_write(h, pdata, ndata) == ndata;
+}
+
+TEST(share_suppresses_redundant_writes)
+{
+	HUDEV const h = open_shared_device();
+	CHECK(h != NULL);
+
+	CHECK(write_msg(h));
+	CHECK(write_msg(h));
+	CHECK(mock_device_packets(DEVPATH) == 1);
+
+	// a different state goes out
+	BYTE const sba[8] = { 64, 0x01, 0x00, 0x00, 0x00, 2 };
+	CHECK(write_bytes(h, sba, sizeof(sba)));
+	CHECK(mock_device_packets(DEVPATH) == 2);
+
+	// and so does a repeat, once the device's copy is old enough
+	CHECK(write_bytes(h, sba, sizeof(sba)));
+	CHECK(mock_device_packets(DEVPATH) == 2);
+	Sleep(REFRESH_MS);
+	CHECK(write_bytes(h, sba, sizeof(sba)));
+	CHECK(mock_device_packets(DEVPATH) == 3);
+
+	usbdev_release(h);
+}
+
+TEST(share_passes_pings_and_keeps_state)
+{
+	HUDEV const h = open_shared_device();
+	CHECK(h != NULL);
+
+	CHECK(write_msg(h));
+	CHECK(mock_device_packets(DEVPATH) == 1);
+
+	// a ping sets nothing, so it's never redundant...
+	BYTE const ping[8] = { 69, 1, 0, 0, 0, 0xFF, 0xFF, 0xFE };
+	CHECK(write_bytes(h, ping, sizeof(ping)));
+	CHECK(write_bytes(h, ping, sizeof(ping)));
+	CHECK(mock_device_packets(DEVPATH) == 3);
+
+	// ...and leaves the known state alone
+	CHECK(write_msg(h));
+	CHECK(mock_device_packets(DEVPATH) == 3);
+
+	usbdev_release(h);
+}
+
+TEST(share_does_not_take_config_commands_for_pba)
+{
+	HUDEV const h = open_shared_device();
+	CHECK(h != NULL);
+
+	BYTE pba[32];
+	memset(pba, 48, sizeof(pba));
+	CHECK(write_bytes(h, pba, sizeof(pba)));
+	CHECK(mock_device_packets(DEVPATH) == 4);
+
+	// a raw write of configuration queries isn't brightness data, so
+	// neither is it suppressed as a repeat...
+	BYTE query[32];
+	memset(query, 0, sizeof(query));
+	for (int i = 0 ; i < 32 ; i += 8)
+	{
+		query[i] = 65;
+		query[i + 1] = 4;
+	}
+
+	CHECK(write_bytes(h, query, sizeof(query)));
+	CHECK(write_bytes(h, query, sizeof(query)));
+	CHECK(mock_device_packets(DEVPATH) == 12);
+
+	// ...nor does it replace the brightness levels on record
+	CHECK(write_bytes(h, pba, sizeof(pba)));
+	CHECK(mock_device_packets(DEVPATH) == 12);
+
+	usbdev_release(h);
+}
+
+TEST(share_levels_make_their_ports_unknown)
+{
+	HUDEV const h = open_shared_device();
+	CHECK(h != NULL);
+
+	BYTE pba[32];
+	memset(pba, 48, sizeof(pba));
+	CHECK(write_bytes(h, pba, sizeof(pba)));
+	CHECK(mock_device_packets(DEVPATH) == 4);
+
+	// 8-bit levels for ports 3-8 aren't tracked, so the PBA has to go
+	// out again to restore them
+	BYTE const levels[8] = { 70, 2 | (6 << 5), 10, 20, 30, 40, 50, 60 };
+	CHECK(write_bytes(h, levels, sizeof(levels)));
+	CHECK(write_bytes(h, pba, sizeof(pba)));
+	CHECK(mock_device_packets(DEVPATH) == 9);
+
+	usbdev_release(h);
+}
+
+// input ring length, as set in usbdev.cpp
+#define RING_LENGTH    16
+#define REPORT_LEN     8
+
+// Open the device with its reader running, on the real clock, so that
+// the read timeouts work
+static HUDEV open_reader(void)
+{
+	mock_reset();
+	mock_plug_device(DEVPATH, true);
+
+	HUDEV const h = usbdev_create(DEVPATH);
+	if (h != NULL)
+		usbdev_start_reader(h, REPORT_LEN);
+
+	return h;
+}
+
+// Each report carries its sequence number twice, the second copy
+// inverted, so a torn copy out of the ring shows
+static void send_report(DWORD seq)
+{
+	BYTE rpt[REPORT_LEN];
+	for (int i = 0 ; i < 4 ; ++i)
+	{
+		rpt[i] = (BYTE)(seq >> (i * 8));
+		rpt[i + 4] = (BYTE)~rpt[i];
+	}
+
+	mock_device_input(DEVPATH, rpt, sizeof(rpt));
+}
+
+static bool report_seq(BYTE const *rpt, size_t n, DWORD *pseq)
+{
+	if (n != REPORT_LEN)
+		return false;
+
+	DWORD seq = 0;
+	for (int i = 0 ; i < 4 ; ++i)
+	{
+		if (rpt[i + 4] != (BYTE)~rpt[i])
+			return false;
+		seq |= (DWORD)rpt[i] << (i * 8);
+	}
+
+	*pseq = seq;
+	return true;
+}
+
+static void wait_input_count(HUDEV h, DWORD count)
+{
+	while (usbdev_input_count(h) < count)
+		Sleep(1);
+}
+
+TEST(input_ring_full_keeps_the_newest)
+{
+	HUDEV const h = open_reader();
+
+	// nobody reads while the ring fills up two and a half times over
+	int const nsent = RING_LENGTH * 5 / 2;
+	for (int i = 0 ; i < nsent ; ++i)
+		send_report(i);
+	wait_input_count(h, nsent);
+
+	// the latest report is there without waiting
+	BYTE rpt[REPORT_LEN];
+	DWORD num = 0, seq = 0;
+	CHECK(usbdev_read_latest(h, rpt, sizeof(rpt), &num) == REPORT_LEN);
+	CHECK(num == nsent - 1);
+	CHECK(report_seq(rpt, REPORT_LEN, &seq) && seq == nsent - 1);
+
+	// a reader that's fallen behind skips to the oldest report still in
+	// the ring, and gets a full ring's worth in order from there
+	num = 0;
+	for (int i = nsent - RING_LENGTH ; i < nsent ; ++i)
+	{
+		size_t const n = usbdev_read_next(h, &num, rpt, sizeof(rpt), 0);
+		CHECK(report_seq(rpt, n, &seq) && seq == (DWORD)i);
+		CHECK(num == (DWORD)i + 1);
+	}
+
+	// and then the ring is empty
+	CHECK(usbdev_read_next(h, &num, rpt, sizeof(rpt), 0) == 0);
+	CHECK(num == nsent);
+
+	// the reader keeps going across the wrap
+	send_report(nsent);
+	CHECK(usbdev_read_next(h, &num, rpt, sizeof(rpt), 1000) == REPORT_LEN);
+	CHECK(report_seq(rpt, REPORT_LEN, &seq) && seq == nsent);
+
+	usbdev_release(h);
+	CHECK(mock_device_pending_reads(DEVPATH) == 0);
+}
+
+#define SPSC_REPORTS   5000
+
+typedef struct {
+	bool throttle;				// stay within a ring's length of the consumer
+	DWORD volatile consumed;	// reports taken by the consumer so far
+} spsc_t;
+
+static void *spsc_producer_proc(void *p)
+{
+	spsc_t * const s = (spsc_t *)p;
+	for (DWORD seq = 0 ; seq < SPSC_REPORTS - 1 ; ++seq)
+	{
+		while (s->throttle && seq - s->consumed >= RING_LENGTH)
+			sched_yield();
+
+		send_report(seq);
+	}
+
+	// the last report waits for the device's queue to drain, so it
+	// isn't lost there, and tells the consumer it's done
+	while (mock_device_pending_reads(DEVPATH) == 0)
+		sched_yield();
+	send_report(SPSC_REPORTS - 1);
+
+	return NULL;
+}
+
+// One producer (the device, through the reader thread) and one consumer
+// (usbdev_read_next()), running flat out.  With the producer held to a
+// ring's length ahead, every report arrives, in order, as the ring wraps
+// over and over.  Let loose, it overruns the ring, and the consumer skips
+// ahead: the reports it gets are still whole and in order.
+static void run_spsc(bool throttle)
+{
+	HUDEV const h = open_reader();
+
+	spsc_t s = { throttle, 0 };
+	pthread_t producer;
+	pthread_create(&producer, NULL, spsc_producer_proc, &s);
+
+	DWORD num = 0, last_seq = 0;
+	int torn = 0, out_of_order = 0, received = 0;
+	for (;;)
+	{
+		BYTE rpt[REPORT_LEN];
+		size_t const n = usbdev_read_next(h, &num, rpt, sizeof(rpt), 1000);
+		if (n == 0)
+			break;
+
+		DWORD seq = 0;
+		if (!report_seq(rpt, n, &seq))
+			torn += 1;
+		else if (received > 0 && seq <= last_seq)
+			out_of_order += 1;
+		else if (throttle && seq != (DWORD)received)
+			out_of_order += 1;
+
+		last_seq = seq;
+		received += 1;
+		s.consumed = num;
+
+		if (seq == SPSC_REPORTS - 1)
+			break;
+	}
+
+	pthread_join(producer, NULL);
+
+	CHECK(torn == 0);
+	CHECK(out_of_order == 0);
+	CHECK(last_seq == SPSC_REPORTS - 1);
+	if (throttle)
+		CHECK(received == SPSC_REPORTS);
+
+	usbdev_release(h);
+}
+
+TEST(input_ring_spsc_wraps_without_loss)
+{
+	run_spsc(true);
+}
+
+TEST(input_ring_spsc_overrun_skips_cleanly)
+{
+	run_spsc(false);
+}
+
+// each thread raises the maximum through its own run of values
+#define MAX_THREADS    4
+#define MAX_VALUES     100000
+
+static volatile LONG g_max;
+
+static void *stats_max_proc(void *p)
+{
+	LONG const id = (LONG)(intptr_t)p;
+	for (LONG v = 1 ; v <= MAX_VALUES ; ++v)
+		usbdev_stats_max(&g_max, v * MAX_THREADS + id);
+
+	return NULL;
+}
+
+TEST(stats_max_is_atomic)
+{
+	g_max = 0;
+
+	pthread_t threads[MAX_THREADS];
+	for (int i = 0 ; i < MAX_THREADS ; ++i)
+		pthread_create(&threads[i], NULL, stats_max_proc, (void *)(intptr_t)i);
+	for (int i = 0 ; i < MAX_THREADS ; ++i)
+		pthread_join(threads[i], NULL);
+
+	// a lost update would leave a smaller value behind
+	CHECK(g_max == MAX_VALUES * MAX_THREADS + MAX_THREADS - 1);
+
+	// and it never lowers the maximum
+	usbdev_stats_max(&g_max, 1);
+	CHECK(g_max == MAX_VALUES * MAX_THREADS + MAX_THREADS - 1);
+}
+
+TEST_MAIN()
@@ -18,7 +18,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
-#include <time.h>
 
 #include <ledwiz.h>
 #include <windows.h>
@@ -35,11 +34,17 @@ struct {
 		int (LWZCALL * LWZ_RAWWRITE) (LWZHANDLE hlwz, uint8_t const *pdata, uint32_t ndata);
 		void (LWZCALL * LWZ_REGISTER)  (LWZHANDLE hlwz, void * hwnd);
 		void (LWZCALL * LWZ_SET_NOTIFY) (LWZNOTIFYPROC notify_callback, LWZDEVICELIST *plist);
+		BOOL (LWZCALL * LWZ_RUN_BROKER) (HANDLE hquit);
+		void (* LWZ_SET_EXTENDED_UNITS) (BOOL enable);
+		uint32_t (* LWZ_GET_DEVICE_HANDLES) (LWZHANDLE *handles, uint32_t max_handles);
+		BOOL (* LWZ_GET_DEVICE_INFO) (LWZHANDLE hlwz, LWZDEVICEINFO *info);
+		BOOL (* LWZ_GET_IO_STATS) (LWZHANDLE hlwz, LWZIOSTATS *stats);
 	} fn;
 
 	HMODULE hdll;
 	HWND hwnd;
 	HANDLE hthread;
+	HANDLE hquit;
 
 	LWZDEVICELIST devlist;
 
@@ -61,14 +66,91 @@ static void CALLBACK notify_cb(int32_t reason, LWZHANDLE hlwz)
 }
 
 
+static BOOL WINAPI console_ctrl_handler(DWORD ctrl_type)
+{
+	// Ctrl+C, Ctrl+Break, closing the console, etc. - stop the broker or the statistics display
+	if (g_main.hquit != NULL)
+	{
+		SetEvent(g_main.hquit);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+
+static void print_stats()
+{
+	// list every unit, including extended units beyond the first 16
+
+	uint32_t const nhandles = g_main.fn.LWZ_GET_DEVICE_HANDLES(NULL, 0);
+	LWZHANDLE * const handles = (LWZHANDLE*)malloc((nhandles + 1) * sizeof(LWZHANDLE));
+
+	if (handles == NULL) {
+		return;
+	}
+
+	uint32_t const n = g_main.fn.LWZ_GET_DEVICE_HANDLES(handles, nhandles);
+
+	printf("\n");
+	printf("unit  messages   packets  failed  suppr  queue  max  coalesced  pacing ms    p50    p90    p99    max (us)\n");
+
+	for (uint32_t i = 0; i < n && i < nhandles; i++)
+	{
+		LWZDEVICEINFO info;
+		info.cbSize = sizeof(info);
+
+		// a Pinscape virtual unit shares the counters of its physical unit
+		if (!g_main.fn.LWZ_GET_DEVICE_INFO(handles[i], &info) ||
+			info.dwDevType == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+		{
+			continue;
+		}
+
+		LWZIOSTATS stats;
+		stats.cbSize = sizeof(stats);
+
+		if (!g_main.fn.LWZ_GET_IO_STATS(handles[i], &stats)) {
+			continue;
+		}
+
+		// share of the messages merged into one already queued
+		DWORD const nsubmitted = stats.dwQueued + stats.dwCoalesced;
+		double const coalesced = nsubmitted != 0 ? 100.0 * stats.dwCoalesced / nsubmitted : 0.0;
+
+		printf("%4d %9lu %9lu %7lu %6lu %6lu %4lu %9.1f%% %10lu %6lu %6lu %6lu %6lu   %s\n",
+			handles[i],
+			stats.dwMessages,
+			stats.dwPackets,
+			stats.dwFailed,
+			stats.dwSuppressed,
+			stats.dwQueueDepth,
+			stats.dwMaxQueueDepth,
+			coalesced,
+			stats.dwPacingMs,
+			stats.dwLatencyP50Us,
+			stats.dwLatencyP90Us,
+			stats.dwLatencyP99Us,
+			stats.dwLatencyMaxUs,
+			info.szName);
+	}
+
+	free(handles);
+}
+
+
 void usage()
 {
 	printf("\n");
 	printf("Usage:\n\n");
-	printf("lwcconfig [-m] [-p <new id>] [<current id>]\n");
+	printf("lwcconfig [-b] [-p <new id>] [<current id>]\n");
+	printf("lwcconfig stats\n");
 	printf("    -h .................... help\n");
 	printf("    -p <new id> ........... program new id\n");
-	printf("    -m .................... measure I/O bandwidth\n");
+	printf("    -b .................... run the device broker until Ctrl+C\n");
+	printf("    stats ................. show the output statistics of each device until Ctrl+C\n");
+	printf("\n");
+	printf("To measure output performance, use lwzbench.\n");
 	printf("\n");
 }
 
@@ -79,7 +161,8 @@ int main(int argc, char* argv[])
 
 	const char * p_arg = NULL;
 	const char * id_arg = NULL;
-	bool do_measure_bandwidth = false;
+	bool do_run_broker = false;
+	bool do_show_stats = false;
 	int err = 0;
 
 	for (int i = 1; i < argc && err == 0; i++) 
@@ -87,9 +170,9 @@ int main(int argc, char* argv[])
 		if (argv[i][0] == '-') 
 		{
 			switch (argv[i][1]) {
-			case 'm':
+			case 'b':
 			{
-				do_measure_bandwidth = true;
+				do_run_broker = true;
 				break;
 			}
 			case 'h':
@@ -113,6 +196,10 @@ int main(int argc, char* argv[])
 			}
 			}
 		}
+		else if (strcmp(argv[i], "stats") == 0)
+		{
+			do_show_stats = true;
+		}
 		else
 		{
 			if (id_arg != NULL)	{
@@ -152,6 +239,11 @@ int main(int argc, char* argv[])
 	((void**)&g_main.fn.LWZ_RAWWRITE)[0]    = GetProcAddress(g_main.hdll, "LWZ_RAWWRITE");
 	((void**)&g_main.fn.LWZ_REGISTER)[0]    = GetProcAddress(g_main.hdll, "LWZ_REGISTER");
 	((void**)&g_main.fn.LWZ_SET_NOTIFY)[0]  = GetProcAddress(g_main.hdll, "LWZ_SET_NOTIFY");
+	((void**)&g_main.fn.LWZ_RUN_BROKER)[0]  = GetProcAddress(g_main.hdll, "LWZ_RUN_BROKER");
+	((void**)&g_main.fn.LWZ_SET_EXTENDED_UNITS)[0] = GetProcAddress(g_main.hdll, "LWZ_SET_EXTENDED_UNITS");
+	((void**)&g_main.fn.LWZ_GET_DEVICE_HANDLES)[0] = GetProcAddress(g_main.hdll, "LWZ_GET_DEVICE_HANDLES");
+	((void**)&g_main.fn.LWZ_GET_DEVICE_INFO)[0]    = GetProcAddress(g_main.hdll, "LWZ_GET_DEVICE_INFO");
+	((void**)&g_main.fn.LWZ_GET_IO_STATS)[0]       = GetProcAddress(g_main.hdll, "LWZ_GET_IO_STATS");
 
 	if (g_main.fn.LWZ_SBA == NULL ||
 		g_main.fn.LWZ_PBA == NULL ||
@@ -162,6 +254,22 @@ int main(int argc, char* argv[])
 		goto Failed;
 	}
 
+	// the statistics cover every unit, so ask for the extended units as well
+
+	if (do_show_stats)
+	{
+		if (g_main.fn.LWZ_SET_EXTENDED_UNITS == NULL ||
+			g_main.fn.LWZ_GET_DEVICE_HANDLES == NULL ||
+			g_main.fn.LWZ_GET_DEVICE_INFO == NULL ||
+			g_main.fn.LWZ_GET_IO_STATS == NULL)
+		{
+			printf("invalid or old version ledwiz.dll! please update");
+			goto Failed;
+		}
+
+		g_main.fn.LWZ_SET_EXTENDED_UNITS(TRUE);
+	}
+
 	// enumerate LED wiz devices
 
 	g_main.fn.LWZ_SET_NOTIFY(notify_cb, &g_main.devlist);
@@ -174,97 +282,14 @@ int main(int argc, char* argv[])
 
 	// verify options
 
-	if (!do_measure_bandwidth &&
+	if (!do_run_broker &&
+		!do_show_stats &&
 		p_arg == NULL)
 	{
 		usage();
 		goto Failed;
 	}
 
-	// measure bandwidth
-
-	if (do_measure_bandwidth)
-	{
-		printf("measuring bandwidth ...\n");
-
-		int const duration_ms_max = 500;
-		uint8_t x32bytes[32] = {0};
-		int nsend = 0;
-		int nsend_total = 0;
-		int nduration_ms = 0;
-		clock_t t0;
-
-		// step 1: send as much data as possible within some fixed time to fill the input buffer
-
-		t0 = clock();
-
-		for (;;)
-		{
-			g_main.fn.LWZ_PBA(g_main.devlist.handles[0], &x32bytes[0]);
-			nsend += 32;
-
-			clock_t t1 = clock();
-			nduration_ms = ((t1 - t0) * 1000) / CLOCKS_PER_SEC;
-
-			if (nduration_ms > duration_ms_max) {
-				break;
-			}
-		}
-
-		nsend_total += nsend;
-
-		// step 2: measure average throughput
-
-		nsend = 0;
-		nduration_ms = 0;
-		t0 = clock();
-
-		for (;;)
-		{
-			g_main.fn.LWZ_PBA(g_main.devlist.handles[0], &x32bytes[0]);
-			nsend += 32;
-
-			clock_t t1 = clock();
-			nduration_ms = ((t1 - t0) * 1000) / CLOCKS_PER_SEC;
-
-			if (nduration_ms > duration_ms_max) {
-				break;
-			}
-		}
-
-		nsend_total += nsend;
-		double bps_avg = (double)nsend * 1000.0 / (double)nduration_ms;
-
-		// step 3: measure burst blocksize
-
-		Sleep((int)((double)nsend_total / bps_avg * 1000.0) + 100); // wait some time until the buffer is again free
-
-		nsend = 0;
-		nduration_ms = 0;
-		t0 = clock();
-
-		for (;;)
-		{
-			g_main.fn.LWZ_PBA(g_main.devlist.handles[0], &x32bytes[0]);
-			nsend += 32;
-
-			clock_t t1 = clock();
-			nduration_ms = ((t1 - t0) * 1000) / CLOCKS_PER_SEC;
-
-			if (nduration_ms > duration_ms_max) {
-				break;
-			}
-		}
-
-		int nsend_burst = nsend - (int)((double)nduration_ms * bps_avg / 1000.0);
-
-		if (nsend_burst < 0) {
-		    nsend_burst = 0;
-		}
-
-		printf("average rate: %0.2f kByte/s, burst blocksize: %d Byte\n", bps_avg / 1024.0, nsend_burst);
-	}
-
 	// reprogram new id
 
 	if (p_arg && g_main.devlist.numdevices > 0)
@@ -312,6 +337,47 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	// run the device broker
+
+	if (do_run_broker)
+	{
+		if (g_main.fn.LWZ_RUN_BROKER == NULL) {
+			printf("invalid or old version ledwiz.dll! please update");
+			goto Failed;
+		}
+
+		g_main.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+		SetConsoleCtrlHandler(console_ctrl_handler, TRUE);
+
+		printf("running device broker, press Ctrl+C to stop ...\n");
+
+		if (!g_main.fn.LWZ_RUN_BROKER(g_main.hquit)) {
+			printf("starting the broker failed! is another broker already running?\n");
+		}
+
+		SetConsoleCtrlHandler(console_ctrl_handler, FALSE);
+		CloseHandle(g_main.hquit);
+		g_main.hquit = NULL;
+	}
+
+	// show the output statistics
+
+	if (do_show_stats)
+	{
+		g_main.hquit = CreateEvent(NULL, TRUE, FALSE, NULL);
+		SetConsoleCtrlHandler(console_ctrl_handler, TRUE);
+
+		printf("showing output statistics, press Ctrl+C to stop ...\n");
+
+		do {
+			print_stats();
+		} while (WaitForSingleObject(g_main.hquit, 1000) == WAIT_TIMEOUT);
+
+		SetConsoleCtrlHandler(console_ctrl_handler, FALSE);
+		CloseHandle(g_main.hquit);
+		g_main.hquit = NULL;
+	}
+
 Failed:
 	if (g_main.hdll) 
 	{
@@ -0,0 +1,750 @@
+/*
+ * LWCloneU2
+ * Copyright (C) 2013 Andreas Dittrich <lwcloneu2@cithraidt.de>
+ *
+ * This program is free software; you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+ * without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+// Output latency benchmark.
+//
+// Runs a set of load scenarios against the attached devices through the
+// regular ledwiz.dll API and reports three latencies for each:
+//
+// - API call: the time the LWZ_PBA/LWZ_SBA call itself takes, which is
+//   what a client such as DOF sees.  It grows when the write queue is
+//   full and the call has to wait.
+//
+// - enqueue to wire: the time from the DLL adding a message to its write
+//   queue until the message has been written to the device, from the
+//   DLL's I/O statistics (LWZ_GET_IO_STATS).
+//
+// - device applied: the time from the API call until the device has
+//   processed the message.  After an update, we queue a request right
+//   behind it and time the device's reply, which it can only send once
+//   it has handled the update.  LWCloneU2 units get the ping command,
+//   and Pinscape units a configuration query.  Other devices don't
+//   answer anything, so they aren't measured.
+//
+// Each scenario's results go to stdout as one line of JSON, so that the
+// output of different runs can be collected and compared; progress
+// messages go to stderr.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ledwiz.h>
+#include <windows.h>
+
+
+#define LEDWIZ_DLL_NAME "ledwiz.dll"
+
+#define BENCH_MAX_DEVICES         64
+#define BENCH_DEFAULT_SECONDS     5
+#define BENCH_SBA_INTERVAL_MS     100       // SBA toggle interval for the sparse scenario
+#define BENCH_FRAME_US            16667     // frame time for the 60 Hz scenario
+#define BENCH_PROBE_INTERVAL_MS   100       // minimum time between device-applied probes on one device
+#define BENCH_PROBE_TIMEOUT_MS    1000      // give up on a probe reply after this long
+#define BENCH_DRAIN_TIMEOUT_MS    2000      // maximum wait for the write queues to empty after a run
+
+#define LWCCONFIG_CMD_PING        69        // LWCloneU2 ping command (see the firmware's comm.h)
+
+
+enum {
+	SCENARIO_PBA_STREAM,      // PBA messages to one device as fast as the DLL takes them
+	SCENARIO_SBA_SPARSE,      // one SBA toggle every BENCH_SBA_INTERVAL_MS
+	SCENARIO_MULTI_DEVICE,    // PBA messages to every device in turn, as fast as possible
+	SCENARIO_FRAME_60HZ,      // a PBA and SBA to every device at the start of each 60 Hz frame
+	SCENARIO_COUNT
+};
+
+static const char * const g_scenario_names[SCENARIO_COUNT] = {
+	"pba_stream",
+	"sba_sparse",
+	"multi_device",
+	"frame_60hz"
+};
+
+// latency samples, in microseconds
+typedef struct {
+	DWORD *v;
+	size_t n;
+	size_t cap;
+	bool sorted;
+} samples_t;
+
+// Device-applied latency probe.  The input callback runs on the DLL's
+// reader thread; it fills in t_reply and then advances 'state'.
+typedef struct {
+	volatile LONG state;      // 0 = idle, 1 = waiting for the reply, 2 = reply received
+	bool ping;                // true: LWCloneU2 ping, false: Pinscape configuration query
+	uint32_t seq;             // sequence number of the last ping sent
+	LONGLONG t_update;        // time of the API call for the update being probed
+	LONGLONG t_reply;         // time the reply arrived
+	DWORD sent_ticks;         // GetTickCount() time the probe was sent
+} probe_t;
+
+typedef struct {
+	LWZHANDLE hlwz;
+	DWORD type;
+	char name[256];
+	bool probe_enabled;
+	probe_t probe;
+} bench_device_t;
+
+
+struct {
+
+	struct {
+		void (LWZCALL * LWZ_SBA) (LWZHANDLE hlwz, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3, uint8_t gps);
+		void (LWZCALL * LWZ_PBA) (LWZHANDLE hlwz, uint8_t const *pmode32bytes);
+		void (LWZCALL * LWZ_SET_NOTIFY) (LWZNOTIFYPROC notify_callback, LWZDEVICELIST *plist);
+		uint32_t (* LWZ_RAWWRITE) (LWZHANDLE hlwz, uint8_t const *pdata, uint32_t ndata);
+		void (* LWZ_SET_EXTENDED_UNITS) (BOOL enable);
+		uint32_t (* LWZ_GET_DEVICE_HANDLES) (LWZHANDLE *handles, uint32_t max_handles);
+		BOOL (* LWZ_GET_DEVICE_INFO) (LWZHANDLE hlwz, LWZDEVICEINFO *info);
+		BOOL (* LWZ_SET_INPUT_CALLBACK) (LWZHANDLE hlwz, LWZINPUTPROC input_callback, void *puser);
+		BOOL (* LWZ_GET_IO_STATS) (LWZHANDLE hlwz, LWZIOSTATS *stats);
+		BOOL (* LWZ_RESET_IO_STATS) (LWZHANDLE hlwz);
+	} fn;
+
+	HMODULE hdll;
+	LONGLONG perf_freq;
+
+	LWZDEVICELIST devlist;
+
+	int ndevices;
+	bench_device_t devices[BENCH_MAX_DEVICES];
+
+} g_main = {0};
+
+
+static LONGLONG now_qpc()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+static DWORD qpc_to_us(LONGLONG dt)
+{
+	if (dt < 0)
+		return 0;
+
+	return (DWORD)(dt * 1000000 / g_main.perf_freq);
+}
+
+
+static void samples_add(samples_t *s, DWORD us)
+{
+	if (s->n == s->cap)
+	{
+		size_t const cap = (s->cap == 0) ? 4096 : s->cap * 2;
+		DWORD * const v = (DWORD*)realloc(s->v, cap * sizeof(DWORD));
+
+		// out of memory - drop the sample
+		if (v == NULL)
+			return;
+
+		s->v = v;
+		s->cap = cap;
+	}
+
+	s->v[s->n++] = us;
+	s->sorted = false;
+}
+
+static int compare_dword(const void *a, const void *b)
+{
+	DWORD const x = *(DWORD const *)a;
+	DWORD const y = *(DWORD const *)b;
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+static DWORD samples_percentile(samples_t *s, unsigned int percent)
+{
+	if (s->n == 0)
+		return 0;
+
+	if (!s->sorted)
+	{
+		qsort(s->v, s->n, sizeof(DWORD), compare_dword);
+		s->sorted = true;
+	}
+
+	size_t rank = (s->n * percent + 99) / 100;
+	if (rank > 0)
+		rank -= 1;
+
+	return s->v[rank];
+}
+
+static void samples_free(samples_t *s)
+{
+	free(s->v);
+	memset(s, 0x00, sizeof(*s));
+}
+
+
+// print a string as a JSON string literal
+static void print_json_string(char const *str)
+{
+	putchar('"');
+
+	for (; *str != '\0'; str++)
+	{
+		unsigned char const c = (unsigned char)*str;
+
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+
+	putchar('"');
+}
+
+static void print_json_samples(char const *key, samples_t *s)
+{
+	printf("\"%s\":{\"count\":%lu,\"p50\":%lu,\"p99\":%lu,\"max\":%lu}",
+		key,
+		(unsigned long)s->n,
+		(unsigned long)samples_percentile(s, 50),
+		(unsigned long)samples_percentile(s, 99),
+		(unsigned long)samples_percentile(s, 100));
+}
+
+
+static void LWZCALLBACK input_cb(void *puser, LWZHANDLE hlwz, uint8_t const *pdata, uint32_t ndata)
+{
+	probe_t * const probe = (probe_t*)puser;
+
+	if (probe->state != 1)
+		return;
+
+	// the ping reply is 69 s0 s1 s2 s3 ..., and the reply to the configuration query is 00 88 ...
+	bool const match = probe->ping ?
+		(ndata >= 5 && pdata[0] == LWCCONFIG_CMD_PING && memcmp(&pdata[1], &probe->seq, 4) == 0) :
+		(ndata >= 2 && pdata[0] == 0x00 && pdata[1] == 0x88);
+
+	if (match)
+	{
+		probe->t_reply = now_qpc();
+		InterlockedExchange(&probe->state, 2);
+	}
+}
+
+// Send a device-applied probe behind the update made at 't_update', if
+// the device supports it and isn't due a rest
+static void probe_send(bench_device_t *dev, LONGLONG t_update)
+{
+	if (!dev->probe_enabled || dev->probe.state != 0)
+		return;
+
+	DWORD const now = GetTickCount();
+	if (now - dev->probe.sent_ticks < BENCH_PROBE_INTERVAL_MS)
+		return;
+
+	// The request goes through the same write queue as the update, so the
+	// device sees it after the update.  The ping's sequence number goes out
+	// little endian, which is how we compare it with the reply.
+	uint8_t query[8] = { 65, 4, 0, 0, 0, 0, 0, 0 };
+
+	if (dev->probe.ping)
+	{
+		dev->probe.seq += 1;
+
+		query[0] = LWCCONFIG_CMD_PING;
+		memcpy(&query[1], &dev->probe.seq, 4);
+		query[5] = 0xFF;
+		query[6] = 0xFF;
+		query[7] = (uint8_t)~query[1];
+	}
+
+	dev->probe.t_update = t_update;
+	dev->probe.sent_ticks = now;
+	InterlockedExchange(&dev->probe.state, 1);
+
+	g_main.fn.LWZ_RAWWRITE(dev->hlwz, query, sizeof(query));
+}
+
+// collect the replies to the outstanding probes
+static void probe_poll(samples_t *applied, DWORD *ptimeouts)
+{
+	for (int i = 0; i < g_main.ndevices; i++)
+	{
+		probe_t * const probe = &g_main.devices[i].probe;
+
+		if (probe->state == 2)
+		{
+			samples_add(applied, qpc_to_us(probe->t_reply - probe->t_update));
+			InterlockedExchange(&probe->state, 0);
+		}
+		else if (probe->state == 1 && GetTickCount() - probe->sent_ticks > BENCH_PROBE_TIMEOUT_MS)
+		{
+			// no reply; a late one is ignored, since the state moves on
+			InterlockedExchange(&probe->state, 0);
+			*ptimeouts += 1;
+		}
+	}
+}
+
+
+static void send_pba(bench_device_t *dev, unsigned int iter, samples_t *api)
+{
+	// change every port on each call, so that nothing is skipped as redundant
+	uint8_t pba[32];
+	for (int port = 0; port < 32; port++) {
+		pba[port] = (uint8_t)(1 + (iter + port) % 48);
+	}
+
+	LONGLONG const t0 = now_qpc();
+	g_main.fn.LWZ_PBA(dev->hlwz, pba);
+	LONGLONG const t1 = now_qpc();
+
+	samples_add(api, qpc_to_us(t1 - t0));
+	probe_send(dev, t0);
+}
+
+static void send_sba(bench_device_t *dev, unsigned int iter, samples_t *api)
+{
+	uint8_t const bank = (iter & 1) ? 0xFF : 0x00;
+
+	LONGLONG const t0 = now_qpc();
+	g_main.fn.LWZ_SBA(dev->hlwz, bank, bank, bank, bank, 2);
+	LONGLONG const t1 = now_qpc();
+
+	samples_add(api, qpc_to_us(t1 - t0));
+	probe_send(dev, t0);
+}
+
+// wait until 'deadline' (a QueryPerformanceCounter() time), collecting probe replies
+static void wait_until(LONGLONG deadline, samples_t *applied, DWORD *ptimeouts)
+{
+	for (;;)
+	{
+		probe_poll(applied, ptimeouts);
+
+		LONGLONG const left = deadline - now_qpc();
+		if (left <= 0)
+			return;
+
+		// Sleep() only has timer tick resolution, so sleep through most
+		// of the wait and then just yield for the last couple of ms
+		DWORD const left_ms = (DWORD)(left * 1000 / g_main.perf_freq);
+		Sleep(left_ms > 2 ? left_ms - 2 : 0);
+	}
+}
+
+
+static void run_scenario(int scenario, DWORD duration_ms)
+{
+	fprintf(stderr, "running %s for %lu ms ...\n", g_scenario_names[scenario], (unsigned long)duration_ms);
+
+	// start from clean statistics
+
+	for (int i = 0; i < g_main.ndevices; i++)
+	{
+		g_main.fn.LWZ_RESET_IO_STATS(g_main.devices[i].hlwz);
+		g_main.devices[i].probe.state = 0;
+		g_main.devices[i].probe.sent_ticks = GetTickCount() - BENCH_PROBE_INTERVAL_MS;
+	}
+
+	samples_t api = {0};
+	samples_t applied = {0};
+	DWORD probe_timeouts = 0;
+	DWORD frames_late = 0;
+	unsigned int iter = 0;
+
+	LONGLONG const t_start = now_qpc();
+	LONGLONG const t_end = t_start + (LONGLONG)duration_ms * g_main.perf_freq / 1000;
+	LONGLONG t_next = t_start;
+
+	while (now_qpc() < t_end)
+	{
+		switch (scenario)
+		{
+		case SCENARIO_PBA_STREAM:
+			send_pba(&g_main.devices[0], iter, &api);
+			probe_poll(&applied, &probe_timeouts);
+			break;
+
+		case SCENARIO_SBA_SPARSE:
+			send_sba(&g_main.devices[0], iter, &api);
+			t_next += (LONGLONG)BENCH_SBA_INTERVAL_MS * g_main.perf_freq / 1000;
+			wait_until(t_next, &applied, &probe_timeouts);
+			break;
+
+		case SCENARIO_MULTI_DEVICE:
+			send_pba(&g_main.devices[iter % g_main.ndevices], iter / g_main.ndevices, &api);
+			probe_poll(&applied, &probe_timeouts);
+			break;
+
+		case SCENARIO_FRAME_60HZ:
+			for (int i = 0; i < g_main.ndevices; i++)
+			{
+				send_pba(&g_main.devices[i], iter, &api);
+				send_sba(&g_main.devices[i], iter, &api);
+			}
+
+			// note frames whose updates didn't fit in the frame time
+			t_next += (LONGLONG)BENCH_FRAME_US * g_main.perf_freq / 1000000;
+			if (now_qpc() > t_next) {
+				frames_late += 1;
+			}
+
+			wait_until(t_next, &applied, &probe_timeouts);
+			break;
+		}
+
+		iter += 1;
+	}
+
+	DWORD const elapsed_ms = qpc_to_us(now_qpc() - t_start) / 1000;
+
+	// let the write queues drain, so that the statistics cover everything sent,
+	// and pick up the last probe replies
+
+	DWORD const t_drain = GetTickCount();
+
+	for (;;)
+	{
+		bool busy = false;
+
+		for (int i = 0; i < g_main.ndevices; i++)
+		{
+			LWZIOSTATS stats;
+			stats.cbSize = sizeof(stats);
+
+			if (g_main.fn.LWZ_GET_IO_STATS(g_main.devices[i].hlwz, &stats) && stats.dwQueueDepth != 0) {
+				busy = true;
+			}
+
+			if (g_main.devices[i].probe.state == 1) {
+				busy = true;
+			}
+		}
+
+		probe_poll(&applied, &probe_timeouts);
+
+		if (!busy || GetTickCount() - t_drain > BENCH_DRAIN_TIMEOUT_MS) {
+			break;
+		}
+
+		Sleep(10);
+	}
+
+	// report
+
+	SYSTEMTIME st;
+	GetSystemTime(&st);
+
+	printf("{\"scenario\":\"%s\",\"time\":\"%04d-%02d-%02dT%02d:%02d:%02dZ\",\"duration_ms\":%lu,\"calls\":%lu,",
+		g_scenario_names[scenario],
+		st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+		(unsigned long)elapsed_ms,
+		(unsigned long)api.n);
+
+	print_json_samples("api_us", &api);
+	printf(",");
+	print_json_samples("applied_us", &applied);
+	printf(",\"probe_timeouts\":%lu", (unsigned long)probe_timeouts);
+
+	if (scenario == SCENARIO_FRAME_60HZ) {
+		printf(",\"frames\":%u,\"frames_late\":%lu", iter, (unsigned long)frames_late);
+	}
+
+	printf(",\"devices\":[");
+
+	for (int i = 0; i < g_main.ndevices; i++)
+	{
+		bench_device_t * const dev = &g_main.devices[i];
+
+		LWZIOSTATS stats;
+		memset(&stats, 0x00, sizeof(stats));
+		stats.cbSize = sizeof(stats);
+		g_main.fn.LWZ_GET_IO_STATS(dev->hlwz, &stats);
+
+		printf("%s{\"unit\":%d,\"name\":", (i != 0) ? "," : "", dev->hlwz);
+		print_json_string(dev->name);
+		printf(",\"messages\":%lu,\"packets\":%lu,\"failed\":%lu,\"suppressed\":%lu,\"queued\":%lu,\"coalesced\":%lu,"
+			"\"max_queue_depth\":%lu,\"pacing_ms\":%lu,"
+			"\"wire_us\":{\"p50\":%lu,\"p99\":%lu,\"max\":%lu},"
+			"\"write_us\":{\"p50\":%lu,\"p99\":%lu,\"max\":%lu}}",
+			stats.dwMessages, stats.dwPackets, stats.dwFailed, stats.dwSuppressed, stats.dwQueued, stats.dwCoalesced,
+			stats.dwMaxQueueDepth, stats.dwPacingMs,
+			stats.dwQueueP50Us, stats.dwQueueP99Us, stats.dwQueueMaxUs,
+			stats.dwLatencyP50Us, stats.dwLatencyP99Us, stats.dwLatencyMaxUs);
+	}
+
+	printf("]}\n");
+	fflush(stdout);
+
+	samples_free(&api);
+	samples_free(&applied);
+}
+
+
+void usage()
+{
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Usage:\n\n");
+	fprintf(stderr, "lwzbench [-d <seconds>] [-s <scenario>] [<unit>]\n");
+	fprintf(stderr, "    -h .................... help\n");
+	fprintf(stderr, "    -d <seconds> .......... duration of each scenario (default %d)\n", BENCH_DEFAULT_SECONDS);
+	fprintf(stderr, "    -s <scenario> ......... run only this scenario:\n");
+	fprintf(stderr, "                            pba_stream, sba_sparse, multi_device, frame_60hz\n");
+	fprintf(stderr, "    <unit> ................ device for the single-device scenarios (default: the first)\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Results are written to stdout, one line of JSON per scenario.\n");
+	fprintf(stderr, "\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+	// parse arguments
+
+	const char * d_arg = NULL;
+	const char * s_arg = NULL;
+	const char * unit_arg = NULL;
+	int scenario_only = -1;
+	int err = 0;
+
+	for (int i = 1; i < argc && err == 0; i++)
+	{
+		if (argv[i][0] == '-')
+		{
+			switch (argv[i][1]) {
+			case 'h':
+			{
+				err = 1;
+				break;
+			}
+			case 'd':
+			{
+				d_arg = &argv[i][2];
+
+				if (d_arg[0] == '\0' && (i+1) < argc) {
+				    d_arg = argv[++i];
+				}
+
+				break;
+			}
+			case 's':
+			{
+				s_arg = &argv[i][2];
+
+				if (s_arg[0] == '\0' && (i+1) < argc) {
+				    s_arg = argv[++i];
+				}
+
+				break;
+			}
+			default:
+			{
+				err = -4;
+			}
+			}
+		}
+		else
+		{
+			if (unit_arg != NULL)	{
+				err = -5;
+			} else {
+				unit_arg = argv[i];
+			}
+		}
+	}
+
+	int const duration_s = (d_arg != NULL) ? atoi(d_arg) : BENCH_DEFAULT_SECONDS;
+
+	if (err == 0 && duration_s <= 0) {
+		err = -6;
+	}
+
+	if (err == 0 && s_arg != NULL)
+	{
+		for (int i = 0; i < SCENARIO_COUNT; i++)
+		{
+			if (strcmp(s_arg, g_scenario_names[i]) == 0) {
+				scenario_only = i;
+			}
+		}
+
+		if (scenario_only < 0) {
+			err = -7;
+		}
+	}
+
+	if (err < 0)
+	{
+		fprintf(stderr, "invalid argument(s), %d", err);
+		usage();
+		return -1;
+	}
+	else if (err != 0)
+	{
+		usage();
+		return -1;
+	}
+
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	g_main.perf_freq = freq.QuadPart;
+
+	// load the ledwiz.dll
+
+	g_main.hdll = LoadLibraryA(LEDWIZ_DLL_NAME);
+
+	if (g_main.hdll == NULL)
+	{
+		fprintf(stderr, "loading " LEDWIZ_DLL_NAME " failed!\n");
+		return -1;
+	}
+
+	((void**)&g_main.fn.LWZ_SBA)[0]                = GetProcAddress(g_main.hdll, "LWZ_SBA");
+	((void**)&g_main.fn.LWZ_PBA)[0]                = GetProcAddress(g_main.hdll, "LWZ_PBA");
+	((void**)&g_main.fn.LWZ_SET_NOTIFY)[0]         = GetProcAddress(g_main.hdll, "LWZ_SET_NOTIFY");
+	((void**)&g_main.fn.LWZ_RAWWRITE)[0]           = GetProcAddress(g_main.hdll, "LWZ_RAWWRITE");
+	((void**)&g_main.fn.LWZ_SET_EXTENDED_UNITS)[0] = GetProcAddress(g_main.hdll, "LWZ_SET_EXTENDED_UNITS");
+	((void**)&g_main.fn.LWZ_GET_DEVICE_HANDLES)[0] = GetProcAddress(g_main.hdll, "LWZ_GET_DEVICE_HANDLES");
+	((void**)&g_main.fn.LWZ_GET_DEVICE_INFO)[0]    = GetProcAddress(g_main.hdll, "LWZ_GET_DEVICE_INFO");
+	((void**)&g_main.fn.LWZ_SET_INPUT_CALLBACK)[0] = GetProcAddress(g_main.hdll, "LWZ_SET_INPUT_CALLBACK");
+	((void**)&g_main.fn.LWZ_GET_IO_STATS)[0]       = GetProcAddress(g_main.hdll, "LWZ_GET_IO_STATS");
+	((void**)&g_main.fn.LWZ_RESET_IO_STATS)[0]     = GetProcAddress(g_main.hdll, "LWZ_RESET_IO_STATS");
+
+	if (g_main.fn.LWZ_SBA == NULL ||
+		g_main.fn.LWZ_PBA == NULL ||
+		g_main.fn.LWZ_SET_NOTIFY == NULL ||
+		g_main.fn.LWZ_RAWWRITE == NULL ||
+		g_main.fn.LWZ_SET_EXTENDED_UNITS == NULL ||
+		g_main.fn.LWZ_GET_DEVICE_HANDLES == NULL ||
+		g_main.fn.LWZ_GET_DEVICE_INFO == NULL ||
+		g_main.fn.LWZ_SET_INPUT_CALLBACK == NULL ||
+		g_main.fn.LWZ_GET_IO_STATS == NULL ||
+		g_main.fn.LWZ_RESET_IO_STATS == NULL)
+	{
+		fprintf(stderr, "getting the function addresses failed! is " LEDWIZ_DLL_NAME " an old version?\n");
+		goto Failed;
+	}
+
+	// enumerate the devices, including extended units
+
+	g_main.fn.LWZ_SET_EXTENDED_UNITS(TRUE);
+	g_main.fn.LWZ_SET_NOTIFY(NULL, &g_main.devlist);
+
+	{
+		LWZHANDLE handles[BENCH_MAX_DEVICES];
+		uint32_t n = g_main.fn.LWZ_GET_DEVICE_HANDLES(handles, BENCH_MAX_DEVICES);
+
+		if (n > BENCH_MAX_DEVICES) {
+			n = BENCH_MAX_DEVICES;
+		}
+
+		for (uint32_t i = 0; i < n; i++)
+		{
+			LWZDEVICEINFO info;
+			info.cbSize = sizeof(info);
+
+			// a Pinscape virtual unit goes through its physical unit, so it would only count twice
+			if (!g_main.fn.LWZ_GET_DEVICE_INFO(handles[i], &info) ||
+				info.dwDevType == LWZ_DEVICE_TYPE_PINSCAPE_VIRT)
+			{
+				continue;
+			}
+
+			bench_device_t * const dev = &g_main.devices[g_main.ndevices++];
+			dev->hlwz = handles[i];
+			dev->type = info.dwDevType;
+			strncpy(dev->name, info.szName, sizeof(dev->name) - 1);
+
+			// only LWCloneU2 and Pinscape units answer the device-applied probe
+			if (info.dwDevType == LWZ_DEVICE_TYPE_LWCLONEU2 || info.dwDevType == LWZ_DEVICE_TYPE_PINSCAPE)
+			{
+				dev->probe.ping = (info.dwDevType == LWZ_DEVICE_TYPE_LWCLONEU2);
+				dev->probe_enabled = (g_main.fn.LWZ_SET_INPUT_CALLBACK(dev->hlwz, input_cb, &dev->probe) != FALSE);
+			}
+		}
+	}
+
+	if (g_main.ndevices <= 0)
+	{
+		fprintf(stderr, "no ledwiz devices detected!\n");
+		goto Failed;
+	}
+
+	// move the selected unit to the front, for the single-device scenarios
+
+	if (unit_arg != NULL)
+	{
+		int const unit = atoi(unit_arg);
+		int index = -1;
+
+		for (int i = 0; i < g_main.ndevices; i++)
+		{
+			if (g_main.devices[i].hlwz == unit) {
+				index = i;
+			}
+		}
+
+		if (index < 0)
+		{
+			fprintf(stderr, "device with id=%d not found!\n", unit);
+			goto Failed;
+		}
+
+		bench_device_t tmp = g_main.devices[0];
+		g_main.devices[0] = g_main.devices[index];
+		g_main.devices[index] = tmp;
+
+		// the probes' callback contexts moved with the devices
+		for (int i = 0; i < g_main.ndevices; i++)
+		{
+			if (g_main.devices[i].probe_enabled) {
+				g_main.fn.LWZ_SET_INPUT_CALLBACK(g_main.devices[i].hlwz, input_cb, &g_main.devices[i].probe);
+			}
+		}
+	}
+
+	// run the scenarios
+
+	for (int i = 0; i < SCENARIO_COUNT; i++)
+	{
+		if (scenario_only < 0 || scenario_only == i) {
+			run_scenario(i, (DWORD)duration_s * 1000);
+		}
+	}
+
+	// turn everything off again
+
+	for (int i = 0; i < g_main.ndevices; i++)
+	{
+		if (g_main.devices[i].probe_enabled) {
+			g_main.fn.LWZ_SET_INPUT_CALLBACK(g_main.devices[i].hlwz, NULL, NULL);
+		}
+
+		g_main.fn.LWZ_SBA(g_main.devices[i].hlwz, 0, 0, 0, 0, 2);
+	}
+
+Failed:
+	if (g_main.hdll)
+	{
+		FreeLibrary(g_main.hdll);
+		g_main.hdll = NULL;
+	}
+
+	return 0;
+}